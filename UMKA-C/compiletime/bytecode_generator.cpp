@@ -1,4 +1,5 @@
 #include "bytecode_generator.h"
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
@@ -42,7 +43,10 @@ void BytecodeGenerator::build_function_common(FuncBuilder& fb, const std::vector
     fb.nextVarIndex = params.size();
     gen_stmt_in_func(body, fb);
 
-    if (fb.code.empty() || fb.code.back() != OP_RETURN) {
+    // a label at the very end is a jump target past the last instruction, it needs a return too
+    const uint8_t last_op = fb.instruction_positions.empty() ? 0 : fb.code[fb.instruction_positions.back()];
+    const bool label_at_end = std::ranges::any_of(fb.label_pos, [&](const auto& label) { return label.second == fb.code.size(); });
+    if (label_at_end || (last_op != OP_RETURN && last_op != OP_TAIL_CALL)) {
         int64_t idx = fb.add_const(ConstEntry());
         fb.emit_push_const_index(idx);
         fb.emit_return();
@@ -346,14 +350,8 @@ void BytecodeGenerator::gen_expr_in_func(Expr* expr, FuncBuilder& fb) {
         for (auto el: arr->elems) gen_expr_in_func(el, fb);
         fb.emit_build_arr(arr->elems.size());
     } else if (auto call = dynamic_cast<CallExpr*>(expr)) {
-        static const std::unordered_map<std::string, uint8_t> castOps = {
-            {"to_int", OP_TO_INT},
-            {"to_double", OP_TO_DOUBLE},
-            {"to_string", OP_TO_STRING}
-        };
-        
-        auto castIt = castOps.find(call->name);
-        if (castIt != castOps.end()) {
+        auto castIt = CAST_OPS.find(call->name);
+        if (castIt != CAST_OPS.end()) {
             if (call->args.size() != 1) {
                 std::cerr << "Cast '" << call->name << "' requires exactly 1 argument\n";
             }
@@ -368,7 +366,7 @@ void BytecodeGenerator::gen_expr_in_func(Expr* expr, FuncBuilder& fb) {
 
         auto itb = builtinIDs.find(call->name);
         if (itb != builtinIDs.end()) {
-            fb.emit_call(itb->second);
+            fb.emit_call_builtin(itb->second);
         } else {
             auto itf = userFuncIndex.find(call->name);
             if (itf == userFuncIndex.end()) {
@@ -495,6 +493,14 @@ void BytecodeGenerator::gen_stmt_in_func(Stmt* s, FuncBuilder& fb) {
         fb.emit_jmp_place_holder(OP_JMP, startL);
         fb.place_label(endL);
     } else if (auto rs = dynamic_cast<ReturnStmt*>(s)) {
+        // nothing runs after a return, so a call it returns can take over the frame
+        auto call = dynamic_cast<CallExpr*>(rs->expr);
+        if (call && !CAST_OPS.contains(call->name) && !builtinIDs.contains(call->name) &&
+            userFuncIndex.contains(call->name)) {
+            for (auto arg: call->args | std::views::reverse) gen_expr_in_func(arg, fb);
+            fb.emit_tail_call(userFuncIndex.at(call->name));
+            return;
+        }
         if (rs->expr) {
             gen_expr_in_func(rs->expr, fb);
         } else {
@@ -542,7 +548,7 @@ void BytecodeGenerator::gen_field_access_expr(FieldAccessExpr* expr, FuncBuilder
 
     auto itb = builtinIDs.find("get");
     if (itb != builtinIDs.end()) {
-        fb.emit_call(itb->second);
+        fb.emit_call_builtin(itb->second);
     }
 }
 
@@ -563,7 +569,7 @@ void BytecodeGenerator::gen_member_access_expr(MemberAccessExpr* expr, FuncBuild
 
     auto itb = builtinIDs.find("get");
     if (itb != builtinIDs.end()) {
-        fb.emit_call(itb->second);
+        fb.emit_call_builtin(itb->second);
     }
 }
 
@@ -598,7 +604,7 @@ void BytecodeGenerator::gen_member_assign_stmt(MemberAssignStmt* stmt, FuncBuild
     // Use the set builtin function to set the field value
     auto itb = builtinIDs.find("set");
     if (itb != builtinIDs.end()) {
-        fb.emit_call(itb->second);
+        fb.emit_call_builtin(itb->second);
         fb.emit_byte(OP_POP);
     }
 }
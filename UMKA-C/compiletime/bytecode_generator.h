@@ -50,6 +50,10 @@ public:
             {"^-^", OP_OPCOT}
     };
 
+    static inline const std::unordered_map<std::string, uint8_t> CAST_OPS = {
+            {"to_int", OP_TO_INT}, {"to_double", OP_TO_DOUBLE}, {"to_string", OP_TO_STRING}
+    };
+
     std::unordered_map<std::string, std::unordered_map<std::string, int64_t>> classFieldIndices;
     std::unordered_map<std::string, int64_t> classFieldCount;
     std::unordered_map<std::string, std::unordered_map<std::string, Expr*>> classFieldDefaults;
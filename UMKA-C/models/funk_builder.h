@@ -73,6 +73,16 @@ struct FuncBuilder {
         emit_int64(id);
     }
 
+    void emit_tail_call(int64_t id) {
+        emit_byte(OP_TAIL_CALL);
+        emit_int64(id);
+    }
+
+    void emit_call_builtin(int64_t id) {
+        emit_byte(OP_CALL_BUILTIN);
+        emit_int64(id);
+    }
+
     void emit_return() { emit_byte(OP_RETURN); }
 
     void emit_build_arr(int64_t idx) {
@@ -27,6 +27,8 @@ enum Opcode : uint8_t {
     OP_JMP_IF_TRUE  = 0x22,
     OP_CALL = 0x23,
     OP_RETURN = 0x24,
+    OP_CALL_BUILTIN = 0x25,
+    OP_TAIL_CALL = 0x26,
     OP_BUILD_ARR = 0x30,
     OP_OPCOT = 0x40,
     OP_CALL_METHOD = 0x50,
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <model/model.h>
+#include <parser/command_parser.h>
+
+#include "register_translator.h"
+
+namespace umka::jit {
+struct ClosureFrame;
+
+// What compiled closures and native code need from the interpreter, implemented by StackMachine.
+class ClosureRuntime {
+  public:
+    virtual ~ClosureRuntime() = default;
+
+    // stack machine semantics of `op` for operands without an inline fast path
+    virtual vm::Value operate(uint8_t op, vm::Value lhs, vm::Value rhs) = 0;
+    virtual bool truthy(vm::Value value) = 0;
+    // CALL or CALL_BUILTIN with arguments in registers[first .. first + count);
+    // the register file may move, frame.registers is updated before returning
+    virtual vm::Value call(uint8_t op, int64_t callee, ClosureFrame &frame, uint32_t first, uint32_t count) = 0;
+    // backward jumps, the garbage collector may run here
+    virtual void safepoint() = 0;
+};
+
+struct ClosureFrame {
+  vm::Value *registers;
+  ClosureRuntime *runtime;
+  vm::Value result;
+};
+
+struct Closure;
+// returns the next closure to run, nullptr after RETURN
+using ClosureHandler = const Closure *(*)(const Closure &, ClosureFrame &);
+
+// One register instruction with its operands decoded ahead of time.
+struct Closure {
+  ClosureHandler handler;
+  uint32_t dst;
+  uint32_t lhs;
+  uint32_t rhs;
+  vm::Value constant;
+  const Closure *target;
+  int64_t callee;
+};
+
+struct ClosureFunction {
+  std::vector<Closure> closures;
+  int64_t register_count{};
+
+  // `start` is 0 or a loop entry of the register code
+  vm::Value run(ClosureFrame &frame, size_t start = 0) const {
+    const Closure *pc = closures.data() + start;
+    while (pc != nullptr) {
+      pc = pc->handler(*pc, frame);
+    }
+    return frame.result;
+  }
+};
+
+// Compiles register code into closures on the JIT thread, nullptr if an instruction has
+// no closure. Constants are taken decoded from JittedFunction::constant_values, which also
+// owns their boxes; jump targets become closure pointers and a compare feeding the forward
+// branch right after it is fused into one closure.
+class ClosureCompiler {
+  public:
+    static std::shared_ptr<const ClosureFunction> compile(
+      const RegisterFunction &function,
+      const std::vector<vm::Value> &constants
+    ) {
+      auto compiled = std::make_shared<ClosureFunction>();
+      compiled->register_count = function.register_count;
+      const auto &code = function.code;
+
+      std::vector<bool> is_target(code.size(), false);
+      for (const auto &instruction: code) {
+        if (is_jump(instruction.code)) {
+          is_target[instruction.arg] = true;
+        }
+      }
+
+      // targets point into this vector, it is not resized after this point
+      compiled->closures.resize(code.size());
+      for (size_t i = 0; i < code.size(); ++i) {
+        const RegisterInstruction &instruction = code[i];
+        Closure &closure = compiled->closures[i];
+        closure.dst = instruction.dst;
+        closure.lhs = instruction.lhs;
+        closure.rhs = instruction.rhs;
+        closure.callee = instruction.arg;
+        if (is_jump(instruction.code)) {
+          closure.target = &compiled->closures[instruction.arg];
+        }
+
+        switch (instruction.code) {
+          case vm::PUSH_CONST:
+            closure.handler = &load_constant;
+            closure.constant = constants.at(instruction.arg);
+            break;
+          case vm::LOAD:
+            closure.handler = &move;
+            break;
+          case vm::JMP:
+            closure.handler = instruction.arg <= static_cast<int64_t>(i) ? &jump<true> : &jump<false>;
+            break;
+          case vm::JMP_IF_FALSE:
+            closure.handler = instruction.arg <= static_cast<int64_t>(i) ? &branch<false, true> : &branch<false, false>;
+            break;
+          case vm::JMP_IF_TRUE:
+            closure.handler = instruction.arg <= static_cast<int64_t>(i) ? &branch<true, true> : &branch<true, false>;
+            break;
+          case vm::CALL:
+          case vm::CALL_BUILTIN:
+            closure.handler = instruction.code == vm::CALL ? &call<vm::CALL> : &call<vm::CALL_BUILTIN>;
+            break;
+          case vm::RETURN:
+            closure.handler = &return_value;
+            break;
+          default:
+            closure.handler = operation_handler(instruction.code);
+            if (closure.handler == nullptr) {
+              return nullptr;
+            }
+        }
+      }
+
+      for (size_t i = 0; i + 1 < code.size(); ++i) {
+        const RegisterInstruction &compare = code[i];
+        const RegisterInstruction &jump = code[i + 1];
+        const bool forward = jump.arg > static_cast<int64_t>(i + 1);
+        if (!vm::is_quickenable(compare.code) || compare.code < vm::EQ || is_target[i + 1] || !forward ||
+            (jump.code != vm::JMP_IF_FALSE && jump.code != vm::JMP_IF_TRUE) || jump.lhs != compare.dst) {
+          continue;
+        }
+        Closure &closure = compiled->closures[i];
+        closure.target = &compiled->closures[jump.arg];
+        closure.handler = compare_and_branch_handler(compare.code, jump.code == vm::JMP_IF_TRUE);
+      }
+      return compiled;
+    }
+
+  private:
+    static bool is_jump(uint8_t op) {
+      return op == vm::JMP || op == vm::JMP_IF_FALSE || op == vm::JMP_IF_TRUE;
+    }
+
+    static const Closure *load_constant(const Closure &self, ClosureFrame &frame) {
+      frame.registers[self.dst] = self.constant;
+      return &self + 1;
+    }
+
+    static const Closure *move(const Closure &self, ClosureFrame &frame) {
+      frame.registers[self.dst] = frame.registers[self.lhs];
+      return &self + 1;
+    }
+
+    template<uint8_t Op>
+    static vm::Value apply(const vm::Value &lhs, const vm::Value &rhs, ClosureFrame &frame) {
+      if constexpr (vm::is_quickenable(Op)) {
+        if (lhs.type == vm::ValueType::INT && rhs.type == vm::ValueType::INT) {
+          return vm::typed_operation<Op>(lhs.i, rhs.i);
+        }
+        if constexpr (Op != vm::REM) {
+          if (lhs.type == vm::ValueType::DOUBLE && rhs.type == vm::ValueType::DOUBLE) {
+            return vm::typed_operation<Op>(lhs.d, rhs.d);
+          }
+        }
+      }
+      return frame.runtime->operate(Op, lhs, rhs);
+    }
+
+    template<uint8_t Op>
+    static const Closure *operation(const Closure &self, ClosureFrame &frame) {
+      frame.registers[self.dst] = apply<Op>(frame.registers[self.lhs], frame.registers[self.rhs], frame);
+      return &self + 1;
+    }
+
+    static bool test(const vm::Value &value, ClosureFrame &frame) {
+      return value.type == vm::ValueType::BOOL ? value.b : frame.runtime->truthy(value);
+    }
+
+    template<uint8_t Op, bool JumpIf>
+    static const Closure *compare_and_branch(const Closure &self, ClosureFrame &frame) {
+      const vm::Value result = apply<Op>(frame.registers[self.lhs], frame.registers[self.rhs], frame);
+      frame.registers[self.dst] = result;
+      // the branch closure right after this one is skipped
+      return test(result, frame) == JumpIf ? self.target : &self + 2;
+    }
+
+    template<bool Backward>
+    static const Closure *jump(const Closure &self, ClosureFrame &frame) {
+      if constexpr (Backward) {
+        frame.runtime->safepoint();
+      }
+      return self.target;
+    }
+
+    template<bool JumpIf, bool Backward>
+    static const Closure *branch(const Closure &self, ClosureFrame &frame) {
+      if (test(frame.registers[self.lhs], frame) != JumpIf) {
+        return &self + 1;
+      }
+      if constexpr (Backward) {
+        frame.runtime->safepoint();
+      }
+      return self.target;
+    }
+
+    template<uint8_t Op>
+    static const Closure *call(const Closure &self, ClosureFrame &frame) {
+      vm::Value result = frame.runtime->call(Op, self.callee, frame, self.lhs, self.rhs);
+      frame.registers[self.dst] = result;
+      return &self + 1;
+    }
+
+    static const Closure *return_value(const Closure &self, ClosureFrame &frame) {
+      frame.result = frame.registers[self.lhs];
+      return nullptr;
+    }
+
+    static ClosureHandler operation_handler(uint8_t op) {
+      switch (op) {
+#define UMKA_CLOSURE_OPERATION(name) \
+        case vm::name: \
+          return &operation<vm::name>;
+        UMKA_CLOSURE_OPERATION(ADD)
+        UMKA_CLOSURE_OPERATION(SUB)
+        UMKA_CLOSURE_OPERATION(MUL)
+        UMKA_CLOSURE_OPERATION(DIV)
+        UMKA_CLOSURE_OPERATION(REM)
+        UMKA_CLOSURE_OPERATION(AND)
+        UMKA_CLOSURE_OPERATION(OR)
+        UMKA_CLOSURE_OPERATION(EQ)
+        UMKA_CLOSURE_OPERATION(NEQ)
+        UMKA_CLOSURE_OPERATION(GT)
+        UMKA_CLOSURE_OPERATION(LT)
+        UMKA_CLOSURE_OPERATION(GTE)
+        UMKA_CLOSURE_OPERATION(LTE)
+        UMKA_CLOSURE_OPERATION(NOT)
+        UMKA_CLOSURE_OPERATION(TO_STRING)
+        UMKA_CLOSURE_OPERATION(TO_INT)
+        UMKA_CLOSURE_OPERATION(TO_DOUBLE)
+#undef UMKA_CLOSURE_OPERATION
+        default:
+          return nullptr;
+      }
+    }
+
+    static ClosureHandler compare_and_branch_handler(uint8_t op, bool jump_if) {
+      switch (op) {
+#define UMKA_CLOSURE_COMPARE(name) \
+        case vm::name: \
+          return jump_if ? &compare_and_branch<vm::name, true> : &compare_and_branch<vm::name, false>;
+        UMKA_CLOSURE_COMPARE(EQ)
+        UMKA_CLOSURE_COMPARE(NEQ)
+        UMKA_CLOSURE_COMPARE(GT)
+        UMKA_CLOSURE_COMPARE(LT)
+        UMKA_CLOSURE_COMPARE(GTE)
+        UMKA_CLOSURE_COMPARE(LTE)
+#undef UMKA_CLOSURE_COMPARE
+        default:
+          return nullptr;
+      }
+    }
+};
+} // namespace umka::jit
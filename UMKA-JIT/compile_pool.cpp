@@ -0,0 +1,108 @@
+#include "compile_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+namespace umka::jit {
+CompilePool::CompilePool(const size_t thread_count) {
+  workers.reserve(std::max<size_t>(thread_count, 1));
+  for (size_t i = 0; i < std::max<size_t>(thread_count, 1); ++i) {
+    workers.emplace_back([this] { worker_loop(); });
+  }
+}
+
+CompilePool::~CompilePool() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+    queue.clear();
+  }
+  job_ready.notify_all();
+  for (auto &worker: workers) {
+    worker.join();
+  }
+}
+
+CompilePool &CompilePool::shared() {
+  static CompilePool pool([] {
+    if (const char *threads = std::getenv("UMKA_JIT_THREADS")) {
+      try {
+        const long count = std::stol(threads);
+        if (count > 0)
+          return static_cast<size_t>(count);
+      } catch (const std::exception &) {
+      }
+    }
+    const size_t cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : size_t{1};
+  }());
+  return pool;
+}
+
+CompilePool::JobId CompilePool::submit(const void *owner, const int64_t priority, std::function<void()> task) {
+  JobId id;
+  {
+    std::lock_guard lock(mutex);
+    id = next_id++;
+    queue.push_back(Job{priority, id, owner, std::move(task)});
+    std::push_heap(queue.begin(), queue.end(), runs_later);
+  }
+  job_ready.notify_one();
+  return id;
+}
+
+bool CompilePool::cancel(const JobId id) {
+  std::lock_guard lock(mutex);
+  const auto it = std::find_if(queue.begin(), queue.end(), [&](const Job &job) { return job.id == id; });
+  if (it == queue.end())
+    return false;
+  queue.erase(it);
+  std::make_heap(queue.begin(), queue.end(), runs_later);
+  return true;
+}
+
+void CompilePool::cancel_all(const void *owner) {
+  std::unique_lock lock(mutex);
+  std::erase_if(queue, [&](const Job &job) { return job.owner == owner; });
+  std::make_heap(queue.begin(), queue.end(), runs_later);
+  job_done.wait(lock, [&] {
+    return running.find(owner) == running.end();
+  });
+}
+
+void CompilePool::worker_loop() {
+  while (true) {
+    Job job;
+
+    {
+      std::unique_lock lock(mutex);
+      job_ready.wait(lock,
+                     [&] {
+                       return !queue.empty() || stopping;
+                     });
+
+      if (stopping) return;
+
+      std::pop_heap(queue.begin(), queue.end(), runs_later);
+      job = std::move(queue.back());
+      queue.pop_back();
+      ++running[job.owner];
+    }
+
+    // a function the JIT cannot compile stays interpreted
+    try {
+      job.task();
+    } catch (const std::exception &) {
+    }
+
+    {
+      std::lock_guard lock(mutex);
+      if (--running[job.owner] == 0)
+        running.erase(job.owner);
+    }
+    job_done.notify_all();
+  }
+}
+} // namespace umka::jit
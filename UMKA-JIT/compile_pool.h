@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace umka::jit {
+// Compiler threads shared by every JitManager of the process. Jobs run hottest first, jobs of
+// equal priority in the order they came.
+class CompilePool {
+  public:
+    using JobId = uint64_t;
+
+    explicit CompilePool(size_t thread_count);
+
+    // drops queued jobs and waits for running ones
+    ~CompilePool();
+
+    CompilePool(const CompilePool &) = delete;
+    CompilePool &operator=(const CompilePool &) = delete;
+
+    // the pool of the process: UMKA_JIT_THREADS threads, or all cores but the interpreter's one
+    static CompilePool &shared();
+
+    size_t thread_count() const { return workers.size(); }
+
+    // `owner` groups the jobs of one client for cancel_all
+    JobId submit(const void *owner, int64_t priority, std::function<void()> task);
+
+    // true if the job was still queued and will not run
+    bool cancel(JobId id);
+
+    // drops the queued jobs of `owner` and waits until none of its jobs runs
+    void cancel_all(const void *owner);
+
+  private:
+    struct Job {
+      int64_t priority;
+      JobId id;
+      const void *owner;
+      std::function<void()> task;
+    };
+
+    // heap order: higher priority first, then the older job
+    static bool runs_later(const Job &a, const Job &b) {
+      return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+    }
+
+    void worker_loop();
+
+    std::vector<Job> queue; // heap by runs_later
+    std::unordered_map<const void *, size_t> running;
+    JobId next_id = 0;
+    bool stopping = false;
+
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+    std::vector<std::thread> workers;
+};
+
+} // namespace umka::jit
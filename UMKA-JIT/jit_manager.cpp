@@ -1,91 +1,93 @@
 #include "jit_manager.h"
+
+#include <iostream>
+
 #include "const_folding.h"
 #include "dce.h"
 #include "constant_propagation.h"
+#include "loop_unrolling.h"
+#include "inlining.h"
+#include "licm.h"
 
 namespace umka::jit {
 JitManager::JitManager(std::vector<vm::Command> &commands,
-                       std::vector<vm::Constant> &const_pool,
-                       std::unordered_map<size_t, vm::FunctionTableEntry> &func_table)
-  : runner(std::make_unique<JitRunner>(commands, const_pool, func_table)),
-    func_table(func_table) {
+                       const std::vector<vm::Constant> &const_pool,
+                       std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+                       std::vector<vm::VMethodTableEntry> vmethod_table,
+                       CompilePool &pool)
+  : runner(std::make_unique<JitRunner>(commands, const_pool, func_table, std::move(vmethod_table))),
+    func_table(func_table),
+    pool(pool),
+    versions(func_table.size()),
+    published(func_table.size()) {
   for (const auto &id: func_table | std::views::keys) {
     jit_state[id] = JitState::NONE;
+    requested_tier[id] = Tier::INTERPRETED;
   }
+  runner->add_optimization(std::make_unique<Inlining>(commands, const_pool));
+  runner->add_optimization(std::make_unique<LoopInvariantCodeMotion>());
+  runner->add_optimization(std::make_unique<LoopUnrolling>());
   runner->add_optimization(std::make_unique<ConstantPropagation>());
   runner->add_optimization(std::make_unique<ConstFolding>());
   runner->add_optimization(std::make_unique<ConstantPropagation>());
   runner->add_optimization(std::make_unique<DeadCodeElimination>());
-  running = true;
-  worker = std::thread([this] { worker_loop(); });
 }
 
-void JitManager::worker_loop() {
-  while (running) {
-    size_t fid;
-
-    {
-      std::unique_lock lock(queue_mutex);
-      cv.wait(lock,
-              [&] {
-                return !queue.empty() || !running;
-              });
-
-      if (!running) return;
-
-      fid = queue.front();
-      queue.pop();
-    }
+void JitManager::compile(size_t fid, Tier tier) {
+  {
+    std::lock_guard lock(state_mutex);
+    // a higher tier was requested after this job started waiting
+    if (requested_tier[fid] != tier)
+      return;
+    pending.erase(fid);
+    jit_state[fid] = JitState::RUNNING;
+  }
 
-    {
-      std::lock_guard lock(state_mutex);
-      jit_state[fid] = JitState::RUNNING;
+  std::optional<JittedFunction> optimized;
+  try {
+    optimized = runner->optimize_function(fid, tier);
+  } catch (const std::exception &error) {
+    // a pass produced code the unchecked interpreter must not run
+    std::cerr << "JIT: function " << fid << " not published: " << error.what() << std::endl;
+    std::lock_guard lock(state_mutex);
+    if (requested_tier[fid] == tier) {
+      jit_state[fid] = JitState::NONE;
     }
+    return;
+  }
 
-    JittedFunction optimized = runner->optimize_function(fid);
-
-    {
-      std::lock_guard lock_data(data_mutex);
-      jit_functions[fid] = std::move(optimized);
+  {
+    std::lock_guard lock(publish_mutex);
+    const JittedFunction *current = published[fid].load(std::memory_order_relaxed);
+    if (current == nullptr || current->tier < tier) {
+      const JittedFunction &version = versions[fid].emplace_back(std::move(*optimized));
+      published[fid].store(&version, std::memory_order_release);
     }
+  }
 
-    {
-      std::lock_guard lock(state_mutex);
+  {
+    std::lock_guard lock(state_mutex);
+    if (requested_tier[fid] == tier) {
       jit_state[fid] = JitState::READY;
     }
   }
 }
 
-bool JitManager::has_jitted(size_t fid) {
-  std::lock_guard lock(state_mutex);
-  return jit_state[fid] == JitState::READY;
-}
-
-std::optional<std::reference_wrapper<const JittedFunction> >
-JitManager::try_get_jitted(size_t fid) {
-  std::lock_guard lock(data_mutex);
-  const auto it = jit_functions.find(fid);
-  if (it == jit_functions.end()) {
-    return std::nullopt;
-  }
-  return std::cref(it->second);
-}
+void JitManager::request_jit(size_t fid, Tier tier, int64_t priority) {
+  if (fid >= versions.size())
+    return;
 
-void JitManager::request_jit(size_t fid) {
-  {
-    std::lock_guard lock(state_mutex);
+  std::lock_guard lock(state_mutex);
 
-    if (jit_state[fid] != JitState::NONE)
-      return;
+  if (tier <= requested_tier[fid])
+    return;
 
-    jit_state[fid] = JitState::QUEUED;
-  }
+  requested_tier[fid] = tier;
+  jit_state[fid] = JitState::QUEUED;
 
-  {
-    std::lock_guard lock(queue_mutex);
-    queue.push(fid);
+  if (const auto it = pending.find(fid); it != pending.end()) {
+    pool.cancel(it->second);
   }
-
-  cv.notify_one();
+  pending[fid] = pool.submit(this, priority, [this, fid, tier] { compile(fid, tier); });
 }
 }
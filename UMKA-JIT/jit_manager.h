@@ -1,16 +1,16 @@
 #pragma once
 
+#include <deque>
 #include <unordered_map>
-#include <queue>
 #include <mutex>
-#include <thread>
-#include <condition_variable>
 #include <atomic>
 #include <optional>
 #include <functional>
 
+#include "compile_pool.h"
 #include "jitted_function.h"
 #include "jit_runner.h"
+#include "tier.h"
 
 namespace umka::jit {
 enum class JitState {
@@ -23,43 +23,51 @@ enum class JitState {
 class JitManager {
   public:
     JitManager(std::vector<vm::Command> &commands,
-               std::vector<vm::Constant> &const_pool,
-               std::unordered_map<size_t, vm::FunctionTableEntry> &func_table);
+               const std::vector<vm::Constant> &const_pool,
+               std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+               std::vector<vm::VMethodTableEntry> vmethod_table,
+               CompilePool &pool = CompilePool::shared());
 
+    // снимает свои задачи из очереди пула и ждёт выполняющиеся
     ~JitManager() {
-      running = false;
-      cv.notify_all();
-      if (worker.joinable())
-        worker.join();
+      pool.cancel_all(this);
     }
 
-    // начало обработки функции
-    void request_jit(size_t fid);
+    // начало обработки функции; запрос не выше уже запрошенного уровня игнорируется, а ещё не
+    // начатая компиляция более низкого уровня отменяется. Пул берёт первой задачу с большим priority
+    // Версия, не прошедшая BytecodeVerifier, не публикуется: функция остаётся на прежнем уровне
+    void request_jit(size_t fid, Tier tier = Tier::OPTIMIZED, int64_t priority = 0);
 
-    // проверка есть ли готовая версия функции
-    bool has_jitted(size_t fid);
-
-    //попробовать взять jitted функцию
-    std::optional<std::reference_wrapper<const JittedFunction>> try_get_jitted(size_t fid);
+    // готовая версия функции самого высокого уровня или nullptr; без блокировок, для пути CALL.
+    // Указатель действителен, пока жив менеджер
+    const JittedFunction* jitted(size_t fid) const {
+      return fid < published.size() ? published[fid].load(std::memory_order_acquire) : nullptr;
+    }
 
   private:
-    void worker_loop();
+    void compile(size_t fid, Tier tier);
 
     std::unique_ptr<JitRunner> runner;
 
     std::unordered_map<size_t, vm::FunctionTableEntry> &func_table;
 
-    std::unordered_map<size_t, JitState> jit_state;
-    std::unordered_map<size_t, JittedFunction> jit_functions;
-
-    std::queue<size_t> queue;
-    std::mutex queue_mutex;
+    CompilePool &pool;
 
+    // состояние последнего запрошенного уровня
+    std::unordered_map<size_t, JitState> jit_state;
+    std::unordered_map<size_t, Tier> requested_tier;
+    // задачи в пуле, которые ещё можно отменить
+    std::unordered_map<size_t, CompilePool::JobId> pending;
     std::mutex state_mutex;
-    std::mutex data_mutex;
 
-    std::condition_variable cv;
-    std::thread worker;
-    std::atomic<bool> running{false};
+    // Версии всех опубликованных уровней, от низшего к высшему. Заменённая версия освобождается
+    // вместе с менеджером, а не сразу: кадры, замыкания и кэш скопированного кода машины ещё
+    // могут на неё ссылаться. Уровень публикуется не больше одного раза, так что на функцию
+    // приходится не больше одной такой версии
+    std::vector<std::deque<JittedFunction>> versions;
+    // последняя из versions[fid], публикуется с release после того, как версия построена
+    std::vector<std::atomic<const JittedFunction*>> published;
+    // разные уровни одной функции могут компилироваться одновременно
+    std::mutex publish_mutex;
 };
 } // namespace umka::jit
@@ -1,11 +1,14 @@
 #pragma once
 
 #include <iostream>
+#include <numeric>
+#include <ranges>
 #include <vector>
 #include <memory>
 #include <unordered_map>
 
 #include <model/model.h>
+#include <parser/bytecode_verifier.h>
 
 #include "jitted_function.h"
 #include "optimizations/base_optimization.h"
@@ -15,53 +18,124 @@ class JitRunner {
   public:
     JitRunner(
       std::vector<vm::Command> &commands,
-      std::vector<vm::Constant> &const_pool,
-      std::unordered_map<size_t, vm::FunctionTableEntry> &func_table
+      const std::vector<vm::Constant> &const_pool,
+      std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+      std::vector<vm::VMethodTableEntry> vmethod_table
     )
       : commands(commands)
         , const_pool(const_pool)
-        , func_table(func_table) {
+        , func_table(func_table)
+        , vmethod_table(std::move(vmethod_table)) {
     }
 
     void add_optimization(std::unique_ptr<IOptimize> opt) {
       optimizations.push_back(std::move(opt));
     }
 
-    std::vector<vm::Command> optimize_range(
-        const std::vector<vm::Command>::iterator begin,
-        const std::vector<vm::Command>::iterator end,
-        vm::FunctionTableEntry& meta
-    ) {
-      std::vector<vm::Command> local(begin, end);
-      for (auto& p : optimizations)
-        p->run(local, const_pool, func_table, meta);
-      return local;
-    }
-
-
-    JittedFunction optimize_function(const size_t func_id) const {
-      auto &meta = func_table.at(func_id);
+    // BASELINE skips the optimization passes and the x86-64 backend. Safe to call for several
+    // functions at once: each works on copies of its code, metadata and constants.
+    // The result goes through BytecodeVerifier like the loaded image, since the machine runs it
+    // without runtime checks; throws std::runtime_error if a pass produced invalid code.
+    JittedFunction optimize_function(const size_t func_id, const Tier tier = Tier::OPTIMIZED) const {
+      vm::FunctionTableEntry meta = func_table.at(func_id);
 
       const auto begin = commands.begin() + meta.code_offset;
       const auto end = commands.begin() + meta.code_offset_end;
 
       std::vector local(begin, end);
+      OffsetMap origins(local.size());
+      std::iota(origins.begin(), origins.end(), 0);
+      std::vector<vm::Constant> constants = localize_constants(local, const_pool);
 
-      for (auto &opt: optimizations) {
-        opt->run(local, const_pool, func_table, meta);
+      if (tier == Tier::OPTIMIZED) {
+        for (auto &opt: optimizations) {
+          opt->run(local, constants, func_table, meta, origins);
+        }
+        // drop what folding made unused
+        constants = localize_constants(local, constants);
       }
+      vm::FunctionTableEntry checked = meta;
+      checked.code_offset = 0;
+      checked.code_offset_end = static_cast<int64_t>(local.size());
+      vm::BytecodeVerifier(local, constants, func_table, vmethod_table).verify(func_id, checked);
+
+      auto osr_entries = loop_entries(begin, end, origins);
 
+      std::vector<size_t> entry_offsets;
+      for (const size_t offset: osr_entries | std::views::values) {
+        entry_offsets.push_back(offset);
+      }
+      auto register_code = RegisterTranslator::translate(local, meta, func_table, entry_offsets);
+      auto [constant_values, constant_boxes] = decode_constants(constants);
+      std::shared_ptr<const ClosureFunction> closure_code;
+      std::shared_ptr<const NativeFunction> native_code;
+      if (register_code.has_value()) {
+        closure_code = ClosureCompiler::compile(*register_code, constant_values);
+        if (tier == Tier::OPTIMIZED) {
+          native_code = NativeCompiler::compile(*register_code, constant_values);
+        }
+      }
       return JittedFunction{
+        tier,
         std::move(local),
+        std::move(constants),
+        std::move(constant_values),
+        std::move(constant_boxes),
         meta.arg_count,
-        meta.local_count
+        meta.local_count,
+        std::move(osr_entries),
+        std::move(register_code),
+        std::move(closure_code),
+        std::move(native_code)
       };
     }
 
+  private:
+    // Points the PUSH_CONSTs of `code` into a new table holding each constant they use once.
+    static std::vector<vm::Constant> localize_constants(
+      std::vector<vm::Command> &code,
+      const std::vector<vm::Constant> &pool
+    ) {
+      std::vector<vm::Constant> table;
+      for (auto &cmd: code) {
+        if (cmd.code == vm::PUSH_CONST) {
+          cmd.arg = intern_constant(table, pool.at(cmd.arg));
+        }
+      }
+      return table;
+    }
+
+    // Targets of backward jumps in the original code, mapped to the first optimized instruction
+    // that still stands for them.
+    static std::unordered_map<size_t, size_t> loop_entries(
+      const std::vector<vm::Command>::iterator begin,
+      const std::vector<vm::Command>::iterator end,
+      const OffsetMap &origins
+    ) {
+      const auto size = static_cast<int64_t>(std::distance(begin, end));
+      std::vector is_header(size, false);
+      for (int64_t i = 0; i < size; ++i) {
+        const vm::Command &cmd = begin[i];
+        const bool jump = cmd.code == vm::JMP || cmd.code == vm::JMP_IF_FALSE || cmd.code == vm::JMP_IF_TRUE;
+        if (jump && cmd.arg < 0 && i + 1 + cmd.arg >= 0) {
+          is_header[i + 1 + cmd.arg] = true;
+        }
+      }
+      std::unordered_map<size_t, size_t> entries;
+      for (size_t i = 0; i < origins.size(); ++i) {
+        if (origins[i] != kNoOrigin && is_header[origins[i]]) {
+          entries.try_emplace(origins[i], i);
+        }
+      }
+      return entries;
+    }
+
   private:
     std::vector<vm::Command> &commands;
-    std::vector<vm::Constant> &const_pool;
+    const std::vector<vm::Constant> &const_pool;
     std::unordered_map<size_t, vm::FunctionTableEntry> &func_table;
+    // CALL_METHOD arities for the verifier
+    const std::vector<vm::VMethodTableEntry> vmethod_table;
     std::vector<std::unique_ptr<IOptimize>> optimizations;
 };
 } // namespace umka::jit
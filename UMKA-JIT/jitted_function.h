@@ -1,14 +1,64 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <model/model.h>
 #include <parser/command_parser.h>
 
+#include "closure_compiler.h"
+#include "native_compiler.h"
+#include "register_translator.h"
+#include "tier.h"
+
 namespace umka::jit {
 struct JittedFunction {
+  Tier tier = Tier::OPTIMIZED;
   std::vector<vm::Command> code;
+  // the constants PUSH_CONST in `code` and in the register code index, each once; the
+  // shared pool of the image is never written by the JIT
+  std::vector<vm::Constant> constants;
+  // `constants` decoded, strings boxed outside the GC heap; the closure and native code use
+  // these values, so the boxes live as long as any copy of the function
+  std::vector<vm::Value> constant_values;
+  std::vector<std::shared_ptr<vm::Entity>> constant_boxes;
   int64_t arg_count{};
+  // grows past the original one when inlined callees get slots of their own
   int64_t local_count{};
+  // loop headers a running frame of the original function can continue from in `code`:
+  // offset in the original function -> offset in `code`
+  std::unordered_map<size_t, size_t> osr_entries;
+  // register form of `code`, absent if the function uses instructions it cannot express
+  std::optional<RegisterFunction> register_code;
+  // register_code compiled to closures, shared so that copies keep their jump pointers valid
+  std::shared_ptr<const ClosureFunction> closure_code;
+  // register_code compiled to x86-64, null where the backend is unavailable
+  std::shared_ptr<const NativeFunction> native_code;
+
+  // locals a frame running `code` needs, see FunctionTableEntry::frame_size
+  int64_t frame_size() const { return std::max(arg_count, local_count + 1); }
 };
 
+// JittedFunction::constant_values and constant_boxes for `constants`
+inline std::pair<std::vector<vm::Value>, std::vector<std::shared_ptr<vm::Entity>>> decode_constants(
+  const std::vector<vm::Constant> &constants
+) {
+  std::vector<vm::Value> values;
+  std::vector<std::shared_ptr<vm::Entity>> boxes;
+  values.reserve(constants.size());
+  for (const auto &constant: constants) {
+    vm::Entity entity = vm::parse_constant(constant);
+    if (auto scalar = vm::unbox_scalar(entity)) {
+      values.push_back(*scalar);
+      continue;
+    }
+    boxes.push_back(std::make_shared<vm::Entity>(std::move(entity)));
+    values.emplace_back(boxes.back().get());
+  }
+  return {std::move(values), std::move(boxes)};
+}
+
 }
\ No newline at end of file
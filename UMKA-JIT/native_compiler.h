@@ -0,0 +1,559 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define UMKA_NATIVE_JIT 1
+#else
+#define UMKA_NATIVE_JIT 0
+#endif
+
+#include <model/model.h>
+#include <parser/command_parser.h>
+
+#include "closure_compiler.h"
+#include "register_translator.h"
+
+namespace umka::jit {
+// Passed to native code and to the runtime helpers it calls. Helpers catch exceptions into
+// `error` and return nullptr, native code then returns at once and run() rethrows.
+struct NativeFrame {
+  ClosureFrame *frame;
+  std::exception_ptr error;
+};
+
+// (frame, registers) -> index of the result register
+using NativeEntry = uint32_t (*)(NativeFrame *, vm::Value *);
+
+// x86-64 code of one function in its own executable mapping.
+class NativeFunction {
+  public:
+    NativeFunction() = default;
+    NativeFunction(const NativeFunction &) = delete;
+    NativeFunction &operator=(const NativeFunction &) = delete;
+
+    ~NativeFunction() {
+#if UMKA_NATIVE_JIT
+      if (memory != nullptr) {
+        munmap(memory, size);
+      }
+#endif
+    }
+
+    // frame.runtime serves calls, slow operations and safepoints like for closures;
+    // `start` is 0 or a loop entry of the register code
+    vm::Value run(ClosureFrame &frame, size_t start = 0) const {
+      NativeFrame native{&frame, nullptr};
+      const NativeEntry code = start == 0 ? entry : loop_entries.at(start);
+      const uint32_t result = code(&native, frame.registers);
+      if (native.error) {
+        std::rethrow_exception(native.error);
+      }
+      return frame.registers[result];
+    }
+
+    int64_t register_count{};
+
+  private:
+    friend class NativeCompiler;
+
+    void *memory = nullptr;
+    size_t size = 0;
+    NativeEntry entry = nullptr;
+    // register pc -> a second prologue that jumps to it
+    std::unordered_map<size_t, NativeEntry> loop_entries;
+};
+
+// Emits x86-64 instructions. Every memory operand is [rbx + disp32]: rbx holds the
+// register file of the running function, r12 its NativeFrame.
+class X64Assembler {
+  public:
+    using Label = size_t;
+
+    enum Condition : uint8_t {
+      BELOW = 0x2, ABOVE_EQUAL = 0x3, EQUAL = 0x4, NOT_EQUAL = 0x5, ABOVE = 0x7,
+      SIGN = 0x8, LESS = 0xC, GREATER_EQUAL = 0xD, LESS_EQUAL = 0xE, GREATER = 0xF
+    };
+
+    Label make_label() {
+      labels.push_back(kUnbound);
+      return labels.size() - 1;
+    }
+
+    void bind(Label label) {
+      labels[label] = code.size();
+    }
+
+    void jmp(Label label) {
+      emit(0xE9);
+      fixup(label);
+    }
+
+    void jcc(Condition condition, Label label) {
+      emit(0x0F, 0x80 | condition);
+      fixup(label);
+    }
+
+    void push_rbx() { emit(0x53); }
+    void push_r12() { emit(0x41, 0x54); }
+    void pop_rbx() { emit(0x5B); }
+    void pop_r12() { emit(0x41, 0x5C); }
+    void sub_rsp_8() { emit(0x48, 0x83, 0xEC, 0x08); }
+    void add_rsp_8() { emit(0x48, 0x83, 0xC4, 0x08); }
+    void ret() { emit(0xC3); }
+    void ud2() { emit(0x0F, 0x0B); }
+
+    void mov_r12_rdi() { emit(0x49, 0x89, 0xFC); }
+    void mov_rbx_rsi() { emit(0x48, 0x89, 0xF3); }
+    void mov_rbx_rax() { emit(0x48, 0x89, 0xC3); }
+    void mov_rdi_r12() { emit(0x4C, 0x89, 0xE7); }
+    void test_rax_rax() { emit(0x48, 0x85, 0xC0); }
+    void test_eax_eax() { emit(0x85, 0xC0); }
+    void movzx_eax_al() { emit(0x0F, 0xB6, 0xC0); }
+    void setcc_al(Condition condition) { emit(0x0F, 0x90 | condition, 0xC0); }
+
+    void mov_eax(uint32_t imm) { emit(0xB8); imm32(imm); }
+    void mov_esi(uint32_t imm) { emit(0xBE); imm32(imm); }
+    void mov_edx(uint32_t imm) { emit(0xBA); imm32(imm); }
+    void mov_ecx(uint32_t imm) { emit(0xB9); imm32(imm); }
+    void mov_r8d(uint32_t imm) { emit(0x41, 0xB8); imm32(imm); }
+    void mov_r9d(uint32_t imm) { emit(0x41, 0xB9); imm32(imm); }
+    void mov_rax(uint64_t imm) { emit(0x48, 0xB8); imm64(imm); }
+    void mov_rdx(uint64_t imm) { emit(0x48, 0xBA); imm64(imm); }
+    void call_rax() { emit(0xFF, 0xD0); }
+
+    void cmp_byte(int32_t disp, uint8_t imm) { emit(0x80); rbx_operand(7, disp); emit(imm); }
+    void mov_byte(int32_t disp, uint8_t imm) { emit(0xC6); rbx_operand(0, disp); emit(imm); }
+    void store_al(int32_t disp) { emit(0x88); rbx_operand(0, disp); }
+    void load_rax(int32_t disp) { emit(0x48, 0x8B); rbx_operand(0, disp); }
+    void store_rax(int32_t disp) { emit(0x48, 0x89); rbx_operand(0, disp); }
+    void add_rax(int32_t disp) { emit(0x48, 0x03); rbx_operand(0, disp); }
+    void sub_rax(int32_t disp) { emit(0x48, 0x2B); rbx_operand(0, disp); }
+    void imul_rax(int32_t disp) { emit(0x48, 0x0F, 0xAF); rbx_operand(0, disp); }
+    void cmp_rax(int32_t disp) { emit(0x48, 0x3B); rbx_operand(0, disp); }
+
+    void movups_load(int32_t disp) { emit(0x0F, 0x10); rbx_operand(0, disp); }
+    void movups_store(int32_t disp) { emit(0x0F, 0x11); rbx_operand(0, disp); }
+    void movsd_load(int32_t disp) { emit(0xF2, 0x0F, 0x10); rbx_operand(0, disp); }
+    void movsd_store(int32_t disp) { emit(0xF2, 0x0F, 0x11); rbx_operand(0, disp); }
+    void addsd(int32_t disp) { emit(0xF2, 0x0F, 0x58); rbx_operand(0, disp); }
+    void subsd(int32_t disp) { emit(0xF2, 0x0F, 0x5C); rbx_operand(0, disp); }
+    void mulsd(int32_t disp) { emit(0xF2, 0x0F, 0x59); rbx_operand(0, disp); }
+    void divsd(int32_t disp) { emit(0xF2, 0x0F, 0x5E); rbx_operand(0, disp); }
+    void ucomisd(int32_t disp) { emit(0x66, 0x0F, 0x2E); rbx_operand(0, disp); }
+
+    // resolves jumps, false if a label was never bound
+    bool finish() {
+      for (const auto &[at, label]: fixups) {
+        if (labels[label] == kUnbound) {
+          return false;
+        }
+        const auto rel = static_cast<int32_t>(static_cast<int64_t>(labels[label]) - static_cast<int64_t>(at + 4));
+        std::memcpy(code.data() + at, &rel, sizeof(rel));
+      }
+      return true;
+    }
+
+    std::vector<uint8_t> code;
+
+  private:
+    static constexpr size_t kUnbound = SIZE_MAX;
+
+    template<typename... Bytes>
+    void emit(Bytes... bytes) {
+      (code.push_back(static_cast<uint8_t>(bytes)), ...);
+    }
+
+    void imm32(uint32_t value) {
+      for (int shift = 0; shift < 32; shift += 8) {
+        emit(value >> shift);
+      }
+    }
+
+    void imm64(uint64_t value) {
+      for (int shift = 0; shift < 64; shift += 8) {
+        emit(value >> shift);
+      }
+    }
+
+    // ModRM with mod = 10 (disp32) and rm = rbx
+    void rbx_operand(uint8_t reg, int32_t disp) {
+      emit(0x80 | reg << 3 | 0x3);
+      imm32(static_cast<uint32_t>(disp));
+    }
+
+    void fixup(Label label) {
+      fixups.emplace_back(code.size(), label);
+      imm32(0);
+    }
+
+    std::vector<size_t> labels;
+    std::vector<std::pair<size_t, Label>> fixups;
+};
+
+// Baseline x86-64 backend for register code. Int and double arithmetic and comparisons are
+// emitted inline behind a type check of both operands; anything else, calls and the safepoints
+// of backward jumps go to runtime helpers, which reach the interpreter through ClosureRuntime.
+// compile() returns nullptr on other platforms and for registers beyond a 32-bit displacement.
+// Constants are taken decoded from JittedFunction::constant_values, as in ClosureCompiler.
+class NativeCompiler {
+  public:
+    static std::shared_ptr<const NativeFunction> compile(
+      const RegisterFunction &function,
+      const std::vector<vm::Value> &constants
+    ) {
+#if UMKA_NATIVE_JIT
+      static_assert(sizeof(vm::Value) == 16 && offsetof(vm::Value, i) == kPayload);
+      if (function.register_count > INT32_MAX / static_cast<int64_t>(sizeof(vm::Value))) {
+        return nullptr;
+      }
+      auto compiled = std::make_shared<NativeFunction>();
+      compiled->register_count = function.register_count;
+
+      X64Assembler a;
+      const auto &code = function.code;
+      std::vector<X64Assembler::Label> instruction_labels;
+      for (size_t i = 0; i < code.size(); ++i) {
+        instruction_labels.push_back(a.make_label());
+      }
+      const X64Assembler::Label bailout = a.make_label();
+
+      emit_prologue(a);
+
+      for (size_t i = 0; i < code.size(); ++i) {
+        const RegisterInstruction &instruction = code[i];
+        a.bind(instruction_labels[i]);
+        switch (instruction.code) {
+          case vm::PUSH_CONST: {
+            const vm::Value &constant = constants.at(instruction.arg);
+            uint64_t bits;
+            std::memcpy(&bits, &constant.i, sizeof(bits));
+            a.mov_rax(bits);
+            a.store_rax(payload(instruction.dst));
+            a.mov_byte(type(instruction.dst), static_cast<uint8_t>(constant.type));
+            break;
+          }
+          case vm::LOAD:
+            a.movups_load(slot(instruction.lhs));
+            a.movups_store(slot(instruction.dst));
+            break;
+          case vm::JMP:
+            if (instruction.arg <= static_cast<int64_t>(i)) {
+              emit_safepoint(a, bailout);
+            }
+            a.jmp(instruction_labels[instruction.arg]);
+            break;
+          case vm::JMP_IF_FALSE:
+          case vm::JMP_IF_TRUE:
+            emit_branch(a, instruction, instruction_labels[instruction.arg],
+                        instruction.arg <= static_cast<int64_t>(i), bailout);
+            break;
+          case vm::CALL:
+          case vm::CALL_BUILTIN:
+            a.mov_rdi_r12();
+            a.mov_esi(instruction.code);
+            a.mov_rdx(static_cast<uint64_t>(instruction.arg));
+            a.mov_ecx(instruction.lhs);
+            a.mov_r8d(instruction.rhs);
+            a.mov_r9d(instruction.dst);
+            emit_helper_call(a, reinterpret_cast<uint64_t>(&call_helper), bailout);
+            break;
+          case vm::RETURN:
+            a.mov_eax(instruction.lhs);
+            emit_epilogue(a);
+            break;
+          default:
+            if (!emit_operation(a, instruction, bailout)) {
+              return nullptr;
+            }
+        }
+      }
+      a.ud2();
+
+      a.bind(bailout);
+      a.mov_eax(UINT32_MAX);
+      emit_epilogue(a);
+
+      std::vector<std::pair<size_t, size_t>> loop_stubs;
+      for (const auto &[offset, pc]: function.loop_entries) {
+        loop_stubs.emplace_back(pc, a.code.size());
+        emit_prologue(a);
+        a.jmp(instruction_labels[pc]);
+      }
+
+      if (!a.finish()) {
+        return nullptr;
+      }
+      void *memory = mmap(nullptr, a.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) {
+        return nullptr;
+      }
+      std::memcpy(memory, a.code.data(), a.code.size());
+      compiled->memory = memory;
+      compiled->size = a.code.size();
+      if (mprotect(memory, a.code.size(), PROT_READ | PROT_EXEC) != 0) {
+        return nullptr;
+      }
+      compiled->entry = reinterpret_cast<NativeEntry>(memory);
+      for (const auto &[pc, at]: loop_stubs) {
+        compiled->loop_entries[pc] = reinterpret_cast<NativeEntry>(static_cast<uint8_t *>(memory) + at);
+      }
+      return compiled;
+#else
+      (void) function;
+      (void) constants;
+      return nullptr;
+#endif
+    }
+
+  private:
+    static constexpr int32_t kPayload = 8;
+
+    static int32_t slot(uint32_t reg) {
+      return static_cast<int32_t>(reg * sizeof(vm::Value));
+    }
+
+    static int32_t type(uint32_t reg) {
+      return slot(reg);
+    }
+
+    static int32_t payload(uint32_t reg) {
+      return slot(reg) + kPayload;
+    }
+
+    static uint8_t tag(vm::ValueType value_type) {
+      return static_cast<uint8_t>(value_type);
+    }
+
+    static void emit_prologue(X64Assembler &a) {
+      a.push_rbx();
+      a.push_r12();
+      a.sub_rsp_8();
+      a.mov_r12_rdi();
+      a.mov_rbx_rsi();
+    }
+
+    static void emit_epilogue(X64Assembler &a) {
+      a.add_rsp_8();
+      a.pop_r12();
+      a.pop_rbx();
+      a.ret();
+    }
+
+    // helpers returning the register file reload rbx from rax, nullptr means an exception
+    static void emit_helper_call(X64Assembler &a, uint64_t helper, X64Assembler::Label bailout) {
+      a.mov_rax(helper);
+      a.call_rax();
+      a.test_rax_rax();
+      a.jcc(X64Assembler::EQUAL, bailout);
+      a.mov_rbx_rax();
+    }
+
+    static void emit_safepoint(X64Assembler &a, X64Assembler::Label bailout) {
+      a.mov_rdi_r12();
+      emit_helper_call(a, reinterpret_cast<uint64_t>(&safepoint_helper), bailout);
+    }
+
+    static void emit_slow_operation(X64Assembler &a, const RegisterInstruction &instruction,
+                                    X64Assembler::Label bailout) {
+      a.mov_rdi_r12();
+      a.mov_esi(instruction.code);
+      a.mov_edx(instruction.dst);
+      a.mov_ecx(instruction.lhs);
+      a.mov_r8d(instruction.rhs);
+      emit_helper_call(a, reinterpret_cast<uint64_t>(&operate_helper), bailout);
+    }
+
+    static void emit_branch(X64Assembler &a, const RegisterInstruction &instruction, X64Assembler::Label target,
+                            bool backward, X64Assembler::Label bailout) {
+      const bool jump_if = instruction.code == vm::JMP_IF_TRUE;
+      const X64Assembler::Label not_bool = a.make_label();
+      const X64Assembler::Label taken = a.make_label();
+      const X64Assembler::Label next = a.make_label();
+      const auto take = jump_if ? X64Assembler::NOT_EQUAL : X64Assembler::EQUAL;
+
+      a.cmp_byte(type(instruction.lhs), tag(vm::ValueType::BOOL));
+      a.jcc(X64Assembler::NOT_EQUAL, not_bool);
+      a.cmp_byte(payload(instruction.lhs), 0);
+      a.jcc(take, backward ? taken : target);
+      a.jmp(next);
+
+      a.bind(not_bool);
+      a.mov_rdi_r12();
+      a.mov_esi(instruction.lhs);
+      a.mov_rax(reinterpret_cast<uint64_t>(&truthy_helper));
+      a.call_rax();
+      a.test_eax_eax();
+      a.jcc(X64Assembler::SIGN, bailout);
+      a.jcc(take, backward ? taken : target);
+      a.jmp(next);
+
+      a.bind(taken);
+      if (backward) {
+        emit_safepoint(a, bailout);
+        a.jmp(target);
+      }
+      a.bind(next);
+    }
+
+    // false if the opcode has no native form
+    static bool emit_operation(X64Assembler &a, const RegisterInstruction &instruction, X64Assembler::Label bailout) {
+      const uint8_t op = instruction.code;
+      switch (op) {
+        case vm::ADD:
+        case vm::SUB:
+        case vm::MUL:
+        case vm::DIV:
+        case vm::EQ:
+        case vm::NEQ:
+        case vm::GT:
+        case vm::LT:
+        case vm::GTE:
+        case vm::LTE:
+          break;
+        case vm::REM:
+        case vm::AND:
+        case vm::OR:
+        case vm::NOT:
+        case vm::TO_STRING:
+        case vm::TO_INT:
+        case vm::TO_DOUBLE:
+          emit_slow_operation(a, instruction, bailout);
+          return true;
+        default:
+          return false;
+      }
+
+      const X64Assembler::Label not_int = a.make_label();
+      const X64Assembler::Label slow = a.make_label();
+      const X64Assembler::Label done = a.make_label();
+      const uint32_t lhs = instruction.lhs;
+      const uint32_t rhs = instruction.rhs;
+      const uint32_t dst = instruction.dst;
+
+      // integer division stays in the runtime, which raises the VM error on a zero divisor
+      if (op != vm::DIV) {
+        a.cmp_byte(type(lhs), tag(vm::ValueType::INT));
+        a.jcc(X64Assembler::NOT_EQUAL, not_int);
+        a.cmp_byte(type(rhs), tag(vm::ValueType::INT));
+        a.jcc(X64Assembler::NOT_EQUAL, not_int);
+        a.load_rax(payload(lhs));
+        switch (op) {
+          case vm::ADD: a.add_rax(payload(rhs)); break;
+          case vm::SUB: a.sub_rax(payload(rhs)); break;
+          case vm::MUL: a.imul_rax(payload(rhs)); break;
+          default: a.cmp_rax(payload(rhs)); break;
+        }
+        if (op == vm::ADD || op == vm::SUB || op == vm::MUL) {
+          a.store_rax(payload(dst));
+          a.mov_byte(type(dst), tag(vm::ValueType::INT));
+        } else {
+          store_condition(a, dst, int_condition(op));
+        }
+        a.jmp(done);
+      }
+
+      // NaN makes double EQ and NEQ disagree with the flags of ucomisd, they stay in the runtime
+      a.bind(not_int);
+      if (op != vm::EQ && op != vm::NEQ) {
+        a.cmp_byte(type(lhs), tag(vm::ValueType::DOUBLE));
+        a.jcc(X64Assembler::NOT_EQUAL, slow);
+        a.cmp_byte(type(rhs), tag(vm::ValueType::DOUBLE));
+        a.jcc(X64Assembler::NOT_EQUAL, slow);
+        // LT and LTE compare the other way round so that unordered operands give false
+        const bool swapped = op == vm::LT || op == vm::LTE;
+        a.movsd_load(payload(swapped ? rhs : lhs));
+        switch (op) {
+          case vm::ADD: a.addsd(payload(rhs)); break;
+          case vm::SUB: a.subsd(payload(rhs)); break;
+          case vm::MUL: a.mulsd(payload(rhs)); break;
+          case vm::DIV: a.divsd(payload(rhs)); break;
+          default: a.ucomisd(payload(swapped ? lhs : rhs)); break;
+        }
+        if (op == vm::ADD || op == vm::SUB || op == vm::MUL || op == vm::DIV) {
+          a.movsd_store(payload(dst));
+          a.mov_byte(type(dst), tag(vm::ValueType::DOUBLE));
+        } else {
+          const bool strict = op == vm::GT || op == vm::LT;
+          store_condition(a, dst, strict ? X64Assembler::ABOVE : X64Assembler::ABOVE_EQUAL);
+        }
+        a.jmp(done);
+      }
+
+      a.bind(slow);
+      emit_slow_operation(a, instruction, bailout);
+      a.bind(done);
+      return true;
+    }
+
+    static X64Assembler::Condition int_condition(uint8_t op) {
+      switch (op) {
+        case vm::EQ: return X64Assembler::EQUAL;
+        case vm::NEQ: return X64Assembler::NOT_EQUAL;
+        case vm::GT: return X64Assembler::GREATER;
+        case vm::LT: return X64Assembler::LESS;
+        case vm::GTE: return X64Assembler::GREATER_EQUAL;
+        default: return X64Assembler::LESS_EQUAL;
+      }
+    }
+
+    static void store_condition(X64Assembler &a, uint32_t dst, X64Assembler::Condition condition) {
+      a.setcc_al(condition);
+      a.movzx_eax_al();
+      a.store_rax(payload(dst));
+      a.mov_byte(type(dst), tag(vm::ValueType::BOOL));
+    }
+
+    static vm::Value *operate_helper(NativeFrame *native, uint32_t op, uint32_t dst, uint32_t lhs,
+                                     uint32_t rhs) noexcept {
+      try {
+        vm::Value *registers = native->frame->registers;
+        registers[dst] = native->frame->runtime->operate(static_cast<uint8_t>(op), registers[lhs], registers[rhs]);
+        return registers;
+      } catch (...) {
+        native->error = std::current_exception();
+        return nullptr;
+      }
+    }
+
+    // 1 or 0, -1 after an exception
+    static int truthy_helper(NativeFrame *native, uint32_t reg) noexcept {
+      try {
+        return native->frame->runtime->truthy(native->frame->registers[reg]) ? 1 : 0;
+      } catch (...) {
+        native->error = std::current_exception();
+        return -1;
+      }
+    }
+
+    static vm::Value *call_helper(NativeFrame *native, uint32_t op, int64_t callee, uint32_t first,
+                                  uint32_t count, uint32_t dst) noexcept {
+      try {
+        ClosureFrame &frame = *native->frame;
+        const vm::Value result = frame.runtime->call(static_cast<uint8_t>(op), callee, frame, first, count);
+        frame.registers[dst] = result;
+        return frame.registers;
+      } catch (...) {
+        native->error = std::current_exception();
+        return nullptr;
+      }
+    }
+
+    static vm::Value *safepoint_helper(NativeFrame *native) noexcept {
+      try {
+        native->frame->runtime->safepoint();
+        return native->frame->registers;
+      } catch (...) {
+        native->error = std::current_exception();
+        return nullptr;
+      }
+    }
+};
+} // namespace umka::jit
@@ -1,19 +1,65 @@
 #pragma once
 #include <model/model.h>
+#include <parser/command_parser.h>
 
+#include <numeric>
 #include <vector>
 
 namespace umka::jit {
 
+// origins[i] is the offset in the unoptimized function that instruction i of the optimized
+// code stands for, kNoOrigin for instructions a pass made up. On-stack replacement looks loop
+// headers up in it, so an instruction keeps the origin of a loop header only if entering the
+// optimized code there with the locals and operand stack the original had at the header
+// behaves like the original.
+using OffsetMap = std::vector<int64_t>;
+constexpr int64_t kNoOrigin = -1;
+
+// Index of `constant` in `pool`, appended if the pool has no equal constant yet. Passes run on
+// the private table of one function, so they may add to it freely.
+inline int64_t intern_constant(std::vector<vm::Constant> &pool, const vm::Constant &constant) {
+  for (size_t i = 0; i < pool.size(); ++i) {
+    if (pool[i].type == constant.type && pool[i].data == constant.data) {
+      return static_cast<int64_t>(i);
+    }
+  }
+  pool.push_back(constant);
+  return static_cast<int64_t>(pool.size() - 1);
+}
+
+// Target of the jump at code[i], -1 unless it is a jump inside the code or to its end.
+inline int64_t jump_target(const std::vector<vm::Command> &code, size_t i) {
+  const auto op = static_cast<vm::OpCode>(code[i].code);
+  if (op != vm::OpCode::JMP && op != vm::OpCode::JMP_IF_FALSE && op != vm::OpCode::JMP_IF_TRUE) {
+    return -1;
+  }
+  const int64_t target = static_cast<int64_t>(i) + code[i].arg + 1;
+  return target >= 0 && target <= static_cast<int64_t>(code.size()) ? target : -1;
+}
+
 struct IOptimize {
   virtual ~IOptimize() = default;
 
+  // passes that add, drop or move instructions keep `origins` parallel to `code`
   virtual void run(
       std::vector<vm::Command>& code,
       std::vector<vm::Constant>& const_pool,
       std::unordered_map<size_t, vm::FunctionTableEntry>& func_table,
-      vm::FunctionTableEntry& meta
+      vm::FunctionTableEntry& meta,
+      OffsetMap& origins
   ) = 0;
+
+  // for callers that do not need the offset map
+  void run(
+      std::vector<vm::Command>& code,
+      std::vector<vm::Constant>& const_pool,
+      std::unordered_map<size_t, vm::FunctionTableEntry>& func_table,
+      vm::FunctionTableEntry& meta
+  ) {
+    OffsetMap origins(code.size());
+    std::iota(origins.begin(), origins.end(), 0);
+    run(code, const_pool, func_table, meta, origins);
+  }
 };
 
 } // namespace umka::jit
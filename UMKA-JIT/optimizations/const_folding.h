@@ -2,25 +2,42 @@
 #include "base_optimization.h"
 #include <model/model.h>
 #include <cstring>
+#include <limits>
 #include <variant>
 
 namespace umka::jit {
 class ConstFolding final: public IOptimize {
   public:
+    using IOptimize::run;
+
+    // A folded constant keeps the origin of its first operand. Folding never reaches across a
+    // jump target, so every target gets an offset of its own and jumps are retargeted to it.
     void run(
       std::vector<vm::Command> &code,
       std::vector<vm::Constant> &const_pool,
       std::unordered_map<size_t, vm::FunctionTableEntry> &,
-      vm::FunctionTableEntry &meta
+      vm::FunctionTableEntry &meta,
+      OffsetMap &origins
     ) override {
       std::vector<vm::Command> out;
       out.reserve(code.size());
+      OffsetMap out_origins;
+      out_origins.reserve(code.size());
 
       using ConstValue = std::variant<int64_t, double>;
-      std::vector<ConstValue> stack;
+      struct Folded {
+        ConstValue value;
+        int64_t origin;
+      };
+      std::vector<Folded> stack;
+
+      auto emit = [&](const vm::Command &cmd, int64_t origin) {
+        out.push_back(cmd);
+        out_origins.push_back(origin);
+      };
 
       auto flush_stack = [&]() {
-        for (const auto &val: stack) {
+        for (const auto &[val, origin]: stack) {
           vm::Constant c;
           if (std::holds_alternative<int64_t>(val)) {
             c.type = vm::TYPE_INT64;
@@ -34,12 +51,11 @@ class ConstFolding final: public IOptimize {
             memcpy(c.data.data(), &v, 8);
           }
 
-          const_pool.push_back(c);
-          const int64_t idx = const_pool.size() - 1;
+          const int64_t idx = intern_constant(const_pool, c);
 
-          out.push_back(vm::Command{
+          emit(vm::Command{
             static_cast<uint8_t>(vm::OpCode::PUSH_CONST), idx
-          });
+          }, origin);
         }
         stack.clear();
       };
@@ -47,6 +63,8 @@ class ConstFolding final: public IOptimize {
       auto needs_flush = [](vm::OpCode op) {
         switch (op) {
           case vm::OpCode::CALL:
+          case vm::OpCode::TAIL_CALL:
+          case vm::OpCode::CALL_BUILTIN:
           case vm::OpCode::LOAD:
           case vm::OpCode::STORE:
           case vm::OpCode::RETURN:
@@ -67,12 +85,25 @@ class ConstFolding final: public IOptimize {
         }
       };
 
+      std::vector is_target(code.size() + 1, false);
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (const int64_t target = jump_target(code, i); target >= 0) {
+          is_target[target] = true;
+        }
+      }
+      // new offset of every old one, exact for jump targets
+      std::vector<int64_t> new_offset(code.size() + 1, 0);
+
       for (size_t i = 0; i < code.size(); ++i) {
         const auto op = static_cast<vm::OpCode>(code[i].code);
+        if (is_target[i]) {
+          flush_stack();
+        }
+        new_offset[i] = static_cast<int64_t>(out.size());
 
         if (needs_flush(op)) {
           flush_stack();
-          out.push_back(code[i]);
+          emit(code[i], origins[i]);
           continue;
         }
 
@@ -80,45 +111,71 @@ class ConstFolding final: public IOptimize {
           const auto &constant = const_pool[code[i].arg];
           if (constant.type == vm::TYPE_INT64) {
             int64_t value = load_int(constant);
-            stack.push_back(value);
+            stack.push_back({value, origins[i]});
           } else if (constant.type == vm::TYPE_DOUBLE) {
             double value = load_double(constant);
-            stack.push_back(value);
+            stack.push_back({value, origins[i]});
           } else {
             flush_stack();
-            out.push_back(code[i]);
+            emit(code[i], origins[i]);
           }
           continue;
         }
 
         if (is_foldable_binary(op)) {
-          if (stack.size() >= 2) {
-            ConstValue rhs = stack.back();
+          if (stack.size() >= 2 && folds(stack[stack.size() - 1].value, stack[stack.size() - 2].value, op)) {
+            // the machine takes the top of the stack as the left operand
+            Folded lhs = stack.back();
             stack.pop_back();
-            ConstValue lhs = stack.back();
+            Folded rhs = stack.back();
             stack.pop_back();
 
-            ConstValue res = eval(lhs, rhs, op);
-            stack.push_back(res);
+            ConstValue res = eval(lhs.value, rhs.value, op);
+            stack.push_back({res, rhs.origin});
           } else {
             flush_stack();
-            out.push_back(code[i]);
+            emit(code[i], origins[i]);
           }
 
           continue;
         }
         flush_stack();
-        out.push_back(code[i]);
+        emit(code[i], origins[i]);
       }
 
       flush_stack();
+      new_offset[code.size()] = static_cast<int64_t>(out.size());
+
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (const int64_t target = jump_target(code, i); target >= 0) {
+          // jumps flush before themselves, so the jump is the last instruction emitted for `i`
+          const int64_t at = new_offset[i + 1] - 1;
+          out[at].arg = new_offset[target] - at - 1;
+        }
+      }
 
       code.swap(out);
+      origins.swap(out_origins);
     }
 
   private:
     static bool is_foldable_binary(const vm::OpCode op);
 
+    // false where the machine raises an error instead of producing a value: integer division
+    // by zero or INT64_MIN / -1, and REM of a double. Float division by zero is not folded either.
+    static bool folds(const std::variant<int64_t, double> &a, const std::variant<int64_t, double> &b, const vm::OpCode op) {
+      if (op != vm::OpCode::DIV && op != vm::OpCode::REM) {
+        return true;
+      }
+      if (!std::holds_alternative<int64_t>(a) || !std::holds_alternative<int64_t>(b)) {
+        const double divisor = std::holds_alternative<int64_t>(b) ? static_cast<double>(std::get<int64_t>(b)) : std::get<double>(b);
+        return op == vm::OpCode::DIV && divisor != 0.0;
+      }
+      const int64_t lhs = std::get<int64_t>(a);
+      const int64_t rhs = std::get<int64_t>(b);
+      return rhs != 0 && !(rhs == -1 && lhs == std::numeric_limits<int64_t>::min());
+    }
+
     static int64_t load_int(const vm::Constant &c) {
       int64_t v;
       memcpy(&v, c.data.data(), 8);
@@ -142,8 +199,8 @@ class ConstFolding final: public IOptimize {
           case vm::OpCode::ADD: return lhs + rhs;
           case vm::OpCode::SUB: return lhs - rhs;
           case vm::OpCode::MUL: return lhs * rhs;
-          case vm::OpCode::DIV: return rhs != 0 ? lhs / rhs : 0;
-          case vm::OpCode::REM: return rhs != 0 ? lhs % rhs : 0;
+          case vm::OpCode::DIV: return lhs / rhs;
+          case vm::OpCode::REM: return lhs % rhs;
           case vm::OpCode::LT: return (lhs < rhs);
           case vm::OpCode::GT: return (lhs > rhs);
           case vm::OpCode::LTE: return (lhs <= rhs);
@@ -163,7 +220,7 @@ class ConstFolding final: public IOptimize {
           case vm::OpCode::ADD: return lhs + rhs;
           case vm::OpCode::SUB: return lhs - rhs;
           case vm::OpCode::MUL: return lhs * rhs;
-          case vm::OpCode::DIV: return rhs != 0.0 ? lhs / rhs : 0.0;
+          case vm::OpCode::DIV: return lhs / rhs;
           case vm::OpCode::LT: return (lhs < rhs);
           case vm::OpCode::GT: return (lhs > rhs);
           case vm::OpCode::LTE: return (lhs <= rhs);
@@ -187,7 +244,7 @@ class ConstFolding final: public IOptimize {
         case vm::OpCode::ADD: return lhs_d + rhs_d;
         case vm::OpCode::SUB: return lhs_d - rhs_d;
         case vm::OpCode::MUL: return lhs_d * rhs_d;
-        case vm::OpCode::DIV: return rhs_d != 0.0 ? lhs_d / rhs_d : 0.0;
+        case vm::OpCode::DIV: return lhs_d / rhs_d;
         case vm::OpCode::LT: return (lhs_d < rhs_d);
         case vm::OpCode::GT: return (lhs_d > rhs_d);
         case vm::OpCode::LTE: return (lhs_d <= rhs_d);
@@ -12,11 +12,15 @@
 namespace umka::jit {
 class ConstantPropagation final: public IOptimize {
   public:
+    using IOptimize::run;
+
+    // rewrites instructions in place, so offsets stay as they are
     void run(
       std::vector<vm::Command> &code,
       std::vector<vm::Constant> &const_pool,
       std::unordered_map<size_t, vm::FunctionTableEntry> &,
-      vm::FunctionTableEntry &meta
+      vm::FunctionTableEntry &meta,
+      OffsetMap &
     ) override {
       using ConstValue = std::variant<int64_t, double>;
 
@@ -42,6 +46,8 @@ class ConstantPropagation final: public IOptimize {
                 prev_op == vm::OpCode::JMP_IF_FALSE ||
                 prev_op == vm::OpCode::JMP_IF_TRUE ||
                 prev_op == vm::OpCode::CALL ||
+                prev_op == vm::OpCode::TAIL_CALL ||
+                prev_op == vm::OpCode::CALL_BUILTIN ||
                 prev_op == vm::OpCode::RETURN ||
                 prev_op == vm::OpCode::CALL_METHOD ||
                 prev_op == vm::OpCode::STORE) {
@@ -71,9 +77,23 @@ class ConstantPropagation final: public IOptimize {
 
       auto push = [&](Value v) { stack.push_back(v); };
 
+      // a jump target is also reached from elsewhere, nothing known on one path holds there
+      std::vector is_target(code.size(), false);
+      for (size_t ip = 0; ip < code.size(); ++ip) {
+        const vm::OpCode op = static_cast<vm::OpCode>(code[ip].code);
+        const int64_t target = static_cast<int64_t>(ip) + code[ip].arg + 1;
+        if ((op == vm::OpCode::JMP || op == vm::OpCode::JMP_IF_FALSE || op == vm::OpCode::JMP_IF_TRUE) &&
+            target >= 0 && target < static_cast<int64_t>(code.size())) {
+          is_target[target] = true;
+        }
+      }
+
       for (size_t ip = 0; ip < code.size(); ++ip) {
         auto &cmd = code[ip];
         vm::OpCode op = static_cast<vm::OpCode>(cmd.code);
+        if (is_target[ip]) {
+          reset_state();
+        }
 
         switch (op) {
           case vm::OpCode::PUSH_CONST: {
@@ -159,8 +179,10 @@ class ConstantPropagation final: public IOptimize {
           }
 
           case vm::OpCode::GET_FIELD: {
+            // leaves the field index under the object
             pop();
             push({false, static_cast<int64_t>(0)});
+            push({false, static_cast<int64_t>(0)});
             break;
           }
 
@@ -197,6 +219,8 @@ class ConstantPropagation final: public IOptimize {
           }
 
           case vm::OpCode::CALL:
+          case vm::OpCode::TAIL_CALL:
+          case vm::OpCode::CALL_BUILTIN:
           case vm::OpCode::RETURN:
             reset_state();
             break;
@@ -216,6 +240,8 @@ class ConstantPropagation final: public IOptimize {
              op == vm::OpCode::JMP_IF_FALSE ||
              op == vm::OpCode::JMP_IF_TRUE ||
              op == vm::OpCode::CALL ||
+             op == vm::OpCode::TAIL_CALL ||
+             op == vm::OpCode::CALL_BUILTIN ||
              op == vm::OpCode::CALL_METHOD ||
              op == vm::OpCode::RETURN;
     }
@@ -9,11 +9,14 @@
 namespace umka::jit {
 class DeadCodeElimination final: public IOptimize {
   public:
+    using IOptimize::run;
+
     void run(
       std::vector<vm::Command> &code,
       std::vector<vm::Constant> &const_pool,
       std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
-      vm::FunctionTableEntry &
+      vm::FunctionTableEntry &,
+      OffsetMap &origins
     ) override {
       if (code.empty()) {
         return;
@@ -59,7 +62,7 @@ class DeadCodeElimination final: public IOptimize {
         }
       }
 
-      int demand = 0;
+      int64_t demand = 0;
 
       for (int i = static_cast<int>(n) - 1; i >= 0; --i) {
         if (!reachable[static_cast<size_t>(i)]) {
@@ -90,10 +93,10 @@ class DeadCodeElimination final: public IOptimize {
         if (is_needed) {
           needed[static_cast<size_t>(i)] = true;
 
-          demand -= static_cast<int>(produces);
+          demand -= produces;
           if (demand < 0) demand = 0;
 
-          demand += static_cast<int>(consumes);
+          demand += consumes;
         }
       }
 
@@ -101,11 +104,14 @@ class DeadCodeElimination final: public IOptimize {
       new_code.reserve(n);
 
       std::vector old_to_new(n, -1);
+      OffsetMap new_origins;
+      new_origins.reserve(n);
 
       for (size_t i = 0; i < n; ++i) {
         if (reachable[i] && needed[i]) {
           old_to_new[i] = static_cast<int>(new_code.size());
           new_code.push_back(code[i]);
+          new_origins.push_back(origins[i]);
         }
       }
 
@@ -133,6 +139,7 @@ class DeadCodeElimination final: public IOptimize {
       }
 
       code.swap(new_code);
+      origins.swap(new_origins);
     }
 
   private:
@@ -162,14 +169,23 @@ class DeadCodeElimination final: public IOptimize {
         case vm::OpCode::OR:
           return 2;
 
+        case vm::OpCode::OPCOT:
+          return 2;
+
         case vm::OpCode::NOT:
         case vm::OpCode::TO_STRING:
         case vm::OpCode::TO_INT:
         case vm::OpCode::TO_DOUBLE:
-        case vm::OpCode::OPCOT:
+        case vm::OpCode::GET_FIELD:
           return 1;
 
+        // the arity depends on the class of the receiver, so everything below it is kept
+        case vm::OpCode::CALL_METHOD:
+          return std::numeric_limits<int>::max();
+
         case vm::OpCode::CALL:
+        case vm::OpCode::TAIL_CALL:
+        case vm::OpCode::CALL_BUILTIN:
           return call_arity(arg, func_table);
 
         case vm::OpCode::BUILD_ARR:
@@ -217,12 +233,18 @@ class DeadCodeElimination final: public IOptimize {
           return 1;
 
         case vm::OpCode::CALL:
+        case vm::OpCode::CALL_BUILTIN:
+        case vm::OpCode::CALL_METHOD:
           return 1;
 
         case vm::OpCode::BUILD_ARR:
           return 1;
 
+        case vm::OpCode::GET_FIELD:
+          return 2;
+
         case vm::OpCode::RETURN:
+        case vm::OpCode::TAIL_CALL:
         case vm::OpCode::STORE:
         case vm::OpCode::POP:
           return 0;
@@ -242,6 +264,9 @@ class DeadCodeElimination final: public IOptimize {
         case vm::OpCode::STORE:
         case vm::OpCode::RETURN:
         case vm::OpCode::CALL:
+        case vm::OpCode::TAIL_CALL:
+        case vm::OpCode::CALL_BUILTIN:
+        case vm::OpCode::CALL_METHOD:
         case vm::OpCode::POP:
           return true;
         default:
@@ -275,20 +300,8 @@ class DeadCodeElimination final: public IOptimize {
       const int64_t id,
       const std::unordered_map<size_t, vm::FunctionTableEntry> &func_table
     ) {
-      switch (id) {
-        case vm::PRINT_FUN: return 1;
-        case vm::LEN_FUN: return 1;
-        case vm::GET_FUN: return 2;
-        case vm::SET_FUN: return 3;
-        case vm::ADD_FUN: return 2;
-        case vm::REMOVE_FUN: return 2;
-        case vm::WRITE_FUN: return 2;
-        case vm::READ_FUN: return 1;
-        case vm::ASSERT_FUN: return 1;
-        case vm::INPUT_FUN: return 0;
-        case vm::RANDOM_FUN: return 0;
-        default:
-          break;
+      if (const int64_t arity = vm::builtin_arity(id); arity >= 0) {
+        return static_cast<int>(arity);
       }
 
       if (const auto it = func_table.find(id); it != func_table.end()) {
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "base_optimization.h"
+#include <model/model.h>
+
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace umka::jit {
+// Replaces CALLs of small user functions with their bytecode. The arguments are stored into
+// slots above the caller's frame, every RETURN becomes a jump past the inlined body with the
+// result left on the operand stack, as RETURN leaves it there for the caller. All inlined
+// bodies share the same slots, a callee never outlives its call site.
+//
+// Only callees that run straight to a RETURN qualify: forward jumps only, no CALL of
+// themselves or of the caller, no method calls, one value on the operand stack at every
+// RETURN and no slot read before it is written, since a fresh frame would start it empty.
+class Inlining final: public IOptimize {
+  public:
+    using IOptimize::run;
+
+    // `commands` and `program_constants` are the image the callees are read from
+    Inlining(const std::vector<vm::Command> &commands, const std::vector<vm::Constant> &program_constants)
+      : commands(commands)
+        , program_constants(program_constants) {
+    }
+
+    void run(
+      std::vector<vm::Command> &code,
+      std::vector<vm::Constant> &const_pool,
+      std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+      vm::FunctionTableEntry &meta,
+      OffsetMap &origins
+    ) override {
+      const int64_t base = meta.frame_size();
+      std::unordered_map<int64_t, bool> inlinable;
+      std::vector<int64_t> callees(code.size(), -1);
+      int64_t callee_frame = 0;
+      size_t growth = 0;
+
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (static_cast<vm::OpCode>(code[i].code) != vm::OpCode::CALL || !func_table.contains(code[i].arg) ||
+            vm::builtin_arity(code[i].arg) >= 0) {
+          continue;
+        }
+        const int64_t id = code[i].arg;
+        const vm::FunctionTableEntry &callee = func_table.at(id);
+        auto known = inlinable.find(id);
+        if (known == inlinable.end()) {
+          known = inlinable.emplace(id, can_inline(callee, func_table, meta)).first;
+        }
+        const size_t size = static_cast<size_t>(callee.code_offset_end - callee.code_offset) +
+                            static_cast<size_t>(callee.arg_count);
+        if (!known->second || growth + size > kMaxGrowth) {
+          continue;
+        }
+        callees[i] = id;
+        growth += size;
+        callee_frame = std::max(callee_frame, callee.frame_size());
+      }
+      if (growth == 0) {
+        return;
+      }
+
+      std::vector<vm::Command> out;
+      OffsetMap out_origins;
+      std::vector<int64_t> new_offset(code.size() + 1, 0);
+      for (size_t i = 0; i < code.size(); ++i) {
+        new_offset[i] = static_cast<int64_t>(out.size());
+        if (callees[i] < 0) {
+          out.push_back(code[i]);
+          out_origins.push_back(origins[i]);
+          continue;
+        }
+
+        const vm::FunctionTableEntry &callee = func_table.at(callees[i]);
+        // CALL pops the arguments into slots 0, 1, ... from the top of the stack down
+        for (int64_t arg = 0; arg < callee.arg_count; ++arg) {
+          out.push_back(command(vm::OpCode::STORE, base + arg));
+          out_origins.push_back(arg == 0 ? origins[i] : kNoOrigin);
+        }
+        // the final RETURN falls through instead
+        const int64_t length = callee.code_offset_end - callee.code_offset - 1;
+        for (int64_t k = 0; k < length; ++k) {
+          vm::Command cmd = commands[callee.code_offset + k];
+          switch (static_cast<vm::OpCode>(cmd.code)) {
+            case vm::OpCode::LOAD:
+            case vm::OpCode::STORE:
+              cmd.arg += base;
+              break;
+            case vm::OpCode::PUSH_CONST:
+              cmd.arg = intern_constant(const_pool, program_constants.at(cmd.arg));
+              break;
+            case vm::OpCode::RETURN:
+              cmd = command(vm::OpCode::JMP, length - k - 1);
+              break;
+            default:
+              break;
+          }
+          out.push_back(cmd);
+          out_origins.push_back(callee.arg_count == 0 && k == 0 ? origins[i] : kNoOrigin);
+        }
+      }
+      new_offset[code.size()] = static_cast<int64_t>(out.size());
+
+      // retarget the caller's own jumps, the inlined ones kept their relative offsets
+      for (size_t i = 0; i < code.size(); ++i) {
+        const auto op = static_cast<vm::OpCode>(code[i].code);
+        if (op != vm::OpCode::JMP && op != vm::OpCode::JMP_IF_FALSE && op != vm::OpCode::JMP_IF_TRUE) {
+          continue;
+        }
+        const int64_t target = static_cast<int64_t>(i) + code[i].arg + 1;
+        if (target >= 0 && target <= static_cast<int64_t>(code.size())) {
+          out[new_offset[i]].arg = new_offset[target] - new_offset[i] - 1;
+        }
+      }
+
+      meta.local_count = std::max(meta.local_count, base + callee_frame - 1);
+      code.swap(out);
+      origins.swap(out_origins);
+    }
+
+  private:
+    // instructions of one callee
+    static constexpr int64_t kMaxCalleeSize = 32;
+    // instructions all inlined bodies of one caller may add
+    static constexpr size_t kMaxGrowth = 256;
+
+    struct StackEffect {
+      int64_t pops;
+      int64_t pushes;
+    };
+
+    static vm::Command command(const vm::OpCode op, const int64_t arg = 0) {
+      return vm::Command{static_cast<uint8_t>(op), arg};
+    }
+
+    std::optional<StackEffect> stack_effect(
+      const vm::Command &cmd,
+      const vm::FunctionTableEntry &callee,
+      const std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+      const vm::FunctionTableEntry &caller
+    ) const {
+      switch (static_cast<vm::OpCode>(cmd.code)) {
+        case vm::OpCode::PUSH_CONST:
+          if (cmd.arg < 0 || cmd.arg >= static_cast<int64_t>(program_constants.size())) {
+            return std::nullopt;
+          }
+          return StackEffect{0, 1};
+        case vm::OpCode::LOAD:
+          return StackEffect{0, 1};
+        case vm::OpCode::STORE:
+        case vm::OpCode::POP:
+        case vm::OpCode::JMP_IF_FALSE:
+        case vm::OpCode::JMP_IF_TRUE:
+        case vm::OpCode::RETURN:
+          return StackEffect{1, 0};
+        case vm::OpCode::JMP:
+          return StackEffect{0, 0};
+        case vm::OpCode::ADD:
+        case vm::OpCode::SUB:
+        case vm::OpCode::MUL:
+        case vm::OpCode::DIV:
+        case vm::OpCode::REM:
+        case vm::OpCode::AND:
+        case vm::OpCode::OR:
+        case vm::OpCode::EQ:
+        case vm::OpCode::NEQ:
+        case vm::OpCode::GT:
+        case vm::OpCode::LT:
+        case vm::OpCode::GTE:
+        case vm::OpCode::LTE:
+        case vm::OpCode::OPCOT:
+          return StackEffect{2, 1};
+        case vm::OpCode::NOT:
+        case vm::OpCode::TO_STRING:
+        case vm::OpCode::TO_DOUBLE:
+        case vm::OpCode::TO_INT:
+          return StackEffect{1, 1};
+        case vm::OpCode::GET_FIELD:
+          return StackEffect{1, 2};
+        case vm::OpCode::BUILD_ARR:
+          if (cmd.arg < 0) {
+            return std::nullopt;
+          }
+          return StackEffect{cmd.arg, 1};
+        case vm::OpCode::CALL_BUILTIN:
+          if (vm::builtin_arity(cmd.arg) < 0) {
+            return std::nullopt;
+          }
+          return StackEffect{vm::builtin_arity(cmd.arg), 1};
+        case vm::OpCode::CALL: {
+          if (const int64_t arity = vm::builtin_arity(cmd.arg); arity >= 0) {
+            return StackEffect{arity, 1};
+          }
+          const auto target = func_table.find(cmd.arg);
+          if (target == func_table.end() || target->second.id == callee.id || target->second.id == caller.id) {
+            return std::nullopt;
+          }
+          return StackEffect{target->second.arg_count, 1};
+        }
+        default:
+          return std::nullopt;
+      }
+    }
+
+    bool can_inline(
+      const vm::FunctionTableEntry &callee,
+      const std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+      const vm::FunctionTableEntry &caller
+    ) const {
+      const int64_t size = callee.code_offset_end - callee.code_offset;
+      if (callee.id == caller.id || size <= 0 || size > kMaxCalleeSize ||
+          callee.code_offset_end > static_cast<int64_t>(commands.size()) ||
+          static_cast<vm::OpCode>(commands[callee.code_offset_end - 1].code) != vm::OpCode::RETURN) {
+        return false;
+      }
+
+      // with forward jumps only, one pass in order sees every predecessor of an instruction
+      // first; per instruction the operand stack depth and the slots written on every path
+      const int64_t frame = callee.frame_size();
+      std::vector<int64_t> depth(size, -1);
+      std::vector<std::vector<bool>> written(size);
+      depth[0] = 0;
+      written[0].assign(frame, false);
+      for (int64_t arg = 0; arg < callee.arg_count; ++arg) {
+        written[0][arg] = true;
+      }
+
+      for (int64_t k = 0; k < size; ++k) {
+        if (depth[k] < 0) {
+          continue;
+        }
+        const vm::Command &cmd = commands[callee.code_offset + k];
+        const auto op = static_cast<vm::OpCode>(cmd.code);
+        const auto effect = stack_effect(cmd, callee, func_table, caller);
+        if (!effect || depth[k] < effect->pops) {
+          return false;
+        }
+        std::vector<bool> state = written[k];
+        if (op == vm::OpCode::LOAD || op == vm::OpCode::STORE) {
+          if (cmd.arg < 0 || cmd.arg >= frame || (op == vm::OpCode::LOAD && !state[cmd.arg])) {
+            return false;
+          }
+          state[cmd.arg] = true;
+        }
+        if (op == vm::OpCode::RETURN) {
+          if (depth[k] != 1) {
+            return false;
+          }
+          continue;
+        }
+
+        const int64_t next_depth = depth[k] - effect->pops + effect->pushes;
+        auto flow_to = [&](const int64_t target) {
+          if (target <= k || target >= size) {
+            return false;
+          }
+          if (depth[target] < 0) {
+            depth[target] = next_depth;
+            written[target] = state;
+            return true;
+          }
+          for (int64_t slot = 0; slot < frame; ++slot) {
+            written[target][slot] = written[target][slot] && state[slot];
+          }
+          return depth[target] == next_depth;
+        };
+        const int64_t target = k + cmd.arg + 1;
+        const bool flows = op == vm::OpCode::JMP ? flow_to(target)
+                         : op == vm::OpCode::JMP_IF_FALSE || op == vm::OpCode::JMP_IF_TRUE
+                             ? flow_to(k + 1) && flow_to(target)
+                             : flow_to(k + 1);
+        if (!flows) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    const std::vector<vm::Command> &commands;
+    const std::vector<vm::Constant> &program_constants;
+};
+
+} // namespace umka::jit
@@ -0,0 +1,423 @@
+#pragma once
+
+#include "base_optimization.h"
+#include <model/model.h>
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+namespace umka::jit {
+// Loop-invariant code motion for the innermost loops the compiler emits:
+//
+//   head  condition; JMP_IF_FALSE exit
+//         body
+//         JMP head
+//   exit
+//
+// An expression is invariant if it reads only constants and locals no STORE of the loop
+// writes, and, for array and field reads, if the loop changes no arrays: no SET, ADD, REMOVE,
+// sorting or heap builtins and no user function or method calls, which might do so. Invariant
+// expressions of the condition and of the body up to its first jump or side effect run on
+// every iteration; each is computed once before the loop into a slot above the frame and the
+// loop loads it from there.
+//
+// The hoisted code runs behind a copy of the condition, so it only runs if the first
+// iteration would have run it as well, and the condition must therefore be free of side
+// effects. An invariant that fails may now fail before an instruction of the first iteration
+// that would have failed first; either way the program stops with an error.
+//
+//         condition; JMP_IF_FALSE exit      <- entered from outside, on-stack replacement too
+//         invariant; STORE t ...
+//   head  condition; JMP_IF_FALSE exit      (invariants replaced with LOAD t)
+//         ...
+class LoopInvariantCodeMotion final: public IOptimize {
+  public:
+    using IOptimize::run;
+
+    void run(
+      std::vector<vm::Command> &code,
+      std::vector<vm::Constant> &,
+      std::unordered_map<size_t, vm::FunctionTableEntry> &,
+      vm::FunctionTableEntry &meta,
+      OffsetMap &origins
+    ) override {
+      std::vector<bool> is_target(code.size() + 1, false);
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (const int64_t target = jump_target(code, i); target >= 0) {
+          is_target[target] = true;
+        }
+      }
+
+      const int64_t base = meta.frame_size();
+      int64_t next_slot = base;
+      std::vector<Loop> loops;
+      for (Loop &loop: find_loops(code)) {
+        find_invariants(code, is_target, loop);
+        if (loop.invariants.empty()) {
+          continue;
+        }
+        for (Invariant &invariant: loop.invariants) {
+          if (next_slot - base == kMaxSlots) {
+            break;
+          }
+          invariant.slot = next_slot++;
+        }
+        std::erase_if(loop.invariants, [](const Invariant &invariant) { return invariant.slot < 0; });
+        if (!loop.invariants.empty()) {
+          loops.push_back(std::move(loop));
+        }
+      }
+      if (loops.empty()) {
+        return;
+      }
+
+      std::vector<vm::Command> out;
+      OffsetMap out_origins;
+      // old target and old offset of every emitted jump that needs retargeting
+      std::vector<std::pair<int64_t, size_t>> pending;
+      std::vector<int64_t> new_offset(code.size() + 1, 0);
+      // head -> the copy of its condition that enters the loop from outside
+      std::map<size_t, int64_t> entry;
+
+      auto emit = [&](const vm::Command instruction, const int64_t origin, const int64_t old_target, size_t from) {
+        out.push_back(instruction);
+        out_origins.push_back(origin);
+        pending.emplace_back(old_target, from);
+      };
+
+      size_t next_loop = 0;
+      const Loop *loop = nullptr;
+      size_t next_invariant = 0;
+      for (size_t i = 0; i < code.size();) {
+        if (next_loop < loops.size() && loops[next_loop].head == i) {
+          loop = &loops[next_loop++];
+          next_invariant = 0;
+          entry[loop->head] = static_cast<int64_t>(out.size());
+          for (size_t k = loop->head; k < loop->exit_test; ++k) {
+            emit(code[k], k == loop->head ? origins[k] : kNoOrigin, -1, k);
+          }
+          emit(code[loop->exit_test], kNoOrigin, static_cast<int64_t>(loop->back_edge + 1), loop->head);
+          for (const Invariant &invariant: loop->invariants) {
+            for (size_t k = invariant.begin; k <= invariant.end; ++k) {
+              emit(code[k], kNoOrigin, -1, k);
+            }
+            emit(command(vm::OpCode::STORE, invariant.slot), kNoOrigin, -1, i);
+          }
+        }
+
+        // the head itself is only right with the invariants already stored
+        const bool head = loop != nullptr && i == loop->head;
+        new_offset[i] = static_cast<int64_t>(out.size());
+        if (loop != nullptr && next_invariant < loop->invariants.size() &&
+            loop->invariants[next_invariant].begin == i) {
+          const Invariant &invariant = loop->invariants[next_invariant++];
+          emit(command(vm::OpCode::LOAD, invariant.slot), head ? kNoOrigin : origins[i], -1, i);
+          i = invariant.end + 1;
+          continue;
+        }
+        emit(code[i], head ? kNoOrigin : origins[i], jump_target(code, i), i);
+        ++i;
+      }
+      new_offset[code.size()] = static_cast<int64_t>(out.size());
+
+      for (size_t at = 0; at < out.size(); ++at) {
+        const auto [target, from] = pending[at];
+        if (target < 0) {
+          continue;
+        }
+        // jumps from outside a loop to its head enter through the hoisted code
+        int64_t destination = new_offset[target];
+        if (const auto head = entry.find(static_cast<size_t>(target)); head != entry.end()) {
+          const Loop &owner = *std::ranges::find(loops, head->first, &Loop::head);
+          if (from < owner.head || from > owner.back_edge) {
+            destination = head->second;
+          }
+        }
+        out[at].arg = destination - static_cast<int64_t>(at) - 1;
+      }
+
+      meta.local_count = std::max(meta.local_count, next_slot - 1);
+      code.swap(out);
+      origins.swap(out_origins);
+    }
+
+  private:
+    // slots one function may spend on hoisted values
+    static constexpr int64_t kMaxSlots = 16;
+
+    enum class Kind {
+      // computes its result from its operands only
+      PURE,
+      // reads arrays or objects
+      READS_HEAP,
+      // no side effect, but not worth or not safe to hoist: allocations, stores
+      OPAQUE,
+      // jumps, calls and builtins with side effects
+      BARRIER
+    };
+
+    struct Effect {
+      int64_t pops;
+      int64_t pushes;
+      Kind kind;
+    };
+
+    // code[begin..end] computes one value the loop does not change
+    struct Invariant {
+      size_t begin;
+      size_t end;
+      int64_t slot = -1;
+    };
+
+    struct Loop {
+      size_t head;
+      // the JMP_IF_FALSE that leaves the loop
+      size_t exit_test;
+      size_t back_edge;
+      std::vector<Invariant> invariants;
+    };
+
+    static vm::Command command(const vm::OpCode op, const int64_t arg = 0) {
+      return vm::Command{static_cast<uint8_t>(op), arg};
+    }
+
+    static vm::OpCode op_at(const std::vector<vm::Command> &code, const size_t i) {
+      return static_cast<vm::OpCode>(code[i].code);
+    }
+
+    static bool writes_heap(const vm::Command &cmd) {
+      switch (static_cast<vm::OpCode>(cmd.code)) {
+        case vm::OpCode::CALL:
+        case vm::OpCode::TAIL_CALL:
+        case vm::OpCode::CALL_METHOD:
+          return true;
+        case vm::OpCode::CALL_BUILTIN:
+          switch (cmd.arg) {
+            case vm::SET_FUN:
+            case vm::ADD_FUN:
+            case vm::REMOVE_FUN:
+            case vm::SORT_FUN:
+            case vm::MAKE_HEAP_FUN:
+            case vm::POP_HEAP_FUN:
+            case vm::PUSH_HEAP_FUN:
+              return true;
+            default:
+              return false;
+          }
+        default:
+          return false;
+      }
+    }
+
+    static Effect effect_of(const vm::Command &cmd) {
+      switch (static_cast<vm::OpCode>(cmd.code)) {
+        case vm::OpCode::PUSH_CONST:
+        case vm::OpCode::LOAD:
+          return {0, 1, Kind::PURE};
+        case vm::OpCode::STORE:
+        case vm::OpCode::POP:
+          return {1, 0, Kind::OPAQUE};
+        case vm::OpCode::ADD:
+        case vm::OpCode::SUB:
+        case vm::OpCode::MUL:
+        case vm::OpCode::DIV:
+        case vm::OpCode::REM:
+        case vm::OpCode::AND:
+        case vm::OpCode::OR:
+        case vm::OpCode::EQ:
+        case vm::OpCode::NEQ:
+        case vm::OpCode::GT:
+        case vm::OpCode::LT:
+        case vm::OpCode::GTE:
+        case vm::OpCode::LTE:
+          return {2, 1, Kind::PURE};
+        case vm::OpCode::OPCOT:
+          return {2, 1, Kind::OPAQUE};
+        case vm::OpCode::NOT:
+        case vm::OpCode::TO_INT:
+        case vm::OpCode::TO_DOUBLE:
+          return {1, 1, Kind::PURE};
+        case vm::OpCode::TO_STRING:
+          return {1, 1, Kind::OPAQUE};
+        case vm::OpCode::GET_FIELD:
+          return {1, 2, Kind::READS_HEAP};
+        case vm::OpCode::BUILD_ARR:
+          if (cmd.arg < 0) {
+            break;
+          }
+          return {cmd.arg, 1, Kind::OPAQUE};
+        case vm::OpCode::CALL_BUILTIN:
+          switch (cmd.arg) {
+            case vm::LEN_FUN:
+            case vm::GET_FUN:
+              return {vm::builtin_arity(cmd.arg), 1, Kind::READS_HEAP};
+            case vm::POW_FUN:
+            case vm::SQRT_FUN:
+            case vm::MIN_FUN:
+            case vm::MAX_FUN:
+              return {vm::builtin_arity(cmd.arg), 1, Kind::PURE};
+            case vm::CONCAT_FUN:
+            case vm::SPLIT_FUN:
+              return {vm::builtin_arity(cmd.arg), 1, Kind::OPAQUE};
+            default:
+              break;
+          }
+          break;
+        default:
+          break;
+      }
+      return {0, 0, Kind::BARRIER};
+    }
+
+    // innermost loops, one per head, that are entered at their head only
+    static std::vector<Loop> find_loops(const std::vector<vm::Command> &code) {
+      std::map<size_t, size_t> back_edges;
+      for (size_t j = 0; j < code.size(); ++j) {
+        const int64_t head = jump_target(code, j);
+        if (op_at(code, j) == vm::OpCode::JMP && head >= 0 && static_cast<size_t>(head) < j) {
+          back_edges[head] = std::max(back_edges[head], j);
+        }
+      }
+
+      std::vector<Loop> loops;
+      for (const auto &[head, back_edge]: back_edges) {
+        bool encloses = false;
+        for (const auto &[other_head, other_back_edge]: back_edges) {
+          encloses |= other_head != head && head <= other_head && other_back_edge <= back_edge;
+        }
+        if (encloses) {
+          continue;
+        }
+
+        // the condition is a plain expression followed by the exit test
+        std::optional<size_t> exit_test;
+        for (size_t k = head; k < back_edge && !exit_test; ++k) {
+          if (op_at(code, k) == vm::OpCode::JMP_IF_FALSE &&
+              jump_target(code, k) == static_cast<int64_t>(back_edge + 1)) {
+            exit_test = k;
+          } else if (const Effect effect = effect_of(code[k]);
+                     effect.kind != Kind::PURE && effect.kind != Kind::READS_HEAP) {
+            break;
+          }
+        }
+        if (!exit_test || *exit_test == head) {
+          continue;
+        }
+
+        bool entered_inside = false;
+        for (size_t k = 0; k < code.size(); ++k) {
+          const int64_t target = jump_target(code, k);
+          entered_inside |= (k < head || k > back_edge) && target > static_cast<int64_t>(head) &&
+                            target <= static_cast<int64_t>(back_edge);
+        }
+        if (!entered_inside) {
+          loops.push_back(Loop{head, *exit_test, back_edge, {}});
+        }
+      }
+      return loops;
+    }
+
+    // Fills loop.invariants, in code order, with the largest invariant expressions of the
+    // condition and of the part of the body every iteration runs.
+    static void find_invariants(const std::vector<vm::Command> &code, const std::vector<bool> &is_target, Loop &loop) {
+      std::unordered_set<int64_t> stored;
+      bool heap_changes = false;
+      for (size_t k = loop.head; k <= loop.back_edge; ++k) {
+        if (op_at(code, k) == vm::OpCode::STORE) {
+          stored.insert(code[k].arg);
+        }
+        heap_changes |= writes_heap(code[k]);
+      }
+
+      // a value on the simulated operand stack, computed by code[begin..] up to its consumer
+      struct Slot {
+        size_t begin;
+        bool invariant;
+        // the only value its instructions leave, so they can move on their own
+        bool single;
+        bool reads_local;
+        bool computes;
+      };
+      std::vector<Slot> stack;
+
+      auto settle = [&](const Slot &slot, const size_t end) {
+        if (!slot.invariant || !slot.single || !slot.reads_local || !slot.computes) {
+          return;
+        }
+        for (size_t k = slot.begin + 1; k <= end; ++k) {
+          if (is_target[k]) {
+            return;
+          }
+        }
+        loop.invariants.push_back(Invariant{slot.begin, end});
+      };
+      // settles stack[from..], the code of each slot ends where the next one's begins
+      auto settle_from = [&](const size_t from, const size_t end) {
+        for (size_t s = from; s < stack.size(); ++s) {
+          settle(stack[s], s + 1 < stack.size() ? stack[s + 1].begin - 1 : end);
+        }
+        stack.resize(from);
+      };
+
+      // the offset the scan stopped at, none if the operand stack does not follow the expressions
+      auto scan = [&](const size_t from, const size_t to) -> std::optional<size_t> {
+        size_t k = from;
+        for (; k < to; ++k) {
+          const vm::Command &cmd = code[k];
+          const Effect effect = effect_of(cmd);
+          if (effect.kind == Kind::BARRIER) {
+            break;
+          }
+          if (static_cast<int64_t>(stack.size()) < effect.pops) {
+            return std::nullopt;
+          }
+
+          const auto op = static_cast<vm::OpCode>(cmd.code);
+          if (op == vm::OpCode::LOAD || op == vm::OpCode::PUSH_CONST) {
+            const bool load = op == vm::OpCode::LOAD;
+            stack.push_back(Slot{k, !load || !stored.contains(cmd.arg), true, load, false});
+            continue;
+          }
+
+          const size_t operands = stack.size() - static_cast<size_t>(effect.pops);
+          bool invariant = effect.kind == Kind::PURE || (effect.kind == Kind::READS_HEAP && !heap_changes);
+          bool reads_local = false;
+          for (size_t s = operands; s < stack.size(); ++s) {
+            invariant = invariant && stack[s].invariant;
+            reads_local = reads_local || stack[s].reads_local;
+          }
+          const size_t begin = invariant && effect.pops > 0 ? stack[operands].begin : k;
+          if (invariant) {
+            stack.resize(operands);
+          } else {
+            settle_from(operands, k - 1);
+          }
+          for (int64_t p = 0; p < effect.pushes; ++p) {
+            stack.push_back(Slot{begin, invariant, effect.pushes == 1, reads_local, true});
+          }
+        }
+        return k;
+      };
+
+      // the condition leaves its value to the exit test, the body starts on an empty stack
+      const auto condition_end = scan(loop.head, loop.exit_test);
+      if (!condition_end || stack.size() != 1) {
+        loop.invariants.clear();
+        return;
+      }
+      settle_from(0, loop.exit_test - 1);
+      const size_t settled = loop.invariants.size();
+      if (const auto body_end = scan(loop.exit_test + 1, loop.back_edge)) {
+        // what is still on the stack was computed before the scan stopped
+        settle_from(0, *body_end - 1);
+      } else {
+        loop.invariants.resize(settled);
+      }
+      std::ranges::sort(loop.invariants, {}, &Invariant::begin);
+    }
+};
+
+} // namespace umka::jit
@@ -0,0 +1,394 @@
+#pragma once
+
+#include "base_optimization.h"
+
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace umka::jit {
+// Unrolls the counted loops the compiler emits for `for (i = a; i < n; i = i + s)` and the
+// equivalent while loops:
+//
+//        PUSH_CONST a; STORE i
+//   head X; LOAD i; CMP; JMP_IF_FALSE exit      (or LOAD i; X; CMP), X is PUSH_CONST n or LOAD m
+//        body
+//        PUSH_CONST s; LOAD i; ADD; STORE i     (or LOAD i; PUSH_CONST s; ADD, or SUB)
+//        JMP head
+//   exit
+//
+// A trip count known from a constant bound and start, at most kMaxTrips, is unrolled fully. Other
+// loops counting towards their bound run `factor` bodies per test while i + (factor - 1) * s
+// still passes it, and the original loop does the remaining iterations. That sum is never
+// computed, it could overflow where the loop itself does not: a constant bound is moved by the
+// distance at compile time, and a local one is checked as i passing it and the distance
+// fitting between them.
+class LoopUnrolling final: public IOptimize {
+  public:
+    using IOptimize::run;
+
+    void run(
+      std::vector<vm::Command> &code,
+      std::vector<vm::Constant> &const_pool,
+      std::unordered_map<size_t, vm::FunctionTableEntry> &,
+      vm::FunctionTableEntry &,
+      OffsetMap &origins
+    ) override {
+      const std::vector<Loop> loops = find_loops(code, const_pool);
+      if (loops.empty()) {
+        return;
+      }
+
+      std::vector<vm::Command> out;
+      OffsetMap out_origins;
+      // old target of every emitted jump that leaves its copy, -1 for resolved ones
+      std::vector<int64_t> pending;
+      std::vector<int64_t> new_offset(code.size() + 1, 0);
+
+      auto emit = [&](const vm::Command instruction, const int64_t origin, const int64_t old_target = -1) {
+        out.push_back(instruction);
+        out_origins.push_back(origin);
+        pending.push_back(old_target);
+      };
+
+      size_t next_loop = 0;
+      for (size_t i = 0; i < code.size();) {
+        if (next_loop == loops.size() || loops[next_loop].head != i) {
+          new_offset[i] = static_cast<int64_t>(out.size());
+          emit(code[i], origins[i], jump_target(code, i));
+          ++i;
+          continue;
+        }
+
+        const Loop &loop = loops[next_loop++];
+        for (size_t k = loop.head; k <= loop.back_edge; ++k) {
+          new_offset[k] = static_cast<int64_t>(out.size());
+        }
+
+        if (loop.trip_count >= 0) {
+          for (int64_t t = 0; t < loop.trip_count; ++t) {
+            emit_iteration(code, loop, emit);
+          }
+        } else {
+          const int64_t guard = static_cast<int64_t>(out.size());
+          std::vector<size_t> guard_exits;
+          const auto test = [&](const vm::OpCode compare) {
+            emit(command(compare), kNoOrigin);
+            guard_exits.push_back(out.size());
+            emit(command(vm::OpCode::JMP_IF_FALSE), kNoOrigin);
+          };
+
+          if (loop.guard_bound) {
+            // i compare the bound moved towards i by the distance
+            emit(command(vm::OpCode::PUSH_CONST, intern_constant(const_pool, int_constant(*loop.guard_bound))),
+                 origins[loop.head]);
+            emit(command(vm::OpCode::LOAD, loop.counter), kNoOrigin);
+            test(loop.compare);
+          } else {
+            // i compare bound, then |bound - i| compared to the distance as i + distance to the
+            // bound; a difference too large for int64 wraps negative and fails the test
+            const bool upwards = loop.step > 0;
+            emit(loop.bound, origins[loop.head]);
+            emit(command(vm::OpCode::LOAD, loop.counter), kNoOrigin);
+            test(loop.compare);
+            emit(command(vm::OpCode::PUSH_CONST, intern_constant(const_pool, int_constant(loop.distance))), kNoOrigin);
+            emit(upwards ? command(vm::OpCode::LOAD, loop.counter) : loop.bound, kNoOrigin);
+            emit(upwards ? loop.bound : command(vm::OpCode::LOAD, loop.counter), kNoOrigin);
+            emit(command(vm::OpCode::SUB), kNoOrigin);
+            test(upwards ? flipped(loop.compare) : loop.compare);
+          }
+
+          for (size_t u = 0; u < loop.factor; ++u) {
+            emit_iteration(code, loop, emit);
+          }
+          emit(command(vm::OpCode::JMP, guard - static_cast<int64_t>(out.size()) - 1), kNoOrigin);
+
+          // the remainder is the original loop, a frame replaced at its head lands on the guard
+          for (const size_t guard_exit: guard_exits) {
+            out[guard_exit].arg = static_cast<int64_t>(out.size() - guard_exit) - 1;
+          }
+          for (size_t k = loop.head; k <= loop.back_edge; ++k) {
+            const int64_t target = jump_target(code, k);
+            const bool leaves = target > static_cast<int64_t>(loop.back_edge);
+            emit(code[k], origins[k], leaves ? target : -1);
+          }
+        }
+        i = loop.back_edge + 1;
+      }
+      new_offset[code.size()] = static_cast<int64_t>(out.size());
+
+      for (size_t at = 0; at < out.size(); ++at) {
+        if (pending[at] >= 0) {
+          out[at].arg = new_offset[pending[at]] - static_cast<int64_t>(at) - 1;
+        }
+      }
+
+      code.swap(out);
+      origins.swap(out_origins);
+    }
+
+  private:
+    static constexpr int64_t kMaxTrips = 16;
+    // instructions the copies of one loop may take together
+    static constexpr size_t kMaxUnrolledSize = 64;
+
+    struct Loop {
+      size_t head;
+      size_t back_edge;
+      int64_t counter;
+      vm::Command bound;
+      // the test as `i compare bound`
+      vm::OpCode compare;
+      int64_t step;
+      // -1 unless unrolled fully
+      int64_t trip_count;
+      size_t factor;
+      // (factor - 1) * |step|, and for a constant bound the bound moved towards i by it
+      int64_t distance;
+      std::optional<int64_t> guard_bound;
+    };
+
+    static vm::Command command(const vm::OpCode op, const int64_t arg = 0) {
+      return vm::Command{static_cast<uint8_t>(op), arg};
+    }
+
+    static vm::OpCode op_at(const std::vector<vm::Command> &code, const size_t i) {
+      return static_cast<vm::OpCode>(code[i].code);
+    }
+
+    static std::optional<int64_t> int_constant(const std::vector<vm::Constant> &pool, const vm::Command &c) {
+      if (static_cast<vm::OpCode>(c.code) != vm::OpCode::PUSH_CONST || c.arg < 0 ||
+          static_cast<size_t>(c.arg) >= pool.size()) {
+        return std::nullopt;
+      }
+      const vm::Constant &constant = pool[c.arg];
+      if (constant.type != vm::TYPE_INT64 || constant.data.size() != 8) {
+        return std::nullopt;
+      }
+      int64_t v;
+      memcpy(&v, constant.data.data(), 8);
+      return v;
+    }
+
+    static vm::Constant int_constant(const int64_t value) {
+      vm::Constant constant{vm::TYPE_INT64, std::vector<uint8_t>(8)};
+      memcpy(constant.data.data(), &value, 8);
+      return constant;
+    }
+
+    static bool is_compare(const vm::OpCode op) {
+      return op == vm::OpCode::LT || op == vm::OpCode::LTE || op == vm::OpCode::GT ||
+             op == vm::OpCode::GTE || op == vm::OpCode::EQ || op == vm::OpCode::NEQ;
+    }
+
+    // `a op b` as `b flipped(op) a`
+    static vm::OpCode flipped(const vm::OpCode op) {
+      switch (op) {
+        case vm::OpCode::LT: return vm::OpCode::GT;
+        case vm::OpCode::GT: return vm::OpCode::LT;
+        case vm::OpCode::LTE: return vm::OpCode::GTE;
+        case vm::OpCode::GTE: return vm::OpCode::LTE;
+        default: return op;
+      }
+    }
+
+    static bool holds(const vm::OpCode op, const int64_t a, const int64_t b) {
+      switch (op) {
+        case vm::OpCode::LT: return a < b;
+        case vm::OpCode::LTE: return a <= b;
+        case vm::OpCode::GT: return a > b;
+        case vm::OpCode::GTE: return a >= b;
+        case vm::OpCode::EQ: return a == b;
+        default: return a != b;
+      }
+    }
+
+    static bool is_bound(const vm::Command &c, const int64_t counter) {
+      const auto op = static_cast<vm::OpCode>(c.code);
+      return op == vm::OpCode::PUSH_CONST || (op == vm::OpCode::LOAD && c.arg != counter);
+    }
+
+    // one copy of body and step, the jumps inside it keep their relative offsets
+    template<typename Emit>
+    static void emit_iteration(const std::vector<vm::Command> &code, const Loop &loop, Emit &emit) {
+      for (size_t k = loop.head + 4; k < loop.back_edge; ++k) {
+        emit(code[k], kNoOrigin);
+      }
+    }
+
+    static std::vector<Loop> find_loops(const std::vector<vm::Command> &code,
+                                        const std::vector<vm::Constant> &pool) {
+      std::vector<Loop> candidates;
+      for (size_t j = 0; j < code.size(); ++j) {
+        if (op_at(code, j) != vm::OpCode::JMP) {
+          continue;
+        }
+        const int64_t head = jump_target(code, j);
+        if (head < 0 || static_cast<size_t>(head) >= j) {
+          continue;
+        }
+        if (auto loop = match(code, pool, static_cast<size_t>(head), j)) {
+          candidates.push_back(*loop);
+        }
+      }
+
+      // innermost loops only, the copies of an outer one would carry the inner loop along
+      std::vector<Loop> loops;
+      for (const Loop &loop: candidates) {
+        bool encloses = false;
+        for (const Loop &other: candidates) {
+          encloses |= &other != &loop && loop.head <= other.head && other.back_edge <= loop.back_edge;
+        }
+        if (!encloses) {
+          loops.push_back(loop);
+        }
+      }
+      return loops;
+    }
+
+    static std::optional<Loop> match(const std::vector<vm::Command> &code,
+                                     const std::vector<vm::Constant> &pool, const size_t head,
+                                     const size_t back_edge) {
+      if (back_edge < head + 8) {
+        return std::nullopt;
+      }
+      const auto cmp = op_at(code, head + 2);
+      if (!is_compare(cmp) || op_at(code, head + 3) != vm::OpCode::JMP_IF_FALSE ||
+          jump_target(code, head + 3) != static_cast<int64_t>(back_edge + 1)) {
+        return std::nullopt;
+      }
+
+      // the step writes the counter, which tells which side of the test it is
+      if (op_at(code, back_edge - 1) != vm::OpCode::STORE) {
+        return std::nullopt;
+      }
+      Loop loop{};
+      loop.head = head;
+      loop.back_edge = back_edge;
+      loop.counter = code[back_edge - 1].arg;
+
+      const vm::Command &lhs = code[head + 1];
+      const vm::Command &rhs = code[head];
+      if (static_cast<vm::OpCode>(lhs.code) == vm::OpCode::LOAD && lhs.arg == loop.counter &&
+          is_bound(rhs, loop.counter)) {
+        loop.bound = rhs;
+        loop.compare = cmp;
+      } else if (static_cast<vm::OpCode>(rhs.code) == vm::OpCode::LOAD && rhs.arg == loop.counter &&
+                 is_bound(lhs, loop.counter)) {
+        loop.bound = lhs;
+        loop.compare = flipped(cmp);
+      } else {
+        return std::nullopt;
+      }
+
+      const auto step_op = op_at(code, back_edge - 2);
+      const vm::Command &top = code[back_edge - 3];
+      const vm::Command &below = code[back_edge - 4];
+      const auto loads_counter = [&](const vm::Command &c) {
+        return static_cast<vm::OpCode>(c.code) == vm::OpCode::LOAD && c.arg == loop.counter;
+      };
+      std::optional<int64_t> step;
+      if (step_op == vm::OpCode::ADD && loads_counter(top)) {
+        step = int_constant(pool, below);
+      } else if (step_op == vm::OpCode::ADD && loads_counter(below)) {
+        step = int_constant(pool, top);
+      } else if (step_op == vm::OpCode::SUB && loads_counter(top)) {
+        step = int_constant(pool, below);
+        if (step && __builtin_sub_overflow(int64_t{0}, *step, &*step)) {
+          step = std::nullopt;
+        }
+      }
+      if (!step || *step == 0) {
+        return std::nullopt;
+      }
+      loop.step = *step;
+
+      // the start value is only known when the initialization comes right before the head
+      bool start_known = false;
+      int64_t first = 0;
+      if (head >= 2 && op_at(code, head - 1) == vm::OpCode::STORE && code[head - 1].arg == loop.counter) {
+        if (const auto start = int_constant(pool, code[head - 2])) {
+          start_known = true;
+          first = *start;
+        }
+      }
+
+      const size_t body = head + 4;
+      const size_t post = back_edge - 4;
+      const bool bound_is_local = static_cast<vm::OpCode>(loop.bound.code) == vm::OpCode::LOAD;
+      for (size_t k = body; k < post; ++k) {
+        if (op_at(code, k) == vm::OpCode::STORE &&
+            (code[k].arg == loop.counter || (bound_is_local && code[k].arg == loop.bound.arg))) {
+          return std::nullopt;
+        }
+        const int64_t target = jump_target(code, k);
+        const auto op = op_at(code, k);
+        if ((op == vm::OpCode::JMP || op == vm::OpCode::JMP_IF_FALSE || op == vm::OpCode::JMP_IF_TRUE) &&
+            (target < static_cast<int64_t>(body) || target > static_cast<int64_t>(post))) {
+          return std::nullopt;
+        }
+      }
+      // nothing else may enter the loop, and a jump past the initialization hides the start value
+      for (size_t k = 0; k < code.size(); ++k) {
+        const int64_t target = jump_target(code, k);
+        if (target < 0 || k == back_edge) {
+          continue;
+        }
+        const bool from_body = k >= body && k < post;
+        if (target == static_cast<int64_t>(head) ||
+            (!from_body && target > static_cast<int64_t>(head) && target <= static_cast<int64_t>(back_edge))) {
+          return std::nullopt;
+        }
+        if (head >= 1 && target == static_cast<int64_t>(head - 1)) {
+          start_known = false;
+        }
+      }
+
+      const size_t length = back_edge - body;
+      loop.trip_count = -1;
+      if (const auto limit = int_constant(pool, loop.bound); start_known && limit) {
+        const int64_t bound = *limit;
+        // a counter that would overflow on the way wraps at run time, so its trips are not counted
+        int64_t trips = 0;
+        bool overflows = false;
+        for (int64_t i = first; !overflows && trips <= kMaxTrips && holds(loop.compare, i, bound);) {
+          ++trips;
+          overflows = __builtin_add_overflow(i, loop.step, &i);
+        }
+        if (!overflows && trips <= kMaxTrips && static_cast<size_t>(trips) * length <= kMaxUnrolledSize) {
+          loop.trip_count = trips;
+          return loop;
+        }
+      }
+
+      // i + (factor - 1) * s passing the test implies the next factor tests pass only if i
+      // moves towards the bound
+      const bool upwards = loop.compare == vm::OpCode::LT || loop.compare == vm::OpCode::LTE;
+      const bool downwards = loop.compare == vm::OpCode::GT || loop.compare == vm::OpCode::GTE;
+      if (!((upwards && loop.step > 0) || (downwards && loop.step < 0)) ||
+          loop.step == std::numeric_limits<int64_t>::min()) {
+        return std::nullopt;
+      }
+      const int64_t limit_step = upwards ? loop.step : -loop.step;
+      const std::optional<int64_t> limit = int_constant(pool, loop.bound);
+      for (const size_t factor: {size_t{4}, size_t{2}}) {
+        if (factor * length > kMaxUnrolledSize ||
+            __builtin_mul_overflow(static_cast<int64_t>(factor - 1), limit_step, &loop.distance)) {
+          continue;
+        }
+        // a constant bound too close to the end of the range leaves no room for the copies
+        int64_t moved = 0;
+        if (limit && (upwards ? __builtin_sub_overflow(*limit, loop.distance, &moved)
+                              : __builtin_add_overflow(*limit, loop.distance, &moved))) {
+          continue;
+        }
+        loop.factor = factor;
+        loop.guard_bound = limit ? std::optional(moved) : std::nullopt;
+        return loop;
+      }
+      return std::nullopt;
+    }
+};
+
+} // namespace umka::jit
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <model/model.h>
+#include <parser/command_parser.h>
+
+namespace umka::jit {
+// Three-address instruction. `code` is the vm::OpCode of the stack instruction it replaces:
+//   PUSH_CONST  dst = constants[arg]
+//   LOAD        dst = lhs (register move)
+//   ADD..LTE    dst = lhs op rhs, NOT/TO_* dst = op lhs
+//   JMP         goto arg, JMP_IF_FALSE/JMP_IF_TRUE test lhs and goto arg
+//   CALL        dst = function arg(lhs .. lhs + rhs - 1), CALL_BUILTIN the same for builtin arg
+//   RETURN      return lhs, a register nothing writes to for a RETURN with an empty stack
+// A TAIL_CALL of the function itself becomes moves of the arguments into the locals and a JMP
+// to instruction 0, any other TAIL_CALL a CALL followed by a RETURN of its result.
+struct RegisterInstruction {
+  uint8_t code;
+  uint32_t dst;
+  uint32_t lhs;
+  uint32_t rhs;
+  int64_t arg;
+};
+
+// Registers 0..frame_size-1 are the locals of the function, the operand stack slot of
+// depth d is register frame_size + d.
+struct RegisterFunction {
+  std::vector<RegisterInstruction> code;
+  int64_t register_count{};
+  // stack offset of every loop header and requested entry the operand stack is empty at -> its
+  // instruction; code entered there only needs the locals in place, on-stack replacement
+  // starts it there
+  std::unordered_map<size_t, size_t> loop_entries;
+};
+
+// Translates the stack code of one function. Operands that are plain local reads are used
+// in place and a result that is stored right away is written to the local directly, so
+// `LOAD 1; LOAD 2; ADD; STORE 3` becomes a single `ADD r3, r1, r2`. Functions using
+// instructions without a register form (objects, arrays, methods) are left to the stack tier.
+class RegisterTranslator {
+  public:
+    // `entries` are further stack offsets on-stack replacement may start at, such as a loop
+    // header a pass moved out of its loop
+    static std::optional<RegisterFunction> translate(
+      const std::vector<vm::Command> &code,
+      const vm::FunctionTableEntry &meta,
+      const std::unordered_map<size_t, vm::FunctionTableEntry> &func_table,
+      const std::vector<size_t> &entries = {}
+    ) {
+      RegisterTranslator translator(code, meta.frame_size());
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].code != vm::CALL && code[i].code != vm::TAIL_CALL) {
+          continue;
+        }
+        const auto callee = func_table.find(code[i].arg);
+        if (callee == func_table.end()) {
+          return std::nullopt;
+        }
+        translator.call_arity[i] = callee->second.arg_count;
+        if (code[i].code == vm::TAIL_CALL && callee->second.id == meta.id) {
+          translator.self_tail_calls.insert(i);
+        }
+      }
+      if (!translator.compute_depths()) {
+        return std::nullopt;
+      }
+      for (const size_t entry: entries) {
+        if (entry < code.size()) {
+          translator.is_target[entry] = true;
+          translator.is_loop_header[entry] = true;
+        }
+      }
+      return translator.emit_all();
+    }
+
+  private:
+    RegisterTranslator(const std::vector<vm::Command> &code, int64_t frame_size)
+      : code(code)
+        , frame_size(static_cast<uint32_t>(frame_size))
+        , depth(code.size(), -1)
+        , is_target(code.size(), false)
+        , is_loop_header(code.size(), false) {
+    }
+
+    struct StackEffect {
+      int64_t pops;
+      int64_t pushes;
+    };
+
+    static std::optional<StackEffect> stack_effect(const vm::Command &cmd) {
+      switch (cmd.code) {
+        case vm::PUSH_CONST:
+        case vm::LOAD:
+          return StackEffect{0, 1};
+        case vm::STORE:
+        case vm::POP:
+        case vm::RETURN:
+        case vm::JMP_IF_FALSE:
+        case vm::JMP_IF_TRUE:
+          return StackEffect{1, 0};
+        case vm::JMP:
+          return StackEffect{0, 0};
+        case vm::ADD:
+        case vm::SUB:
+        case vm::MUL:
+        case vm::DIV:
+        case vm::REM:
+        case vm::AND:
+        case vm::OR:
+        case vm::EQ:
+        case vm::NEQ:
+        case vm::GT:
+        case vm::LT:
+        case vm::GTE:
+        case vm::LTE:
+          return StackEffect{2, 1};
+        case vm::NOT:
+        case vm::TO_STRING:
+        case vm::TO_INT:
+        case vm::TO_DOUBLE:
+          return StackEffect{1, 1};
+        case vm::CALL_BUILTIN:
+          if (vm::builtin_arity(cmd.arg) < 0) {
+            return std::nullopt;
+          }
+          return StackEffect{vm::builtin_arity(cmd.arg), 1};
+        default:
+          return std::nullopt;
+      }
+    }
+
+    static bool is_jump(uint8_t op) {
+      return op == vm::JMP || op == vm::JMP_IF_FALSE || op == vm::JMP_IF_TRUE;
+    }
+
+    // Stack depth before every reachable instruction; false if the code has no register form.
+    bool compute_depths() {
+      if (code.empty() || frame_size > kMaxRegister) {
+        return false;
+      }
+      std::vector<size_t> worklist = {0};
+      depth[0] = 0;
+      while (!worklist.empty()) {
+        const size_t i = worklist.back();
+        worklist.pop_back();
+        const vm::Command &cmd = code[i];
+
+        StackEffect effect{};
+        if (cmd.code == vm::CALL || cmd.code == vm::TAIL_CALL) {
+          effect = StackEffect{call_arity.at(i), 1};
+          if (self_tail_calls.contains(i)) {
+            is_target[0] = true;
+            // a fresh frame starts the locals past the arguments as unit
+            reads_unit = reads_unit || frame_size > static_cast<uint32_t>(call_arity.at(i));
+          }
+        } else if (cmd.code == vm::RETURN && depth[i] == 0) {
+          // the top-level code ends this way
+          effect = StackEffect{0, 0};
+          reads_unit = true;
+        } else if (auto known = stack_effect(cmd)) {
+          effect = *known;
+        } else {
+          return false;
+        }
+        if (depth[i] < effect.pops) {
+          return false;
+        }
+        const int64_t next = depth[i] - effect.pops + effect.pushes;
+        max_depth = std::max(max_depth, next);
+
+        auto flow_to = [&](int64_t target) {
+          if (target < 0 || target >= static_cast<int64_t>(code.size())) {
+            return false;
+          }
+          if (depth[target] == -1) {
+            depth[target] = next;
+            worklist.push_back(target);
+            return true;
+          }
+          return depth[target] == next;
+        };
+
+        if (cmd.code == vm::RETURN || cmd.code == vm::TAIL_CALL) {
+          continue;
+        }
+        if (is_jump(cmd.code)) {
+          const int64_t target = static_cast<int64_t>(i) + 1 + cmd.arg;
+          if (!flow_to(target)) {
+            return false;
+          }
+          is_target[target] = true;
+          if (target <= static_cast<int64_t>(i)) {
+            is_loop_header[target] = true;
+          }
+          if (cmd.code == vm::JMP) {
+            continue;
+          }
+        }
+        if (!flow_to(static_cast<int64_t>(i) + 1)) {
+          return false;
+        }
+      }
+      return frame_size + max_depth <= kMaxRegister;
+    }
+
+    RegisterFunction emit_all() {
+      std::vector<size_t> label(code.size() + 1, 0);
+      bool falls_through = false;
+
+      for (size_t i = 0; i < code.size(); ++i) {
+        if (depth[i] == -1) {
+          label[i] = out.size();
+          falls_through = false;
+          continue;
+        }
+        if (is_target[i]) {
+          if (falls_through) {
+            flush(0);
+          }
+          block_start = out.size();
+          stack.clear();
+          for (int64_t d = 0; d < depth[i]; ++d) {
+            stack.push_back(temp(d));
+          }
+        }
+        label[i] = out.size();
+        if (is_loop_header[i] && depth[i] == 0) {
+          loop_entries[i] = out.size();
+        }
+        falls_through = emit(code[i], i);
+      }
+
+      for (auto &instruction: out) {
+        if (is_jump(instruction.code)) {
+          instruction.arg = static_cast<int64_t>(label[instruction.arg]);
+        }
+      }
+      return RegisterFunction{
+        std::move(out),
+        frame_size + max_depth + (reads_unit ? 1 : 0),
+        std::move(loop_entries)
+      };
+    }
+
+    // Emits the register form of one stack instruction, returns whether control falls through.
+    bool emit(const vm::Command &cmd, size_t index) {
+      switch (cmd.code) {
+        case vm::PUSH_CONST: {
+          const uint32_t dst = temp(stack.size());
+          out.push_back({vm::PUSH_CONST, dst, 0, 0, cmd.arg});
+          stack.push_back(dst);
+          return true;
+        }
+        case vm::LOAD:
+          stack.push_back(static_cast<uint32_t>(cmd.arg));
+          return true;
+        case vm::STORE: {
+          const auto local = static_cast<uint32_t>(cmd.arg);
+          const uint32_t value = pop();
+          materialize_reads_of(local);
+          if (value != local) {
+            if (value == temp(stack.size()) && out.size() > block_start && out.back().dst == value &&
+                writes_dst(out.back().code)) {
+              out.back().dst = local;
+            } else {
+              out.push_back({vm::LOAD, local, value, 0, 0});
+            }
+          }
+          return true;
+        }
+        case vm::POP:
+          pop();
+          return true;
+        case vm::NOT:
+        case vm::TO_STRING:
+        case vm::TO_INT:
+        case vm::TO_DOUBLE: {
+          const uint32_t operand = pop();
+          const uint32_t dst = temp(stack.size());
+          out.push_back({cmd.code, dst, operand, 0, 0});
+          stack.push_back(dst);
+          return true;
+        }
+        case vm::JMP:
+          flush(0);
+          out.push_back({vm::JMP, 0, 0, 0, static_cast<int64_t>(index) + 1 + cmd.arg});
+          return false;
+        case vm::JMP_IF_FALSE:
+        case vm::JMP_IF_TRUE: {
+          const uint32_t condition = pop();
+          flush(0);
+          out.push_back({cmd.code, 0, condition, 0, static_cast<int64_t>(index) + 1 + cmd.arg});
+          return true;
+        }
+        case vm::CALL:
+        case vm::CALL_BUILTIN: {
+          const size_t arity = cmd.code == vm::CALL
+                                 ? static_cast<size_t>(call_arity.at(index))
+                                 : static_cast<size_t>(vm::builtin_arity(cmd.arg));
+          flush(stack.size() - arity);
+          const uint32_t first = temp(stack.size() - arity);
+          stack.resize(stack.size() - arity);
+          out.push_back({cmd.code, first, first, static_cast<uint32_t>(arity), cmd.arg});
+          stack.push_back(first);
+          return true;
+        }
+        case vm::TAIL_CALL: {
+          const auto arity = static_cast<size_t>(call_arity.at(index));
+          flush(stack.size() - arity);
+          const uint32_t first = temp(stack.size() - arity);
+          if (!self_tail_calls.contains(index)) {
+            out.push_back({vm::CALL, first, first, static_cast<uint32_t>(arity), cmd.arg});
+            out.push_back({vm::RETURN, 0, first, 0, 0});
+            return false;
+          }
+          // the top of the stack is argument 0, as CALL pops it
+          for (size_t arg = 0; arg < arity; ++arg) {
+            out.push_back({vm::LOAD, static_cast<uint32_t>(arg), temp(stack.size() - 1 - arg), 0, 0});
+          }
+          for (auto local = static_cast<uint32_t>(arity); local < frame_size; ++local) {
+            out.push_back({vm::LOAD, local, unit_register(), 0, 0});
+          }
+          out.push_back({vm::JMP, 0, 0, 0, 0});
+          return false;
+        }
+        case vm::RETURN:
+          out.push_back({vm::RETURN, 0, stack.empty() ? unit_register() : pop(), 0, 0});
+          return false;
+        default: {
+          const uint32_t lhs = pop();
+          const uint32_t rhs = pop();
+          const uint32_t dst = temp(stack.size());
+          out.push_back({cmd.code, dst, lhs, rhs, 0});
+          stack.push_back(dst);
+          return true;
+        }
+      }
+    }
+
+    static bool writes_dst(uint8_t op) {
+      return !is_jump(op) && op != vm::RETURN;
+    }
+
+    uint32_t temp(size_t stack_depth) const {
+      return frame_size + static_cast<uint32_t>(stack_depth);
+    }
+
+    // the register after the deepest temporary, never written and so unit
+    uint32_t unit_register() const {
+      return frame_size + static_cast<uint32_t>(max_depth);
+    }
+
+    uint32_t pop() {
+      const uint32_t reg = stack.back();
+      stack.pop_back();
+      return reg;
+    }
+
+    // Copies local reads still pending on the stack from depth `from` up into their own slots.
+    void flush(size_t from) {
+      for (size_t d = from; d < stack.size(); ++d) {
+        if (stack[d] != temp(d)) {
+          out.push_back({vm::LOAD, temp(d), stack[d], 0, 0});
+          stack[d] = temp(d);
+        }
+      }
+    }
+
+    void materialize_reads_of(uint32_t local) {
+      for (size_t d = 0; d < stack.size(); ++d) {
+        if (stack[d] == local) {
+          out.push_back({vm::LOAD, temp(d), local, 0, 0});
+          stack[d] = temp(d);
+        }
+      }
+    }
+
+  private:
+    static constexpr uint32_t kMaxRegister = UINT32_MAX / 2;
+
+    const std::vector<vm::Command> &code;
+    const uint32_t frame_size;
+    std::vector<int64_t> depth;
+    std::vector<bool> is_target;
+    std::vector<bool> is_loop_header;
+    std::unordered_map<size_t, int64_t> call_arity;
+    std::unordered_set<size_t> self_tail_calls;
+    int64_t max_depth = 0;
+    bool reads_unit = false;
+    std::unordered_map<size_t, size_t> loop_entries;
+
+    std::vector<RegisterInstruction> out;
+    std::vector<uint32_t> stack;
+    size_t block_start = 0;
+};
+} // namespace umka::jit
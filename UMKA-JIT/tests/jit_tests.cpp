@@ -1,9 +1,24 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <thread>
+
 #include <model/model.h>
 #include <parser/command_parser.h>
 
 #include "constant_propagation.h"
 #include "const_folding.h"
 #include "dce.h"
+#include "loop_unrolling.h"
+#include "inlining.h"
+#include "licm.h"
+#include "native_compiler.h"
+#include "closure_compiler.h"
+#include "register_translator.h"
+#include "jit_runner.h"
+#include "jit_manager.h"
+#include "compile_pool.h"
 
 #include "gtest/gtest.h"
 
@@ -130,6 +145,31 @@ TEST(JitConstantPropagation, StoreUnknownInvalidatesConstant) {
 }
 
 
+TEST(JitConstantPropagation, ForgetsLocalsAtLoopHeader) {
+  using umka::vm::OpCode;
+
+  std::vector pool = {make_int(2), make_int(3)};
+
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::LOAD, 0), // loop head, 2 only on the first iteration
+    cmd(OpCode::CALL_BUILTIN, umka::vm::PRINT_FUN),
+    cmd(OpCode::POP),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::JMP, -6)
+  };
+
+  umka::jit::ConstantPropagation cp;
+  umka::vm::FunctionTableEntry meta{};
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+
+  cp.run(code, pool, funcs, meta);
+
+  EXPECT_EQ(static_cast<OpCode>(code[2].code), OpCode::LOAD);
+}
+
 TEST(JitConstFolding, ArithmeticNested) {
   // const pool: 2,3,4
   std::vector pool = {
@@ -298,6 +338,58 @@ TEST(JitConstFolding, CannotFoldMixedStackValues) {
   EXPECT_EQ(static_cast<umka::vm::OpCode>(code[3].code), umka::vm::OpCode::ADD);
 }
 
+TEST(JitConstFolding, TopOfStackIsLeftOperand) {
+  std::vector pool = {make_int(10), make_int(3)};
+
+  std::vector code = {
+    cmd(umka::vm::OpCode::PUSH_CONST, 0),
+    cmd(umka::vm::OpCode::PUSH_CONST, 1),
+    cmd(umka::vm::OpCode::SUB), // 3 - 10
+    cmd(umka::vm::OpCode::STORE, 0)
+  };
+
+  umka::vm::FunctionTableEntry meta{};
+  umka::jit::ConstFolding folding;
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  folding.run(code, pool, funcs, meta);
+
+  ASSERT_EQ(code.size(), 2);
+  int64_t result = 0;
+  memcpy(&result, pool[code[0].arg].data.data(), 8);
+  EXPECT_EQ(result, -7);
+}
+
+TEST(JitConstFolding, RetargetsJumpsAndTracksOrigins) {
+  using umka::vm::OpCode;
+
+  std::vector pool = {make_int(1)};
+
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::LOAD, 0), // loop head
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::JMP, -7)
+  };
+
+  umka::vm::FunctionTableEntry meta{};
+  umka::jit::ConstFolding folding;
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::OffsetMap origins = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  folding.run(code, pool, funcs, meta, origins);
+
+  ASSERT_EQ(code.size(), 7);
+  EXPECT_EQ(static_cast<OpCode>(code[6].code), OpCode::JMP);
+  EXPECT_EQ(code[6].arg, -5); // back to LOAD 0
+  EXPECT_EQ(origins, (umka::jit::OffsetMap{0, 3, 4, 5, 8, 9, 10}));
+}
+
 TEST(JitDCE, RemoveUnusedArithmetic) {
   std::vector pool = {make_int(1), make_int(2)};
 
@@ -365,6 +457,24 @@ TEST(JitDCE, KeepCallEvenIfResultUnused) {
   EXPECT_EQ(static_cast<umka::vm::OpCode>(code[3].code), umka::vm::OpCode::POP);
 }
 
+TEST(JitDCE, KeepArgumentsOfMethodCall) {
+  std::vector pool = {make_int(3)};
+
+  std::vector code = {
+    cmd(umka::vm::OpCode::PUSH_CONST, 0), // argument
+    cmd(umka::vm::OpCode::LOAD, 0), // receiver
+    cmd(umka::vm::OpCode::CALL_METHOD, 1),
+    cmd(umka::vm::OpCode::POP)
+  };
+
+  umka::vm::FunctionTableEntry meta{};
+  umka::jit::DeadCodeElimination dce;
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  dce.run(code, pool, funcs, meta);
+
+  ASSERT_EQ(code.size(), 4);
+}
+
 TEST(JitDCE, RemoveUnreachableAfterJump) {
   std::vector<umka::vm::Constant> pool = {};
 
@@ -406,3 +516,1178 @@ TEST(JitDCE, DeadAfterReturn) {
   EXPECT_EQ(static_cast<umka::vm::OpCode>(code[0].code), umka::vm::OpCode::PUSH_CONST);
   EXPECT_EQ(static_cast<umka::vm::OpCode>(code[1].code), umka::vm::OpCode::RETURN);
 }
+
+static umka::vm::FunctionTableEntry frame_meta(const int64_t arg_count, const int64_t local_count) {
+  umka::vm::FunctionTableEntry meta{};
+  meta.arg_count = arg_count;
+  meta.local_count = local_count;
+  return meta;
+}
+
+TEST(JitRegisterTranslator, LocalOperandsAndStoreFoldIntoOneInstruction) {
+  using umka::vm::OpCode;
+
+  std::vector code = {
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 3),
+    cmd(OpCode::LOAD, 3),
+    cmd(OpCode::RETURN)
+  };
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(0, 4), funcs);
+
+  ASSERT_TRUE(translated.has_value());
+  ASSERT_EQ(translated->code.size(), 2);
+  const auto &add = translated->code[0];
+  EXPECT_EQ(add.code, OpCode::ADD);
+  EXPECT_EQ(add.dst, 3);
+  EXPECT_EQ(add.lhs, 2); // stack top
+  EXPECT_EQ(add.rhs, 1);
+  EXPECT_EQ(translated->code[1].code, OpCode::RETURN);
+  EXPECT_EQ(translated->code[1].lhs, 3);
+}
+
+TEST(JitRegisterTranslator, LoopKeepsJumpTargets) {
+  using umka::vm::OpCode;
+
+  // sum of 0..n, n is argument 0, i and sum are locals 1 and 2
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::LOAD, 0), // loop head
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LTE),
+    cmd(OpCode::JMP_IF_FALSE, 9),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::JMP, -13),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(1, 2), funcs);
+
+  ASSERT_TRUE(translated.has_value());
+  const std::vector<OpCode> expected = {
+    OpCode::PUSH_CONST, OpCode::PUSH_CONST,
+    OpCode::LTE, OpCode::JMP_IF_FALSE,
+    OpCode::ADD, OpCode::PUSH_CONST, OpCode::ADD, OpCode::JMP,
+    OpCode::RETURN
+  };
+  ASSERT_EQ(translated->code.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(translated->code[i].code, expected[i]) << "at " << i;
+  }
+  EXPECT_EQ(translated->code[0].dst, 1);
+  EXPECT_EQ(translated->code[3].arg, 8); // loop exit
+  EXPECT_EQ(translated->code[4].dst, 2);
+  EXPECT_EQ(translated->code[6].dst, 1);
+  EXPECT_EQ(translated->code[7].arg, 2); // loop head
+  EXPECT_EQ(translated->register_count, 5); // three locals and two stack slots
+}
+
+TEST(JitRegisterTranslator, CallArgumentsOccupyConsecutiveRegisters) {
+  using umka::vm::OpCode;
+
+  std::vector code = {
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::CALL, 1),
+    cmd(OpCode::RETURN)
+  };
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[1] = frame_meta(2, 0);
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+
+  ASSERT_TRUE(translated.has_value());
+  ASSERT_EQ(translated->code.size(), 4);
+  EXPECT_EQ(translated->code[0].code, OpCode::LOAD);
+  EXPECT_EQ(translated->code[0].dst, 2);
+  EXPECT_EQ(translated->code[1].code, OpCode::LOAD);
+  EXPECT_EQ(translated->code[1].dst, 3);
+  EXPECT_EQ(translated->code[2].code, OpCode::CALL);
+  EXPECT_EQ(translated->code[2].lhs, 2);
+  EXPECT_EQ(translated->code[2].rhs, 2);
+  EXPECT_EQ(translated->code[2].arg, 1);
+}
+
+TEST(JitRegisterTranslator, ObjectCodeStaysOnStackTier) {
+  using umka::vm::OpCode;
+
+  std::vector code = {
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::GET_FIELD, 0),
+    cmd(OpCode::RETURN)
+  };
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  EXPECT_FALSE(umka::jit::RegisterTranslator::translate(code, frame_meta(1, 0), funcs).has_value());
+}
+
+namespace {
+// Counts the interpreter services closures ask for, arithmetic is done inline.
+class CountingRuntime final : public umka::jit::ClosureRuntime {
+  public:
+    umka::vm::Value operate(uint8_t, umka::vm::Value, umka::vm::Value) override {
+      ++operations;
+      return umka::vm::Value{};
+    }
+
+    bool truthy(umka::vm::Value value) override {
+      return value.b;
+    }
+
+    umka::vm::Value call(uint8_t, int64_t, umka::jit::ClosureFrame &, uint32_t, uint32_t) override {
+      return umka::vm::Value{};
+    }
+
+    void safepoint() override {
+      ++safepoints;
+    }
+
+    int operations = 0;
+    int safepoints = 0;
+};
+} // namespace
+
+TEST(JitClosureCompiler, RunsLoopWithInlineArithmetic) {
+  using umka::vm::OpCode;
+
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LTE),
+    cmd(OpCode::JMP_IF_FALSE, 9),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::JMP, -13),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+  std::vector const_pool = {make_int(0), make_int(1)};
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(1, 2), funcs);
+  ASSERT_TRUE(translated.has_value());
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto compiled = umka::jit::ClosureCompiler::compile(*translated, constants);
+  ASSERT_NE(compiled, nullptr);
+
+  std::vector<umka::vm::Value> registers(compiled->register_count);
+  registers[0] = umka::vm::Value(int64_t{5});
+  CountingRuntime runtime;
+  umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+  const umka::vm::Value result = compiled->run(frame);
+
+  ASSERT_EQ(result.type, umka::vm::ValueType::INT);
+  EXPECT_EQ(result.i, 15);
+  EXPECT_EQ(runtime.operations, 0);
+  EXPECT_EQ(runtime.safepoints, 6);
+}
+
+TEST(JitClosureCompiler, ForwardBranchTakesFusedCompare) {
+  using umka::vm::OpCode;
+
+  // return a < b ? 1 : 2 with a, b the arguments
+  std::vector code = {
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LT),
+    cmd(OpCode::JMP_IF_FALSE, 2),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::RETURN),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::RETURN)
+  };
+  std::vector const_pool = {make_int(1), make_int(2)};
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+  ASSERT_TRUE(translated.has_value());
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto compiled = umka::jit::ClosureCompiler::compile(*translated, constants);
+  ASSERT_NE(compiled, nullptr);
+
+  auto run = [&](int64_t a, int64_t b) {
+    std::vector<umka::vm::Value> registers(compiled->register_count);
+    registers[0] = umka::vm::Value(a);
+    registers[1] = umka::vm::Value(b);
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    return compiled->run(frame).i;
+  };
+  EXPECT_EQ(run(1, 2), 1);
+  EXPECT_EQ(run(3, 2), 2);
+}
+
+TEST(JitClosureCompiler, SelfTailCallRunsAsALoop) {
+  using umka::vm::OpCode;
+
+  // sum(n, acc): n == 0 ? acc : sum(n - 1, acc + n), slot 2 is a local the loop resets
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::EQ),
+    cmd(OpCode::JMP_IF_FALSE, 2),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::RETURN),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::SUB),
+    cmd(OpCode::TAIL_CALL, 0)
+  };
+  std::vector const_pool = {make_int(0), make_int(1)};
+
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(2, 2);
+  auto translated = umka::jit::RegisterTranslator::translate(code, funcs[0], funcs);
+  ASSERT_TRUE(translated.has_value());
+  EXPECT_TRUE(std::none_of(translated->code.begin(), translated->code.end(), [](const auto &instruction) {
+    return instruction.code == OpCode::CALL;
+  }));
+  EXPECT_EQ(translated->code.back().code, OpCode::JMP);
+  EXPECT_EQ(translated->code.back().arg, 0);
+
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto compiled = umka::jit::ClosureCompiler::compile(*translated, constants);
+  ASSERT_NE(compiled, nullptr);
+  std::vector<umka::vm::Value> registers(compiled->register_count);
+  registers[0] = umka::vm::Value(int64_t{10});
+  registers[1] = umka::vm::Value(int64_t{0});
+  CountingRuntime runtime;
+  umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+  EXPECT_EQ(compiled->run(frame).i, 55);
+  EXPECT_EQ(runtime.safepoints, 10);
+}
+
+TEST(JitClosureCompiler, UnsupportedInstructionIsRejected) {
+  using umka::vm::OpCode;
+
+  umka::jit::RegisterFunction function;
+  function.code = {{OpCode::GET_FIELD, 0, 0, 0, 0}, {OpCode::RETURN, 0, 0, 0, 0}};
+  function.register_count = 1;
+  EXPECT_EQ(umka::jit::ClosureCompiler::compile(function, {}), nullptr);
+}
+
+static std::vector<umka::vm::Command> sum_loop_code() {
+  using umka::vm::OpCode;
+
+  return {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LTE),
+    cmd(OpCode::JMP_IF_FALSE, 9),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::JMP, -13),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+}
+
+TEST(JitNativeCompiler, RunsLoopWithInlineArithmetic) {
+  if (!UMKA_NATIVE_JIT) {
+    GTEST_SKIP() << "no native backend for this platform";
+  }
+  const auto code = sum_loop_code();
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(1, 2), funcs);
+  ASSERT_TRUE(translated.has_value());
+
+  std::vector const_pool = {make_int(0), make_int(1)};
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto compiled = umka::jit::NativeCompiler::compile(*translated, constants);
+  ASSERT_NE(compiled, nullptr);
+
+  std::vector<umka::vm::Value> registers(compiled->register_count);
+  registers[0] = umka::vm::Value(int64_t{100});
+  CountingRuntime runtime;
+  umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+  const umka::vm::Value result = compiled->run(frame);
+
+  ASSERT_EQ(result.type, umka::vm::ValueType::INT);
+  EXPECT_EQ(result.i, 5050);
+  EXPECT_EQ(runtime.operations, 0);
+  EXPECT_EQ(runtime.safepoints, 101);
+}
+
+TEST(JitNativeCompiler, DoubleArithmeticAndComparisons) {
+  using umka::vm::OpCode;
+  if (!UMKA_NATIVE_JIT) {
+    GTEST_SKIP() << "no native backend for this platform";
+  }
+
+  // return a * b < b - a with a, b the arguments
+  std::vector code = {
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::SUB),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::MUL),
+    cmd(OpCode::LT),
+    cmd(OpCode::RETURN)
+  };
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+  ASSERT_TRUE(translated.has_value());
+  auto compiled = umka::jit::NativeCompiler::compile(*translated, {});
+  ASSERT_NE(compiled, nullptr);
+
+  auto run = [&](double a, double b) {
+    std::vector<umka::vm::Value> registers(compiled->register_count);
+    registers[0] = umka::vm::Value(a);
+    registers[1] = umka::vm::Value(b);
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    const umka::vm::Value result = compiled->run(frame);
+    EXPECT_EQ(runtime.operations, 0);
+    EXPECT_EQ(result.type, umka::vm::ValueType::BOOL);
+    return result.b;
+  };
+  EXPECT_TRUE(run(0.5, 3.0));   // 1.5 < 2.5
+  EXPECT_FALSE(run(2.0, 3.0));  // 6 < 1
+  EXPECT_FALSE(run(0.0, std::nan("")));
+}
+
+TEST(JitNativeCompiler, RuntimeExceptionsReachTheCaller) {
+  using umka::vm::OpCode;
+  if (!UMKA_NATIVE_JIT) {
+    GTEST_SKIP() << "no native backend for this platform";
+  }
+
+  class ThrowingRuntime final : public umka::jit::ClosureRuntime {
+    public:
+      umka::vm::Value operate(uint8_t, umka::vm::Value, umka::vm::Value) override {
+        throw std::runtime_error("bad operands");
+      }
+
+      bool truthy(umka::vm::Value) override { return false; }
+
+      umka::vm::Value call(uint8_t, int64_t, umka::jit::ClosureFrame &, uint32_t, uint32_t) override {
+        return umka::vm::Value{};
+      }
+
+      void safepoint() override {}
+  };
+
+  std::vector code = {
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::RETURN)
+  };
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+  ASSERT_TRUE(translated.has_value());
+  auto compiled = umka::jit::NativeCompiler::compile(*translated, {});
+  ASSERT_NE(compiled, nullptr);
+
+  std::vector<umka::vm::Value> registers(compiled->register_count);
+  registers[0] = umka::vm::Value(int64_t{1});
+  registers[1] = umka::vm::Value(2.0);
+  ThrowingRuntime runtime;
+  umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+  EXPECT_THROW(compiled->run(frame), std::runtime_error);
+}
+
+TEST(JitClosureCompiler, IntegerDivisionByZeroThrows) {
+  using umka::vm::OpCode;
+
+  for (const auto op: {OpCode::DIV, OpCode::REM}) {
+    std::vector code = {
+      cmd(OpCode::LOAD, 1),
+      cmd(OpCode::LOAD, 0),
+      cmd(op),
+      cmd(OpCode::RETURN)
+    };
+    std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+    auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+    ASSERT_TRUE(translated.has_value());
+    auto compiled = umka::jit::ClosureCompiler::compile(*translated, {});
+    ASSERT_NE(compiled, nullptr);
+
+    std::vector<umka::vm::Value> registers(compiled->register_count);
+    registers[0] = umka::vm::Value(int64_t{7});
+    registers[1] = umka::vm::Value(int64_t{0});
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    EXPECT_THROW(compiled->run(frame), std::runtime_error);
+  }
+}
+
+TEST(JitClosureCompiler, IntegerDivisionOverflowIsDefined) {
+  using umka::vm::OpCode;
+
+  for (const auto op: {OpCode::DIV, OpCode::REM}) {
+    std::vector code = {
+      cmd(OpCode::LOAD, 1),
+      cmd(OpCode::LOAD, 0),
+      cmd(op),
+      cmd(OpCode::RETURN)
+    };
+    std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+    auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(2, 0), funcs);
+    ASSERT_TRUE(translated.has_value());
+    auto compiled = umka::jit::ClosureCompiler::compile(*translated, {});
+    ASSERT_NE(compiled, nullptr);
+
+    std::vector<umka::vm::Value> registers(compiled->register_count);
+    registers[0] = umka::vm::Value(std::numeric_limits<int64_t>::min());
+    registers[1] = umka::vm::Value(int64_t{-1});
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    if (op == OpCode::DIV) {
+      EXPECT_THROW(compiled->run(frame), std::runtime_error);
+    } else {
+      EXPECT_EQ(compiled->run(frame).i, 0);
+    }
+  }
+}
+
+TEST(JitConstFolding, FaultingDivisionIsLeftToTheMachine) {
+  using umka::vm::OpCode;
+
+  // return 10 / 0, return 10 % 0 and return INT64_MIN / -1 with literal operands
+  const std::vector<std::pair<OpCode, std::vector<umka::vm::Constant>>> cases = {
+    {OpCode::DIV, {make_int(0), make_int(10)}},
+    {OpCode::REM, {make_int(0), make_int(10)}},
+    {OpCode::DIV, {make_int(-1), make_int(std::numeric_limits<int64_t>::min())}},
+  };
+  for (const auto &[op, pool]: cases) {
+    std::vector code = {
+      cmd(OpCode::PUSH_CONST, 0),
+      cmd(OpCode::PUSH_CONST, 1),
+      cmd(op),
+      cmd(OpCode::RETURN)
+    };
+    std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+    funcs[0] = frame_meta(0, 0);
+    funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+    umka::jit::JitRunner runner(code, pool, funcs, {});
+    runner.add_optimization(std::make_unique<umka::jit::ConstantPropagation>());
+    runner.add_optimization(std::make_unique<umka::jit::ConstFolding>());
+    runner.add_optimization(std::make_unique<umka::jit::DeadCodeElimination>());
+    const umka::jit::JittedFunction jitted = runner.optimize_function(0);
+
+    ASSERT_EQ(jitted.code.size(), code.size());
+    EXPECT_EQ(static_cast<OpCode>(jitted.code[2].code), op);
+    ASSERT_NE(jitted.closure_code, nullptr);
+    std::vector<umka::vm::Value> registers(jitted.closure_code->register_count);
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    EXPECT_THROW(jitted.closure_code->run(frame), std::runtime_error);
+  }
+}
+
+static std::vector<umka::vm::Command> counted_sum_code() {
+  using umka::vm::OpCode;
+
+  // sum = 0; for (i = 0; i < 3; i = i + 1) sum = sum + i; return sum
+  return {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LT),
+    cmd(OpCode::JMP_IF_FALSE, 9),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 2),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::JMP, -13),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::RETURN)
+  };
+}
+
+static int64_t run_on_closures(const std::vector<umka::vm::Command> &code,
+                               const std::vector<umka::vm::Constant> &const_pool,
+                               const umka::vm::FunctionTableEntry &meta,
+                               const std::vector<int64_t> &args) {
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, meta, funcs);
+  EXPECT_TRUE(translated.has_value());
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto compiled = umka::jit::ClosureCompiler::compile(*translated, constants);
+  EXPECT_NE(compiled, nullptr);
+
+  std::vector<umka::vm::Value> registers(compiled->register_count);
+  for (size_t i = 0; i < args.size(); ++i) {
+    registers[i] = umka::vm::Value(args[i]);
+  }
+  CountingRuntime runtime;
+  umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+  return compiled->run(frame).i;
+}
+
+TEST(JitLoopUnrolling, FullyUnrollsConstantTripCount) {
+  using umka::vm::OpCode;
+
+  auto code = counted_sum_code();
+  std::vector pool = {make_int(0), make_int(3), make_int(1)};
+  umka::vm::FunctionTableEntry meta = frame_meta(0, 2);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::OffsetMap origins(code.size());
+  std::iota(origins.begin(), origins.end(), 0);
+  umka::jit::LoopUnrolling unrolling;
+  unrolling.run(code, pool, funcs, meta, origins);
+
+  // the initialization, three copies of body and step, the return
+  ASSERT_EQ(code.size(), 4 + 3 * 8 + 2);
+  ASSERT_EQ(origins.size(), code.size());
+  for (size_t i = 0; i < code.size(); ++i) {
+    const auto op = static_cast<OpCode>(code[i].code);
+    EXPECT_NE(op, OpCode::JMP);
+    EXPECT_NE(op, OpCode::JMP_IF_FALSE);
+  }
+  EXPECT_EQ(origins[4], umka::jit::kNoOrigin);
+  EXPECT_EQ(origins[code.size() - 2], 17);
+  EXPECT_EQ(run_on_closures(code, pool, meta, {}), 3);
+}
+
+TEST(JitLoopUnrolling, PartiallyUnrollsWithRemainderLoop) {
+  using umka::vm::OpCode;
+
+  const auto original = sum_loop_code();
+  auto code = original;
+  std::vector pool = {make_int(0), make_int(1)};
+  umka::vm::FunctionTableEntry meta = frame_meta(1, 2);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::OffsetMap origins(code.size());
+  std::iota(origins.begin(), origins.end(), 0);
+  umka::jit::LoopUnrolling unrolling;
+  unrolling.run(code, pool, funcs, meta, origins);
+
+  // guard, four copies, back jump, then the original loop for the rest
+  ASSERT_EQ(code.size(), original.size() + 10 + 4 * 8 + 1);
+  ASSERT_EQ(pool.size(), 3);
+  EXPECT_EQ(static_cast<OpCode>(code[8].code), OpCode::PUSH_CONST);
+  EXPECT_EQ(code[8].arg, 2);
+  // a frame replaced at the loop head enters the unrolled loop
+  EXPECT_EQ(std::ranges::find(origins, 4) - origins.begin(), 4);
+
+  for (const int64_t n: {0, 1, 2, 3, 4, 5, 6, 9, 100}) {
+    EXPECT_EQ(run_on_closures(code, pool, meta, {n}), n * (n + 1) / 2) << "n = " << n;
+  }
+}
+
+TEST(JitLoopUnrolling, LeavesLoopsThatWriteTheirCounter) {
+  using umka::vm::OpCode;
+
+  auto code = counted_sum_code();
+  code[11] = cmd(OpCode::STORE, 0);
+  const auto original = code;
+  std::vector pool = {make_int(0), make_int(3), make_int(1)};
+  umka::vm::FunctionTableEntry meta = frame_meta(0, 2);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::LoopUnrolling unrolling;
+  unrolling.run(code, pool, funcs, meta);
+
+  ASSERT_EQ(code.size(), original.size());
+  for (size_t i = 0; i < code.size(); ++i) {
+    EXPECT_EQ(code[i].code, original[i].code);
+    EXPECT_EQ(code[i].arg, original[i].arg);
+  }
+  EXPECT_EQ(pool.size(), 3);
+}
+
+TEST(JitLoopUnrolling, GuardsDoNotOverflowNearInt64Max) {
+  using umka::vm::OpCode;
+  constexpr int64_t max = std::numeric_limits<int64_t>::max();
+  constexpr int64_t start = max - 10;
+
+  // count = 0; for (i = max - 10; i < n; i = i + 1) count = count + 1; return count
+  const std::vector original = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LT),
+    cmd(OpCode::JMP_IF_FALSE, 9),
+    cmd(OpCode::PUSH_CONST, 2),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 2),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::JMP, -13),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+  const umka::vm::FunctionTableEntry meta = frame_meta(1, 3);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::LoopUnrolling unrolling;
+
+  // ten trips are too many copies, so both bounds get the partial unrolling and its guard
+  for (const bool constant_bound: {false, true}) {
+    auto code = original;
+    if (constant_bound) {
+      code[4] = cmd(OpCode::PUSH_CONST, 3);
+    }
+    std::vector pool = {make_int(0), make_int(start), make_int(1), make_int(max)};
+    auto unrolled_meta = meta;
+    unrolling.run(code, pool, funcs, unrolled_meta);
+    ASSERT_GT(code.size(), original.size());
+
+    for (const int64_t n: {max, max - 1, max - 3, start + 1, start, int64_t{0}, std::numeric_limits<int64_t>::min()}) {
+      const int64_t expected = constant_bound ? 10 : n > start ? n - start : 0;
+      EXPECT_EQ(run_on_closures(code, pool, meta, {n}), expected) << "n = " << n << (constant_bound ? ", constant" : "");
+    }
+  }
+
+  // i <= max would step past the end of the range, so its trips are not counted
+  auto code = original;
+  code[2] = cmd(OpCode::PUSH_CONST, 4);
+  code[4] = cmd(OpCode::PUSH_CONST, 3);
+  code[6] = cmd(OpCode::LTE);
+  std::vector pool = {make_int(0), make_int(start), make_int(1), make_int(max), make_int(max - 2)};
+  auto unrolled_meta = meta;
+  unrolling.run(code, pool, funcs, unrolled_meta);
+  EXPECT_NE(std::ranges::find_if(code, [](const umka::vm::Command &c) {
+    return static_cast<OpCode>(c.code) == OpCode::JMP;
+  }), code.end());
+}
+
+// main returns diff(3, 10) + diff(20, 5), diff(x, y) = |x - y| with two RETURNs and a let slot
+static std::vector<umka::vm::Command> inlining_program() {
+  using umka::vm::OpCode;
+
+  return {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::CALL, 1),
+    cmd(OpCode::PUSH_CONST, 2),
+    cmd(OpCode::PUSH_CONST, 3),
+    cmd(OpCode::CALL, 1),
+    cmd(OpCode::ADD),
+    cmd(OpCode::RETURN),
+
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::SUB),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::PUSH_CONST, 4),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::LT),
+    cmd(OpCode::JMP_IF_FALSE, 4),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::PUSH_CONST, 4),
+    cmd(OpCode::SUB),
+    cmd(OpCode::RETURN),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+}
+
+static std::unordered_map<size_t, umka::vm::FunctionTableEntry> inlining_functions(const size_t program_size) {
+  umka::vm::FunctionTableEntry main = frame_meta(0, 0);
+  main.id = 0;
+  main.code_offset = 0;
+  main.code_offset_end = 8;
+  umka::vm::FunctionTableEntry diff = frame_meta(2, 2);
+  diff.id = 1;
+  diff.code_offset = 8;
+  diff.code_offset_end = static_cast<int64_t>(program_size);
+  return {{0, main}, {1, diff}};
+}
+
+TEST(JitInlining, ReplacesCallsAndMovesCalleeLocalsAboveTheFrame) {
+  using umka::vm::OpCode;
+
+  const auto program = inlining_program();
+  const std::vector program_pool = {make_int(3), make_int(10), make_int(20), make_int(5), make_int(0)};
+  auto funcs = inlining_functions(program.size());
+
+  std::vector code(program.begin(), program.begin() + 8);
+  // the caller's private table, the callee constant is missing from it
+  std::vector pool(program_pool.begin(), program_pool.begin() + 4);
+  umka::vm::FunctionTableEntry meta = funcs.at(0);
+  umka::jit::OffsetMap origins(code.size());
+  std::iota(origins.begin(), origins.end(), 0);
+  umka::jit::Inlining inlining(program, program_pool);
+  inlining.run(code, pool, funcs, meta, origins);
+
+  for (const auto &command: code) {
+    EXPECT_NE(static_cast<OpCode>(command.code), OpCode::CALL);
+    if (static_cast<OpCode>(command.code) == OpCode::LOAD || static_cast<OpCode>(command.code) == OpCode::STORE) {
+      EXPECT_GE(command.arg, 1);
+    }
+  }
+  EXPECT_EQ(pool.size(), 5);
+  EXPECT_EQ(meta.frame_size(), 1 + funcs.at(1).frame_size());
+  ASSERT_EQ(origins.size(), code.size());
+  EXPECT_EQ(origins[2], 2);
+  EXPECT_EQ(run_on_closures(code, pool, meta, {}), 22);
+}
+
+TEST(JitInlining, KeepsRecursiveAndOversizedCallees) {
+  using umka::vm::OpCode;
+
+  auto program = inlining_program();
+  // diff now calls itself
+  program[16] = cmd(OpCode::CALL, 1);
+  const std::vector program_pool = {make_int(3), make_int(10), make_int(20), make_int(5), make_int(0)};
+  auto funcs = inlining_functions(program.size());
+
+  umka::jit::Inlining inlining(program, program_pool);
+  std::vector code(program.begin(), program.begin() + 8);
+  std::vector pool = program_pool;
+  umka::vm::FunctionTableEntry meta = funcs.at(0);
+  inlining.run(code, pool, funcs, meta);
+  EXPECT_EQ(code.size(), 8);
+  EXPECT_EQ(meta.local_count, 0);
+
+  // a body of 40 instructions is over the budget of one callee
+  program = inlining_program();
+  program.resize(8);
+  for (int i = 0; i < 20; ++i) {
+    program.push_back(cmd(OpCode::LOAD, 0));
+    program.push_back(cmd(OpCode::POP));
+  }
+  program.push_back(cmd(OpCode::LOAD, 1));
+  program.push_back(cmd(OpCode::RETURN));
+  funcs = inlining_functions(program.size());
+  umka::jit::Inlining large(program, program_pool);
+  code.assign(program.begin(), program.begin() + 8);
+  large.run(code, pool, funcs, meta);
+  EXPECT_EQ(code.size(), 8);
+}
+
+TEST(JitInlining, KeepsCalleesReadingUnwrittenSlots) {
+  using umka::vm::OpCode;
+
+  auto program = inlining_program();
+  // the STORE to the let slot is skipped, its LOADs would see the previous call's value
+  program[11] = cmd(OpCode::POP);
+  const std::vector program_pool = {make_int(3), make_int(10), make_int(20), make_int(5), make_int(0)};
+  auto funcs = inlining_functions(program.size());
+
+  umka::jit::Inlining inlining(program, program_pool);
+  std::vector code(program.begin(), program.begin() + 8);
+  std::vector pool = program_pool;
+  umka::vm::FunctionTableEntry meta = funcs.at(0);
+  inlining.run(code, pool, funcs, meta);
+  EXPECT_EQ(code.size(), 8);
+}
+
+// scaled_sum(n, k, m): s = 0; for (i = 0; i < n; i = i + 1) s = s + k * m; return s
+static std::vector<umka::vm::Command> scaled_sum_code() {
+  using umka::vm::OpCode;
+
+  return {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 4),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::STORE, 3),
+    cmd(OpCode::LOAD, 0), // loop head
+    cmd(OpCode::LOAD, 3),
+    cmd(OpCode::LT),
+    cmd(OpCode::JMP_IF_FALSE, 11),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::LOAD, 1),
+    cmd(OpCode::MUL),
+    cmd(OpCode::LOAD, 4),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 4),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::LOAD, 3),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 3),
+    cmd(OpCode::JMP, -15),
+    cmd(OpCode::LOAD, 4),
+    cmd(OpCode::RETURN)
+  };
+}
+
+TEST(JitLoopInvariantCodeMotion, HoistsInvariantArithmeticBehindACopyOfTheCondition) {
+  using umka::vm::OpCode;
+
+  const auto original = scaled_sum_code();
+  auto code = original;
+  std::vector pool = {make_int(0), make_int(1)};
+  umka::vm::FunctionTableEntry meta = frame_meta(3, 4);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::OffsetMap origins(code.size());
+  std::iota(origins.begin(), origins.end(), 0);
+  umka::jit::LoopInvariantCodeMotion licm;
+  licm.run(code, pool, funcs, meta, origins);
+
+  // condition copy, k * m into slot 5, then the loop loading it
+  ASSERT_EQ(code.size(), original.size() + 4 + 4 - 2);
+  EXPECT_EQ(meta.frame_size(), 6);
+  EXPECT_EQ(static_cast<OpCode>(code[10].code), OpCode::MUL);
+  EXPECT_EQ(static_cast<OpCode>(code[11].code), OpCode::STORE);
+  EXPECT_EQ(code[11].arg, 5);
+  EXPECT_EQ(static_cast<OpCode>(code[16].code), OpCode::LOAD);
+  EXPECT_EQ(code[16].arg, 5);
+  EXPECT_EQ(std::ranges::count(code, static_cast<uint8_t>(OpCode::MUL), &umka::vm::Command::code), 1);
+  // both exits leave the loop, the back edge skips the hoisted code
+  EXPECT_EQ(7 + code[7].arg + 1, code.size() - 2);
+  EXPECT_EQ(15 + code[15].arg + 1, code.size() - 2);
+  EXPECT_EQ(code.size() - 3 + code[code.size() - 3].arg + 1, 12);
+  // a frame replaced at the loop head runs the hoisted code first
+  ASSERT_EQ(origins.size(), code.size());
+  EXPECT_EQ(std::ranges::find(origins, 4) - origins.begin(), 4);
+
+  for (const int64_t n: {0, 1, 5}) {
+    EXPECT_EQ(run_on_closures(code, pool, meta, {n, 6, 7}), n * 42) << "n = " << n;
+  }
+}
+
+TEST(JitLoopInvariantCodeMotion, KeepsWhatTheLoopChanges) {
+  using umka::vm::OpCode;
+  std::vector pool = {make_int(0), make_int(1)};
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  umka::jit::LoopInvariantCodeMotion licm;
+
+  // k is written inside the loop
+  auto code = scaled_sum_code();
+  code[13] = cmd(OpCode::STORE, 1);
+  auto meta = frame_meta(3, 4);
+  licm.run(code, pool, funcs, meta);
+  EXPECT_EQ(code.size(), scaled_sum_code().size());
+
+  // for (i = 0; i < len(a); i = i + 1) body: len(a) moves unless the body may change arrays
+  auto len_loop = [](const umka::vm::Command body) {
+    return std::vector{
+      cmd(OpCode::PUSH_CONST, 0),
+      cmd(OpCode::STORE, 1),
+      cmd(OpCode::LOAD, 0), // loop head
+      cmd(OpCode::CALL_BUILTIN, umka::vm::LEN_FUN),
+      cmd(OpCode::LOAD, 1),
+      cmd(OpCode::LT),
+      cmd(OpCode::JMP_IF_FALSE, 8),
+      cmd(OpCode::LOAD, 0),
+      body,
+      cmd(OpCode::POP),
+      cmd(OpCode::PUSH_CONST, 1),
+      cmd(OpCode::LOAD, 1),
+      cmd(OpCode::ADD),
+      cmd(OpCode::STORE, 1),
+      cmd(OpCode::JMP, -13),
+      cmd(OpCode::LOAD, 1),
+      cmd(OpCode::RETURN)
+    };
+  };
+  code = len_loop(cmd(OpCode::CALL_BUILTIN, umka::vm::PRINT_FUN));
+  meta = frame_meta(1, 1);
+  licm.run(code, pool, funcs, meta);
+  ASSERT_EQ(code.size(), 17 + 5 + 3 - 1);
+  EXPECT_EQ(static_cast<OpCode>(code[8].code), OpCode::CALL_BUILTIN);
+  EXPECT_EQ(static_cast<OpCode>(code[9].code), OpCode::STORE);
+  EXPECT_EQ(static_cast<OpCode>(code[10].code), OpCode::LOAD);
+  EXPECT_EQ(code[10].arg, 2);
+
+  for (const int64_t builtin: {umka::vm::SORT_FUN, umka::vm::POP_HEAP_FUN}) {
+    code = len_loop(cmd(OpCode::CALL_BUILTIN, builtin));
+    meta = frame_meta(1, 1);
+    licm.run(code, pool, funcs, meta);
+    EXPECT_EQ(code.size(), 17);
+    EXPECT_EQ(meta.frame_size(), 2);
+  }
+}
+
+TEST(JitLoopInvariantCodeMotion, RegisterCodeEntersAtTheConditionCopy) {
+  using umka::vm::OpCode;
+
+  std::vector code = scaled_sum_code();
+  std::vector pool = {make_int(0), make_int(1)};
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(3, 4);
+  funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+  umka::jit::JitRunner runner(code, pool, funcs, {});
+  runner.add_optimization(std::make_unique<umka::jit::LoopInvariantCodeMotion>());
+  const umka::jit::JittedFunction jitted = runner.optimize_function(0);
+
+  ASSERT_EQ(jitted.osr_entries.size(), 1);
+  EXPECT_EQ(jitted.osr_entries.at(4), 4);
+  ASSERT_TRUE(jitted.register_code.has_value());
+  EXPECT_TRUE(jitted.register_code->loop_entries.contains(4));
+}
+
+TEST(JitRunner, FunctionsGetPrivateDeduplicatedConstants) {
+  using umka::vm::OpCode;
+
+  std::vector pool = {make_int(7), make_int(1), make_int(2), make_int(1)};
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::PUSH_CONST, 3), // the same 1 again
+    cmd(OpCode::STORE, 1),
+    cmd(OpCode::PUSH_CONST, 1),
+    cmd(OpCode::PUSH_CONST, 2),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 2),
+    cmd(OpCode::LOAD, 2),
+    cmd(OpCode::RETURN)
+  };
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(0, 3);
+  funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+  umka::jit::JitRunner runner(code, pool, funcs, {});
+  runner.add_optimization(std::make_unique<umka::jit::ConstFolding>());
+
+  const umka::jit::JittedFunction baseline = runner.optimize_function(0, umka::jit::Tier::BASELINE);
+  ASSERT_EQ(baseline.constants.size(), 2);
+  EXPECT_EQ(baseline.constant_values[0].i, 1);
+  EXPECT_EQ(baseline.constant_values[1].i, 2);
+  EXPECT_EQ(baseline.code[2].arg, 0);
+
+  // the folded 1 + 2 takes the place of 2, which nothing loads any more
+  const umka::jit::JittedFunction optimized = runner.optimize_function(0);
+  ASSERT_EQ(optimized.constants.size(), 2);
+  EXPECT_EQ(optimized.constant_values[0].i, 1);
+  EXPECT_EQ(optimized.constant_values[1].i, 3);
+  for (const auto &command: optimized.code) {
+    if (command.code == umka::vm::PUSH_CONST) {
+      EXPECT_LT(command.arg, 2);
+    }
+  }
+  EXPECT_EQ(pool.size(), 4);
+}
+
+// a pass bug: loads a slot past the frame
+struct BreakingPass : umka::jit::IOptimize {
+  using IOptimize::run;
+
+  void run(
+    std::vector<umka::vm::Command> &code,
+    std::vector<umka::vm::Constant> &,
+    std::unordered_map<size_t, umka::vm::FunctionTableEntry> &,
+    umka::vm::FunctionTableEntry &meta,
+    umka::jit::OffsetMap &
+  ) override {
+    for (auto &command: code) {
+      if (command.code == umka::vm::LOAD) {
+        command.arg = meta.frame_size();
+      }
+    }
+  }
+};
+
+TEST(JitRunner, CodeFailingVerificationIsRejected) {
+  using umka::vm::OpCode;
+
+  std::vector pool = {make_int(1)};
+  std::vector code = {
+    cmd(OpCode::LOAD, 0),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::RETURN)
+  };
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(1, 1);
+  funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+  umka::jit::JitRunner runner(code, pool, funcs, {});
+  runner.add_optimization(std::make_unique<BreakingPass>());
+
+  EXPECT_NO_THROW(runner.optimize_function(0, umka::jit::Tier::BASELINE));
+  EXPECT_THROW(runner.optimize_function(0), std::runtime_error);
+}
+
+TEST(JitOnStackReplacement, LoopHeadersSurviveThePasses) {
+  using umka::vm::OpCode;
+
+  std::vector<umka::vm::Constant> pool = {make_int(1)};
+  std::vector code = {
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::PUSH_CONST, 0),
+    cmd(OpCode::ADD),
+    cmd(OpCode::STORE, 0),
+    cmd(OpCode::LOAD, 0), // loop head
+    cmd(OpCode::CALL_BUILTIN, umka::vm::PRINT_FUN),
+    cmd(OpCode::POP),
+    cmd(OpCode::JMP, -4)
+  };
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(0, 1);
+  funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+  umka::jit::JitRunner runner(code, pool, funcs, {});
+  runner.add_optimization(std::make_unique<umka::jit::ConstantPropagation>());
+  runner.add_optimization(std::make_unique<umka::jit::ConstFolding>());
+  runner.add_optimization(std::make_unique<umka::jit::DeadCodeElimination>());
+  const umka::jit::JittedFunction jitted = runner.optimize_function(0);
+
+  ASSERT_EQ(jitted.code.size(), 6);
+  ASSERT_EQ(jitted.osr_entries.size(), 1);
+  EXPECT_EQ(jitted.osr_entries.at(4), 2);
+  EXPECT_EQ(static_cast<OpCode>(jitted.code[2].code), OpCode::LOAD);
+  EXPECT_EQ(jitted.code[5].arg, -4);
+}
+
+TEST(JitOnStackReplacement, RegisterCodeStartsAtLoopHead) {
+  using umka::vm::OpCode;
+
+  // the sum loop as top-level code: no result, a bare RETURN
+  std::vector code = sum_loop_code();
+  code.erase(code.end() - 2);
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  auto translated = umka::jit::RegisterTranslator::translate(code, frame_meta(1, 2), funcs);
+  ASSERT_TRUE(translated.has_value());
+  ASSERT_EQ(translated->loop_entries.size(), 1);
+  const size_t entry = translated->loop_entries.at(4);
+  EXPECT_EQ(entry, 2);
+
+  std::vector const_pool = {make_int(0), make_int(1)};
+  auto run = [&](const auto &compiled) {
+    // n = 3, i = 1, sum = 10, as a frame stopped at the loop head would have them
+    std::vector<umka::vm::Value> registers(compiled->register_count);
+    registers[0] = umka::vm::Value(int64_t{3});
+    registers[1] = umka::vm::Value(int64_t{1});
+    registers[2] = umka::vm::Value(int64_t{10});
+    CountingRuntime runtime;
+    umka::jit::ClosureFrame frame{registers.data(), &runtime, umka::vm::Value{}};
+    EXPECT_TRUE(compiled->run(frame, entry).is_unit());
+    EXPECT_EQ(registers[1].i, 4);
+    EXPECT_EQ(registers[2].i, 16);
+  };
+  const auto [constants, boxes] = umka::jit::decode_constants(const_pool);
+  auto closures = umka::jit::ClosureCompiler::compile(*translated, constants);
+  ASSERT_NE(closures, nullptr);
+  run(closures);
+  if (UMKA_NATIVE_JIT) {
+    auto native = umka::jit::NativeCompiler::compile(*translated, constants);
+    ASSERT_NE(native, nullptr);
+    run(native);
+  }
+}
+
+// waits for the worker to publish code of `fid` other than `previous`
+static const umka::jit::JittedFunction *wait_for_jitted(
+  const umka::jit::JitManager &manager, size_t fid, const umka::jit::JittedFunction *previous = nullptr
+) {
+  for (int attempt = 0; attempt < 5000; ++attempt) {
+    if (const auto *jitted = manager.jitted(fid); jitted != previous) {
+      return jitted;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return previous;
+}
+
+TEST(JitManager, PublishesEachTierAndKeepsReplacedCode) {
+  using umka::jit::Tier;
+
+  std::vector code = sum_loop_code();
+  std::vector pool = {make_int(0), make_int(1)};
+  std::unordered_map<size_t, umka::vm::FunctionTableEntry> funcs;
+  funcs[0] = frame_meta(1, 2);
+  funcs[0].code_offset_end = static_cast<int64_t>(code.size());
+
+  umka::jit::JitManager manager(code, pool, funcs, {});
+  EXPECT_EQ(manager.jitted(0), nullptr);
+  EXPECT_EQ(manager.jitted(7), nullptr);
+
+  manager.request_jit(0, Tier::BASELINE);
+  const umka::jit::JittedFunction *baseline = wait_for_jitted(manager, 0);
+  ASSERT_NE(baseline, nullptr);
+  EXPECT_EQ(baseline->tier, Tier::BASELINE);
+  EXPECT_EQ(baseline->code.size(), code.size());
+
+  manager.request_jit(0, Tier::BASELINE); // already requested, ignored
+  manager.request_jit(0, Tier::OPTIMIZED);
+  const umka::jit::JittedFunction *optimized = wait_for_jitted(manager, 0, baseline);
+  ASSERT_NE(optimized, baseline);
+  EXPECT_EQ(optimized->tier, Tier::OPTIMIZED);
+  // the baseline version stays valid for frames that still run it
+  EXPECT_EQ(baseline->tier, Tier::BASELINE);
+  EXPECT_EQ(baseline->code.size(), code.size());
+}
+
+TEST(JitCompilePool, RunsHottestFirstAndDropsCancelledJobs) {
+  umka::jit::CompilePool pool(1);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::vector<int> order;
+  std::mutex order_mutex;
+  auto record = [&](int value) {
+    return [&, value] {
+      std::lock_guard lock(order_mutex);
+      order.push_back(value);
+    };
+  };
+  int machine = 0;
+  int other_machine = 0;
+
+  // keeps the only thread busy while the rest is queued, once the worker has picked it up
+  std::promise<void> started;
+  pool.submit(&machine, 0, [&started, released] {
+    started.set_value();
+    released.wait();
+  });
+  started.get_future().wait();
+  pool.submit(&other_machine, 9, record(9));
+  pool.submit(&machine, 1, record(1));
+  const auto cold = pool.submit(&machine, 0, record(0));
+  pool.submit(&machine, 5, record(5));
+  pool.submit(&machine, 3, record(3));
+  pool.submit(&machine, 5, record(6));
+  EXPECT_TRUE(pool.cancel(cold));
+  EXPECT_FALSE(pool.cancel(cold));
+  // nothing of other_machine runs, so this does not wait
+  pool.cancel_all(&other_machine);
+  release.set_value();
+
+  for (int attempt = 0; attempt < 5000; ++attempt) {
+    {
+      std::lock_guard lock(order_mutex);
+      if (order.size() == 4)
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::lock_guard lock(order_mutex);
+  EXPECT_EQ(order, (std::vector{5, 6, 3, 1}));
+}
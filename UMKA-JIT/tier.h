@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+namespace umka::jit {
+// How much the JIT spends on a function. A higher tier replaces the code of a lower one.
+enum class Tier : uint8_t {
+  INTERPRETED,
+  // register code and closures straight from the bytecode, cheap to produce
+  BASELINE,
+  // the optimization passes first, then every backend including x86-64
+  OPTIMIZED
+};
+
+} // namespace umka::jit
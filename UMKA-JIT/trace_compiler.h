@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <model/model.h>
+#include <parser/command_parser.h>
+
+namespace umka::jit {
+// One instruction executed while the interpreter recorded a loop iteration.
+struct TraceStep {
+  size_t offset;
+  vm::Command command;
+  // operand types seen before the instruction, stack top first; for PUSH_CONST the constant
+  vm::ValueType types[2];
+  // frames between the loop frame and the one the instruction ran in
+  uint32_t depth = 0;
+  // CALL, CALL_METHOD: the function called, its argument count and frame size, and whether
+  // its instructions were recorded as the next steps, one frame deeper
+  int64_t callee = -1;
+  int64_t call_arity = 0;
+  int64_t callee_frame_size = 0;
+  bool inlined = false;
+  // CALL_METHOD, GET_FIELD: class of the receiver; GET_FIELD: the field index it resolved to
+  int64_t class_id = 0;
+  int64_t field_index = 0;
+  // jumps: whether it was taken
+  bool taken = false;
+};
+
+// Frame of an inlined callee that a trace exit hands back to the interpreter: function
+// `function` with its locals in registers [base, base + size), resuming at `resume_offset`.
+struct TraceFrame {
+  int64_t function;
+  size_t resume_offset;
+  uint32_t base;
+  uint32_t size;
+  std::vector<uint32_t> stack;
+};
+
+// Where the interpreter resumes after leaving a trace and which registers hold its operand
+// stack, bottom first. An exit inside inlined calls resumes the loop frame after the outermost
+// call and pushes the callee frames above it, outermost first.
+struct TraceExit {
+  size_t resume_offset;
+  std::vector<uint32_t> stack;
+  std::vector<TraceFrame> frames;
+};
+
+// Register instruction of a trace, `code` as in RegisterInstruction with these changes:
+//   ADD_I64_I64..LTE_F64_F64  typed operation; if `guarded`, an operand of another type leaves through `exit`
+//   JMP_IF_FALSE/JMP_IF_TRUE  guard, leaves through `exit` if lhs is false/true
+//   JMP                       back to the loop header, a GC safepoint
+//   CALL_METHOD               guard, leaves through `exit` unless lhs is an object of class `arg`
+//   GET_FIELD                 the CALL_METHOD guard, then dst = rhs, the index of the field
+//   BUILD_ARR                 dst = array of registers lhs .. lhs + rhs - 1
+//   POP                       dst = unit, the locals of an inlined callee start empty
+//   CALL                      always to function `arg`, inlined calls leave no instruction
+struct TraceInstruction {
+  uint8_t code;
+  bool guarded;
+  uint32_t dst;
+  uint32_t lhs;
+  uint32_t rhs;
+  int64_t arg;
+  uint32_t exit;
+};
+
+// A loop iteration as straight-line register code. Registers 0..frame_size-1 are the locals
+// of the frame the loop runs in, the operand stack of depth d is register frame_size + d. An
+// inlined callee gets its locals and operand stack in the same way above its caller's stack.
+struct Trace {
+  size_t header;
+  int64_t frame_size;
+  int64_t register_count;
+  std::vector<TraceInstruction> code;
+  std::vector<TraceExit> exits;
+};
+
+// Turns a recorded iteration into a Trace. Branches become guards that leave the trace on the
+// path that was not recorded, arithmetic is specialized to the operand types seen while
+// recording. Local reads are used in place and results stored right away are written to the
+// local, as in RegisterTranslator. A type guard is dropped when the trace itself has already
+// established both operand types earlier in the same iteration.
+//
+// Calls are recorded into the callee, up to kMaxInlineDepth frames deep: the callee's locals
+// and stack get registers of their own, its RETURN becomes a move into the caller's stack, and
+// an exit inside it rebuilds its frame. A CALL has a single target; a CALL_METHOD and a GET_FIELD
+// are guarded on the class of the receiver they saw. Deeper calls and CALL_BUILTIN stay calls,
+// whose result has no known type. TAIL_CALL and OPCOT are not recorded, nor is a RETURN of the
+// loop frame.
+class TraceCompiler {
+  public:
+    // frames the recorder may enter above the loop frame
+    static constexpr uint32_t kMaxInlineDepth = 4;
+
+    static bool can_record(uint8_t op) {
+      switch (op) {
+        case vm::PUSH_CONST:
+        case vm::POP:
+        case vm::STORE:
+        case vm::LOAD:
+        case vm::NOT:
+        case vm::AND:
+        case vm::OR:
+        case vm::TO_STRING:
+        case vm::TO_INT:
+        case vm::TO_DOUBLE:
+        case vm::JMP:
+        case vm::JMP_IF_FALSE:
+        case vm::JMP_IF_TRUE:
+        case vm::CALL:
+        case vm::CALL_BUILTIN:
+        case vm::CALL_METHOD:
+        case vm::GET_FIELD:
+        case vm::BUILD_ARR:
+        case vm::RETURN:
+          return true;
+        default:
+          return vm::is_quickenable(op);
+      }
+    }
+
+    // nullopt unless the steps form a loop back to `header` with an empty operand stack
+    static std::optional<Trace> compile(const std::vector<TraceStep> &steps, size_t header, int64_t frame_size) {
+      if (steps.empty() || steps.front().offset != header || frame_size < 0 || frame_size > kMaxRegister) {
+        return std::nullopt;
+      }
+      TraceCompiler compiler(header, static_cast<uint32_t>(frame_size));
+      for (size_t i = 0; i < steps.size(); ++i) {
+        if (!compiler.emit(steps[i], i + 1 == steps.size())) {
+          return std::nullopt;
+        }
+      }
+      if (!compiler.closed) {
+        return std::nullopt;
+      }
+      return Trace{
+        header,
+        frame_size,
+        compiler.register_count,
+        std::move(compiler.out),
+        std::move(compiler.exits)
+      };
+    }
+
+  private:
+    // a frame of the recorded iteration: the loop frame or an inlined callee
+    struct Level {
+      int64_t function;
+      uint32_t base;
+      uint32_t size;
+      // in the caller, where it continues after the call
+      size_t return_offset;
+      std::vector<uint32_t> stack;
+    };
+
+    TraceCompiler(size_t header, uint32_t frame_size)
+      : header(header)
+        , register_count(frame_size) {
+      levels.push_back(Level{-1, 0, frame_size, 0, {}});
+    }
+
+    bool emit(const TraceStep &step, bool last) {
+      const vm::Command &cmd = step.command;
+      if (step.depth + 1 != levels.size()) {
+        return false;
+      }
+      std::vector<uint32_t> &stack = levels.back().stack;
+      switch (cmd.code) {
+        case vm::PUSH_CONST: {
+          const uint32_t dst = push_temp(step.types[0]);
+          out.push_back({vm::PUSH_CONST, false, dst, 0, 0, cmd.arg, 0});
+          return true;
+        }
+        case vm::LOAD:
+          if (cmd.arg < 0 || cmd.arg >= levels.back().size) {
+            return false;
+          }
+          push(local(cmd.arg));
+          return true;
+        case vm::STORE:
+          return cmd.arg >= 0 && cmd.arg < levels.back().size && !stack.empty() && store(local(cmd.arg));
+        case vm::POP:
+          if (stack.empty()) {
+            return false;
+          }
+          pop();
+          return true;
+        case vm::NOT:
+        case vm::TO_STRING:
+        case vm::TO_INT:
+        case vm::TO_DOUBLE: {
+          if (stack.empty()) {
+            return false;
+          }
+          const uint32_t operand = pop();
+          const uint32_t dst = push_temp(result_type(cmd.code));
+          out.push_back({cmd.code, false, dst, operand, 0, 0, 0});
+          return true;
+        }
+        case vm::JMP:
+          return !last || close_loop(step);
+        case vm::JMP_IF_FALSE:
+        case vm::JMP_IF_TRUE: {
+          if (stack.empty()) {
+            return false;
+          }
+          const uint32_t condition = pop();
+          const bool jumps_if = cmd.code == vm::JMP_IF_TRUE;
+          // the guard leaves when the condition would send control off the recorded path
+          const bool leave_if = step.taken ? !jumps_if : jumps_if;
+          const size_t other = step.taken ? step.offset + 1 : step.offset + 1 + cmd.arg;
+          out.push_back({leave_if ? vm::JMP_IF_TRUE : vm::JMP_IF_FALSE, true, 0, condition, 0, 0, exit_to(other)});
+          return !last || close_loop(step);
+        }
+        case vm::CALL_METHOD:
+          if (stack.empty()) {
+            return false;
+          }
+          out.push_back({vm::CALL_METHOD, true, 0, stack.back(), 0, step.class_id, exit_to(step.offset)});
+          [[fallthrough]];
+        case vm::CALL:
+          if (step.callee < 0 || step.call_arity < 0 || static_cast<size_t>(step.call_arity) > stack.size()) {
+            return false;
+          }
+          return step.inlined ? enter(step) : call(vm::CALL, step.callee, step.call_arity);
+        case vm::CALL_BUILTIN:
+          return vm::builtin_arity(cmd.arg) >= 0 && static_cast<size_t>(vm::builtin_arity(cmd.arg)) <= stack.size() &&
+                 call(vm::CALL_BUILTIN, cmd.arg, vm::builtin_arity(cmd.arg));
+        case vm::RETURN:
+          return leave();
+        case vm::GET_FIELD:
+          return get_field(step);
+        case vm::BUILD_ARR: {
+          if (cmd.arg < 0 || static_cast<size_t>(cmd.arg) > stack.size()) {
+            return false;
+          }
+          const size_t first_depth = stack.size() - cmd.arg;
+          for (size_t d = first_depth; d < stack.size(); ++d) {
+            materialize(d);
+          }
+          stack.resize(first_depth);
+          const uint32_t dst = push_temp(vm::ValueType::BOXED);
+          out.push_back({vm::BUILD_ARR, false, dst, dst, static_cast<uint32_t>(cmd.arg), 0, 0});
+          return true;
+        }
+        default:
+          if (!vm::is_quickenable(cmd.code) && cmd.code != vm::AND && cmd.code != vm::OR) {
+            return false;
+          }
+          return binary(step);
+      }
+    }
+
+    // a call the trace makes, to a callee that was not recorded
+    bool call(uint8_t op, int64_t callee, int64_t arity) {
+      std::vector<uint32_t> &stack = levels.back().stack;
+      const size_t first_depth = stack.size() - arity;
+      for (size_t d = first_depth; d < stack.size(); ++d) {
+        materialize(d);
+      }
+      stack.resize(first_depth);
+      const uint32_t first = push_temp(kUnknown);
+      out.push_back({op, false, first, first, static_cast<uint32_t>(arity), callee, 0});
+      return true;
+    }
+
+    // Continues in the recorded callee: its locals go above the caller's stack, arguments are
+    // moved in as call_function would pop them, the other locals are cleared.
+    bool enter(const TraceStep &step) {
+      if (levels.size() > kMaxInlineDepth || step.callee_frame_size < step.call_arity) {
+        return false;
+      }
+      std::vector<uint32_t> &stack = levels.back().stack;
+      const uint32_t base = temp(stack.size());
+      if (base + step.callee_frame_size > kMaxRegister) {
+        return false;
+      }
+      const auto size = static_cast<uint32_t>(step.callee_frame_size);
+      for (uint32_t i = 0; i < size; ++i) {
+        if (i < step.call_arity) {
+          const uint32_t argument = stack[stack.size() - 1 - i];
+          out.push_back({vm::LOAD, false, base + i, argument, 0, 0, 0});
+          known_type(base + i) = known_type(argument);
+        } else {
+          out.push_back({vm::POP, false, base + i, 0, 0, 0, 0});
+          known_type(base + i) = vm::ValueType::UNIT;
+        }
+      }
+      stack.resize(stack.size() - step.call_arity);
+      levels.push_back(Level{step.callee, base, size, step.offset + 1, {}});
+      register_count = std::max<int64_t>(register_count, base + size);
+      return true;
+    }
+
+    // RETURN of an inlined callee: its result moves to the top of the caller's stack
+    bool leave() {
+      if (levels.size() == 1 || levels.back().stack.size() != 1) {
+        return false;
+      }
+      const uint32_t value = pop();
+      const vm::ValueType type = known_type(value);
+      levels.pop_back();
+      const uint32_t dst = push_temp(type);
+      out.push_back({vm::LOAD, false, dst, value, 0, 0, 0});
+      return true;
+    }
+
+    // the object stays on the stack above its field index, so a temporary object moves up first
+    bool get_field(const TraceStep &step) {
+      std::vector<uint32_t> &stack = levels.back().stack;
+      if (stack.empty() || step.field_index < 0 || step.field_index > UINT32_MAX) {
+        return false;
+      }
+      const uint32_t exit = exit_to(step.offset);
+      uint32_t object = pop();
+      if (object == temp(stack.size())) {
+        out.push_back({vm::LOAD, false, temp(stack.size() + 1), object, 0, 0, 0});
+        object = temp(stack.size() + 1);
+      }
+      const uint32_t index = push_temp(vm::ValueType::INT);
+      out.push_back({vm::GET_FIELD, true, index, object, static_cast<uint32_t>(step.field_index), step.class_id, exit});
+      push(object);
+      known_type(object) = vm::ValueType::BOXED;
+      return true;
+    }
+
+    bool binary(const TraceStep &step) {
+      if (levels.back().stack.size() < 2) {
+        return false;
+      }
+      const uint8_t op = step.command.code;
+      // a failed type guard resumes at the instruction itself with both operands on the stack
+      const uint32_t exit = exit_to(step.offset);
+      const uint32_t lhs = pop();
+      const uint32_t rhs = pop();
+      const vm::ValueType type = step.types[0];
+      const bool typed = vm::is_quickenable(op) && type == step.types[1] &&
+                         vm::quickened_opcode(op, type) != op;
+      if (!typed) {
+        exits.pop_back();
+        const uint32_t dst = push_temp(result_type(op));
+        out.push_back({op, false, dst, lhs, rhs, 0, 0});
+        return true;
+      }
+      const bool guarded = known_type(lhs) != type || known_type(rhs) != type;
+      if (!guarded) {
+        exits.pop_back();
+      }
+      const bool compare = op >= vm::EQ;
+      const uint32_t dst = push_temp(compare ? vm::ValueType::BOOL : type);
+      out.push_back({vm::quickened_opcode(op, type), guarded, dst, lhs, rhs, 0, guarded ? exit : 0});
+      return true;
+    }
+
+    bool close_loop(const TraceStep &step) {
+      const bool jumps = step.command.code == vm::JMP || step.taken;
+      if (!jumps || step.offset + 1 + step.command.arg != header || levels.size() != 1 || !levels[0].stack.empty()) {
+        return false;
+      }
+      out.push_back({vm::JMP, false, 0, 0, 0, 0, 0});
+      closed = true;
+      return true;
+    }
+
+    bool store(uint32_t local) {
+      const uint32_t value = pop();
+      const std::vector<uint32_t> &stack = levels.back().stack;
+      for (size_t d = 0; d < stack.size(); ++d) {
+        if (stack[d] == local) {
+          materialize(d);
+        }
+      }
+      if (value != local) {
+        if (value == temp(stack.size()) && !out.empty() && out.back().dst == value && writes_dst(out.back().code)) {
+          out.back().dst = local;
+        } else {
+          out.push_back({vm::LOAD, false, local, value, 0, 0, 0});
+        }
+      }
+      known_type(local) = known_type(value);
+      return true;
+    }
+
+    static bool writes_dst(uint8_t op) {
+      return op != vm::JMP && op != vm::JMP_IF_FALSE && op != vm::JMP_IF_TRUE;
+    }
+
+    static vm::ValueType result_type(uint8_t op) {
+      switch (op) {
+        case vm::NOT:
+        case vm::EQ:
+        case vm::NEQ:
+        case vm::GT:
+        case vm::LT:
+        case vm::GTE:
+        case vm::LTE:
+          return vm::ValueType::BOOL;
+        case vm::TO_INT:
+          return vm::ValueType::INT;
+        case vm::TO_DOUBLE:
+          return vm::ValueType::DOUBLE;
+        default:
+          return kUnknown;
+      }
+    }
+
+    // copies a pending local read at depth `d` into its own temporary
+    void materialize(size_t d) {
+      std::vector<uint32_t> &stack = levels.back().stack;
+      if (stack[d] != temp(d)) {
+        out.push_back({vm::LOAD, false, temp(d), stack[d], 0, 0, 0});
+        known_type(temp(d)) = known_type(stack[d]);
+        stack[d] = temp(d);
+      }
+    }
+
+    uint32_t exit_to(size_t resume_offset) {
+      TraceExit exit{levels.size() == 1 ? resume_offset : levels[1].return_offset, levels[0].stack, {}};
+      for (size_t i = 1; i < levels.size(); ++i) {
+        const Level &level = levels[i];
+        const size_t resume = i + 1 < levels.size() ? levels[i + 1].return_offset : resume_offset;
+        exit.frames.push_back(TraceFrame{level.function, resume, level.base, level.size, level.stack});
+      }
+      exits.push_back(std::move(exit));
+      return static_cast<uint32_t>(exits.size() - 1);
+    }
+
+    uint32_t local(int64_t index) const {
+      return levels.back().base + static_cast<uint32_t>(index);
+    }
+
+    uint32_t temp(size_t depth) const {
+      return levels.back().base + levels.back().size + static_cast<uint32_t>(depth);
+    }
+
+    void push(uint32_t reg) {
+      levels.back().stack.push_back(reg);
+      register_count = std::max<int64_t>(register_count, temp(levels.back().stack.size() - 1) + 1);
+    }
+
+    uint32_t push_temp(vm::ValueType type) {
+      const uint32_t reg = temp(levels.back().stack.size());
+      push(reg);
+      known_type(reg) = type;
+      return reg;
+    }
+
+    uint32_t pop() {
+      std::vector<uint32_t> &stack = levels.back().stack;
+      const uint32_t reg = stack.back();
+      stack.pop_back();
+      return reg;
+    }
+
+    vm::ValueType &known_type(uint32_t reg) {
+      if (reg >= known.size()) {
+        known.resize(reg + 1, kUnknown);
+      }
+      return known[reg];
+    }
+
+    // no value has this type, so it never matches a guard
+    static constexpr auto kUnknown = static_cast<vm::ValueType>(0xFF);
+    static constexpr int64_t kMaxRegister = UINT32_MAX / 2;
+
+    const size_t header;
+    // the loop frame first, the innermost inlined callee last
+    std::vector<Level> levels;
+    std::vector<vm::ValueType> known;
+    int64_t register_count;
+    bool closed = false;
+
+    std::vector<TraceInstruction> out;
+    std::vector<TraceExit> exits;
+};
+} // namespace umka::jit
@@ -44,7 +44,7 @@ public:
 
     if (std::holds_alternative<Owner<Array>>(entity.value)) {
       auto arr = std::get<Owner<Array>>(entity.value);
-      size += arr->size() * sizeof(std::pair<size_t, Reference<Entity>>);
+      size += arr->size() * sizeof(Value);
     }
 
     if (std::holds_alternative<std::string>(entity.value)) {
@@ -76,13 +76,13 @@ public:
 
   void collect(
       std::vector<Owner<Entity>>& heap,
-      const std::vector<Reference<Entity>>& operand_stack,
-      const std::vector<StackFrame>& stack_of_functions
+      const std::vector<Value>& operand_stack,
+      const std::vector<Value>& locals
   ) {
     if constexpr (std::is_same_v<Tag, DebugMod>) {
       std::cout << "Mark" << std::endl;
     }
-    mark(heap, operand_stack, stack_of_functions);
+    mark(heap, operand_stack, locals);
 
     if constexpr (std::is_same_v<Tag, DebugMod>) {
       std::cout << "Sweep" << std::endl;
@@ -104,9 +104,9 @@ private:
   size_t total_available_ram_bytes;
   size_t after_last_clean;
 
-  std::unordered_map<Owner<Entity>, bool> marked_objects;
+  std::unordered_map<const Entity*, bool> marked_objects;
 
-  std::unordered_map<Owner<Entity>, bool> heap_objects;
+  std::unordered_map<const Entity*, bool> heap_objects;
 
   static size_t detect_total_ram_bytes() {
 #if defined(_WIN32)
@@ -142,60 +142,50 @@ private:
 
   void mark(
       std::vector<Owner<Entity>>& heap,
-      const std::vector<Reference<Entity>>& operand_stack,
-      const std::vector<StackFrame>& stack_of_functions
+      const std::vector<Value>& operand_stack,
+      const std::vector<Value>& locals
   ) {
     marked_objects.clear();
     heap_objects.clear();
     for (const auto& owner : heap) {
       if (owner) {
-        marked_objects[owner] = false;
-        heap_objects[owner] = true;
+        marked_objects[owner.get()] = false;
+        heap_objects[owner.get()] = true;
       }
     }
 
-    for (const auto& ref : operand_stack) {
-      if (!ref.expired()) {
-        auto owner = ref.lock();
-        if (owner) {
-          mark_recursive(owner);
-        }
-      }
+    for (const auto& value : operand_stack) {
+      mark_recursive(value);
     }
 
-    for (const auto& frame : stack_of_functions) {
-      for (const auto& [key, ref] : frame.name_resolver) {
-        if (!ref.expired()) {
-          auto owner = ref.lock();
-          if (owner) mark_recursive(owner);
-        }
-      }
+    // slots of all frames live in one contiguous stack
+    for (const auto& value : locals) {
+      mark_recursive(value);
     }
   }
 
-  void mark_recursive(Owner<Entity> entity_owner) {
-    if (!entity_owner) return;
+  void mark_recursive(const Value& value) {
+    // scalars are stored inline and own no heap memory
+    if (!value.is_boxed()) return;
 
-    if (!heap_objects.contains(entity_owner)) {
+    const Entity* entity = value.boxed;
+    if (!heap_objects.contains(entity)) {
       return;
     }
 
-    if (marked_objects.contains(entity_owner) && marked_objects[entity_owner]) {
+    if (marked_objects.contains(entity) && marked_objects[entity]) {
       return;
     }
 
-    marked_objects[entity_owner] = true;
+    marked_objects[entity] = true;
 
-    if (!std::holds_alternative<Owner<Array>>(entity_owner->value)) {
+    if (!std::holds_alternative<Owner<Array>>(entity->value)) {
       return;
     }
 
-    const auto& arr = std::get<Owner<Array>>(entity_owner->value);
-    for (const auto& ref : *arr) {
-      if (!ref.expired()) {
-        auto owner = ref.lock();
-        if (owner) mark_recursive(owner);
-      }
+    const auto& arr = std::get<Owner<Array>>(entity->value);
+    for (const auto& elem : *arr) {
+      mark_recursive(elem);
     }
   }
 
@@ -219,9 +209,9 @@ private:
         erase(it);
         continue;
       }
-      const Owner<Entity>& entity_owner = *it;
+      const Entity* entity = it->get();
 
-      if (!marked_objects.contains(entity_owner) || !marked_objects[entity_owner]) {
+      if (!marked_objects.contains(entity) || !marked_objects[entity]) {
         freed_bytes += calculate_entity_size(**it);
         erase(it);
       } else {
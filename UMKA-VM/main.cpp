@@ -1,19 +1,79 @@
 #include "model/model.h"
 #include "runtime/stack_machine.h"
 #include "parser/command_parser.h"
+#include "parser/bytecode_verifier.h"
 #include "runtime/profiler.h"
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <string_view>
 
 
 using namespace umka::vm;
 
 constexpr const char* DEFAULT_BYTECODE_PATH = "program.umka";
-size_t HOT_REGIONS_COUNT = 10;
+constexpr const char* TOS_CACHE_FLAG = "--tos-cache";
+// --jit=<policy> overrides UMKA_JIT=<policy>, see TieringPolicy::parse
+constexpr std::string_view JIT_POLICY_FLAG = "--jit=";
+constexpr const char* JIT_POLICY_ENV = "UMKA_JIT";
+// --sequences runs the program on the profiling interpreter without the JIT and prints its most
+// frequent opcode sequences, the input test/profile_sequences.py builds the superinstruction
+// profile from
+constexpr const char* SEQUENCES_FLAG = "--sequences";
+size_t HOT_SEQUENCES_COUNT = 256;
+
+template<typename Tag>
+void run_verified(CommandParser& parser, const TieringPolicy& tiering) {
+    StackMachine<Tag> vm(parser, DispatchMode::THREADED, tiering);
+    vm.run([init = false](Command cmd, std::string stack_top) mutable {
+        return false;
+        if (!init) {
+            init = true;
+            std::cout << "Executing command" << std::endl;
+        }
+        std::cout 
+            << std::hex << "0x"
+            << (int)cmd.code 
+            << std::dec
+            << ' ' << cmd.arg 
+            << ' ' << stack_top 
+            << std::endl;
+    });
+}
+
+void print_hot_sequences(CommandParser& parser) {
+    StackMachine<DebugMod> vm(parser, DispatchMode::THREADED, TieringPolicy::parse("off"));
+    vm.run();
+    for (const auto& sequence : vm.get_profiler()->get_hot_sequences(HOT_SEQUENCES_COUNT)) {
+        std::cout << "sequence " << sequence.count;
+        for (uint8_t opcode : sequence.opcodes) {
+            std::cout << ' ' << opcode_name(opcode);
+        }
+        std::cout << std::endl;
+    }
+}
 
 int main(int argc, char* argv[]) {
     try {
-        std::string bytecode_path = (argc > 1) ? argv[1] : DEFAULT_BYTECODE_PATH;
+        std::string bytecode_path = DEFAULT_BYTECODE_PATH;
+        bool tos_cache = false;
+        bool sequences = false;
+        TieringPolicy tiering;
+        if (const char* policy = std::getenv(JIT_POLICY_ENV)) {
+            tiering = TieringPolicy::parse(policy);
+        }
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg = argv[i];
+            if (arg == TOS_CACHE_FLAG) {
+                tos_cache = true;
+            } else if (arg == SEQUENCES_FLAG) {
+                sequences = true;
+            } else if (arg.starts_with(JIT_POLICY_FLAG)) {
+                tiering = TieringPolicy::parse(arg.substr(JIT_POLICY_FLAG.size()), tiering);
+            } else {
+                bytecode_path = argv[i];
+            }
+        }
         
         std::cout << "Loading bytecode from: " << bytecode_path << std::endl;
         std::ifstream bytecode_file(bytecode_path, std::ios::binary);
@@ -24,25 +84,20 @@ int main(int argc, char* argv[]) {
         CommandParser parser;
 
         parser.parse(bytecode_file);
+        BytecodeVerifier(
+            parser.get_commands(),
+            parser.get_const_pool(),
+            parser.get_func_table(),
+            parser.get_vmethod_table()
+        ).verify();
 
-        StackMachine<ReleaseMod> vm(parser);
-        vm.run([init = false](Command cmd, std::string stack_top) mutable {
-            return false;
-            if (!init) {
-                init = true;
-                std::cout << "Executing command" << std::endl;
-            }
-            std::cout 
-                << std::hex << "0x"
-                << (int)cmd.code 
-                << std::dec
-                << ' ' << cmd.arg 
-                << ' ' << stack_top 
-                << std::endl;
-        });
-        
-        auto profiler = vm.get_profiler();
-        auto hot_regions = profiler->get_hot_regions(HOT_REGIONS_COUNT);
+        if (sequences) {
+            print_hot_sequences(parser);
+        } else if (tos_cache) {
+            run_verified<TosCachedMod>(parser, tiering);
+        } else {
+            run_verified<VerifiedMod>(parser, tiering);
+        }
         
         std::cout << "Execution completed successfully" << std::endl;
         return 0;
@@ -1,17 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <compare>
 #include <concepts>
 #include <cstdint>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <memory>
 #include <optional>
 #include <ranges>
 #include <string>
+#include <tuple>
 #include <sstream>
+#include <stdexcept>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -22,7 +28,8 @@ template<typename T>
 using Owner = std::shared_ptr<T>;
 
 struct Entity;
-using Array = std::vector<Reference<Entity>>;
+struct Value;
+using Array = std::vector<Value>;
 using unit = std::monostate;
 
 #define for_all_types(X) \
@@ -69,6 +76,88 @@ concept ConvertableToString = requires(T value) {
     { std::to_string(value) } -> std::same_as<std::string>;
 };
 
+template <typename T1, typename T2>
+std::partial_ordering compare_alternatives(const T1& arg1, const T2& arg2) {
+    if constexpr (Comparable<T1, T2>) {
+        return arg1 <=> arg2;
+    }
+    if constexpr (Equtable<T1, T2>) {
+        return arg1 == arg2
+        ? std::partial_ordering::equivalent 
+        : std::partial_ordering::unordered;
+    }
+    // if constexpr (std::is_same_v<Owner<Array>, T1> && std::is_same_v<T1, T2>) {
+    //     static_assert(!std::is_same_v<std::string, T1>);
+    //     static_assert(!std::is_same_v<std::string, T2>);
+    //     size_t sz = std::min(arg1->size(), arg2->size());
+    //     for (size_t i = 0; i < sz; ++i) {
+    //         const auto& x = *((*arg1)[i]).lock();
+    //         static_assert(std::is_same_v<decltype(x), const Entity&>);
+    //         const auto& y = *((*arg2)[i]).lock();
+    //         if (x != y) {
+    //             return x <=> y;
+    //         }
+    //     }
+    //     return arg1->size() <=> arg2->size();
+    // }
+    return std::partial_ordering::unordered;
+}
+
+enum class ValueType : uint8_t {
+    UNIT,
+    INT,
+    DOUBLE,
+    BOOL,
+    BOXED,
+};
+
+// Slot of the operand stack, locals and arrays. Numbers, bools and unit are stored inline,
+// everything else is boxed in a GC-owned Entity. Boxed strings and constants are immutable;
+// boxed arrays and objects (arrays of fields) are shared and mutated in place by add_elem, set
+// and remove, so every Value pointing at one observes the write.
+struct Value {
+    ValueType type;
+    union {
+        int64_t i;
+        double d;
+        bool b;
+        Entity* boxed;
+    };
+
+    Value() : type(ValueType::UNIT), i(0) {}
+    Value(unit) : Value() {}
+    Value(int64_t value) : type(ValueType::INT), i(value) {}
+    Value(double value) : type(ValueType::DOUBLE), d(value) {}
+    Value(bool value) : type(ValueType::BOOL), b(value) {}
+    explicit Value(Entity* entity) : type(ValueType::BOXED), boxed(entity) {}
+
+    bool is_unit() const { return type == ValueType::UNIT; }
+    bool is_boxed() const { return type == ValueType::BOXED; }
+
+    template <typename T>
+    const T* get_if() const;
+
+    template <typename T>
+    const T& get() const {
+        if (const T* value = get_if<T>()) {
+            return *value;
+        }
+        throw std::runtime_error("Bad value access");
+    }
+
+    template <typename F>
+    decltype(auto) visit(F&& f) const;
+
+    std::string to_string() const;
+
+    std::partial_ordering operator<=>(const Value& other) const;
+
+    bool operator==(const Value& other) const {
+        return (*this <=> other) == std::partial_ordering::equivalent;
+    }
+};
+static_assert(sizeof(Value) == 16);
+
 struct Entity {
     std::variant<
         int64_t,
@@ -94,7 +183,7 @@ struct Entity {
                 for (size_t it = 0; const auto& value : *arg) {
                     ss 
                         << it << ": " 
-                        << value.lock()->to_string() 
+                        << value.to_string() 
                         << (it + 1 == arg->size() ? "" : ", ")
                     ;
                     ++it;
@@ -117,32 +206,7 @@ struct Entity {
     std::partial_ordering operator<=>(const Entity& other) const {
         return std::visit([&](auto&& arg1) -> std::partial_ordering {
             return std::visit([&](auto&& arg2) -> std::partial_ordering {
-                using T1 = std::decay_t<decltype(arg1)>;
-                using T2 = std::decay_t<decltype(arg2)>;
-                
-                if constexpr (Comparable<T1, T2>) {
-                    return arg1 <=> arg2;
-                }
-                if constexpr (Equtable<T1, T2>) {
-                    return arg1 == arg2
-                    ? std::partial_ordering::equivalent 
-                    : std::partial_ordering::unordered;
-                }
-                // if constexpr (std::is_same_v<Owner<Array>, T1> && std::is_same_v<T1, T2>) {
-                //     static_assert(!std::is_same_v<std::string, T1>);
-                //     static_assert(!std::is_same_v<std::string, T2>);
-                //     size_t sz = std::min(arg1->size(), arg2->size());
-                //     for (size_t i = 0; i < sz; ++i) {
-                //         const auto& x = *((*arg1)[i]).lock();
-                //         static_assert(std::is_same_v<decltype(x), const Entity&>);
-                //         const auto& y = *((*arg2)[i]).lock();
-                //         if (x != y) {
-                //             return x <=> y;
-                //         }
-                //     }
-                //     return arg1->size() <=> arg2->size();
-                // }
-                return std::partial_ordering::unordered;
+                return compare_alternatives(arg1, arg2);
             }, other.value);
         }, value);
     }
@@ -156,9 +220,60 @@ struct Entity {
     }
 };
 
+template <typename T>
+const T* Value::get_if() const {
+    if constexpr (std::is_same_v<T, int64_t>) {
+        return type == ValueType::INT ? &i : nullptr;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return type == ValueType::DOUBLE ? &d : nullptr;
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return type == ValueType::BOOL ? &b : nullptr;
+    } else {
+        return type == ValueType::BOXED ? std::get_if<T>(&boxed->value) : nullptr;
+    }
+}
+
+template <typename F>
+decltype(auto) Value::visit(F&& f) const {
+    switch (type) {
+        case ValueType::INT: return f(i);
+        case ValueType::DOUBLE: return f(d);
+        case ValueType::BOOL: return f(b);
+        case ValueType::UNIT: return f(unit{});
+        default: return std::visit(f, std::as_const(boxed->value));
+    }
+}
+
+inline std::string Value::to_string() const {
+    switch (type) {
+        case ValueType::INT: return std::to_string(i);
+        case ValueType::DOUBLE: return std::to_string(d);
+        case ValueType::BOOL: return std::to_string(b);
+        case ValueType::UNIT: return "unit";
+        default: return boxed->to_string();
+    }
+}
+
+inline std::partial_ordering Value::operator<=>(const Value& other) const {
+    if (type == ValueType::INT && other.type == ValueType::INT) {
+        return i <=> other.i;
+    }
+    return visit([&](const auto& arg1) -> std::partial_ordering {
+        return other.visit([&](const auto& arg2) -> std::partial_ordering {
+            return compare_alternatives(arg1, arg2);
+        });
+    });
+}
+
 
 struct Command {
+    Command() = default;
+    constexpr Command(uint8_t code, int64_t arg = 0) : code(code), arg(arg) {}
+
     uint8_t code;
+    // set by the interpreter on an arithmetic or compare site that missed the operand types
+    // it was quickened for; the site stays generic instead of flipping back and forth
+    bool generic = false;
     int64_t arg;
 };
 
@@ -170,6 +285,9 @@ struct FunctionTableEntry {
     int64_t local_count;
     
     FunctionTableEntry() : id(0), code_offset(0), code_offset_end(0), arg_count(0), local_count(0) {}
+
+    // Let-bound locals are numbered from arg_count + 1 up to local_count inclusive.
+    int64_t frame_size() const { return std::max(arg_count, local_count + 1); }
 };
 
 constexpr static int64_t kMaxI64 = std::numeric_limits<int64_t>::max();
@@ -196,6 +314,40 @@ enum BuiltinFunctionIDs : int64_t {
     POP_HEAP_FUN = kMaxI64 - 19,
     PUSH_HEAP_FUN = kMaxI64 - 20,
 };
+constexpr static int64_t kBuiltinCount = kMaxI64 - PUSH_HEAP_FUN + 1;
+
+// Stack arguments popped by a builtin, -1 if id is not a builtin.
+constexpr int64_t builtin_arity(int64_t id) {
+    switch (id) {
+        case INPUT_FUN:
+        case RANDOM_FUN:
+            return 0;
+        case PRINT_FUN:
+        case LEN_FUN:
+        case READ_FUN:
+        case ASSERT_FUN:
+        case SQRT_FUN:
+        case SORT_FUN:
+        case MAKE_HEAP_FUN:
+        case POP_HEAP_FUN:
+            return 1;
+        case GET_FUN:
+        case ADD_FUN:
+        case REMOVE_FUN:
+        case CONCAT_FUN:
+        case WRITE_FUN:
+        case POW_FUN:
+        case MIN_FUN:
+        case MAX_FUN:
+        case SPLIT_FUN:
+        case PUSH_HEAP_FUN:
+            return 2;
+        case SET_FUN:
+            return 3;
+        default:
+            return -1;
+    }
+}
 
 enum ConstantType : uint8_t {
     TYPE_INT64 = 0x01,
@@ -209,12 +361,59 @@ struct Constant {
     std::vector<uint8_t> data;
 };
 
+// Call-site cache of CALL_METHOD / GET_FIELD: class_id -> function_id or field_index.
+// One entry is monomorphic, up to kCapacity polymorphic; misses of a full cache go to
+// the megamorphic MemberTable.
+struct InlineCache {
+    static constexpr size_t kCapacity = 4;
+
+    struct Entry {
+        int64_t class_id;
+        int64_t target;
+    };
+
+    std::array<Entry, kCapacity> entries;
+    size_t size = 0;
+};
+
+// Inline caches of one code vector, site maps an instruction offset to its cache
+struct InlineCacheTable {
+    std::vector<uint32_t> site;
+    std::vector<InlineCache> caches;
+
+    InlineCache& at(size_t offset) { return caches[site[offset]]; }
+};
+
+class MemoCache;
+
+// Function table entry resolved at link time, CALL operands index a dense vector of these
+struct FunctionRecord {
+    uint64_t id;
+    std::vector<Command>::iterator code;
+    int64_t arg_count;
+    int64_t local_count;
+    int64_t frame_size;
+    size_t counter_slot;
+    // result cache of a pure function, null for the others
+    MemoCache* memo = nullptr;
+};
+
 struct StackFrame {
     uint64_t name;
-    std::vector<Command>::const_iterator instruction_ptr;
-    std::vector<Command>::const_iterator begin;
-    std::vector<Command>::const_iterator end;
-    std::unordered_map<int64_t, Reference<Entity>> name_resolver = {};
+    std::vector<Command>::iterator instruction_ptr;
+    std::vector<Command>::iterator begin;
+    std::vector<Command>::iterator end;
+    // first slot of the frame in the VM-wide locals stack
+    size_t locals_base = 0;
+    InlineCacheTable* inline_caches = nullptr;
+    // what PUSH_CONST indexes: the constants of the image, or those of a jitted function
+    const std::vector<Value>* constants = nullptr;
+    // handler addresses parallel to [begin, end), filled by the threaded dispatcher
+    const void** threaded_code = nullptr;
+    // entry of a result cache the RETURN of this frame fills, see MemoCache
+    MemoCache* memo = nullptr;
+    uint32_t memo_slot = 0;
+    uint64_t memo_ticket = 0;
 };
 
 // Virtual method table entry: (class_id, method_id) -> function_id
@@ -231,10 +430,98 @@ struct VFieldTableEntry {
     int64_t field_index;
 };
 
+// Dense (class_id, member_id) -> target table, ids are assigned sequentially by the compiler
+struct MemberTable {
+    int64_t class_count = 0;
+    int64_t member_count = 0;
+    std::vector<int64_t> targets;
+
+    // entries are (class_id, member_id, target) tuples
+    static MemberTable build(const std::vector<std::tuple<int64_t, int64_t, int64_t>>& entries) {
+        MemberTable table;
+        for (const auto& [class_id, member_id, target] : entries) {
+            table.class_count = std::max(table.class_count, class_id + 1);
+            table.member_count = std::max(table.member_count, member_id + 1);
+        }
+        table.targets.assign(table.class_count * table.member_count, -1);
+        for (const auto& [class_id, member_id, target] : entries) {
+            if (class_id >= 0 && member_id >= 0) {
+                table.targets[class_id * table.member_count + member_id] = target;
+            }
+        }
+        return table;
+    }
+
+    // -1 if the class has no such member
+    int64_t find(int64_t class_id, int64_t member_id) const {
+        if (class_id < 0 || class_id >= class_count || member_id < 0 || member_id >= member_count) {
+            return -1;
+        }
+        return targets[class_id * member_count + member_id];
+    }
+};
+
 Entity make_entity(auto&& x) { return Entity { .value = x }; }
+
+// Scalars are kept inline, only strings and arrays need a box on the heap.
+inline std::optional<Value> unbox_scalar(const Entity& entity) {
+    return std::visit([](const auto& arg) -> std::optional<Value> {
+        using T = std::decay_t<decltype(arg)>;
+        if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, Owner<Array>>) {
+            return std::nullopt;
+        } else {
+            return Value(arg);
+        }
+    }, entity.value);
+}
+
+inline Entity parse_constant(const Constant& constant) {
+    switch (constant.type) {
+        case TYPE_INT64: {
+            int64_t value;
+            std::memcpy(&value, constant.data.data(), sizeof(int64_t));
+            return make_entity(value);
+        }
+        case TYPE_DOUBLE: {
+            double value;
+            std::memcpy(&value, constant.data.data(), sizeof(double));
+            return make_entity(value);
+        }
+        case TYPE_STRING: {
+            std::string value(constant.data.begin(), constant.data.end());
+            return make_entity(value);
+        }
+        case TYPE_UNIT:
+            return make_entity(unit{});
+        default:
+            throw std::runtime_error("Unknown constant type");
+    }
+}
+
+// Scalar results of arithmetic; integral promotions (e.g. bool + bool) collapse to int64.
+Value make_value(auto x) {
+    using T = decltype(x);
+    if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, unit>) {
+        return Value(x);
+    } else if constexpr (std::is_integral_v<T>) {
+        return Value(static_cast<int64_t>(x));
+    } else {
+        static_assert(std::is_floating_point_v<T>, "only scalars are stored inline");
+        return Value(static_cast<double>(x));
+    }
+}
 Entity make_array();
 
 struct ReleaseMod {};
 struct DebugMod {};
+// Image passed BytecodeVerifier: per-instruction operand and stack checks are compiled out.
+struct VerifiedMod {};
+// Verified image run with the top one or two operands cached in locals of the dispatch loop.
+struct TosCachedMod {};
+
+enum class DispatchMode {
+    SWITCH,
+    THREADED,
+};
 
 }
@@ -0,0 +1,225 @@
+#include "bytecode_verifier.h"
+#include "command_parser.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace umka::vm {
+BytecodeVerifier::BytecodeVerifier(
+    const std::vector<Command>& commands,
+    const std::vector<Constant>& const_pool,
+    const std::unordered_map<size_t, FunctionTableEntry>& func_table,
+    const std::vector<VMethodTableEntry>& vmethod_table
+)
+    : commands(commands)
+    , const_pool(const_pool)
+    , func_table(func_table)
+    , vmethod_table(vmethod_table)
+{}
+
+void BytecodeVerifier::verify() {
+    for (size_t id = 0; id < func_table.size(); ++id) {
+        current_function = id;
+        current_offset = -1;
+        auto it = func_table.find(id);
+        if (it == func_table.end()) {
+            fail("function table has a gap");
+        }
+        verify_entry(it->second);
+    }
+    for (const auto& method : vmethod_table) {
+        if (method.function_id < 0 || !func_table.contains(method.function_id)) {
+            current_function = 0;
+            current_offset = -1;
+            fail("vmethod table refers to unknown function " + std::to_string(method.function_id));
+        }
+    }
+
+    for (size_t id = 0; id < func_table.size(); ++id) {
+        current_function = id;
+        verify_function(func_table.at(id));
+    }
+}
+
+void BytecodeVerifier::verify(size_t function_id, const FunctionTableEntry& entry) {
+    current_function = function_id;
+    current_offset = -1;
+    verify_entry(entry);
+    verify_function(entry);
+}
+
+void BytecodeVerifier::verify_entry(const FunctionTableEntry& entry) {
+    if (entry.code_offset < 0 || entry.code_offset >= entry.code_offset_end ||
+        entry.code_offset_end > static_cast<int64_t>(commands.size())) {
+        fail("invalid code range [" + std::to_string(entry.code_offset) + ", " +
+             std::to_string(entry.code_offset_end) + ")");
+    }
+    if (entry.arg_count < 0 || entry.local_count < 0) {
+        fail("negative argument or local count");
+    }
+}
+
+void BytecodeVerifier::verify_function(const FunctionTableEntry& entry) {
+    const int64_t begin = entry.code_offset;
+    const int64_t end = entry.code_offset_end;
+
+    // operand stack depth relative to the frame entry, -1 while unvisited
+    std::vector<int64_t> depth(end - begin, -1);
+    std::vector<int64_t> worklist = { begin };
+    depth[0] = 0;
+
+    auto flow_to = [&](int64_t target, int64_t target_depth) {
+        if (target < begin || target >= end) {
+            fail("control flow leaves the function to offset " + std::to_string(target));
+        }
+        int64_t& known = depth[target - begin];
+        if (known == -1) {
+            known = target_depth;
+            worklist.push_back(target);
+        } else if (known != target_depth) {
+            fail("inconsistent stack depth at offset " + std::to_string(target) + ": " +
+                 std::to_string(known) + " vs " + std::to_string(target_depth));
+        }
+    };
+
+    while (!worklist.empty()) {
+        current_offset = worklist.back();
+        worklist.pop_back();
+
+        const Command& cmd = commands[current_offset];
+        const int64_t current_depth = depth[current_offset - begin];
+        const auto [pops, pushes] = stack_effect(cmd, entry);
+        if (current_depth < pops) {
+            fail("stack underflow: needs " + std::to_string(pops) + " operand(s), has " +
+                 std::to_string(current_depth));
+        }
+        const int64_t next_depth = current_depth - pops + pushes;
+
+        switch (cmd.code) {
+            case RETURN:
+            case TAIL_CALL:
+                break;
+            case JMP:
+                flow_to(current_offset + 1 + cmd.arg, next_depth);
+                break;
+            case JMP_IF_FALSE:
+            case JMP_IF_TRUE:
+                flow_to(current_offset + 1, next_depth);
+                flow_to(current_offset + 1 + cmd.arg, next_depth);
+                break;
+            default:
+                flow_to(current_offset + 1, next_depth);
+        }
+    }
+}
+
+BytecodeVerifier::StackEffect BytecodeVerifier::stack_effect(
+    const Command& cmd,
+    const FunctionTableEntry& entry
+) const {
+    switch (cmd.code) {
+        case PUSH_CONST:
+            if (cmd.arg < 0 || cmd.arg >= static_cast<int64_t>(const_pool.size())) {
+                fail("constant index " + std::to_string(cmd.arg) + " out of range");
+            }
+            return { 0, 1 };
+        case LOAD:
+        case STORE:
+            if (cmd.arg < 0 || cmd.arg >= entry.frame_size()) {
+                fail("local index " + std::to_string(cmd.arg) + " exceeds frame size " +
+                     std::to_string(entry.frame_size()));
+            }
+            return cmd.code == LOAD ? StackEffect{ 0, 1 } : StackEffect{ 1, 0 };
+        case POP:
+            return { 1, 0 };
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case REM:
+        case AND:
+        case OR:
+        case EQ:
+        case NEQ:
+        case GT:
+        case LT:
+        case GTE:
+        case LTE:
+        case OPCOT:
+            return { 2, 1 };
+        case NOT:
+        case TO_STRING:
+        case TO_DOUBLE:
+        case TO_INT:
+            return { 1, 1 };
+        case JMP:
+            return { 0, 0 };
+        case JMP_IF_FALSE:
+        case JMP_IF_TRUE:
+            return { 1, 0 };
+        case CALL:
+            return call_effect(cmd.arg);
+        case TAIL_CALL:
+            if (builtin_arity(cmd.arg) >= 0) {
+                fail("tail call to builtin " + std::to_string(cmd.arg));
+            }
+            return call_effect(cmd.arg);
+        case CALL_BUILTIN:
+            if (builtin_arity(cmd.arg) < 0) {
+                fail("call to unknown builtin " + std::to_string(cmd.arg));
+            }
+            return { builtin_arity(cmd.arg), 1 };
+        case CALL_METHOD:
+            return method_call_effect(cmd.arg);
+        case RETURN:
+            return { 1, 0 };
+        case BUILD_ARR:
+            if (cmd.arg < 0) {
+                fail("negative array size " + std::to_string(cmd.arg));
+            }
+            return { cmd.arg, 1 };
+        case GET_FIELD:
+            // object is consumed and pushed back above the field index
+            return { 1, 2 };
+        default:
+            fail("unknown " + opcode_name(cmd.code));
+    }
+}
+
+BytecodeVerifier::StackEffect BytecodeVerifier::call_effect(int64_t function_id) const {
+    if (int64_t arity = builtin_arity(function_id); arity >= 0) {
+        return { arity, 1 };
+    }
+    if (function_id < 0 || !func_table.contains(function_id)) {
+        fail("call to unknown function " + std::to_string(function_id));
+    }
+    return { func_table.at(function_id).arg_count, 1 };
+}
+
+BytecodeVerifier::StackEffect BytecodeVerifier::method_call_effect(int64_t method_id) const {
+    int64_t arity = -1;
+    for (const auto& method : vmethod_table) {
+        if (method.method_id != method_id) {
+            continue;
+        }
+        int64_t method_arity = func_table.at(method.function_id).arg_count;
+        if (arity != -1 && arity != method_arity) {
+            fail("method " + std::to_string(method_id) + " has overrides with different arity");
+        }
+        arity = method_arity;
+    }
+    if (arity == -1) {
+        fail("call to unknown method " + std::to_string(method_id));
+    }
+    return { arity, 1 };
+}
+
+void BytecodeVerifier::fail(const std::string& message) const {
+    std::string location = "function " + std::to_string(current_function);
+    if (current_offset >= 0) {
+        location += ", offset " + std::to_string(current_offset) + " (" +
+                    opcode_name(commands[current_offset].code) + ")";
+    }
+    throw std::runtime_error("Bytecode verification failed at " + location + ": " + message);
+}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../model/model.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace umka::vm {
+// Load-time check of a parsed image: every function is walked once with an abstract
+// operand stack, so jump targets, constant/local/function indices and stack depth are
+// known to be valid before StackMachine<VerifiedMod> runs without per-instruction checks.
+class BytecodeVerifier {
+public:
+    BytecodeVerifier(
+        const std::vector<Command>& commands,
+        const std::vector<Constant>& const_pool,
+        const std::unordered_map<size_t, FunctionTableEntry>& func_table,
+        const std::vector<VMethodTableEntry>& vmethod_table
+    );
+
+    // throws std::runtime_error describing the first violation
+    void verify();
+    // checks only `entry`, the function `function_id` whose code lies in `commands`; used for
+    // JIT output, which has its own code, constant table and local count
+    void verify(size_t function_id, const FunctionTableEntry& entry);
+
+private:
+    struct StackEffect {
+        int64_t pops;
+        int64_t pushes;
+    };
+
+    void verify_entry(const FunctionTableEntry& entry);
+    void verify_function(const FunctionTableEntry& entry);
+    StackEffect stack_effect(const Command& cmd, const FunctionTableEntry& entry) const;
+    StackEffect call_effect(int64_t function_id) const;
+    StackEffect method_call_effect(int64_t method_id) const;
+
+    [[noreturn]] void fail(const std::string& message) const;
+
+    const std::vector<Command>& commands;
+    const std::vector<Constant>& const_pool;
+    const std::unordered_map<size_t, FunctionTableEntry>& func_table;
+    const std::vector<VMethodTableEntry>& vmethod_table;
+
+    // location reported by fail()
+    size_t current_function = 0;
+    int64_t current_offset = -1;
+};
+}
@@ -180,6 +180,18 @@ std::unordered_map<size_t, FunctionTableEntry>&& CommandParser::extract_func_tab
 std::vector<VMethodTableEntry>&& CommandParser::extract_vmethod_table() { return std::move(vmethod_table); }
 std::vector<VFieldTableEntry>&& CommandParser::extract_vfield_table() { return std::move(vfield_table); }
 
+std::string opcode_name(uint8_t code) {
+    switch (code) {
+#define UMKA_OPCODE_NAME(op) \
+        case op: \
+            return #op;
+        for_all_opcodes(UMKA_OPCODE_NAME)
+#undef UMKA_OPCODE_NAME
+        default:
+            return "opcode " + std::to_string(code);
+    }
+}
+
 bool CommandParser::has_operand(uint8_t opcode) const {
     switch(static_cast<OpCode>(opcode)) {
         case OpCode::PUSH_CONST:
@@ -189,8 +201,9 @@ bool CommandParser::has_operand(uint8_t opcode) const {
         case OpCode::JMP_IF_FALSE:
         case OpCode::JMP_IF_TRUE:
         case OpCode::CALL:
+        case OpCode::CALL_BUILTIN:
+        case OpCode::TAIL_CALL:
         case OpCode::BUILD_ARR:
-        case OpCode::REM:
         case OpCode::CALL_METHOD:
         case OpCode::GET_FIELD:
             return true;
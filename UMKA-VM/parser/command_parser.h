@@ -4,9 +4,40 @@
 #include <cstdint>
 #include <vector>
 #include <istream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
 
 namespace umka::vm {
+// Superinstructions (name, opcode, component opcodes), generated by test/profile_sequences.py
+// from the dynamic opcode sequences of the example programs (`umka_vm --sequences`, profile in
+// test/superinstruction_profile.txt); do not edit by hand. The rule: sequences are ranked by the
+// dispatches fusing them saves, count * (length - 1), and the first 16 are taken, skipping one
+// that contains or is contained in a sequence already taken, as well as any with a component
+// that switches frames or a jump before the last component.
+// StackMachine fuses them at load time by writing the opcode over the first instruction of a
+// sequence; the operands stay in the arg of every component slot and the slots keep their
+// original instructions, so offsets and jump targets do not change.
+#define for_all_superinstructions(X) \
+    X(PUSH_CONST_LOAD_ADD, 0xC0, PUSH_CONST, LOAD, ADD) \
+    X(LOAD_LOAD, 0xC1, LOAD, LOAD) \
+    X(LOAD_GET_FIELD_CALL_BUILTIN, 0xC2, LOAD, GET_FIELD, CALL_BUILTIN) \
+    X(LOAD_ADD_LOAD_CALL_BUILTIN, 0xC3, LOAD, ADD, LOAD, CALL_BUILTIN) \
+    X(LOAD_ADD_STORE_JMP, 0xC4, LOAD, ADD, STORE, JMP) \
+    X(ADD_LOAD_CALL_BUILTIN_LOAD, 0xC5, ADD, LOAD, CALL_BUILTIN, LOAD) \
+    X(CALL_BUILTIN_POP_LOAD, 0xC6, CALL_BUILTIN, POP, LOAD) \
+    X(LOAD_CALL_BUILTIN_POP, 0xC7, LOAD, CALL_BUILTIN, POP) \
+    X(LOAD_SUB_SUB_LOAD, 0xC8, LOAD, SUB, SUB, LOAD) \
+    X(SUB_LOAD_LT_JMP_IF_FALSE, 0xC9, SUB, LOAD, LT, JMP_IF_FALSE) \
+    X(SUB_SUB_LOAD_LT, 0xCA, SUB, SUB, LOAD, LT) \
+    X(LOAD_CALL_BUILTIN_GT_JMP_IF_FALSE, 0xCB, LOAD, CALL_BUILTIN, GT, JMP_IF_FALSE) \
+    X(GET_FIELD_CALL_BUILTIN_LOAD_MUL, 0xCC, GET_FIELD, CALL_BUILTIN, LOAD, MUL) \
+    X(LOAD_MUL_MUL_LOAD, 0xCD, LOAD, MUL, MUL, LOAD) \
+    X(GET_FIELD_CALL_BUILTIN_POP, 0xCE, GET_FIELD, CALL_BUILTIN, POP) \
+    X(CALL_BUILTIN_STORE_PUSH_CONST_LOAD, 0xCF, CALL_BUILTIN, STORE, PUSH_CONST, LOAD)
+
 enum OpCode : uint8_t {
     PUSH_CONST = 0x01,
     POP = 0x02,
@@ -31,6 +62,8 @@ enum OpCode : uint8_t {
     JMP_IF_TRUE = 0x22,
     CALL = 0x23,
     RETURN = 0x24,
+    CALL_BUILTIN = 0x25,
+    TAIL_CALL = 0x26,
     BUILD_ARR = 0x30,
     OPCOT = 0x40,
     CALL_METHOD = 0x50,
@@ -38,8 +71,184 @@ enum OpCode : uint8_t {
     TO_STRING = 0x60,
     TO_DOUBLE = 0x61,
     TO_INT = 0x62,
+
+    // Typed forms of ADD..LTE, the interpreter rewrites a site into one of them at run time
+    // (see StackMachine::quicken); they are never emitted by the compiler.
+    ADD_I64_I64 = 0x80,
+    SUB_I64_I64 = 0x81,
+    MUL_I64_I64 = 0x82,
+    DIV_I64_I64 = 0x83,
+    REM_I64_I64 = 0x84,
+    EQ_I64_I64 = 0x8A,
+    NEQ_I64_I64 = 0x8B,
+    GT_I64_I64 = 0x8C,
+    LT_I64_I64 = 0x8D,
+    GTE_I64_I64 = 0x8E,
+    LTE_I64_I64 = 0x8F,
+    ADD_F64_F64 = 0xA0,
+    SUB_F64_F64 = 0xA1,
+    MUL_F64_F64 = 0xA2,
+    DIV_F64_F64 = 0xA3,
+    EQ_F64_F64 = 0xAA,
+    NEQ_F64_F64 = 0xAB,
+    GT_F64_F64 = 0xAC,
+    LT_F64_F64 = 0xAD,
+    GTE_F64_F64 = 0xAE,
+    LTE_F64_F64 = 0xAF,
+
+#define UMKA_SUPERINSTRUCTION_OPCODE(name, code, ...) name = code,
+    for_all_superinstructions(UMKA_SUPERINSTRUCTION_OPCODE)
+#undef UMKA_SUPERINSTRUCTION_OPCODE
 };
 
+#define for_all_opcodes(X) \
+    X(PUSH_CONST) \
+    X(POP) \
+    X(STORE) \
+    X(LOAD) \
+    X(ADD) \
+    X(SUB) \
+    X(MUL) \
+    X(DIV) \
+    X(REM) \
+    X(NOT) \
+    X(AND) \
+    X(OR) \
+    X(EQ) \
+    X(NEQ) \
+    X(GT) \
+    X(LT) \
+    X(GTE) \
+    X(LTE) \
+    X(JMP) \
+    X(JMP_IF_FALSE) \
+    X(JMP_IF_TRUE) \
+    X(CALL) \
+    X(RETURN) \
+    X(CALL_BUILTIN) \
+    X(TAIL_CALL) \
+    X(BUILD_ARR) \
+    X(OPCOT) \
+    X(CALL_METHOD) \
+    X(GET_FIELD) \
+    X(TO_STRING) \
+    X(TO_DOUBLE) \
+    X(TO_INT) \
+    X(ADD_I64_I64) \
+    X(SUB_I64_I64) \
+    X(MUL_I64_I64) \
+    X(DIV_I64_I64) \
+    X(REM_I64_I64) \
+    X(EQ_I64_I64) \
+    X(NEQ_I64_I64) \
+    X(GT_I64_I64) \
+    X(LT_I64_I64) \
+    X(GTE_I64_I64) \
+    X(LTE_I64_I64) \
+    X(ADD_F64_F64) \
+    X(SUB_F64_F64) \
+    X(MUL_F64_F64) \
+    X(DIV_F64_F64) \
+    X(EQ_F64_F64) \
+    X(NEQ_F64_F64) \
+    X(GT_F64_F64) \
+    X(LT_F64_F64) \
+    X(GTE_F64_F64) \
+    X(LTE_F64_F64)
+
+constexpr bool is_quickenable(uint8_t op) {
+    return (op >= ADD && op <= REM) || (op >= EQ && op <= LTE);
+}
+
+constexpr bool is_quickened(uint8_t op) {
+    return (op >= ADD_I64_I64 && op <= LTE_I64_I64) || (op >= ADD_F64_F64 && op <= LTE_F64_F64);
+}
+
+// ADD for ADD_I64_I64 and ADD_F64_F64, any other opcode maps to itself
+constexpr uint8_t generic_opcode(uint8_t op) {
+    return is_quickened(op) ? ADD + (op & 0x1F) : op;
+}
+
+// Typed form of a quickenable op for two operands of the given type, op itself if there is none
+constexpr uint8_t quickened_opcode(uint8_t op, ValueType type) {
+    if (type == ValueType::INT) {
+        return ADD_I64_I64 + (op - ADD);
+    }
+    if (type == ValueType::DOUBLE && op != REM) {
+        return ADD_F64_F64 + (op - ADD);
+    }
+    return op;
+}
+
+// Integer DIV and REM by zero raise the VM error instead of trapping the process, and so does
+// INT64_MIN / -1, the one quotient that overflows; INT64_MIN % -1 is 0. Every tier, native code
+// included, divides through typed_operation or the generic handler, and both come here.
+template<typename T>
+void check_divisor(const char* op_name, T divisor) {
+    if constexpr (std::is_integral_v<T>) {
+        if (divisor == 0) {
+            throw std::runtime_error(std::string(op_name) + ": integer division by zero");
+        }
+    }
+}
+
+template<typename L, typename R>
+auto checked_divide(L lhs, R rhs) {
+    if constexpr (std::is_integral_v<L>) {
+        check_divisor("DIV", rhs);
+    }
+    if constexpr (std::is_same_v<L, int64_t> && std::is_same_v<R, int64_t>) {
+        if (rhs == -1 && lhs == std::numeric_limits<int64_t>::min()) {
+            throw std::runtime_error("DIV: integer division overflow");
+        }
+    }
+    return lhs / rhs;
+}
+
+template<typename L, typename R>
+auto checked_remainder(L lhs, R rhs) {
+    check_divisor("REM", rhs);
+    if constexpr (std::is_same_v<R, int64_t>) {
+        if (rhs == -1) {
+            return decltype(lhs % rhs){ 0 };
+        }
+    }
+    return lhs % rhs;
+}
+
+// Result of a quickenable op on two operands of the same scalar type; lhs is the stack top
+template<uint8_t Op, typename T>
+Value typed_operation(T lhs, T rhs) {
+    if constexpr (Op == ADD) {
+        return Value(lhs + rhs);
+    } else if constexpr (Op == SUB) {
+        return Value(lhs - rhs);
+    } else if constexpr (Op == MUL) {
+        return Value(lhs * rhs);
+    } else if constexpr (Op == DIV) {
+        return Value(checked_divide(lhs, rhs));
+    } else if constexpr (Op == REM) {
+        return Value(checked_remainder(lhs, rhs));
+    } else if constexpr (Op == EQ) {
+        return Value(lhs == rhs);
+    } else if constexpr (Op == NEQ) {
+        return Value(lhs != rhs);
+    } else if constexpr (Op == GT) {
+        return Value(lhs > rhs);
+    } else if constexpr (Op == LT) {
+        return Value(lhs < rhs);
+    } else if constexpr (Op == GTE) {
+        return Value(lhs >= rhs);
+    } else if constexpr (Op == LTE) {
+        return Value(lhs <= rhs);
+    } else {
+        static_assert(Op != Op, "No typed form for opcode");
+    }
+}
+
+// "ADD", "LOAD", ... for the generic opcodes, "opcode <n>" for anything else
+std::string opcode_name(uint8_t code);
+
 class CommandParser {
 public:
     struct BytecodeHeader {
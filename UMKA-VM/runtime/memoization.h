@@ -0,0 +1,204 @@
+#pragma once
+
+#include <parser/command_parser.h>
+#include "model/model.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace umka::vm {
+// Builtins whose result depends on their arguments only and that change nothing.
+constexpr bool is_pure_builtin(int64_t id) {
+    switch (id) {
+        case LEN_FUN:
+        case GET_FUN:
+        case CONCAT_FUN:
+        case POW_FUN:
+        case SQRT_FUN:
+        case MIN_FUN:
+        case MAX_FUN:
+        case SPLIT_FUN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Marks the functions of a linked image whose result depends on their arguments only: no I/O,
+// random or array changing builtins, no objects, methods or arrays of their own, and calls
+// to pure functions only. Every function starts out pure and loses it with its first impure
+// instruction or callee, so recursion alone keeps a function pure.
+inline std::vector<bool> find_pure_functions(
+    const std::vector<Command>& commands,
+    const std::unordered_map<size_t, FunctionTableEntry>& func_table
+) {
+    const size_t count = func_table.size();
+    std::vector<bool> pure(count, true);
+    std::vector<std::vector<size_t>> callers(count);
+    std::vector<size_t> impure;
+
+    for (size_t id = 0; id < count; ++id) {
+        const FunctionTableEntry& entry = func_table.at(id);
+        for (int64_t offset = entry.code_offset; offset < entry.code_offset_end && pure[id]; ++offset) {
+            const Command& cmd = commands[offset];
+            switch (cmd.code) {
+                case CALL:
+                case TAIL_CALL:
+                    callers[cmd.arg].push_back(id);
+                    break;
+                case CALL_BUILTIN:
+                    pure[id] = is_pure_builtin(cmd.arg);
+                    break;
+                case BUILD_ARR:
+                case CALL_METHOD:
+                case GET_FIELD:
+                    pure[id] = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (!pure[id]) {
+            impure.push_back(id);
+        }
+    }
+
+    while (!impure.empty()) {
+        const size_t callee = impure.back();
+        impure.pop_back();
+        for (size_t caller : callers[callee]) {
+            if (pure[caller]) {
+                pure[caller] = false;
+                impure.push_back(caller);
+            }
+        }
+    }
+    return pure;
+}
+
+// Bounded result cache of one pure function, consulted by StackMachine::call_function. The
+// cache stays off for the first kWarmupCalls calls, and a cache that answers fewer than one
+// in kMinHitRatio of the next kProbeCalls lookups turns off for good: the arguments of that
+// function hardly repeat. Only calls whose arguments and result are all scalars are cached.
+//
+// Entries are direct mapped. A miss reserves the entry of its arguments under a fresh ticket
+// and the returning call fills it only if the ticket is still there, so a recursive call that
+// took the same entry in between does not get the outer result stored under its arguments.
+class MemoCache {
+  public:
+    static constexpr size_t kMaxArgs = 4;
+    static constexpr size_t kEntries = 1024;
+    static constexpr int64_t kWarmupCalls = 256;
+    static constexpr int64_t kProbeCalls = 4096;
+    static constexpr int64_t kMinHitRatio = 16;
+
+    enum class Lookup { SKIP, HIT, MISS };
+
+    explicit MemoCache(int64_t arg_count) : arg_count(static_cast<size_t>(arg_count)) {}
+
+    static bool fits(int64_t arg_count) {
+        return arg_count >= 0 && static_cast<size_t>(arg_count) <= kMaxArgs;
+    }
+
+    // `args` are the arguments as they lie on the operand stack. HIT sets `result`, MISS
+    // reserves an entry that fill() with the same `ticket` completes.
+    Lookup lookup(const Value* args, Value& result, uint32_t& slot, uint64_t& ticket) {
+        if (state == State::OFF || ++calls <= kWarmupCalls) {
+            return Lookup::SKIP;
+        }
+        uint64_t hash = arg_count;
+        for (size_t i = 0; i < arg_count; ++i) {
+            if (args[i].is_boxed()) {
+                return Lookup::SKIP;
+            }
+            hash = (hash ^ bits(args[i]) ^ static_cast<uint64_t>(args[i].type)) * 0x9E3779B97F4A7C15ull;
+        }
+        if (entries.empty()) {
+            entries.resize(kEntries);
+        }
+
+        slot = static_cast<uint32_t>((hash >> 32) % kEntries);
+        Entry& entry = entries[slot];
+        if (entry.filled && same_args(entry, args)) {
+            ++hits;
+            result = entry.result;
+            probe();
+            return Lookup::HIT;
+        }
+        probe();
+        if (state == State::OFF) {
+            return Lookup::SKIP;
+        }
+        entry.ticket = ticket = ++next_ticket;
+        entry.filled = false;
+        std::copy(args, args + arg_count, entry.args.begin());
+        return Lookup::MISS;
+    }
+
+    void fill(uint32_t slot, uint64_t ticket, const Value& result) {
+        if (slot >= entries.size() || result.is_boxed()) {
+            return;
+        }
+        Entry& entry = entries[slot];
+        if (entry.ticket == ticket) {
+            entry.result = result;
+            entry.filled = true;
+        }
+    }
+
+  private:
+    enum class State { PROBING, ON, OFF };
+
+    struct Entry {
+        uint64_t ticket = 0;
+        bool filled = false;
+        std::array<Value, kMaxArgs> args;
+        Value result;
+    };
+
+    // the payload of a scalar, unset union bytes excluded
+    static uint64_t bits(const Value& value) {
+        switch (value.type) {
+            case ValueType::INT:
+                return static_cast<uint64_t>(value.i);
+            case ValueType::DOUBLE:
+                return std::bit_cast<uint64_t>(value.d);
+            case ValueType::BOOL:
+                return value.b;
+            default:
+                return 0;
+        }
+    }
+
+    bool same_args(const Entry& entry, const Value* args) const {
+        for (size_t i = 0; i < arg_count; ++i) {
+            if (entry.args[i].type != args[i].type || bits(entry.args[i]) != bits(args[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void probe() {
+        if (state != State::PROBING || ++lookups < kProbeCalls) {
+            return;
+        }
+        state = hits * kMinHitRatio >= lookups ? State::ON : State::OFF;
+        if (state == State::OFF) {
+            entries = {};
+        }
+    }
+
+    const size_t arg_count;
+    State state = State::PROBING;
+    int64_t calls = 0;
+    int64_t lookups = 0;
+    int64_t hits = 0;
+    uint64_t next_ticket = 0;
+    std::vector<Entry> entries;
+};
+}
@@ -10,12 +10,12 @@
 
 namespace umka::vm {
 #define if_get_then_apply_op(T, S) \
-    if (std::get_if<T>(&a.value) && std::get_if<S>(&b.value)) { \
-        return make_entity(op(std::get<T>(a.value), std::get<S>(b.value))); \
+    if (a.get_if<T>() && b.get_if<S>()) { \
+        return make_value(op(*a.get_if<T>(), *b.get_if<S>())); \
     }
 
 template<typename F>
-Entity numeric_applier(Entity a, Entity b, F op) {
+Value numeric_applier(Value a, Value b, F op) {
     if_get_then_apply_op(int64_t, int64_t)
     if_get_then_apply_op(int64_t, double)
     if_get_then_apply_op(int64_t, bool)
@@ -32,7 +32,7 @@ Entity numeric_applier(Entity a, Entity b, F op) {
 }
 
 template<typename F>
-Entity mod_applier(Entity a, Entity b, F op) {
+Value mod_applier(Value a, Value b, F op) {
     if_get_then_apply_op(int64_t, int64_t)
     if_get_then_apply_op(bool, int64_t)
     if_get_then_apply_op(bool, bool)
@@ -42,12 +42,12 @@ Entity mod_applier(Entity a, Entity b, F op) {
 #undef if_get_then_apply_op
 
 #define if_get_then_apply_unary_op(T) \
-    if (auto* val = std::get_if<T>(&a.value)) { \
-        return make_entity(op(*val)); \
+    if (auto* val = a.get_if<T>()) { \
+        return make_value(op(*val)); \
     }
 
 template<typename F>
-Entity unary_applier(Entity a, F op) {
+Value unary_applier(Value a, F op) {
     if_get_then_apply_unary_op(int64_t)
     if_get_then_apply_unary_op(double)
     if_get_then_apply_unary_op(bool)
@@ -58,8 +58,8 @@ Entity unary_applier(Entity a, F op) {
 #undef if_get_then_apply_unary_op
 
 template <typename T>
-T umka_cast(Entity a) {
-    T new_value = std::visit([a](auto value) -> T {
+T umka_cast(const Value& a) {
+    T new_value = a.visit([&a](const auto& value) -> T {
         if constexpr (std::is_convertible_v<std::decay_t<decltype(value)>, T>) {
             return static_cast<T>(value);
         } else if constexpr (std::is_same_v<T, std::string>) {
@@ -81,7 +81,7 @@ T umka_cast(Entity a) {
         } else {
             throw std::runtime_error("Bad cast in umka_cast");
         }
-    }, a.value);
+    });
     return new_value;
 }
 }
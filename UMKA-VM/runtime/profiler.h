@@ -1,13 +1,71 @@
 #pragma once
 
 #include <model/model.h>
+#include <tier.h>
 
 #include <algorithm>
+#include <charconv>
 #include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 namespace umka::vm {
+// When functions move up the JIT tiers. Calls and taken backward jumps add their weight to the
+// hotness of a function, and every decay_period such events all hotness is halved, so code that
+// was hot once but no longer runs stops climbing. A threshold of 0 disables its tier.
+struct TieringPolicy {
+    int64_t call_weight = 1;
+    int64_t loop_weight = 1;
+    int64_t baseline_threshold = 1000;
+    int64_t optimize_threshold = 10000;
+    int64_t decay_period = 1 << 20;
+    // backward jumps between attempts to trace a loop or to replace its frame
+    int64_t trace_threshold = 1000;
+
+    static TieringPolicy parse(std::string_view spec) {
+        return parse(spec, TieringPolicy{});
+    }
+
+    // "off", or comma separated key=value pairs over `base`:
+    // call, loop, baseline, optimize, decay, trace
+    static TieringPolicy parse(std::string_view spec, TieringPolicy base) {
+        if (spec == "off") {
+            base.baseline_threshold = 0;
+            base.optimize_threshold = 0;
+            return base;
+        }
+        while (!spec.empty()) {
+            const std::string_view item = spec.substr(0, spec.find(','));
+            spec.remove_prefix(std::min(spec.size(), item.size() + 1));
+            const size_t eq = item.find('=');
+            const std::string_view key = item.substr(0, eq);
+            int64_t value = -1;
+            if (eq != std::string_view::npos) {
+                const std::string_view text = item.substr(eq + 1);
+                auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (error != std::errc() || end != text.data() + text.size()) {
+                    value = -1;
+                }
+            }
+            int64_t* field = key == "call"     ? &base.call_weight
+                           : key == "loop"     ? &base.loop_weight
+                           : key == "baseline" ? &base.baseline_threshold
+                           : key == "optimize" ? &base.optimize_threshold
+                           : key == "decay"    ? &base.decay_period
+                           : key == "trace"    ? &base.trace_threshold
+                                               : nullptr;
+            if (field == nullptr || value < 0 || (field == &base.trace_threshold && value == 0)) {
+                throw std::runtime_error("Invalid JIT policy entry: " + std::string(item));
+            }
+            *field = value;
+        }
+        return base;
+    }
+};
+
 class Profiler
 {
   public:
@@ -18,60 +76,103 @@ class Profiler
         int64_t jump_count;
     };
 
-    Profiler(const std::unordered_map<size_t, FunctionTableEntry>& func_table, const std::vector<Command>& commands)
-      : func_table(func_table)
+    struct HotSequence {
+        std::vector<uint8_t> opcodes;
+        int64_t count;
+    };
+
+    // What a taken backward jump asks of the machine.
+    struct LoopEvent {
+        // the loop ran another trace_threshold times
+        bool hot;
+        // the function just became hot enough for this tier, INTERPRETED if not
+        jit::Tier tier;
+        int64_t hotness;
+    };
+
+    Profiler(const std::unordered_map<size_t, FunctionTableEntry>& func_table, const std::vector<Command>& commands,
+             const TieringPolicy& policy = {})
+      : policy(policy)
+      , func_table(func_table)
       , commands(commands)
     {
         for (const auto& [id, func] : func_table) {
-            function_call_counts[id] = 0;
+            counter_slots[id] = call_counts.size();
+            call_counts.push_back(0);
         }
+        hotness.resize(call_counts.size());
+        tiers.resize(call_counts.size(), jit::Tier::INTERPRETED);
     }
 
-    void increment_function_call(uint64_t function_id) { 
-        function_call_counts.at(function_id)++;
+    // Resolved once per function at link time, calls then count by slot without hashing.
+    size_t counter_slot(uint64_t function_id) const {
+        return counter_slots.at(function_id);
     }
 
-    void record_backward_jump(size_t jump_source_offset, size_t jump_target_offset, size_t func_id) {
-        if (jump_target_offset < jump_source_offset) {
-            // Backward jump
-            backward_jumps[jump_source_offset] = jump_target_offset;
-            function_of_jump[jump_source_offset] = func_id;
-            if (backward_jump_counts.find(jump_source_offset) == backward_jump_counts.end()) {
-                backward_jump_counts[jump_source_offset] = 0;
-            }
-            backward_jump_counts[jump_source_offset]++;
+    // Returns the tier the function just became hot enough for, INTERPRETED if none.
+    jit::Tier increment_function_call(size_t slot) {
+        ++call_counts[slot];
+        return heat(slot, policy.call_weight);
+    }
+
+    // Counts a taken jump; only backward ones heat their function. Offsets are relative to the
+    // code the frame runs, a jitted copy has offsets of its own, so jumps are told apart by
+    // function as well.
+    LoopEvent record_backward_jump(size_t jump_source_offset, size_t jump_target_offset, size_t func_id) {
+        if (jump_target_offset >= jump_source_offset) {
+            return { false, jit::Tier::INTERPRETED, 0 };
+        }
+        auto [it, inserted] = backward_jumps.try_emplace((uint64_t{ func_id } << 32) | jump_source_offset);
+        BackwardJump& jump = it->second;
+        if (inserted) {
+            jump.target_offset = jump_target_offset;
+            jump.func_id = func_id;
+            const auto slot = counter_slots.find(func_id);
+            jump.slot = slot != counter_slots.end() ? slot->second : kNoSlot;
+        }
+        const bool hot = ++jump.count % policy.trace_threshold == 0;
+        if (jump.slot == kNoSlot) {
+            return { hot, jit::Tier::INTERPRETED, 0 };
         }
+        const jit::Tier tier = heat(jump.slot, policy.loop_weight);
+        return { hot, tier, hotness[jump.slot] };
     }
 
-    bool is_function_hot(const uint64_t function_id) const {
-        auto it = function_call_counts.find(function_id);
-        if (it == function_call_counts.end()) {
-            return false;
+    // Counts the opcode sequences of length 2..kMaxSequenceLength ending at this instruction.
+    void record_instruction(uint8_t opcode) {
+        recent_opcodes = (recent_opcodes << 8) | opcode;
+        recent_count = std::min(recent_count + 1, kMaxSequenceLength);
+        for (size_t length = 2; length <= recent_count; ++length) {
+            const uint64_t mask = (uint64_t{ 1 } << (8 * length)) - 1;
+            ++sequence_counts[(uint64_t{ length } << 32) | (recent_opcodes & mask)];
         }
-        return it->second > threshold;
+    }
+
+    int64_t function_hotness(size_t slot) const {
+        return hotness[slot];
     }
 
     std::vector<HotRegion> get_hot_regions(size_t top_n = 10) const {
         std::vector<HotRegion> regions;
 
-        for (const auto& [jump_offset, target_offset] : backward_jumps) {
-            int64_t jump_count = backward_jump_counts.at(jump_offset);
-            size_t func_id = function_of_jump.at(jump_offset);
+        for (const auto& [jump_offset, jump] : backward_jumps) {
+            int64_t jump_count = jump.count;
+            size_t func_id = jump.func_id;
 
             regions.push_back(HotRegion{ 
                 static_cast<size_t>(func_table.at(func_id).code_offset),
                 static_cast<size_t>(func_table.at(func_id).code_offset_end),
-                function_call_counts.at(func_id),
+                call_count(func_id),
                 jump_count 
             });
         }
 
         for (const auto& [id, func] : func_table) {
-            if (function_call_counts.at(id) > 0) {
+            if (call_count(id) > 0) {
                 regions.push_back(HotRegion{ 
                     static_cast<size_t>(func.code_offset),
                     static_cast<size_t>(func.code_offset_end),
-                    function_call_counts.at(id),
+                    call_count(id),
                     1 
                 });
             }
@@ -90,13 +191,79 @@ class Profiler
         return regions;
     }
 
+    // Most frequent recorded sequences, used to pick the superinstruction catalogue.
+    std::vector<HotSequence> get_hot_sequences(size_t top_n = 10) const {
+        std::vector<HotSequence> sequences;
+        for (const auto& [key, count] : sequence_counts) {
+            const size_t length = key >> 32;
+            HotSequence sequence{ std::vector<uint8_t>(length), count };
+            for (size_t i = 0; i < length; ++i) {
+                sequence.opcodes[length - 1 - i] = static_cast<uint8_t>(key >> (8 * i));
+            }
+            sequences.push_back(std::move(sequence));
+        }
+
+        std::sort(sequences.begin(), sequences.end(), [](const HotSequence& a, const HotSequence& b) {
+            return a.count > b.count;
+        });
+
+        if (sequences.size() > top_n) {
+            sequences.resize(top_n);
+        }
+
+        return sequences;
+    }
+
   private:
-    const size_t threshold = 300000000000;
+    struct BackwardJump {
+        size_t target_offset = 0;
+        size_t func_id = 0;
+        size_t slot = 0;
+        int64_t count = 0;
+    };
+
+    static constexpr size_t kMaxSequenceLength = 4;
+    // jumps of frames whose function is not in the table are counted but heat nothing
+    static constexpr size_t kNoSlot = SIZE_MAX;
+
+    int64_t call_count(uint64_t function_id) const {
+        return call_counts[counter_slots.at(function_id)];
+    }
+
+    // Each tier is reported once, the first time the hotness of the function reaches it.
+    jit::Tier heat(size_t slot, int64_t weight) {
+        if (policy.decay_period > 0 && ++events_since_decay >= policy.decay_period) {
+            events_since_decay = 0;
+            for (int64_t& score : hotness) {
+                score /= 2;
+            }
+        }
+        const int64_t score = hotness[slot] += weight;
+        const jit::Tier reached = reaches(score, policy.optimize_threshold) ? jit::Tier::OPTIMIZED
+                                : reaches(score, policy.baseline_threshold) ? jit::Tier::BASELINE
+                                                                              : jit::Tier::INTERPRETED;
+        if (reached <= tiers[slot]) {
+            return jit::Tier::INTERPRETED;
+        }
+        tiers[slot] = reached;
+        return reached;
+    }
+
+    static bool reaches(int64_t score, int64_t threshold) {
+        return threshold > 0 && score >= threshold;
+    }
+
+    const TieringPolicy policy;
     const std::unordered_map<size_t, FunctionTableEntry>& func_table;
     const std::vector<Command>& commands;
-    std::unordered_map<uint64_t, int64_t> function_call_counts;
-    std::unordered_map<size_t, size_t> backward_jumps;   // jump_offset -> target_offset
-    std::unordered_map<size_t, size_t> function_of_jump; // jump_offset -> function_start_offset
-    std::unordered_map<size_t, int64_t> backward_jump_counts;
+    std::unordered_map<uint64_t, size_t> counter_slots;
+    std::vector<int64_t> call_counts;
+    std::vector<int64_t> hotness;
+    std::vector<jit::Tier> tiers; // highest tier reported for each slot
+    int64_t events_since_decay = 0;
+    std::unordered_map<uint64_t, BackwardJump> backward_jumps; // (func_id << 32) | jump_offset -> loop it closes
+    uint64_t recent_opcodes = 0; // last opcodes, newest in the low byte
+    size_t recent_count = 0;
+    std::unordered_map<uint64_t, int64_t> sequence_counts; // (length << 32) | packed opcodes
 };
 }
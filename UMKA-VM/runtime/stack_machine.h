@@ -4,13 +4,18 @@
 #include <parser/command_parser.h>
 #include "model/model.h"
 #include "operations.h"
+#include "memoization.h"
 #include "profiler.h"
 #include "standart_funcs.h"
 #include <jit_manager.h>
+#include <trace_compiler.h>
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <ranges>
@@ -18,60 +23,105 @@
 #include <string>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace umka::vm {
-#define CHECK_REF(ref) \
-    if ((ref).expired()) { \
-        throw std::runtime_error("Reference expired at " + std::string(__FILE__) + ":" + std::to_string(__LINE__)); \
-    }
-
 #define CHECK_STACK_EMPTY(op_name) \
-    if (operand_stack.empty()) { \
-        throw std::runtime_error("Stack underflow at operation: " + op_name); \
+    if (runtime_checks && operand_stack.empty()) { \
+        throw std::runtime_error(std::string("Stack underflow at operation: ") + op_name); \
     }
 
+#if defined(__GNUC__) || defined(__clang__)
+#define UMKA_HAS_COMPUTED_GOTO 1
+#else
+#define UMKA_HAS_COMPUTED_GOTO 0
+#endif
 
 template<typename Tag = ReleaseMod>
 class StackMachine
 {
   public:
-    StackMachine(auto&& parser)
+    StackMachine(auto&& parser, DispatchMode dispatch_mode = DispatchMode::THREADED, const TieringPolicy& tiering = {})
       : commands(std::move(parser.extract_commands()))
       , const_pool(std::move(parser.extract_const_pool()))
       , func_table(std::move(parser.extract_func_table()))
       , vmethod_table(std::move(parser.extract_vmethod_table()))
       , vfield_table(std::move(parser.extract_vfield_table()))
-      , profiler(std::make_unique<Profiler>(func_table, commands))
+      , profiler(std::make_unique<Profiler>(func_table, commands, tiering))
       , garbage_collector()
-      , jit_manager(std::make_unique<jit::JitManager>(commands, const_pool, func_table))
+      , jit_manager(std::make_unique<jit::JitManager>(jit_commands, const_pool, func_table, vmethod_table))
+      , dispatch_mode(dispatch_mode)
     {
-        
+        materialize_constants();
+        link_functions();
+        // the interpreter quickens commands in place, the JIT compiles from untouched bytecode
+        jit_commands = commands;
+        std::vector<std::tuple<int64_t, int64_t, int64_t>> members;
         for (const auto& entry : vmethod_table) {
-            vmethod_map[{ entry.class_id, entry.method_id }] = entry.function_id;
+            members.emplace_back(entry.class_id, entry.method_id, entry.function_id);
         }
+        vmethods = MemberTable::build(members);
+        members.clear();
         for (const auto& entry : vfield_table) {
-            vfield_map[{ entry.class_id, entry.field_id }] = entry.field_index;
+            members.emplace_back(entry.class_id, entry.field_id, entry.field_index);
         }
+        vfields = MemberTable::build(members);
+        command_caches = make_inline_caches(commands);
+        fuse_superinstructions(commands);
+        traces.resize(commands.size());
+
         stack_of_functions.emplace_back(StackFrame{
             .name = 0,
             .instruction_ptr = commands.begin(),
             .begin = commands.begin(),
             .end = commands.end(),
-            .name_resolver = {},
+            .locals_base = 0,
+            .inline_caches = &command_caches,
+            .constants = &constants,
         });
+        if (!functions.empty()) {
+            locals.resize(functions[0].frame_size);
+        }
     }
 
     using debugger_t = std::function<void(Command, std::string)>;
-    void run(debugger_t debugger = [](auto, auto) {}) {
+    // without a debugger DebugMod only profiles, the stack top is not rendered per instruction
+    void run(debugger_t debugger = {}) {
         if constexpr (std::is_same_v<Tag, DebugMod>) {
             print_debug_parsed_info();
         }
 
-        while (!stack_of_functions.empty()) {
+#if UMKA_HAS_COMPUTED_GOTO
+        if constexpr (std::is_same_v<Tag, TosCachedMod>) {
+            run_tos_cached();
+            return;
+        }
+        if (dispatch_mode == DispatchMode::THREADED) {
+            run_threaded(debugger);
+            return;
+        }
+#endif
+        run_switch(debugger);
+    }
+
+    Profiler* get_profiler() { return profiler.get(); }
+
+    size_t call_depth() const { return stack_of_functions.size(); }
+
+    bool has_trace(size_t header) const { return header < traces.size() && traces[header].trace != nullptr; }
+
+  private:
+    // Verified images (see BytecodeVerifier) skip operand, stack and range checks. Jitted code
+    // is verified by JitRunner before it is published, so its frames skip them too.
+    static constexpr bool runtime_checks = !std::is_same_v<Tag, VerifiedMod> && !std::is_same_v<Tag, TosCachedMod>;
+
+    // Runs until the frame stack is back to `depth` frames, nested runs serve register code calls.
+    void run_switch(debugger_t& debugger, size_t depth = 0) {
+        while (stack_of_functions.size() > depth) {
             StackFrame& current_frame = stack_of_functions.back();
             if (current_frame.instruction_ptr >= current_frame.end) {
-                stack_of_functions.pop_back();
+                pop_frame();
                 continue;
             }
 
@@ -80,16 +130,304 @@ class StackMachine
             ++current_frame.instruction_ptr;
 
             if constexpr (std::is_same_v<Tag, DebugMod>) {
-                auto entity = stack_lookup();
-                debugger(*it, entity.has_value() ? entity.value().to_string() : "EMPTY STACK");
+                profiler->record_instruction(generic_opcode(it->code));
+                if (debugger) {
+                    auto entity = stack_lookup();
+                    debugger(*it, entity.has_value() ? entity.value().to_string() : "EMPTY STACK");
+                }
             }
             execute_command(*it, current_frame, current_offset);
         }
     }
 
-    Profiler* get_profiler() { return profiler.get(); }
+#if UMKA_HAS_COMPUTED_GOTO
+    // Direct-threaded dispatch: every code vector is translated once into an array of
+    // handler addresses, so each instruction costs a single indirect jump.
+    void run_threaded(debugger_t& debugger) {
+        const void* handlers[256];
+        std::fill(std::begin(handlers), std::end(handlers), &&op_unknown);
+#define UMKA_BIND_HANDLER(op) handlers[op] = &&op_##op;
+        for_all_opcodes(UMKA_BIND_HANDLER)
+#undef UMKA_BIND_HANDLER
+#define UMKA_BIND_SUPERINSTRUCTION(name, code, ...) handlers[name] = &&op_##name;
+        for_all_superinstructions(UMKA_BIND_SUPERINSTRUCTION)
+#undef UMKA_BIND_SUPERINSTRUCTION
+
+        StackFrame* frame = nullptr;
+        std::vector<Command>::iterator current;
+        size_t current_offset = 0;
+
+#define UMKA_DISPATCH() \
+        do { \
+            current = frame->instruction_ptr++; \
+            current_offset = std::distance(frame->begin, current); \
+            if constexpr (std::is_same_v<Tag, DebugMod>) { \
+                if (current < frame->end) { \
+                    profiler->record_instruction(generic_opcode(current->code)); \
+                    if (debugger) { \
+                        auto entity = stack_lookup(); \
+                        debugger(*current, entity.has_value() ? entity.value().to_string() : "EMPTY STACK"); \
+                    } \
+                } \
+            } \
+            goto *frame->threaded_code[current_offset]; \
+        } while (false)
+
+      reload_frame:
+        if (stack_of_functions.empty()) {
+            return;
+        }
+        frame = &stack_of_functions.back();
+        if (frame->threaded_code == nullptr) {
+            frame->threaded_code = translate_threaded(*frame, handlers, &&op_end_of_code);
+        }
+        UMKA_DISPATCH();
+
+#define UMKA_THREADED_HANDLER(op) \
+      op_##op: \
+        execute<op>(*current, *frame, current_offset); \
+        if constexpr (changes_frame(op)) { \
+            goto reload_frame; \
+        } \
+        if constexpr (is_quickenable(op) || is_quickened(op)) { \
+            if (current->code != op) { \
+                frame->threaded_code[current_offset] = handlers[current->code]; \
+            } \
+        } \
+        UMKA_DISPATCH();
+        for_all_opcodes(UMKA_THREADED_HANDLER)
+#undef UMKA_THREADED_HANDLER
+
+#define UMKA_THREADED_SUPERINSTRUCTION(name, code, ...) \
+      op_##name: \
+        execute_fused<__VA_ARGS__>(*current, *frame, current_offset); \
+        if constexpr (any_changes_frame<__VA_ARGS__>()) { \
+            goto reload_frame; \
+        } \
+        UMKA_DISPATCH();
+        for_all_superinstructions(UMKA_THREADED_SUPERINSTRUCTION)
+#undef UMKA_THREADED_SUPERINSTRUCTION
+
+      op_end_of_code:
+        pop_frame();
+        goto reload_frame;
+
+      op_unknown:
+        throw std::runtime_error("Unknown opcode: " + std::to_string(current->code) + " at " +
+                                 std::to_string(current_offset));
+#undef UMKA_DISPATCH
+    }
+
+    // Top-of-stack caching: up to two topmost operands live in `top` and `second` instead of
+    // operand_stack. Every cached handler exists once per cache state (0, 1 or 2 values) and
+    // dispatches through the table of the state it leaves; instructions without a cached form
+    // spill the cache and run the shared handler with an empty cache.
+    void run_tos_cached() {
+#define UMKA_FOR_CACHED_BINARY(X) X(ADD) X(SUB) X(MUL) X(DIV) X(REM) X(EQ) X(NEQ) X(GT) X(LT) X(GTE) X(LTE)
+        const void* handlers[3][256];
+        std::fill(&handlers[0][0], &handlers[0][0] + 3 * 256, &&op_unknown);
+#define UMKA_BIND_SPILLING(op) \
+        handlers[0][op] = &&op_##op; \
+        handlers[1][op] = &&spill_1; \
+        handlers[2][op] = &&spill_2;
+        for_all_opcodes(UMKA_BIND_SPILLING)
+#undef UMKA_BIND_SPILLING
+#define UMKA_BIND_CACHED(op) \
+        handlers[0][op] = &&s0_##op; \
+        handlers[1][op] = &&s1_##op; \
+        handlers[2][op] = &&s2_##op;
+        UMKA_BIND_CACHED(PUSH_CONST)
+        UMKA_BIND_CACHED(LOAD)
+        UMKA_BIND_CACHED(STORE)
+        UMKA_BIND_CACHED(POP)
+        UMKA_BIND_CACHED(JMP)
+        UMKA_BIND_CACHED(JMP_IF_FALSE)
+        UMKA_BIND_CACHED(JMP_IF_TRUE)
+#undef UMKA_BIND_CACHED
+#define UMKA_BIND_CACHED_BINARY(op) \
+        for (int state = 0; state < 3; ++state) { \
+            handlers[state][quickened_opcode(op, ValueType::INT)] = handlers[state][op] = \
+                state == 0 ? &&s0_##op : state == 1 ? &&s1_##op : &&s2_##op; \
+            if (op != REM) { \
+                handlers[state][quickened_opcode(op, ValueType::DOUBLE)] = handlers[state][op]; \
+            } \
+        }
+        UMKA_FOR_CACHED_BINARY(UMKA_BIND_CACHED_BINARY)
+#undef UMKA_BIND_CACHED_BINARY
+
+        StackFrame* frame = nullptr;
+        std::vector<Command>::iterator current;
+        Value top;
+        Value second;
+
+#define UMKA_TOS_DISPATCH(state) \
+        do { \
+            current = frame->instruction_ptr++; \
+            if (current >= frame->end) { \
+                goto end_of_code_##state; \
+            } \
+            goto *handlers[state][current->code]; \
+        } while (false)
+
+      reload_frame:
+        if (stack_of_functions.empty()) {
+            return;
+        }
+        frame = &stack_of_functions.back();
+        UMKA_TOS_DISPATCH(0);
+
+      spill_2:
+        operand_stack.push_back(second);
+      spill_1:
+        operand_stack.push_back(top);
+        goto *handlers[0][current->code];
+
+#define UMKA_SPILLING_HANDLER(op) \
+      op_##op: \
+        execute<op>(*current, *frame, std::distance(frame->begin, current)); \
+        if constexpr (changes_frame(op)) { \
+            goto reload_frame; \
+        } \
+        UMKA_TOS_DISPATCH(0);
+        for_all_opcodes(UMKA_SPILLING_HANDLER)
+#undef UMKA_SPILLING_HANDLER
+
+      s0_PUSH_CONST:
+        top = constant_at(*frame->constants, current->arg);
+        UMKA_TOS_DISPATCH(1);
+      s1_PUSH_CONST:
+        second = top;
+        top = constant_at(*frame->constants, current->arg);
+        UMKA_TOS_DISPATCH(2);
+      s2_PUSH_CONST:
+        operand_stack.push_back(second);
+        second = top;
+        top = constant_at(*frame->constants, current->arg);
+        UMKA_TOS_DISPATCH(2);
+
+      s0_LOAD:
+        top = locals[frame->locals_base + current->arg];
+        UMKA_TOS_DISPATCH(1);
+      s1_LOAD:
+        second = top;
+        top = locals[frame->locals_base + current->arg];
+        UMKA_TOS_DISPATCH(2);
+      s2_LOAD:
+        operand_stack.push_back(second);
+        second = top;
+        top = locals[frame->locals_base + current->arg];
+        UMKA_TOS_DISPATCH(2);
+
+      s0_STORE:
+        locals[frame->locals_base + current->arg] = operand_stack.back();
+        operand_stack.pop_back();
+        UMKA_TOS_DISPATCH(0);
+      s1_STORE:
+        locals[frame->locals_base + current->arg] = top;
+        UMKA_TOS_DISPATCH(0);
+      s2_STORE:
+        locals[frame->locals_base + current->arg] = top;
+        top = second;
+        UMKA_TOS_DISPATCH(1);
+
+      s0_POP:
+        operand_stack.pop_back();
+        UMKA_TOS_DISPATCH(0);
+      s1_POP:
+        UMKA_TOS_DISPATCH(0);
+      s2_POP:
+        top = second;
+        UMKA_TOS_DISPATCH(1);
+
+#define UMKA_CACHED_BINARY_HANDLER(op) \
+      s0_##op: \
+        top = operand_stack.back(); \
+        operand_stack.pop_back(); \
+        goto s1_##op; \
+      s1_##op: \
+        top = apply_operation<op>(top, operand_stack.back()); \
+        operand_stack.pop_back(); \
+        UMKA_TOS_DISPATCH(1); \
+      s2_##op: \
+        top = apply_operation<op>(top, second); \
+        UMKA_TOS_DISPATCH(1);
+        UMKA_FOR_CACHED_BINARY(UMKA_CACHED_BINARY_HANDLER)
+#undef UMKA_CACHED_BINARY_HANDLER
+
+        // top and second live in machine registers, outside the collector's roots (operand_stack and
+        // locals), so a jump that may collect spills them first. A taken backward jump spills the
+        // `next` values that stay cached and goes through loop_back_edge like the other dispatch
+        // modes; a trace or on-stack replacement may move or pop the frame, so it is reloaded.
+#define UMKA_TOS_JUMP_HANDLER(state, op, condition, next) \
+      s##state##_##op: \
+        if (garbage_collector.should_collect()) { \
+            if constexpr (state == 2) { \
+                operand_stack.push_back(second); \
+            } \
+            if constexpr (state >= 1) { \
+                operand_stack.push_back(top); \
+            } \
+            collect_garbage_if_needed(); \
+            goto *handlers[0][op]; \
+        } \
+        if (condition) { \
+            jump(*frame, current->arg); \
+            if (current->arg < 0) { \
+                if constexpr (next == 2) { \
+                    operand_stack.push_back(second); \
+                } \
+                if constexpr (next >= 1) { \
+                    operand_stack.push_back(top); \
+                } \
+                loop_back_edge(*frame, std::distance(frame->begin, current)); \
+                goto reload_frame; \
+            } \
+        } \
+        UMKA_TOS_DISPATCH(next);
+        UMKA_TOS_JUMP_HANDLER(0, JMP, true, 0)
+        UMKA_TOS_JUMP_HANDLER(1, JMP, true, 1)
+        UMKA_TOS_JUMP_HANDLER(2, JMP, true, 2)
+        UMKA_TOS_JUMP_HANDLER(0, JMP_IF_FALSE, !umka_cast<bool>(get_operand_from_stack("JUMP_CONDITION")), 0)
+        UMKA_TOS_JUMP_HANDLER(1, JMP_IF_FALSE, !umka_cast<bool>(top), 0)
+        UMKA_TOS_JUMP_HANDLER(2, JMP_IF_FALSE, !umka_cast<bool>(std::exchange(top, second)), 1)
+        UMKA_TOS_JUMP_HANDLER(0, JMP_IF_TRUE, umka_cast<bool>(get_operand_from_stack("JUMP_CONDITION")), 0)
+        UMKA_TOS_JUMP_HANDLER(1, JMP_IF_TRUE, umka_cast<bool>(top), 0)
+        UMKA_TOS_JUMP_HANDLER(2, JMP_IF_TRUE, umka_cast<bool>(std::exchange(top, second)), 1)
+#undef UMKA_TOS_JUMP_HANDLER
+
+      end_of_code_2:
+        operand_stack.push_back(second);
+      end_of_code_1:
+        operand_stack.push_back(top);
+      end_of_code_0:
+        pop_frame();
+        goto reload_frame;
+
+      op_unknown:
+        throw std::runtime_error("Unknown opcode: " + std::to_string(current->code) + " at " +
+                                 std::to_string(std::distance(frame->begin, current)));
+#undef UMKA_TOS_DISPATCH
+#undef UMKA_FOR_CACHED_BINARY
+    }
+
+    const void** translate_threaded(
+        const StackFrame& frame,
+        const void* const* handlers,
+        const void* end_of_code
+    ) {
+        auto [it, inserted] = threaded_code.try_emplace(std::to_address(frame.begin));
+        std::vector<const void*>& code = it->second;
+        if (inserted) {
+            code.reserve(std::distance(frame.begin, frame.end) + 1);
+            for (auto cmd = frame.begin; cmd != frame.end; ++cmd) {
+                code.push_back(handlers[cmd->code]);
+            }
+            code.push_back(end_of_code);
+        }
+        return code.data();
+    }
+#endif
 
-  private:
     size_t get_current_function() const {
         if (!stack_of_functions.empty()) {
             const StackFrame& frame = stack_of_functions.back();
@@ -98,513 +436,1289 @@ class StackMachine
         return 0;
     }
 
-    Entity parse_constant(const Constant& constant) {
-        switch (constant.type) {
-            case TYPE_INT64: {
-                int64_t value;
-                std::memcpy(&value, constant.data.data(), sizeof(int64_t));
-                return make_entity(value);
+    // Constants are decoded once and live outside the GC heap, so they are never swept
+    // and PUSH_CONST only copies a ready value.
+    void materialize_constants() {
+        constants.reserve(const_pool.size());
+        for (size_t i = constants.size(); i < const_pool.size(); ++i) {
+            Entity entity = parse_constant(const_pool[i]);
+            if (auto scalar = unbox_scalar(entity)) {
+                constants.push_back(*scalar);
+                continue;
             }
-            case TYPE_DOUBLE: {
-                double value;
-                std::memcpy(&value, constant.data.data(), sizeof(double));
-                return make_entity(value);
+            constant_boxes.emplace_back(std::make_shared<Entity>(std::move(entity)));
+            constants.emplace_back(constant_boxes.back().get());
+        }
+    }
+
+    const Value& constant_at(const std::vector<Value>& table, int64_t index) const {
+        if (runtime_checks && (index < 0 || index >= static_cast<int64_t>(table.size()))) {
+            throw std::runtime_error("Constant index out of bounds");
+        }
+        return table[index];
+    }
+
+    // constants of the image, for code recorded from `commands`
+    const Value& constant_at(int64_t index) const {
+        return constant_at(constants, index);
+    }
+
+    // Turns func_table into the dense functions vector of validated records that CALL operands
+    // index. Images that still call builtins through CALL get CALL_BUILTIN instead.
+    void link_functions() {
+        functions.reserve(func_table.size());
+        for (size_t index = 0; index < func_table.size(); ++index) {
+            auto it = func_table.find(index);
+            if (it == func_table.end()) {
+                throw std::runtime_error("Link error: function table has no function " + std::to_string(index));
             }
-            case TYPE_STRING: {
-                std::string value(constant.data.begin(), constant.data.end());
-                return make_entity(value);
+            const FunctionTableEntry& entry = it->second;
+            if (entry.code_offset < 0 || entry.code_offset >= entry.code_offset_end ||
+                entry.code_offset_end > static_cast<int64_t>(commands.size())) {
+                throw std::runtime_error("Link error: invalid code range of function " + std::to_string(index));
             }
-            case TYPE_UNIT:
-                return make_entity(unit{});
+            functions.push_back(FunctionRecord{
+                .id = entry.id,
+                .code = commands.begin() + entry.code_offset,
+                .arg_count = entry.arg_count,
+                .local_count = entry.local_count,
+                .frame_size = entry.frame_size(),
+                .counter_slot = profiler->counter_slot(index),
+            });
+        }
+
+        for (size_t offset = 0; offset < commands.size(); ++offset) {
+            Command& cmd = commands[offset];
+            if (cmd.code == TAIL_CALL) {
+                if (cmd.arg < 0 || cmd.arg >= static_cast<int64_t>(functions.size())) {
+                    throw std::runtime_error("Link error: tail call to unknown function " + std::to_string(cmd.arg) +
+                                             " at offset " + std::to_string(offset));
+                }
+                continue;
+            }
+            if (cmd.code != CALL) {
+                continue;
+            }
+            if (builtin_arity(cmd.arg) >= 0) {
+                cmd.code = CALL_BUILTIN;
+            } else if (cmd.arg < 0 || cmd.arg >= static_cast<int64_t>(functions.size())) {
+                throw std::runtime_error("Link error: call to unknown function " + std::to_string(cmd.arg) +
+                                         " at offset " + std::to_string(offset));
+            }
+        }
+
+        const std::vector<bool> pure = find_pure_functions(commands, func_table);
+        memo_caches.resize(functions.size());
+        for (size_t index = 0; index < functions.size(); ++index) {
+            if (pure[index] && MemoCache::fits(functions[index].arg_count)) {
+                memo_caches[index] = std::make_unique<MemoCache>(functions[index].arg_count);
+                functions[index].memo = memo_caches[index].get();
+            }
+        }
+    }
+
+    void execute_command(Command& cmd, StackFrame& current_frame, size_t current_offset) {
+        switch (cmd.code) {
+#define UMKA_EXECUTE_CASE(op) \
+            case op: \
+                execute<op>(cmd, current_frame, current_offset); \
+                break;
+            for_all_opcodes(UMKA_EXECUTE_CASE)
+#undef UMKA_EXECUTE_CASE
+#define UMKA_EXECUTE_SUPERINSTRUCTION_CASE(name, code, ...) \
+            case name: \
+                execute_fused<__VA_ARGS__>(cmd, current_frame, current_offset); \
+                break;
+            for_all_superinstructions(UMKA_EXECUTE_SUPERINSTRUCTION_CASE)
+#undef UMKA_EXECUTE_SUPERINSTRUCTION_CASE
             default:
-                throw std::runtime_error("Unknown constant type");
+                throw std::runtime_error("Unknown opcode: " + std::to_string(cmd.code) + " at " +
+                                         std::to_string(current_offset));
         }
     }
 
-    void execute_command(const Command& cmd, StackFrame& current_frame, size_t current_offset) {
-        auto call_function = [this](int64_t function_id, const std::string& error_context) {
-            if (func_table.size() <= function_id) {
-                throw std::runtime_error("Function not found: " + std::to_string(function_id));
+    // Jumps count too: a backward one may run a trace, whose calls push and pop frames.
+    static constexpr bool changes_frame(uint8_t op) {
+        return op == CALL || op == TAIL_CALL || op == RETURN || op == CALL_METHOD || op == JMP || op == JMP_IF_FALSE || op == JMP_IF_TRUE;
+    }
+
+    template<uint8_t... Ops>
+    static constexpr bool any_changes_frame() {
+        return (changes_frame(Ops) || ...);
+    }
+
+    // A generic arithmetic or compare site specializes itself to the operand types it sees,
+    // unless a type miss already de-quickened it.
+    void quicken(Command& cmd) {
+        if (cmd.generic || operand_stack.size() < 2) {
+            return;
+        }
+        const Value& lhs = operand_stack.back();
+        const Value& rhs = operand_stack[operand_stack.size() - 2];
+        if (lhs.type == rhs.type) {
+            cmd.code = quickened_opcode(cmd.code, lhs.type);
+        }
+    }
+
+    template<uint8_t Op>
+    void execute_quickened(Command& cmd, StackFrame& current_frame, size_t current_offset) {
+        constexpr ValueType type = Op >= ADD_F64_F64 ? ValueType::DOUBLE : ValueType::INT;
+        if (apply_typed<generic_opcode(Op), type>()) {
+            return;
+        }
+        cmd.code = generic_opcode(Op);
+        cmd.generic = true;
+        execute<generic_opcode(Op)>(cmd, current_frame, current_offset);
+    }
+
+    // Replaces the two top operands with Op applied to them if both have the given type
+    template<uint8_t Op, ValueType Type>
+    bool apply_typed() {
+        if constexpr (Type == ValueType::DOUBLE && Op == REM) {
+            return false;
+        } else {
+            if (runtime_checks && operand_stack.size() < 2) {
+                return false;
+            }
+            Value& lhs = operand_stack.back();
+            Value& rhs = operand_stack[operand_stack.size() - 2];
+            if (lhs.type != Type || rhs.type != Type) {
+                return false;
             }
+            if constexpr (Type == ValueType::INT) {
+                rhs = typed_operation<Op>(lhs.i, rhs.i);
+            } else {
+                rhs = typed_operation<Op>(lhs.d, rhs.d);
+            }
+            operand_stack.pop_back();
+            return true;
+        }
+    }
 
-            const FunctionTableEntry& entry = func_table[function_id];
-            if (entry.code_offset < 0 || entry.code_offset >= commands.size() || entry.code_offset_end < 0 ||
-                entry.code_offset_end > commands.size() || entry.code_offset >= entry.code_offset_end) {
-                throw std::runtime_error("Invalid function code range");
+    // Runs the components of a superinstruction in one dispatch. The instruction pointer is
+    // advanced before every component, so a trailing jump is relative to its own slot.
+    template<uint8_t... Ops>
+    void execute_fused(Command& head, StackFrame& current_frame, size_t current_offset) {
+        Command* slot = &head;
+        size_t index = 0;
+        ([&] {
+            if (index > 0) {
+                ++current_frame.instruction_ptr;
             }
+            execute_component<Ops>(slot[index], current_frame, current_offset + index);
+            ++index;
+        }(), ...);
+    }
 
-            profiler->increment_function_call(function_id);
+    template<uint8_t Op>
+    void execute_component(Command& cmd, StackFrame& current_frame, size_t current_offset) {
+        if constexpr (is_quickenable(Op)) {
+            if (apply_typed<Op, ValueType::INT>() || apply_typed<Op, ValueType::DOUBLE>()) {
+                return;
+            }
+        }
+        execute<Op>(cmd, current_frame, current_offset);
+    }
 
-            auto new_frame = StackFrame {
-                .name = entry.id,
-                .instruction_ptr = commands.begin() + entry.code_offset,
-                .begin = commands.begin(),
-                .end = commands.end(),
-            };
+    // Writes the longest superinstruction starting at each slot over it. Matching reads the
+    // original opcodes, so sequences may overlap: inner heads are reached only by jumps.
+    static void fuse_superinstructions(std::vector<Command>& code) {
+        if constexpr (std::is_same_v<Tag, DebugMod> || std::is_same_v<Tag, TosCachedMod>) {
+            // the debugger and the sequence profile see every instruction, the cached-top
+            // handlers have no fused forms
+            return;
+        }
+        const std::vector<Command> original = code;
+        for (size_t i = 0; i < original.size(); ++i) {
+            size_t fused_length = 1;
+#define UMKA_MATCH_SUPERINSTRUCTION(name, opcode, ...) \
+            if (matches_sequence<__VA_ARGS__>(original, i) && sequence_length<__VA_ARGS__>() > fused_length) { \
+                code[i].code = name; \
+                fused_length = sequence_length<__VA_ARGS__>(); \
+            }
+            for_all_superinstructions(UMKA_MATCH_SUPERINSTRUCTION)
+#undef UMKA_MATCH_SUPERINSTRUCTION
+        }
+    }
 
-            if (jit_manager->has_jitted(function_id)) {
-                auto jitted_func = jit_manager->try_get_jitted(function_id);
-                if (jitted_func.has_value()) {
-                    const auto& jit_function = jitted_func.value().get();
-                    new_frame = StackFrame{
-                        .name = entry.id,
-                        .instruction_ptr = jit_function.code.begin(),
-                        .begin = jit_function.code.begin(),
-                        .end = jit_function.code.end(),
-                    };
-                }
+    template<uint8_t... Ops>
+    static constexpr size_t sequence_length() {
+        return sizeof...(Ops);
+    }
+
+    template<uint8_t... Ops>
+    static bool matches_sequence(const std::vector<Command>& code, size_t at) {
+        if (at + sizeof...(Ops) > code.size()) {
+            return false;
+        }
+        size_t index = at;
+        return ((code[index++].code == Ops) && ...);
+    }
+
+    template<uint8_t Op>
+    void execute(Command& cmd, StackFrame& current_frame, size_t current_offset) {
+        if constexpr (is_quickenable(Op)) {
+            quicken(cmd);
+        }
+
+        if constexpr (is_quickened(Op)) {
+            execute_quickened<Op>(cmd, current_frame, current_offset);
+        } else if constexpr (Op == PUSH_CONST) {
+            operand_stack.push_back(constant_at(*current_frame.constants, cmd.arg));
+        } else if constexpr (Op == POP) {
+            CHECK_STACK_EMPTY(std::string("POP"));
+            operand_stack.pop_back();
+        } else if constexpr (Op == STORE) {
+            int64_t var_index = cmd.arg;
+            CHECK_STACK_EMPTY(std::string("STORE"));
+            Value value = operand_stack.back();
+            operand_stack.pop_back();
+
+            if (runtime_checks && stack_of_functions.empty()) {
+                throw std::runtime_error("No active stack frame");
             }
-            else if (profiler->is_function_hot(function_id)) {
-                jit_manager->request_jit(function_id);
+            StackFrame& frame = stack_of_functions.back();
+            if (runtime_checks && var_index < 0) {
+                throw std::runtime_error("Invalid variable index");
             }
-
-            for (int64_t i = 0; i < entry.arg_count; ++i) {
-                if (operand_stack.empty()) {
-                    throw std::runtime_error("Not enough arguments for " + error_context);
+            size_t slot = frame.locals_base + var_index;
+            if (runtime_checks && slot >= locals.size()) {
+                // the active frame owns the top of the locals stack, so it can grow in place
+                locals.resize(slot + 1);
+            }
+            locals[slot] = value;
+        } else if constexpr (Op == LOAD) {
+            int64_t var_index = cmd.arg;
+            if (runtime_checks && stack_of_functions.empty()) {
+                throw std::runtime_error("No active stack frame");
+            }
+            StackFrame& frame = stack_of_functions.back();
+            size_t slot = frame.locals_base + var_index;
+            if (runtime_checks && (var_index < 0 || slot >= locals.size())) {
+                throw std::runtime_error("Variable not found");
+            }
+            operand_stack.push_back(locals[slot]);
+        } else if constexpr (Op == ADD) {
+            binary_operation("ADD", [](auto a, auto b) { return a + b; });
+        } else if constexpr (Op == SUB) {
+            binary_operation("SUB", [](auto a, auto b) { return a - b; });
+        } else if constexpr (Op == MUL) {
+            binary_operation("MUL", [](auto a, auto b) { return a * b; });
+        } else if constexpr (Op == DIV) {
+            binary_operation("DIV", [](auto a, auto b) { return checked_divide(a, b); });
+        } else if constexpr (Op == REM) {
+            auto f = [](auto a, auto b) { return checked_remainder(a, b); };
+            binary_operation("REM", f, mod_applier<decltype(f)>);
+        } else if constexpr (Op == NOT) {
+            unary_operation("NOT", [](auto val) { return !val; });
+        } else if constexpr (Op == AND) {
+            binary_operation("AND", [](auto a, auto b) { return a && b; });
+        } else if constexpr (Op == OR) {
+            binary_operation("OR", [](auto a, auto b) { return a || b; });
+        } else if constexpr (Op == EQ) {
+            compare_operation([](auto a, auto b) { return a == b; });
+        } else if constexpr (Op == NEQ) {
+            compare_operation([](auto a, auto b) { return a != b; });
+        } else if constexpr (Op == GT) {
+            compare_operation([](auto a, auto b) { return a > b; });
+        } else if constexpr (Op == LT) {
+            compare_operation([](auto a, auto b) { return a < b; });
+        } else if constexpr (Op == GTE) {
+            compare_operation([](auto a, auto b) { return a >= b; });
+        } else if constexpr (Op == LTE) {
+            compare_operation([](auto a, auto b) { return a <= b; });
+        } else if constexpr (Op == JMP || Op == JMP_IF_FALSE || Op == JMP_IF_TRUE) {
+            collect_garbage_if_needed();
+            if (Op == JMP || jump_condition() == (Op == JMP_IF_TRUE)) {
+                jump(current_frame, cmd.arg);
+                if (cmd.arg < 0) {
+                    loop_back_edge(current_frame, current_offset);
                 }
-                Reference<Entity> arg_ref = operand_stack.back();
+            }
+        } else if constexpr (Op == CALL) {
+            collect_garbage_if_needed();
+            call_function(cmd.arg, "function call");
+        } else if constexpr (Op == TAIL_CALL) {
+            collect_garbage_if_needed();
+            tail_call(cmd.arg);
+        } else if constexpr (Op == CALL_BUILTIN) {
+            if (runtime_checks && builtin_arity(cmd.arg) < 0) {
+                throw std::runtime_error("Unknown builtin: " + std::to_string(cmd.arg));
+            }
+            (this->*builtin_handler(cmd.arg))();
+        } else if constexpr (Op == RETURN) {
+            std::optional<Value> return_value;
+            if (!operand_stack.empty()) {
+                return_value = operand_stack.back();
                 operand_stack.pop_back();
-                new_frame.name_resolver[i] = arg_ref;
             }
 
-            stack_of_functions.emplace_back(std::move(new_frame));
-        };
+            if (runtime_checks && stack_of_functions.empty()) {
+                throw std::runtime_error("No frame to return from");
+            }
+            if (return_value.has_value()) {
+                remember_result(stack_of_functions.back(), *return_value);
+            }
+            pop_frame();
 
-        auto BinaryOperationDecoratorWithApplier = [machine = this](const std::string& op_name, auto f, auto applier) {
-            auto [lhs, rhs] = machine->get_operands_from_stack(op_name);
-            Entity result = applier(lhs, rhs, f);
-            machine->create_and_push(result);
-        };
+            if (return_value.has_value() && !stack_of_functions.empty()) {
+                operand_stack.push_back(*return_value);
+            }
+        } else if constexpr (Op == BUILD_ARR) {
+            int64_t count = cmd.arg;
+            if (runtime_checks && operand_stack.size() < static_cast<size_t>(count)) {
+                throw std::runtime_error("Not enough operands for BUILD_ARR");
+            }
 
-        auto BinaryOperationDecorator = [BinaryOperationDecoratorWithApplier](const std::string& op_name, auto f) {
-            BinaryOperationDecoratorWithApplier(op_name, f, numeric_applier<decltype(f)>);
-        };
+            Entity array_entity = make_array();
+            Array& array = *std::get<Owner<Array>>(array_entity.value);
+            array.assign(operand_stack.end() - count, operand_stack.end());
+            operand_stack.resize(operand_stack.size() - count);
 
-        auto UnaryOperationDecorator = [machine = this](const std::string& op_name, auto f) {
-            auto operand = machine->get_operand_from_stack(op_name);
-            Entity result = unary_applier(operand, f);
-            machine->create_and_push(result);
-        };
+            create_and_push(std::move(array_entity));
+        } else if constexpr (Op == OPCOT) {
+            auto [lhs, rhs] = get_operands_from_stack("OPCOT");
+            operand_stack.push_back(lhs.is_unit() ? rhs : lhs);
+        } else if constexpr (Op == TO_STRING) {
+            auto operand = get_operand_from_stack("TO_STRING");
+            create_and_push(make_entity(operand.to_string()));
+        } else if constexpr (Op == TO_INT) {
+            int64_t casted_value = umka_cast<int64_t>(get_operand_from_stack("CAST_TO_INT"));
+            operand_stack.emplace_back(casted_value);
+        } else if constexpr (Op == TO_DOUBLE) {
+            auto casted_value = umka_cast<double>(get_operand_from_stack("CAST_TO_DOUBLE"));
+            operand_stack.emplace_back(casted_value);
+        } else if constexpr (Op == CALL_METHOD) {
+            collect_garbage_if_needed();
+            int64_t method_id = cmd.arg;
 
-        auto CompareOperationDecorator = [BinaryOperationDecoratorWithApplier](auto f) {
-            BinaryOperationDecoratorWithApplier(
-              "Ordering", f, [](const Entity& a, const Entity& b, auto f) { return Entity(f(a, b)); });
-        };
+            CHECK_STACK_EMPTY("CALL_METHOD");
+            int64_t class_id = class_id_of(operand_stack.back());
+            int64_t function_id = resolve_member(
+                current_frame.inline_caches->at(current_offset), vmethods, class_id, method_id);
+            if (function_id < 0) {
+                throw std::runtime_error("CALL_METHOD: method not found for class_id=" + std::to_string(class_id) +
+                                         ", method_id=" + std::to_string(method_id));
+            }
 
-        switch (cmd.code) {
-            case PUSH_CONST: {
-                int64_t const_index = cmd.arg;
-                if (const_index < 0 || const_index >= const_pool.size()) {
-                    throw std::runtime_error("Constant index out of bounds");
-                }
+            call_function(function_id, "method call");
+        } else if constexpr (Op == GET_FIELD) {
+            int64_t field_id = cmd.arg;
 
-                Entity constant_entity = parse_constant(const_pool[const_index]);
-                create_and_push(constant_entity);
-                break;
+            Value obj = get_operand_from_stack("GET_FIELD");
+            int64_t class_id = class_id_of(obj);
+            int64_t field_index = resolve_member(
+                current_frame.inline_caches->at(current_offset), vfields, class_id, field_id);
+            if (field_index < 0) {
+                throw std::runtime_error("GET_FIELD: field not found for class_id=" + std::to_string(class_id) +
+                                         ", field_id=" + std::to_string(field_id));
             }
-            case POP:
-                CHECK_STACK_EMPTY(std::string("POP"));
-                operand_stack.pop_back();
-                break;
-            case STORE: {
-                int64_t var_index = cmd.arg;
-                CHECK_STACK_EMPTY(std::string("STORE"));
-                Reference<Entity> ref = operand_stack.back();
-                operand_stack.pop_back();
 
-                if (stack_of_functions.empty()) {
-                    throw std::runtime_error("No active stack frame");
-                }
-                StackFrame& frame = stack_of_functions.back();
-                frame.name_resolver[var_index] = ref;
-                break;
-            }
-            case LOAD: {
-                int64_t var_index = cmd.arg;
-                if (stack_of_functions.empty()) {
-                    throw std::runtime_error("No active stack frame");
-                }
-                StackFrame& frame = stack_of_functions.back();
-                if (!frame.name_resolver.contains(var_index)) {
-                    throw std::runtime_error("Variable not found");
-                }
-                operand_stack.emplace_back(frame.name_resolver[var_index]);
-                break;
+            operand_stack.emplace_back(field_index);
+            operand_stack.push_back(obj);
+        } else {
+            static_assert(Op != Op, "No handler for opcode");
+        }
+    }
+
+    void call_function(int64_t function_index, const char* error_context) {
+        if constexpr (runtime_checks) {
+            if (function_index < 0 || function_index >= static_cast<int64_t>(functions.size())) {
+                throw std::runtime_error("Function not found: " + std::to_string(function_index));
             }
-            case ADD:
-                BinaryOperationDecorator("ADD", [](auto a, auto b) { return a + b; });
-                break;
-            case SUB:
-                BinaryOperationDecorator("SUB", [](auto a, auto b) { return a - b; });
-                break;
-            case MUL:
-                BinaryOperationDecorator("MUL", [](auto a, auto b) { return a * b; });
-                break;
-            case DIV:
-                BinaryOperationDecorator("DIV", [](auto a, auto b) { return a / b; });
-                break;
-            case REM: {
-                auto f = [](auto a, auto b) { return a % b; };
-                BinaryOperationDecoratorWithApplier("REM", f, mod_applier<decltype(f)>);
-                break;
+        }
+
+        const FunctionRecord& entry = functions[function_index];
+        if (const jit::Tier tier = profiler->increment_function_call(entry.counter_slot); tier != jit::Tier::INTERPRETED) {
+            jit_manager->request_jit(entry.id, tier, profiler->function_hotness(entry.counter_slot));
+        }
+
+        // the debugger sees every instruction, so it gets no cached results
+        uint32_t memo_slot = 0;
+        uint64_t memo_ticket = 0;
+        MemoCache* memo = std::is_same_v<Tag, DebugMod> ? nullptr : entry.memo;
+        if (memo != nullptr && operand_stack.size() >= static_cast<size_t>(entry.arg_count)) {
+            Value cached;
+            switch (memo->lookup(operand_stack.data() + operand_stack.size() - entry.arg_count, cached, memo_slot, memo_ticket)) {
+                case MemoCache::Lookup::HIT:
+                    operand_stack.resize(operand_stack.size() - entry.arg_count);
+                    operand_stack.push_back(cached);
+                    return;
+                case MemoCache::Lookup::SKIP:
+                    memo = nullptr;
+                    break;
+                case MemoCache::Lookup::MISS:
+                    break;
             }
-            case NOT:
-                UnaryOperationDecorator("NOT", [](auto val) { return !val; });
-                break;
-            case AND:
-                BinaryOperationDecorator("AND", [](auto a, auto b) { return a && b; });
-                break;
-            case OR:
-                BinaryOperationDecorator("OR", [](auto a, auto b) { return a || b; });
-                break;
-            case EQ:
-                CompareOperationDecorator([](auto a, auto b) { return a == b; });
-                break;
-            case NEQ:
-                CompareOperationDecorator([](auto a, auto b) { return a != b; });
-                break;
-            case GT:
-                CompareOperationDecorator([](auto a, auto b) { return a > b; });
-                break;
-            case LT:
-                CompareOperationDecorator([](auto a, auto b) { return a < b; });
-                break;
-            case GTE:
-                CompareOperationDecorator([](auto a, auto b) { return a >= b; });
-                break;
-            case LTE:
-                CompareOperationDecorator([](auto a, auto b) { return a <= b; });
-                break;
-            case JMP:
-                profiler->record_backward_jump(current_offset, cmd.arg, get_current_function());
-                current_frame.instruction_ptr += cmd.arg;
-                break;
-            case JMP_IF_FALSE:
-                if (!jump_condition()) {
-                    profiler->record_backward_jump(current_offset, cmd.arg, get_current_function());
-                    current_frame.instruction_ptr += cmd.arg;
-                }
-                break;
-            case JMP_IF_TRUE:
-                if (jump_condition()) {
-                    profiler->record_backward_jump(current_offset, cmd.arg, get_current_function());
-                    current_frame.instruction_ptr += cmd.arg;
+        }
+
+        size_t locals_base = locals.size();
+        int64_t frame_size = entry.frame_size;
+        StackFrame new_frame = interpreted_frame(entry, locals_base);
+        new_frame.memo = memo;
+        new_frame.memo_slot = memo_slot;
+        new_frame.memo_ticket = memo_ticket;
+
+        if (const jit::JittedFunction* jitted_function = jit_manager->jitted(entry.id)) {
+            if constexpr (!std::is_same_v<Tag, DebugMod>) {
+                if (jitted_function->native_code != nullptr) {
+                    call_native(*jitted_function->native_code, entry, error_context);
+                    remember_result(new_frame, operand_stack.back());
+                    return;
                 }
-                break;
-            case CALL: 
-                if (!call_standart_func(cmd.arg)) {
-                    call_function(cmd.arg, "function call");
+                if (jitted_function->closure_code != nullptr) {
+                    call_closures(*jitted_function->closure_code, entry, error_context);
+                    remember_result(new_frame, operand_stack.back());
+                    return;
                 }
-                break;
-            case RETURN: {
-                Reference<Entity> return_value;
-                if (!operand_stack.empty()) {
-                    return_value = operand_stack.back();
-                    operand_stack.pop_back();
-                    CHECK_REF(return_value);
+                if (jitted_function->register_code.has_value()) {
+                    call_registers(*jitted_function->register_code, jitted_function->constant_values, entry, error_context);
+                    remember_result(new_frame, operand_stack.back());
+                    return;
                 }
+            }
+            JittedCode& jitted = jitted_code_for(jitted_function->code);
+            frame_size = jitted_function->frame_size();
+            new_frame = StackFrame{
+                .name = entry.id,
+                .instruction_ptr = jitted.code.begin(),
+                .begin = jitted.code.begin(),
+                .end = jitted.code.end(),
+                .locals_base = locals_base,
+                .inline_caches = &jitted.caches,
+                .constants = &jitted_function->constant_values,
+                .memo = memo,
+                .memo_slot = memo_slot,
+                .memo_ticket = memo_ticket,
+            };
+        }
 
-                if (stack_of_functions.empty()) {
-                    throw std::runtime_error("No frame to return from");
-                }
-                stack_of_functions.pop_back();
+        if (runtime_checks && operand_stack.size() < static_cast<size_t>(entry.arg_count)) {
+            throw std::runtime_error("Not enough arguments for " + std::string(error_context));
+        }
+        locals.resize(locals_base + frame_size);
+        for (int64_t i = 0; i < entry.arg_count; ++i) {
+            locals[locals_base + i] = operand_stack.back();
+            operand_stack.pop_back();
+        }
 
-                if (!return_value.expired() && !stack_of_functions.empty()) {
-                    operand_stack.emplace_back(return_value);
-                }
-                break;
+        stack_of_functions.emplace_back(std::move(new_frame));
+    }
+
+    // Completes the result cache entry the call of `frame` reserved, if any.
+    static void remember_result(const StackFrame& frame, const Value& result) {
+        if (frame.memo != nullptr) {
+            frame.memo->fill(frame.memo_slot, frame.memo_ticket, result);
+        }
+    }
+
+    // CALL followed by RETURN without a frame in between: the callee takes over the slot and the
+    // locals of the calling frame, so tail recursion runs in constant frame and locals stacks.
+    void tail_call(int64_t function_index) {
+        const size_t depth = stack_of_functions.size();
+        call_function(function_index, "tail call");
+        if (stack_of_functions.size() == depth) {
+            // a register tier already ran the callee, return its result
+            Value result = operand_stack.back();
+            operand_stack.pop_back();
+            remember_result(stack_of_functions.back(), result);
+            pop_frame();
+            if (!stack_of_functions.empty()) {
+                operand_stack.push_back(result);
             }
-            case BUILD_ARR: {
-                int64_t count = cmd.arg;
-                if (operand_stack.size() < static_cast<size_t>(count)) {
-                    throw std::runtime_error("Not enough operands for BUILD_ARR");
+            return;
+        }
+
+        StackFrame callee = std::move(stack_of_functions.back());
+        stack_of_functions.pop_back();
+        StackFrame& caller = stack_of_functions.back();
+        const size_t frame_size = locals.size() - callee.locals_base;
+        std::move(locals.begin() + callee.locals_base, locals.end(), locals.begin() + caller.locals_base);
+        locals.resize(caller.locals_base + frame_size);
+        callee.locals_base = caller.locals_base;
+        // the result of the callee is that of the caller, whose cache entry it completes
+        if (caller.memo != nullptr) {
+            callee.memo = caller.memo;
+            callee.memo_slot = caller.memo_slot;
+            callee.memo_ticket = caller.memo_ticket;
+        }
+        caller = std::move(callee);
+    }
+
+    // Register and closure tiers: the function runs to completion without a frame of its
+    // own. Its registers extend the locals stack, so the garbage collector sees them as roots.
+    template<typename Run>
+    void call_without_frame(int64_t register_count, const FunctionRecord& entry, const char* error_context, Run run) {
+        if (runtime_checks && operand_stack.size() < static_cast<size_t>(entry.arg_count)) {
+            throw std::runtime_error("Not enough arguments for " + std::string(error_context));
+        }
+        const size_t base = locals.size();
+        locals.resize(base + register_count);
+        for (int64_t i = 0; i < entry.arg_count; ++i) {
+            locals[base + i] = operand_stack.back();
+            operand_stack.pop_back();
+        }
+        Value result = run(base);
+        locals.resize(base);
+        operand_stack.push_back(result);
+    }
+
+    void call_registers(const jit::RegisterFunction& function, const std::vector<Value>& function_constants,
+                        const FunctionRecord& entry, const char* error_context) {
+        call_without_frame(function.register_count, entry, error_context, [&](size_t base) {
+            return run_registers(function, function_constants, base);
+        });
+    }
+
+    void call_closures(const jit::ClosureFunction& function, const FunctionRecord& entry, const char* error_context) {
+        call_without_frame(function.register_count, entry, error_context, [&](size_t base) {
+            ClosureBridge bridge(*this, base);
+            jit::ClosureFrame frame{ .registers = locals.data() + base, .runtime = &bridge, .result = Value{} };
+            return function.run(frame);
+        });
+    }
+
+    void call_native(const jit::NativeFunction& function, const FunctionRecord& entry, const char* error_context) {
+        call_without_frame(function.register_count, entry, error_context, [&](size_t base) {
+            ClosureBridge bridge(*this, base);
+            jit::ClosureFrame frame{ .registers = locals.data() + base, .runtime = &bridge, .result = Value{} };
+            return function.run(frame);
+        });
+    }
+
+    // Interpreter services for closure and native code, one bridge per running function.
+    class ClosureBridge final : public jit::ClosureRuntime {
+      public:
+        ClosureBridge(StackMachine& machine, size_t base) : machine(machine), base(base) {}
+
+        Value operate(uint8_t op, Value lhs, Value rhs) override {
+            return machine.operate(op, lhs, rhs);
+        }
+
+        bool truthy(Value value) override {
+            return umka_cast<bool>(value);
+        }
+
+        Value call(uint8_t op, int64_t callee, jit::ClosureFrame& frame, uint32_t first, uint32_t count) override {
+            Value result = machine.call_from_registers(op, callee, base + first, count);
+            frame.registers = machine.locals.data() + base;
+            return result;
+        }
+
+        void safepoint() override {
+            machine.collect_garbage_if_needed();
+        }
+
+      private:
+        StackMachine& machine;
+        size_t base;
+    };
+
+    Value operate(uint8_t op, Value lhs, Value rhs) {
+        switch (op) {
+#define UMKA_OPERATE_CASE(name) \
+            case name: \
+                return apply_operation<name>(lhs, rhs);
+            UMKA_OPERATE_CASE(ADD)
+            UMKA_OPERATE_CASE(SUB)
+            UMKA_OPERATE_CASE(MUL)
+            UMKA_OPERATE_CASE(DIV)
+            UMKA_OPERATE_CASE(REM)
+            UMKA_OPERATE_CASE(AND)
+            UMKA_OPERATE_CASE(OR)
+            UMKA_OPERATE_CASE(EQ)
+            UMKA_OPERATE_CASE(NEQ)
+            UMKA_OPERATE_CASE(GT)
+            UMKA_OPERATE_CASE(LT)
+            UMKA_OPERATE_CASE(GTE)
+            UMKA_OPERATE_CASE(LTE)
+            UMKA_OPERATE_CASE(NOT)
+            UMKA_OPERATE_CASE(TO_STRING)
+            UMKA_OPERATE_CASE(TO_INT)
+            UMKA_OPERATE_CASE(TO_DOUBLE)
+#undef UMKA_OPERATE_CASE
+            default:
+                throw std::runtime_error("No operation for opcode " + std::to_string(op));
+        }
+    }
+
+    Value run_registers(const jit::RegisterFunction& function, const std::vector<Value>& function_constants,
+                        size_t base, size_t pc = 0) {
+        const jit::RegisterInstruction* code = function.code.data();
+        while (true) {
+            const jit::RegisterInstruction& ins = code[pc++];
+            // calls may grow the locals stack, so registers are addressed from the base
+            Value* registers = locals.data() + base;
+            switch (ins.code) {
+                case PUSH_CONST:
+                    registers[ins.dst] = constant_at(function_constants, ins.arg);
+                    break;
+                case LOAD:
+                    registers[ins.dst] = registers[ins.lhs];
+                    break;
+#define UMKA_REGISTER_OPERATION(op) \
+                case op: \
+                    register_operation<op>(registers, ins); \
+                    break;
+                UMKA_REGISTER_OPERATION(ADD)
+                UMKA_REGISTER_OPERATION(SUB)
+                UMKA_REGISTER_OPERATION(MUL)
+                UMKA_REGISTER_OPERATION(DIV)
+                UMKA_REGISTER_OPERATION(REM)
+                UMKA_REGISTER_OPERATION(AND)
+                UMKA_REGISTER_OPERATION(OR)
+                UMKA_REGISTER_OPERATION(EQ)
+                UMKA_REGISTER_OPERATION(NEQ)
+                UMKA_REGISTER_OPERATION(GT)
+                UMKA_REGISTER_OPERATION(LT)
+                UMKA_REGISTER_OPERATION(GTE)
+                UMKA_REGISTER_OPERATION(LTE)
+                UMKA_REGISTER_OPERATION(NOT)
+                UMKA_REGISTER_OPERATION(TO_STRING)
+                UMKA_REGISTER_OPERATION(TO_INT)
+                UMKA_REGISTER_OPERATION(TO_DOUBLE)
+#undef UMKA_REGISTER_OPERATION
+                case JMP:
+                    collect_garbage_if_needed();
+                    pc = ins.arg;
+                    break;
+                case JMP_IF_FALSE:
+                    collect_garbage_if_needed();
+                    if (!umka_cast<bool>(registers[ins.lhs])) {
+                        pc = ins.arg;
+                    }
+                    break;
+                case JMP_IF_TRUE:
+                    collect_garbage_if_needed();
+                    if (umka_cast<bool>(registers[ins.lhs])) {
+                        pc = ins.arg;
+                    }
+                    break;
+                case CALL:
+                case CALL_BUILTIN: {
+                    Value result = call_from_registers(ins.code, ins.arg, base + ins.lhs, ins.rhs);
+                    locals[base + ins.dst] = result;
+                    break;
                 }
+                case RETURN:
+                    return registers[ins.lhs];
+                default:
+                    throw std::runtime_error("Unknown register instruction: " + std::to_string(ins.code));
+            }
+        }
+    }
+
+    template<uint8_t Op>
+    void register_operation(Value* registers, const jit::RegisterInstruction& ins) {
+        registers[ins.dst] = apply_operation<Op>(registers[ins.lhs], registers[ins.rhs]);
+    }
 
-                Entity array_entity = make_array();
-                Array& array = *std::get<Owner<Array>>(array_entity.value);
-                array.resize(count);
-                for (int64_t i = count - 1; i >= 0; --i) {
-                    Reference<Entity> ref = operand_stack.back();
-                    operand_stack.pop_back();
-                    CHECK_REF(ref);
-                    array[i] = ref;
+    // Int and double operands are handled inline, anything else goes through the stack handler.
+    // Unary operations ignore rhs.
+    template<uint8_t Op>
+    Value apply_operation(Value lhs, Value rhs) {
+        if constexpr (is_quickenable(Op)) {
+            if (lhs.type == ValueType::INT && rhs.type == ValueType::INT) {
+                return typed_operation<Op>(lhs.i, rhs.i);
+            }
+            if constexpr (Op != REM) {
+                if (lhs.type == ValueType::DOUBLE && rhs.type == ValueType::DOUBLE) {
+                    return typed_operation<Op>(lhs.d, rhs.d);
                 }
+            }
+        }
+        constexpr bool is_unary = Op == NOT || Op == TO_STRING || Op == TO_INT || Op == TO_DOUBLE;
+        if constexpr (!is_unary) {
+            operand_stack.push_back(rhs);
+        }
+        operand_stack.push_back(lhs);
+        Command scratch{Op};
+        scratch.generic = true;
+        execute<Op>(scratch, stack_of_functions.back(), 0);
+        Value result = operand_stack.back();
+        operand_stack.pop_back();
+        return result;
+    }
 
-                create_and_push(std::move(array_entity));
-                break;
+    // CALL or CALL_BUILTIN from register or closure code, arguments are locals[first .. first + count)
+    Value call_from_registers(uint8_t code, int64_t callee, size_t first, uint32_t count) {
+        for (uint32_t i = 0; i < count; ++i) {
+            operand_stack.push_back(locals[first + i]);
+        }
+        if (code == CALL_BUILTIN) {
+            if (runtime_checks && builtin_arity(callee) < 0) {
+                throw std::runtime_error("Unknown builtin: " + std::to_string(callee));
             }
-            case OPCOT: {
-                auto [lhs, rhs] = get_operands_from_stack("OPCOT");
-                create_and_push(lhs.is_unit() ? rhs : lhs);
-                break;
+            (this->*builtin_handler(callee))();
+        } else {
+            collect_garbage_if_needed();
+            const size_t depth = stack_of_functions.size();
+            call_function(callee, "function call");
+            if (stack_of_functions.size() > depth) {
+                debugger_t no_debugger;
+                run_switch(no_debugger, depth);
             }
-            case TO_STRING: {
-                auto operand = get_operand_from_stack("TO_STRING");
-                create_and_push(make_entity(operand.to_string()));
-                break;
+        }
+        Value result = operand_stack.back();
+        operand_stack.pop_back();
+        return result;
+    }
+
+    struct TraceSlot {
+        std::unique_ptr<jit::Trace> trace;
+        uint32_t early_exits = 0;
+    };
+
+    // Heats the function of a taken jump and queues it for the JIT tier it reached.
+    Profiler::LoopEvent count_back_edge(const StackFrame& frame, size_t jump_offset) {
+        const auto event = profiler->record_backward_jump(jump_offset, std::distance(frame.begin, frame.instruction_ptr), frame.name);
+        if (event.tier != jit::Tier::INTERPRETED) {
+            jit_manager->request_jit(frame.name, event.tier, event.hotness);
+        }
+        return event;
+    }
+
+    // Counts the loop closed by a taken backward jump and runs its trace once it has one. A hot
+    // loop first tries to move its frame into the optimized function and is traced otherwise.
+    // Only frames running `commands` are traced or replaced, jitted copies have offsets of
+    // their own.
+    void loop_back_edge(StackFrame& frame, size_t jump_offset) {
+        const size_t header = std::distance(frame.begin, frame.instruction_ptr);
+        const bool replaceable = !recording_trace && frame.begin == commands.begin();
+        const bool traceable = !std::is_same_v<Tag, DebugMod> && replaceable;
+        if (traceable && traces[header].trace != nullptr) {
+            run_trace(traces[header]);
+            return;
+        }
+        if (!count_back_edge(frame, jump_offset).hot || !replaceable) {
+            return;
+        }
+        if (replace_frame(frame, header)) {
+            return;
+        }
+        if (traceable) {
+            record_trace(header);
+        }
+    }
+
+    // On-stack replacement: continues the frame at the loop header in the optimized version of
+    // its function. A frame is replaced once, so baseline code, which would then keep the frame
+    // from ever reaching the optimized tier, is not used here. Register tiers finish the
+    // function right here, on the locals the frame already has, and return like RETURN does;
+    // otherwise the frame switches to the optimized bytecode.
+    bool replace_frame(StackFrame& frame, size_t header) {
+        const FunctionRecord& entry = functions[frame.name];
+        const jit::JittedFunction* jitted = jit_manager->jitted(entry.id);
+        if (jitted == nullptr || jitted->tier != jit::Tier::OPTIMIZED) {
+            return false;
+        }
+        const jit::JittedFunction& function = *jitted;
+        const auto osr = function.osr_entries.find(header - std::distance(commands.begin(), entry.code));
+        if (osr == function.osr_entries.end()) {
+            return false;
+        }
+
+        if constexpr (!std::is_same_v<Tag, DebugMod>) {
+            const size_t base = frame.locals_base;
+            if (function.register_code.has_value() && locals.size() == base + entry.frame_size) {
+                const auto& loop_entries = function.register_code->loop_entries;
+                if (const auto pc = loop_entries.find(osr->second); pc != loop_entries.end()) {
+                    Value result = run_from_loop(function, base, pc->second);
+                    remember_result(frame, result);
+                    pop_frame();
+                    if (!stack_of_functions.empty()) {
+                        operand_stack.push_back(result);
+                    }
+                    return true;
+                }
             }
-            case TO_INT: {
-                int64_t casted_value = umka_cast<int64_t>(get_operand_from_stack("CAST_TO_INT"));
-                create_and_push(make_entity(casted_value));
+        }
+
+        JittedCode& jitted_code = jitted_code_for(function.code);
+        // the frame is the innermost one, so its locals end the locals stack
+        if (locals.size() < frame.locals_base + function.frame_size()) {
+            locals.resize(frame.locals_base + function.frame_size());
+        }
+        frame.begin = jitted_code.code.begin();
+        frame.end = jitted_code.code.end();
+        frame.instruction_ptr = frame.begin + osr->second;
+        frame.inline_caches = &jitted_code.caches;
+        frame.constants = &function.constant_values;
+        frame.threaded_code = nullptr;
+        return true;
+    }
+
+    // runs the best register tier of `function` from loop entry `pc` on registers at `base`
+    Value run_from_loop(const jit::JittedFunction& function, size_t base, size_t pc) {
+        const jit::RegisterFunction& registers = *function.register_code;
+        locals.resize(base + registers.register_count);
+        if (function.native_code != nullptr || function.closure_code != nullptr) {
+            ClosureBridge bridge(*this, base);
+            jit::ClosureFrame frame{ .registers = locals.data() + base, .runtime = &bridge, .result = Value{} };
+            return function.native_code != nullptr ? function.native_code->run(frame, pc)
+                                                   : function.closure_code->run(frame, pc);
+        }
+        return run_registers(registers, function.constant_values, base, pc);
+    }
+
+    // Interprets one iteration of the loop at `header` from the untouched bytecode, logging
+    // operand types, branch directions and the classes receivers had, and installs its trace if
+    // the iteration came back to the header. Calls are entered in interpreted frames and
+    // recorded too, up to TraceCompiler::kMaxInlineDepth frames deep; deeper ones run to
+    // completion and stay calls in the trace.
+    void record_trace(size_t header) {
+        const size_t depth = stack_of_functions.size();
+        const int64_t frame_size = locals.size() - stack_of_functions.back().locals_base;
+        std::vector<jit::TraceStep> steps;
+        bool closed = false;
+        recording_trace = true;
+        while (!closed && steps.size() < kMaxTraceLength) {
+            StackFrame& frame = stack_of_functions.back();
+            const auto level = static_cast<uint32_t>(stack_of_functions.size() - depth);
+            const size_t offset = std::distance(frame.begin, frame.instruction_ptr);
+            if (offset >= jit_commands.size() || !jit::TraceCompiler::can_record(jit_commands[offset].code)) {
                 break;
             }
-            case TO_DOUBLE: {
-                auto casted_value = umka_cast<double>(get_operand_from_stack("CAST_TO_DOUBLE"));
-                create_and_push(make_entity(casted_value));
+            Command cmd = jit_commands[offset];
+            jit::TraceStep step{
+                .offset = offset,
+                .command = cmd,
+                .types = { operand_type(0), operand_type(1) },
+                .depth = level,
+            };
+            if (cmd.code == PUSH_CONST) {
+                step.types[0] = constant_at(cmd.arg).type;
+            } else if (cmd.code == RETURN && level == 0) {
                 break;
+            } else if (cmd.code == CALL_METHOD || cmd.code == GET_FIELD) {
+                if (operand_stack.empty() || operand_stack.back().get_if<Owner<Array>>() == nullptr) {
+                    break;
+                }
+                step.class_id = class_id_of(operand_stack.back());
+                const int64_t target = (cmd.code == CALL_METHOD ? vmethods : vfields).find(step.class_id, cmd.arg);
+                if (target < 0) {
+                    break;
+                }
+                (cmd.code == CALL_METHOD ? step.callee : step.field_index) = target;
+            } else if (cmd.code == CALL) {
+                step.callee = cmd.arg;
+            }
+            if (step.callee >= 0) {
+                step.call_arity = functions[step.callee].arg_count;
+                step.callee_frame_size = functions[step.callee].frame_size;
+                step.inlined = level < jit::TraceCompiler::kMaxInlineDepth &&
+                               operand_stack.size() >= static_cast<size_t>(step.call_arity);
+            }
+            ++frame.instruction_ptr;
+            if (step.inlined) {
+                enter_interpreted(step.callee);
+            } else {
+                const size_t frames = stack_of_functions.size();
+                execute_command(cmd, frame, offset);
+                if (stack_of_functions.size() > frames) {
+                    debugger_t no_debugger;
+                    run_switch(no_debugger, frames);
+                }
             }
-            case CALL_METHOD: {
-                int64_t method_id = cmd.arg;
+            const StackFrame& after = stack_of_functions.back();
+            const size_t next = std::distance(after.begin, after.instruction_ptr);
+            step.taken = next != offset + 1;
+            steps.push_back(step);
+            closed = stack_of_functions.size() == depth && next == header;
+        }
+        recording_trace = false;
+        if (!closed) {
+            return;
+        }
+        if (auto trace = jit::TraceCompiler::compile(steps, header, frame_size)) {
+            traces[header].trace = std::make_unique<jit::Trace>(std::move(*trace));
+        }
+    }
 
-                Entity obj = *operand_stack.back().lock();
-                auto arr = std::get<Owner<Array>>(obj.value);
+    // Calls `function_index` in an interpreted frame, bypassing result caches and jitted code.
+    void enter_interpreted(int64_t function_index) {
+        const FunctionRecord& entry = functions[function_index];
+        const size_t locals_base = locals.size();
+        locals.resize(locals_base + entry.frame_size);
+        for (int64_t i = 0; i < entry.arg_count; ++i) {
+            locals[locals_base + i] = operand_stack.back();
+            operand_stack.pop_back();
+        }
+        stack_of_functions.push_back(interpreted_frame(entry, locals_base));
+    }
 
-                Reference<Entity> class_id_ref = (*arr)[0];
-                CHECK_REF(class_id_ref);
-                int64_t class_id = umka_cast<int64_t>(*class_id_ref.lock());
+    // frame of `entry` running from `commands`, at the entry of the function
+    StackFrame interpreted_frame(const FunctionRecord& entry, size_t locals_base) {
+        return StackFrame{
+            .name = entry.id,
+            .instruction_ptr = entry.code,
+            .begin = commands.begin(),
+            .end = commands.end(),
+            .locals_base = locals_base,
+            .inline_caches = &command_caches,
+            .constants = &constants,
+        };
+    }
 
-                auto key = std::make_pair(class_id, method_id);
-                auto it = vmethod_map.find(key);
-                if (it == vmethod_map.end()) {
-                    throw std::runtime_error("CALL_METHOD: method not found for class_id=" + std::to_string(class_id) +
-                                             ", method_id=" + std::to_string(method_id));
-                }
+    ValueType operand_type(size_t depth) const {
+        return operand_stack.size() > depth ? operand_stack[operand_stack.size() - 1 - depth].type : ValueType::UNIT;
+    }
 
-                int64_t function_id = it->second;
+    // Runs a trace from its loop header until a guard fails, then rebuilds the operand stack of
+    // the exit and leaves the frame at the instruction the interpreter resumes with; an exit
+    // inside inlined calls also pushes their frames back. A trace that keeps failing in its
+    // first iteration is dropped so the loop can be traced again.
+    void run_trace(TraceSlot& slot) {
+        const jit::Trace& trace = *slot.trace;
+        const size_t base = stack_of_functions.back().locals_base;
+        if (locals.size() != base + trace.frame_size) {
+            return;
+        }
+        locals.resize(base + trace.register_count);
+        const jit::TraceInstruction* code = trace.code.data();
+        const jit::TraceExit* exit = nullptr;
+        size_t pc = 0;
+        bool looped = false;
+        while (exit == nullptr) {
+            const jit::TraceInstruction& ins = code[pc++];
+            looped |= ins.code == JMP;
+            switch (ins.code) {
+#define UMKA_TRACE_CASE(op) \
+                case op: \
+                    exit = trace_step<op>(trace, ins, base, pc); \
+                    break;
+                for_all_opcodes(UMKA_TRACE_CASE)
+#undef UMKA_TRACE_CASE
+                default:
+                    throw std::runtime_error("Unknown trace instruction: " + std::to_string(ins.code));
+            }
+        }
+        const Value* registers = locals.data() + base;
+        for (uint32_t reg : exit->stack) {
+            operand_stack.push_back(registers[reg]);
+        }
+        // callee locals live in registers that are dropped below, so they are copied out first
+        std::vector<Value> callee_locals;
+        for (const jit::TraceFrame& callee : exit->frames) {
+            callee_locals.insert(callee_locals.end(), registers + callee.base, registers + callee.base + callee.size);
+            for (uint32_t reg : callee.stack) {
+                operand_stack.push_back(registers[reg]);
+            }
+        }
+        locals.resize(base + trace.frame_size);
+        StackFrame& frame = stack_of_functions.back();
+        frame.instruction_ptr = frame.begin + exit->resume_offset;
+        auto next_local = callee_locals.begin();
+        for (const jit::TraceFrame& callee : exit->frames) {
+            StackFrame callee_frame = interpreted_frame(functions[callee.function], locals.size());
+            callee_frame.instruction_ptr = commands.begin() + callee.resume_offset;
+            locals.insert(locals.end(), next_local, next_local + callee.size);
+            next_local += callee.size;
+            stack_of_functions.push_back(callee_frame);
+        }
+        if (!looped && ++slot.early_exits == kMaxEarlyExits) {
+            slot = TraceSlot{};
+        }
+    }
 
-                call_function(function_id, "method call");
-                break;
+    // Executes one trace instruction, returns the exit taken if it leaves the trace
+    template<uint8_t Op>
+    const jit::TraceExit* trace_step(const jit::Trace& trace, const jit::TraceInstruction& ins, size_t base, size_t& pc) {
+        // calls may grow the locals stack, so registers are addressed from the base
+        Value* registers = locals.data() + base;
+        if constexpr (is_quickened(Op)) {
+            constexpr ValueType type = Op >= ADD_F64_F64 ? ValueType::DOUBLE : ValueType::INT;
+            const Value& lhs = registers[ins.lhs];
+            const Value& rhs = registers[ins.rhs];
+            if (ins.guarded && (lhs.type != type || rhs.type != type)) {
+                return &trace.exits[ins.exit];
+            }
+            if constexpr (type == ValueType::INT) {
+                registers[ins.dst] = typed_operation<generic_opcode(Op)>(lhs.i, rhs.i);
+            } else {
+                registers[ins.dst] = typed_operation<generic_opcode(Op)>(lhs.d, rhs.d);
+            }
+        } else if constexpr (Op == PUSH_CONST) {
+            registers[ins.dst] = constant_at(ins.arg);
+        } else if constexpr (Op == POP) {
+            registers[ins.dst] = Value{};
+        } else if constexpr (Op == CALL_METHOD || Op == GET_FIELD) {
+            const auto* object = registers[ins.lhs].get_if<Owner<Array>>();
+            if (object == nullptr || (*object)->empty() || class_id_of(registers[ins.lhs]) != ins.arg) {
+                return &trace.exits[ins.exit];
+            }
+            if constexpr (Op == GET_FIELD) {
+                registers[ins.dst] = Value(static_cast<int64_t>(ins.rhs));
             }
-            case GET_FIELD: {
-                int64_t field_id = cmd.arg;
+        } else if constexpr (Op == BUILD_ARR) {
+            Entity array_entity = make_array();
+            std::get<Owner<Array>>(array_entity.value)->assign(registers + ins.lhs, registers + ins.lhs + ins.rhs);
+            registers[ins.dst] = create(std::move(array_entity));
+        } else if constexpr (Op == LOAD) {
+            registers[ins.dst] = registers[ins.lhs];
+        } else if constexpr (Op == JMP_IF_FALSE || Op == JMP_IF_TRUE) {
+            if (umka_cast<bool>(registers[ins.lhs]) == (Op == JMP_IF_TRUE)) {
+                return &trace.exits[ins.exit];
+            }
+        } else if constexpr (Op == JMP) {
+            collect_garbage_if_needed();
+            pc = 0;
+        } else if constexpr (Op == CALL || Op == CALL_BUILTIN) {
+            Value result = call_from_registers(Op, ins.arg, base + ins.lhs, ins.rhs);
+            locals[base + ins.dst] = result;
+        } else if constexpr (is_quickenable(Op) || Op == AND || Op == OR || Op == NOT || Op == TO_STRING ||
+                             Op == TO_INT || Op == TO_DOUBLE) {
+            registers[ins.dst] = apply_operation<Op>(registers[ins.lhs], registers[ins.rhs]);
+        } else {
+            throw std::runtime_error("No trace form for opcode " + std::to_string(Op));
+        }
+        return nullptr;
+    }
+
+    void pop_frame() {
+        locals.resize(stack_of_functions.back().locals_base);
+        stack_of_functions.pop_back();
+    }
 
-                Reference<Entity> obj_ref = operand_stack.back();
-                Entity obj = get_operand_from_stack("GET_FIELD");
-                Owner<Array>& arr = std::get<Owner<Array>>(obj.value);
+    static InlineCacheTable make_inline_caches(const std::vector<Command>& code) {
+        InlineCacheTable table;
+        table.site.resize(code.size());
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].code == CALL_METHOD || code[i].code == GET_FIELD) {
+                table.site[i] = table.caches.size();
+                table.caches.emplace_back();
+            }
+        }
+        return table;
+    }
 
-                Reference<Entity> class_id_ref = (*arr)[0];
-                CHECK_REF(class_id_ref);
-                int64_t class_id = umka_cast<int64_t>(*class_id_ref.lock());
+    // Jitted functions run from a private copy, so they are quickened in place like the
+    // loaded code and get inline caches of their own.
+    struct JittedCode {
+        std::vector<Command> code;
+        InlineCacheTable caches;
+    };
 
-                auto key = std::make_pair(class_id, field_id);
-                auto it = vfield_map.find(key);
-                if (it == vfield_map.end()) {
-                    throw std::runtime_error("GET_FIELD: field not found for class_id=" + std::to_string(class_id) +
-                                             ", field_id=" + std::to_string(field_id));
-                }
+    JittedCode& jitted_code_for(const std::vector<Command>& code) {
+        auto [it, inserted] = jitted_code.try_emplace(code.data());
+        if (inserted) {
+            it->second.code = code;
+            it->second.caches = make_inline_caches(code);
+            fuse_superinstructions(it->second.code);
+        }
+        return it->second;
+    }
 
-                int64_t field_index = it->second;
+    static int64_t class_id_of(const Value& object) {
+        const Value& class_id = (*object.get<Owner<Array>>())[0];
+        return class_id.type == ValueType::INT ? class_id.i : umka_cast<int64_t>(class_id);
+    }
 
-                create_and_push(make_entity(field_index));
-                operand_stack.emplace_back(std::move(obj_ref));
-                break;
+    // -1 if the class has no such member
+    static int64_t resolve_member(InlineCache& cache, const MemberTable& table, int64_t class_id, int64_t member_id) {
+        for (size_t i = 0; i < cache.size; ++i) {
+            if (cache.entries[i].class_id == class_id) {
+                return cache.entries[i].target;
             }
-            default:
-                throw std::runtime_error("Unknown opcode: " + std::to_string(cmd.code) + " at " +
-                                         std::to_string(current_offset));
         }
+        int64_t target = table.find(class_id, member_id);
+        if (target >= 0 && cache.size < InlineCache::kCapacity) {
+            cache.entries[cache.size++] = { class_id, target };
+        }
+        return target;
     }
 
-    std::pair<Entity, Entity> get_operands_from_stack(const std::string& op_name) {
+    void jump(StackFrame& frame, int64_t offset) {
+        if (runtime_checks && (offset > std::distance(frame.instruction_ptr, frame.end) ||
+            -offset > std::distance(frame.begin, frame.instruction_ptr))) {
+            throw std::runtime_error("Jump target out of range");
+        }
+        frame.instruction_ptr += offset;
+    }
+
+    template<typename F, typename Applier>
+    void binary_operation(const char* op_name, F f, Applier applier) {
+        auto [lhs, rhs] = get_operands_from_stack(op_name);
+        operand_stack.push_back(applier(lhs, rhs, f));
+    }
+
+    template<typename F>
+    void binary_operation(const char* op_name, F f) {
+        binary_operation(op_name, f, numeric_applier<F>);
+    }
+
+    template<typename F>
+    void unary_operation(const char* op_name, F f) {
+        auto operand = get_operand_from_stack(op_name);
+        operand_stack.push_back(unary_applier(operand, f));
+    }
+
+    template<typename F>
+    void compare_operation(F f) {
+        binary_operation("Ordering", f, [](const Value& a, const Value& b, auto f) { return Value(f(a, b)); });
+    }
+
+    std::pair<Value, Value> get_operands_from_stack(const char* op_name) {
         CHECK_STACK_EMPTY(op_name);
-        Reference<Entity> lhs = operand_stack.back();
+        Value lhs = operand_stack.back();
         operand_stack.pop_back();
         CHECK_STACK_EMPTY(op_name);
-        Reference<Entity> rhs = operand_stack.back();
+        Value rhs = operand_stack.back();
         operand_stack.pop_back();
-        CHECK_REF(lhs);
-        CHECK_REF(rhs);
-        return { *lhs.lock(), *rhs.lock() };
+        return { lhs, rhs };
     }
 
-    Entity get_operand_from_stack(const std::string& op_name) {
+    Value get_operand_from_stack(const char* op_name) {
         CHECK_STACK_EMPTY(op_name);
-        Reference<Entity> operand = operand_stack.back();
+        Value operand = operand_stack.back();
         operand_stack.pop_back();
-        CHECK_REF(operand);
-        return *operand.lock();
+        return operand;
     }
 
-    Reference<Entity> stack_pop() {
-        CHECK_STACK_EMPTY(std::string("STACK_POP"));
-        Reference<Entity> operand = operand_stack.back();
-        operand_stack.pop_back();
-        return operand;
+    Value stack_pop() {
+        return get_operand_from_stack("STACK_POP");
     }
 
-    std::optional<Entity> stack_lookup() {
+    std::optional<Value> stack_lookup() {
         if (operand_stack.empty()) {
             return std::nullopt;
         }
-        return *operand_stack.back().lock();
+        return operand_stack.back();
     }
 
-    Owner<Entity> create(Entity result) {
+    // Boxed values held in C++ locals are not GC roots, so allocation never collects;
+    // collection runs at function calls and jumps, where every live value sits in a root.
+    Value create(Entity result) {
+        if (auto scalar = unbox_scalar(result)) {
+            return *scalar;
+        }
         size_t entity_size = GarbageCollector<Tag>::calculate_entity_size(result);
+        heap.emplace_back(std::make_shared<Entity>(std::move(result)));
+        garbage_collector.add_allocated_bytes(entity_size);
+        return Value(heap.back().get());
+    }
 
+    void create_and_push(Entity result) { 
+        operand_stack.push_back(create(std::move(result))); 
+    }
+
+    void collect_garbage_if_needed() {
         if (garbage_collector.should_collect()) {
-            garbage_collector.collect(heap, operand_stack, stack_of_functions);
+            garbage_collector.collect(heap, operand_stack, locals);
             if (garbage_collector.should_collect()) {
                 throw std::runtime_error("OutOfMemory: Garbage collection did not free enough memory");
             }
         }
-
-        heap.emplace_back(std::make_shared<Entity>(std::move(result)));
-        garbage_collector.add_allocated_bytes(entity_size);
-        return heap.back();
-    }
-
-    void create_and_push(Entity result) { 
-        operand_stack.emplace_back(create(std::move(result))); 
     }
 
     bool jump_condition() {
-        CHECK_STACK_EMPTY(std::string("JUMP_CONDITION"));
-        Reference<Entity> condition_ref = operand_stack.back();
-        operand_stack.pop_back();
-        if (condition_ref.expired())
-            throw std::runtime_error("Condition expired");
-        Entity condition = *condition_ref.lock();
-        return umka_cast<bool>(condition);
+        return umka_cast<bool>(get_operand_from_stack("JUMP_CONDITION"));
     }
 
-    bool call_standart_func(int64_t func_id) {
-        auto call_void_proc = [this](auto proc) {
-            auto arg = get_operand_from_stack("CALL PROC");
-            proc(arg);
-            create_and_push(make_entity(unit{}));
-        };
-
-        auto call_value_proc = [this](auto proc) {
-            auto arg = get_operand_from_stack("CALL PROC");
-            create_and_push(make_entity(proc(arg)));
-        };
-
-        auto create_array = [this](auto values) {
-            Entity array_entity = make_array();
-            Array& array = *std::get<Owner<Array>>(array_entity.value);
-            for (size_t i = 0; i < values.size(); ++i) {
-                Owner<Entity> line_entity = create(make_entity(std::move(values[i])));
-                array.emplace_back(std::move(line_entity));
-            }
+    // Builtins pop their arguments straight off the operand stack and push exactly one
+    // result, void procedures push an inline unit.
+    using BuiltinHandler = void (StackMachine::*)();
 
-            create_and_push(array_entity);
-        };
+    static BuiltinHandler builtin_handler(int64_t id) {
+        static constexpr auto handlers = []<size_t... I>(std::index_sequence<I...>) {
+            return std::array<BuiltinHandler, sizeof...(I)>{ &StackMachine::call_builtin<kMaxI64 - I>... };
+        }(std::make_index_sequence<kBuiltinCount>{});
+        return handlers[kMaxI64 - id];
+    }
 
-        switch (func_id) {
-        case PRINT_FUN:
-            call_void_proc([this](auto arg) { print(arg); });
-            return true;
-        case LEN_FUN:
-            call_value_proc([this](auto arg) { return len(arg); });
-            return true;
-        case GET_FUN: {
-            auto arr = get_operand_from_stack("CALL GET");
-            auto idx = umka_cast<int64_t>(get_operand_from_stack("CALL GET"));
-            create_and_push(*get(arr, idx).lock());
-            return true;
-        }
-        case SET_FUN: {
-            call_void_proc([&](auto arr) { 
-                auto idx = umka_cast<int64_t>(get_operand_from_stack("CALL SET"));
-                auto val = stack_pop();
-                set(arr, idx, val); 
-            });
-            return true;
-        }
-        case ADD_FUN: {
-            call_void_proc([&](auto arr) { 
-                auto val = stack_pop();
-                add_elem(arr, val); 
-            });
-            return true;
-        }
-        case REMOVE_FUN: {
-            call_void_proc([&](auto arr) { 
-                auto idx = umka_cast<int64_t>(get_operand_from_stack("CALL REMOVE"));
-                remove(arr, idx); 
-            });
-            return true;
-        }
-        case WRITE_FUN: {
-            call_void_proc([&](auto filename) { 
-                auto content = get_operand_from_stack("CALL WRITE");
-                write(filename.to_string(), content); 
-            });
-            return true;
-        }
-        case READ_FUN: {
-            auto filename = get_operand_from_stack("CALL READ");
-            std::vector<std::string> lines = read(filename.to_string());
-            create_array(lines);
-            return true;
-        }
-        case ASSERT_FUN: {
-            call_void_proc([this](auto arg) { umka_assert(arg); });
-            return true;
-        }
-        case INPUT_FUN: {
-            create_and_push(make_entity(input()));
-            return true;
-        }
-        case RANDOM_FUN: {
-            create_and_push(make_entity(random()));
-            return true;
-        }
-        case POW_FUN: {
-            auto [base_entity, exp_entity] = get_operands_from_stack("CALL POW");
-            auto base = umka_cast<double>(base_entity);
-            auto exp = umka_cast<double>(exp_entity);
-            create_and_push(make_entity(pow(base, exp)));
-            return true;
-        }
-        case SQRT_FUN: {
-            call_value_proc([this](auto arg) { return sqrt(umka_cast<double>(arg)); });
-            return true;
-        }
-        case CONCAT_FUN: {
-            auto [first, second] = get_operands_from_stack("CALL CONCAT");
+    template<int64_t Id>
+    void call_builtin() {
+        if constexpr (Id == PRINT_FUN) {
+            print(builtin_arg());
+            operand_stack.emplace_back();
+        } else if constexpr (Id == LEN_FUN) {
+            operand_stack.emplace_back(len(builtin_arg()));
+        } else if constexpr (Id == GET_FUN) {
+            auto arr = builtin_arg();
+            auto idx = umka_cast<int64_t>(builtin_arg());
+            operand_stack.push_back(get(arr, idx));
+        } else if constexpr (Id == SET_FUN) {
+            auto arr = builtin_arg();
+            auto idx = umka_cast<int64_t>(builtin_arg());
+            auto val = builtin_arg();
+            set(arr, idx, val);
+            operand_stack.emplace_back();
+        } else if constexpr (Id == ADD_FUN) {
+            auto arr = builtin_arg();
+            auto val = builtin_arg();
+            add_elem(arr, val);
+            // elements are stored inline, so growth is the only allocation to account for
+            garbage_collector.add_allocated_bytes(sizeof(Value));
+            operand_stack.emplace_back();
+        } else if constexpr (Id == REMOVE_FUN) {
+            auto arr = builtin_arg();
+            auto idx = umka_cast<int64_t>(builtin_arg());
+            remove(arr, idx);
+            operand_stack.emplace_back();
+        } else if constexpr (Id == CONCAT_FUN) {
+            auto first = builtin_arg();
+            auto second = builtin_arg();
             create_and_push(make_entity(first.to_string() + second.to_string()));
-            return true;
-        }
-        case MIN_FUN: {
-            auto [first, second] = get_operands_from_stack("CALL MIN");
-            create_and_push(std::min(first, second));
-            return true;
-        }
-        case MAX_FUN: {
-            auto [first, second] = get_operands_from_stack("CALL MAX");
-            create_and_push(std::max(first, second));
-            return true;
-        }
-        case SORT_FUN: {
-            call_void_proc([&](auto arr) { umka_sort(arr); });
-            return true;
-        }
-        case SPLIT_FUN: {
-            auto [str, delim] = get_operands_from_stack("CALL SPLIT");
-            std::vector<std::string> lines = split(str, delim);
-            create_array(lines);
-            return true;
-        }
-        case MAKE_HEAP_FUN: {
-            call_void_proc([&](auto arr) { make_heap(arr); });
-            return true;
-        }
-        case POP_HEAP_FUN: {
-            call_void_proc([&](auto arr) { pop_heap(arr); });
-            return true;
-        }
-        case PUSH_HEAP_FUN: {
-            call_void_proc([&](auto arr) { 
-                auto val = stack_pop();
-                push_heap(arr, val); 
-            });
-            return true;
+        } else if constexpr (Id == WRITE_FUN) {
+            auto filename = builtin_arg();
+            auto content = builtin_arg();
+            write(filename.to_string(), content);
+            operand_stack.emplace_back();
+        } else if constexpr (Id == READ_FUN) {
+            push_string_array(read(builtin_arg().to_string()));
+        } else if constexpr (Id == ASSERT_FUN) {
+            umka_assert(builtin_arg());
+            operand_stack.emplace_back();
+        } else if constexpr (Id == INPUT_FUN) {
+            create_and_push(make_entity(input()));
+        } else if constexpr (Id == RANDOM_FUN) {
+            operand_stack.emplace_back(random());
+        } else if constexpr (Id == POW_FUN) {
+            auto base = umka_cast<double>(builtin_arg());
+            auto exp = umka_cast<double>(builtin_arg());
+            operand_stack.emplace_back(pow(base, exp));
+        } else if constexpr (Id == SQRT_FUN) {
+            operand_stack.emplace_back(sqrt(umka_cast<double>(builtin_arg())));
+        } else if constexpr (Id == MIN_FUN || Id == MAX_FUN) {
+            auto first = builtin_arg();
+            auto second = builtin_arg();
+            operand_stack.push_back(Id == MIN_FUN ? std::min(first, second) : std::max(first, second));
+        } else if constexpr (Id == SORT_FUN) {
+            umka_sort(builtin_arg());
+            operand_stack.emplace_back();
+        } else if constexpr (Id == SPLIT_FUN) {
+            auto str = builtin_arg();
+            auto delim = builtin_arg();
+            push_string_array(split(str, delim));
+        } else if constexpr (Id == MAKE_HEAP_FUN) {
+            make_heap(builtin_arg());
+            operand_stack.emplace_back();
+        } else if constexpr (Id == POP_HEAP_FUN) {
+            pop_heap(builtin_arg());
+            operand_stack.emplace_back();
+        } else if constexpr (Id == PUSH_HEAP_FUN) {
+            auto arr = builtin_arg();
+            auto val = builtin_arg();
+            push_heap(arr, val);
+            garbage_collector.add_allocated_bytes(sizeof(Value));
+            operand_stack.emplace_back();
+        } else {
+            static_assert(Id != Id, "No handler for builtin");
         }
-        default: 
-            return false;
+    }
+
+    Value builtin_arg() {
+        return get_operand_from_stack("CALL_BUILTIN");
+    }
+
+    void push_string_array(const std::vector<std::string>& values) {
+        Entity array_entity = make_array();
+        Array& array = *std::get<Owner<Array>>(array_entity.value);
+        array.reserve(values.size());
+        for (const auto& value : values) {
+            array.push_back(create(make_entity(value)));
         }
+        create_and_push(std::move(array_entity));
     }
 
     void print_debug_parsed_info() {
@@ -627,8 +1741,8 @@ class StackMachine
         }
 
         std::cout << "\nConsts\n";
-        for (int id = 0; id < (int)const_pool.size(); ++id) {
-            std::cout << id << " " << parse_constant(const_pool[id]).to_string() << "\n";
+        for (int id = 0; id < (int)constants.size(); ++id) {
+            std::cout << id << " " << constants[id].to_string() << "\n";
         }
         std::cout << "\nCommands:\n";
         for (int i = 0; i < commands.size(); ++i) {
@@ -642,20 +1756,36 @@ class StackMachine
     }
 
     std::vector<Command> commands;
+    std::vector<Command> jit_commands;
     std::vector<Constant> const_pool;
+    std::vector<Value> constants;
+    std::vector<Owner<Entity>> constant_boxes;
     std::unordered_map<size_t, FunctionTableEntry> func_table;
+    std::vector<FunctionRecord> functions;
+    // result caches of the pure functions, FunctionRecord::memo points into them
+    std::vector<std::unique_ptr<MemoCache>> memo_caches;
     std::vector<VMethodTableEntry> vmethod_table;
     std::vector<VFieldTableEntry> vfield_table;
-    std::map<std::pair<int64_t, int64_t>, int64_t> vmethod_map;
-    std::map<std::pair<int64_t, int64_t>, int64_t> vfield_map;
+    MemberTable vmethods;
+    MemberTable vfields;
+    InlineCacheTable command_caches;
+    std::unordered_map<const Command*, JittedCode> jitted_code;
     std::unique_ptr<Profiler> profiler;
     std::vector<Owner<Entity>> heap = {};
     std::vector<StackFrame> stack_of_functions;
-    std::vector<Reference<Entity>> operand_stack;
+    std::vector<Value> locals;
+    std::vector<Value> operand_stack;
     GarbageCollector<Tag> garbage_collector;
     std::unique_ptr<jit::JitManager> jit_manager;
+    DispatchMode dispatch_mode;
+    std::unordered_map<const Command*, std::vector<const void*>> threaded_code;
+    // loop traces by header offset in `commands`
+    std::vector<TraceSlot> traces;
+    bool recording_trace = false;
+    static constexpr size_t kMaxTraceLength = 1000;
+    static constexpr uint32_t kMaxEarlyExits = 64;
 };
 
+#undef UMKA_HAS_COMPUTED_GOTO
 #undef CHECK_STACK_EMPTY
-#undef CHECK_REF
 }
@@ -1,6 +1,8 @@
 #include "standart_funcs.h"
 #include <model/model.h>
+#include <algorithm>
 #include <cmath>
+#include <iterator>
 #include <iostream>
 #include <fstream>
 #include <ostream>
@@ -10,17 +12,17 @@
 #include <vector>
 
 namespace umka::vm {
-void out(std::ostream& os, Entity entity) {
-    os << entity.to_string() << "\n";
+void out(std::ostream& os, Value value) {
+    os << value.to_string() << "\n";
 }
 
-void print(Entity entity) {
-    out(std::cout, entity);
+void print(Value value) {
+    out(std::cout, value);
 }
 
-void write(const std::string& filename, Entity entity) {
+void write(const std::string& filename, Value value) {
     auto file = std::ofstream(filename);
-    out(file, entity);
+    out(file, value);
 }
 
 std::vector<std::string> read(const std::string& filename) {
@@ -39,22 +41,22 @@ std::vector<std::string> read(const std::string& filename) {
     return lines;
 }
 
-int64_t len(Entity entity) {
-    if (std::holds_alternative<Owner<Array>>(entity.value)) {
-        return std::get<Owner<Array>>(entity.value)->size();
-    } else if (std::holds_alternative<std::string>(entity.value)) {
-        return std::get<std::string>(entity.value).size();
+int64_t len(Value value) {
+    if (auto* arr = value.get_if<Owner<Array>>()) {
+        return (*arr)->size();
+    } else if (auto* str = value.get_if<std::string>()) {
+        return str->size();
     }
     throw std::runtime_error("Invalid type for len()");
 }
 
-void add_elem(Entity array, Reference<Entity> elem) {
-    auto owner = std::get<Owner<Array>>(array.value);
+void add_elem(Value array, Value elem) {
+    auto& owner = array.get<Owner<Array>>();
     owner->emplace_back(elem);
 }
 
-void remove(Entity array, int64_t index) {
-    auto& arr = std::get<Owner<Array>>(array.value);
+void remove(Value array, int64_t index) {
+    auto& arr = array.get<Owner<Array>>();
     if (index < 0 || index >= static_cast<int64_t>(arr->size())) {
         throw std::out_of_range("Array index out of bounds");
     }
@@ -62,24 +64,24 @@ void remove(Entity array, int64_t index) {
     arr->erase(arr->begin() + index);
 }
 
-Reference<Entity> get(Entity array, int64_t index) {
-    auto& map = std::get<Owner<Array>>(array.value);
+Value get(Value array, int64_t index) {
+    auto& map = array.get<Owner<Array>>();
     if (index < 0 || index >= static_cast<int64_t>(map->size())) {
         throw std::out_of_range("Array index out of bounds");
     }
     return map->at(index);
 }
 
-void set(Entity array, int64_t index, Reference<Entity> elem) {
-    auto& map = std::get<Owner<Array>>(array.value);
+void set(Value array, int64_t index, Value elem) {
+    auto& map = array.get<Owner<Array>>();
     if (index < 0 || index >= static_cast<int64_t>(map->size())) {
         throw std::out_of_range("Array index out of bounds");
     }
     (*map)[index] = elem;
 }
 
-void umka_assert(Entity& condition) {
-    if (!std::get<bool>(condition.value)) {
+void umka_assert(Value condition) {
+    if (!condition.get<bool>()) {
         throw std::runtime_error("Assertion failed");
     }
 }
@@ -102,16 +104,16 @@ double sqrt(double number) {
     return std::sqrt(number);
 }
 
-void umka_sort(Entity array) {
-    auto arr = std::get<Owner<Array>>(array.value);
-    std::sort(arr->begin(), arr->end(), [](const auto a, const auto b) {
-        return *a.lock() < *b.lock();
+void umka_sort(Value array) {
+    auto& arr = array.get<Owner<Array>>();
+    std::sort(arr->begin(), arr->end(), [](const auto& a, const auto& b) {
+        return a < b;
     });
 }
 
-std::vector<std::string> split(const Entity& str_entity, const Entity& delim_entty) {
-    std::string str = str_entity.to_string();
-    std::string delim = delim_entty.to_string();
+std::vector<std::string> split(const Value& str_value, const Value& delim_value) {
+    std::string str = str_value.to_string();
+    std::string delim = delim_value.to_string();
 
     auto tokens = make_array();
     std::string processed = str;
@@ -129,26 +131,26 @@ std::vector<std::string> split(const Entity& str_entity, const Entity& delim_ent
     );
 }
 
-void make_heap(Entity array) {
-    auto arr = std::get<Owner<Array>>(array.value);
-    std::make_heap(arr->begin(), arr->end(), [](const auto a, const auto b) {
-        return *a.lock() < *b.lock();
+void make_heap(Value array) {
+    auto& arr = array.get<Owner<Array>>();
+    std::make_heap(arr->begin(), arr->end(), [](const auto& a, const auto& b) {
+        return a < b;
     });
 }
 
-void pop_heap(Entity array) {
-    auto arr = std::get<Owner<Array>>(array.value);
-    std::pop_heap(arr->begin(), arr->end(), [](const auto a, const auto b) {
-        return *a.lock() < *b.lock();
+void pop_heap(Value array) {
+    auto& arr = array.get<Owner<Array>>();
+    std::pop_heap(arr->begin(), arr->end(), [](const auto& a, const auto& b) {
+        return a < b;
     });
     arr->pop_back();
 }
 
-void push_heap(Entity array, Reference<Entity> elem) {
-    auto arr = std::get<Owner<Array>>(array.value);
+void push_heap(Value array, Value elem) {
+    auto& arr = array.get<Owner<Array>>();
     arr->emplace_back(elem);
-    std::push_heap(arr->begin(), arr->end(), [](const auto a, const auto b) {
-        return *a.lock() < *b.lock();
+    std::push_heap(arr->begin(), arr->end(), [](const auto& a, const auto& b) {
+        return a < b;
     });
 }
 }
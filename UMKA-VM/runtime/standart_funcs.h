@@ -8,23 +8,23 @@
 #include <vector>
 
 namespace umka::vm {
-void out(std::ostream& os, Reference<Entity> entity);
-void print(Entity entity);
-void write(const std::string& filename, Entity entity);
+void out(std::ostream& os, Value value);
+void print(Value value);
+void write(const std::string& filename, Value value);
 std::vector<std::string> read(const std::string& filename);
-int64_t len(Entity entity);
-void add_elem(Entity array, Reference<Entity> elem);
-void remove(Entity array, int64_t index);
-Reference<Entity> get(Entity array, int64_t index);
-void set(Entity array, int64_t index, Reference<Entity> elem);
-void umka_assert(Entity& condition);
+int64_t len(Value value);
+void add_elem(Value array, Value elem);
+void remove(Value array, int64_t index);
+Value get(Value array, int64_t index);
+void set(Value array, int64_t index, Value elem);
+void umka_assert(Value condition);
 std::string input();
 double random();
 double pow(double base, double exp);
 double sqrt(double number);
-void umka_sort(Entity array);
-std::vector<std::string> split(const Entity& str_entity, const Entity& delim_entity);
-void make_heap(Entity array);
-void pop_heap(Entity array);
-void push_heap(Entity array, Reference<Entity> elem);
+void umka_sort(Value array);
+std::vector<std::string> split(const Value& str_value, const Value& delim_value);
+void make_heap(Value array);
+void pop_heap(Value array);
+void push_heap(Value array, Value elem);
 }
@@ -2,6 +2,7 @@
 #include <model/model.h>
 #include <runtime/stack_machine.h>
 #include <parser/command_parser.h>
+#include <parser/bytecode_verifier.h>
 
 using namespace umka::vm;
 
@@ -65,6 +66,25 @@ TEST_F(EntityTest, CmpTest) {
     EXPECT_FALSE(a <= b);
 }
 
+TEST_F(EntityTest, ValueKeepsScalarsInline) {
+    Value i = int64_t{2};
+    Value d = 2.0;
+    Value b = true;
+    EXPECT_FALSE(i.is_boxed());
+    EXPECT_TRUE(i == d);
+    EXPECT_TRUE(Value(int64_t{1}) == b);
+    EXPECT_TRUE(Value(int64_t{3}) > d);
+    EXPECT_EQ(numeric_applier(i, d, [](auto a, auto b) { return a + b; }).to_string(), "4.000000");
+    EXPECT_EQ(numeric_applier(b, b, [](auto a, auto b) { return a + b; }).get<int64_t>(), 2);
+
+    Entity str = make_entity(std::string("42"));
+    Value boxed(&str);
+    EXPECT_TRUE(boxed.is_boxed());
+    EXPECT_EQ(umka_cast<int64_t>(boxed), 42);
+    EXPECT_EQ(umka_cast<std::string>(Value{}), "unit");
+    EXPECT_FALSE(boxed == Value(int64_t{42}));
+}
+
 class StackMachineTest : public ::testing::Test {
 protected:
     Command return_cmd = Command{RETURN, 0};
@@ -78,6 +98,17 @@ protected:
         parser.const_pool.push_back(int_const);
     }
 
+    // appends INT64 constants to the pool, after the 42 at index 0
+    void push_int_constants(std::initializer_list<int64_t> values) {
+        for (int64_t value : values) {
+            Constant constant;
+            constant.type = TYPE_INT64;
+            constant.data.resize(sizeof(int64_t));
+            *reinterpret_cast<int64_t*>(constant.data.data()) = value;
+            parser.const_pool.push_back(constant);
+        }
+    }
+
     MockCommandParser parser;
 };
 
@@ -316,6 +347,1286 @@ TEST_F(StackMachineTest, FunctionCallWithArguments) {
     ASSERT_EQ(*calls, 8);
 }
 
+TEST_F(StackMachineTest, SwitchDispatchFallback) {
+    Constant const5, const3;
+    const5.type = TYPE_INT64; const3.type = TYPE_INT64;
+    const5.data.resize(sizeof(int64_t));
+    const3.data.resize(sizeof(int64_t));
+    *reinterpret_cast<int64_t*>(const5.data.data()) = 5;
+    *reinterpret_cast<int64_t*>(const3.data.data()) = 3;
+
+    parser.const_pool = {const5, const3};
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.code_offset = 4;
+    func.code_offset_end = 8;
+    parser.func_table[0] = func;
+
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{PUSH_CONST, 1},
+        Command{CALL, 0},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{RETURN},
+    };
+
+    auto [calls, validator] = make_instruction_validator({
+        PUSH_CONST, PUSH_CONST, CALL, LOAD, LOAD, ADD, RETURN, RETURN
+    });
+
+    StackMachine<DebugMod> machine(parser, DispatchMode::SWITCH);
+    machine.run(validator);
+    ASSERT_EQ(*calls, 8);
+}
+
+TEST_F(StackMachineTest, ThreadedDispatchFallsOffCodeEnd) {
+    // no RETURN: the frame must be popped when the code runs out
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{JMP, 1},
+        Command{POP},
+        Command{PUSH_CONST, 0},
+    };
+
+    auto [calls, validator] = make_instruction_validator({PUSH_CONST, JMP, PUSH_CONST});
+
+    StackMachine<DebugMod> machine(parser, DispatchMode::THREADED);
+    machine.run(validator);
+    ASSERT_EQ(*calls, 3);
+}
+
+TEST_F(StackMachineTest, JumpOutOfRangeThrows) {
+    parser.commands = {
+        Command{JMP, 5},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        StackMachine<ReleaseMod> machine(copy, mode);
+        EXPECT_THROW(machine.run(), std::runtime_error);
+    }
+}
+
+TEST_F(StackMachineTest, PushConstAllConstantTypes) {
+    Constant double_const, string_const, unit_const;
+    double_const.type = TYPE_DOUBLE;
+    double_const.data.resize(sizeof(double));
+    *reinterpret_cast<double*>(double_const.data.data()) = 2.5;
+    string_const.type = TYPE_STRING;
+    string_const.data = {'u', 'm', 'k', 'a'};
+    unit_const.type = TYPE_UNIT;
+
+    parser.const_pool.push_back(double_const);
+    parser.const_pool.push_back(string_const);
+    parser.const_pool.push_back(unit_const);
+
+    // the same constant pushed twice must stay intact after being stored and loaded
+    parser.commands = {
+        Command{PUSH_CONST, 2},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{PUSH_CONST, 1},
+        Command{PUSH_CONST, 3},
+        Command{PUSH_CONST, 0},
+        Command{RETURN},
+    };
+
+    std::vector<std::string> stack_tops;
+    StackMachine<DebugMod> machine(parser);
+    machine.run([&](Command, std::string stack_top) { stack_tops.push_back(stack_top); });
+
+    std::vector<std::string> expected = {
+        "EMPTY STACK", "umka", "EMPTY STACK", "umka", "umka", "2.500000", "unit", "42"
+    };
+    EXPECT_EQ(stack_tops, expected);
+}
+
+TEST_F(StackMachineTest, CalleeLocalsDoNotClobberCaller) {
+    Constant const7;
+    const7.type = TYPE_INT64;
+    const7.data.resize(sizeof(int64_t));
+    *reinterpret_cast<int64_t*>(const7.data.data()) = 7;
+    parser.const_pool.push_back(const7);
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 1;
+    func.local_count = 1;
+    func.code_offset = 7;
+    func.code_offset_end = 11;
+    parser.func_table[0] = func;
+
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{CALL, 0},
+        Command{POP},
+        Command{LOAD, 0},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{STORE, 1},
+        Command{LOAD, 1},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        std::vector<std::string> stack_tops;
+        StackMachine<DebugMod> machine(copy, mode);
+        machine.run([&](Command, std::string stack_top) { stack_tops.push_back(stack_top); });
+
+        ASSERT_EQ(stack_tops.size(), 11);
+        EXPECT_EQ(stack_tops[7], "7");
+        EXPECT_EQ(stack_tops[10], "42");
+    }
+}
+
+TEST_F(StackMachineTest, PolymorphicMethodCallSite) {
+    for (int64_t value : {0, 1, 7, 9, 5}) {
+        Constant c;
+        c.type = TYPE_INT64;
+        c.data.resize(sizeof(int64_t));
+        *reinterpret_cast<int64_t*>(c.data.data()) = value;
+        parser.const_pool.push_back(c);
+    }
+
+    auto add_function = [&](uint64_t id, int64_t begin, int64_t end, int64_t args) {
+        FunctionTableEntry func;
+        func.id = id;
+        func.code_offset = begin;
+        func.code_offset_end = end;
+        func.arg_count = args;
+        parser.func_table[id] = func;
+    };
+    add_function(0, 0, 16, 0);
+    add_function(1, 16, 19, 1);
+    add_function(2, 19, 21, 1);
+    add_function(3, 21, 23, 1);
+    parser.vmethod_table = {
+        VMethodTableEntry{.class_id = 0, .method_id = 0, .function_id = 2},
+        VMethodTableEntry{.class_id = 1, .method_id = 0, .function_id = 3},
+    };
+
+    // main calls f(obj) for objects of class 0, 1 and 0 again; f has a single CALL_METHOD site
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{BUILD_ARR, 1},
+        Command{CALL, 1},
+        Command{CALL, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 2},
+        Command{BUILD_ARR, 1},
+        Command{CALL, 1},
+        Command{CALL, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 1},
+        Command{BUILD_ARR, 1},
+        Command{CALL, 1},
+        Command{CALL, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{CALL_METHOD, 0},
+        Command{RETURN},
+        Command{PUSH_CONST, 3},
+        Command{RETURN},
+        Command{PUSH_CONST, 4},
+        Command{RETURN},
+    };
+
+    MockCommandParser unknown_class = parser;
+    unknown_class.commands[10] = Command{PUSH_CONST, 5};
+
+    testing::internal::CaptureStdout();
+    StackMachine<ReleaseMod> machine(parser);
+    machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "7\n9\n7\n");
+
+    testing::internal::CaptureStdout();
+    StackMachine<ReleaseMod> failing(unknown_class);
+    EXPECT_THROW(failing.run(), std::runtime_error);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "7\n9\n");
+}
+
+TEST_F(StackMachineTest, LinkRejectsUnknownCallTargets) {
+    FunctionTableEntry func;
+    func.id = 0;
+    func.arg_count = 0;
+    func.local_count = 0;
+    func.code_offset = 3;
+    func.code_offset_end = 5;
+    parser.func_table[0] = func;
+
+    parser.commands = {
+        Command{CALL, 0},
+        Command{CALL, PRINT_FUN},
+        Command{RETURN},
+        Command{PUSH_CONST, 0},
+        Command{RETURN},
+    };
+
+    MockCommandParser unknown_call = parser;
+    unknown_call.commands[0] = Command{CALL, 1};
+    EXPECT_THROW(StackMachine<ReleaseMod>{unknown_call}, std::runtime_error);
+
+    testing::internal::CaptureStdout();
+    StackMachine<ReleaseMod> machine(parser);
+    machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "42\n");
+}
+
+TEST_F(StackMachineTest, TailCallReusesTheCallerFrame) {
+    push_int_constants({0, 100, 1});
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.local_count = 0;
+    func.code_offset = 6;
+    func.code_offset_end = 19;
+    parser.func_table[0] = func;
+
+    // print(sum(100, 0)) with sum(n, acc) = n == 0 ? acc : sum(n - 1, acc + n)
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{PUSH_CONST, 2},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{PUSH_CONST, 1},
+        Command{LOAD, 0},
+        Command{EQ},
+        Command{JMP_IF_FALSE, 2},
+        Command{LOAD, 1},
+        Command{RETURN},
+        Command{LOAD, 1},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{SUB},
+        Command{TAIL_CALL, 0},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "5050\n");
+    }
+
+    MockCommandParser cached = parser;
+    testing::internal::CaptureStdout();
+    StackMachine<TosCachedMod> tos_machine(cached);
+    tos_machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "5050\n");
+
+    MockCommandParser debugged = parser;
+    size_t max_depth = 0;
+    testing::internal::CaptureStdout();
+    StackMachine<DebugMod> debug_machine(debugged);
+    debug_machine.run([&](Command, std::string) { max_depth = std::max(max_depth, debug_machine.call_depth()); });
+    testing::internal::GetCapturedStdout();
+    EXPECT_EQ(max_depth, 2);
+
+    MockCommandParser builtin_target = parser;
+    builtin_target.commands[18] = Command{TAIL_CALL, PRINT_FUN};
+    EXPECT_THROW(StackMachine<ReleaseMod>{builtin_target}, std::runtime_error);
+}
+
+TEST_F(StackMachineTest, PureRecursionIsMemoized) {
+    push_int_constants({60, 2, 1});
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 1;
+    func.local_count = 0;
+    func.code_offset = 5;
+    func.code_offset_end = 21;
+    parser.func_table[0] = func;
+
+    // print(fib(60)) with the naive fib(n) = n < 2 ? n : fib(n - 2) + fib(n - 1), which
+    // only finishes with its results cached
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 2},
+        Command{LOAD, 0},
+        Command{RETURN},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{SUB},
+        Command{CALL, 0},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{SUB},
+        Command{CALL, 0},
+        Command{ADD},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "1548008755920\n");
+    }
+}
+
+TEST_F(StackMachineTest, CallBuiltinPushesOneResult) {
+    Constant const7;
+    const7.type = TYPE_INT64;
+    const7.data.resize(sizeof(int64_t));
+    *reinterpret_cast<int64_t*>(const7.data.data()) = 7;
+    parser.const_pool.push_back(const7);
+
+    // print(print(min(42, 7))): the outer print gets the unit returned by the inner one
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{PUSH_CONST, 1},
+        Command{CALL_BUILTIN, MIN_FUN},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "7\nunit\n");
+    }
+}
+
+TEST_F(StackMachineTest, QuickenedSiteFollowsOperandTypes) {
+    Constant const7;
+    const7.type = TYPE_INT64;
+    const7.data.resize(sizeof(int64_t));
+    *reinterpret_cast<int64_t*>(const7.data.data()) = 7;
+    parser.const_pool.push_back(const7);
+
+    Constant const_half;
+    const_half.type = TYPE_DOUBLE;
+    const_half.data.resize(sizeof(double));
+    *reinterpret_cast<double*>(const_half.data.data()) = 1.5;
+    parser.const_pool.push_back(const_half);
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.local_count = 1;
+    func.code_offset = 16;
+    func.code_offset_end = 20;
+    parser.func_table[0] = func;
+
+    // the single ADD in function 0 sees int, double and then mixed operands
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{PUSH_CONST, 0},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 2},
+        Command{PUSH_CONST, 2},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 2},
+        Command{PUSH_CONST, 1},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "49\n3.000000\n8.500000\n");
+    }
+}
+
+TEST_F(StackMachineTest, QuickeningIgnoresTheOperandField) {
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.local_count = 1;
+    func.code_offset = 9;
+    func.code_offset_end = 13;
+    parser.func_table[0] = func;
+
+    // a stray operand on ADD is no de-quickened site
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{PUSH_CONST, 0},
+        Command{CALL, 0},
+        Command{POP},
+        Command{PUSH_CONST, 0},
+        Command{PUSH_CONST, 0},
+        Command{CALL, 0},
+        Command{POP},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{ADD, 7},
+        Command{RETURN},
+    };
+
+    std::vector<uint8_t> executed;
+    StackMachine<DebugMod> machine(parser);
+    machine.run([&](const Command& cmd, const std::string&) { executed.push_back(cmd.code); });
+    EXPECT_EQ(std::ranges::count(executed, uint8_t{ADD}), 1);
+    EXPECT_EQ(std::ranges::count(executed, uint8_t{ADD_I64_I64}), 1);
+}
+
+TEST_F(StackMachineTest, IntegerDivisionByZeroRaisesTheVmError) {
+    Constant zero;
+    zero.type = TYPE_INT64;
+    zero.data.resize(sizeof(int64_t));
+    parser.const_pool.push_back(zero);
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.local_count = 1;
+    func.code_offset = 11;
+    func.code_offset_end = 15;
+    parser.func_table[0] = func;
+
+    // 42 / 42 quickens the DIV, then 42 / 0 reaches the typed form
+    for (auto op : {DIV, REM}) {
+        parser.commands = {
+            Command{PUSH_CONST, 0},
+            Command{PUSH_CONST, 0},
+            Command{CALL, 0},
+            Command{CALL_BUILTIN, PRINT_FUN},
+            Command{POP},
+            Command{PUSH_CONST, 1},
+            Command{PUSH_CONST, 0},
+            Command{CALL, 0},
+            Command{CALL_BUILTIN, PRINT_FUN},
+            Command{POP},
+            Command{RETURN},
+            Command{LOAD, 1},
+            Command{LOAD, 0},
+            Command{op},
+            Command{RETURN},
+        };
+
+        auto expect_error = [](auto& machine) {
+            testing::internal::CaptureStdout();
+            try {
+                machine.run();
+                ADD_FAILURE() << "no error";
+            } catch (const std::runtime_error& error) {
+                EXPECT_NE(std::string(error.what()).find("integer division by zero"), std::string::npos);
+            }
+            testing::internal::GetCapturedStdout();
+        };
+        for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+            MockCommandParser copy = parser;
+            StackMachine<ReleaseMod> machine(copy, mode);
+            expect_error(machine);
+        }
+        MockCommandParser copy = parser;
+        StackMachine<TosCachedMod> cached(copy);
+        expect_error(cached);
+    }
+}
+
+TEST_F(StackMachineTest, IntegerDivisionOverflowIsDefined) {
+    push_int_constants({std::numeric_limits<int64_t>::min(), -1, 7});
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 2;
+    func.local_count = 1;
+    func.code_offset = 11;
+    func.code_offset_end = 15;
+    parser.func_table[0] = func;
+
+    // 7 op -1 quickens the site, then INT64_MIN op -1 reaches the typed form: the quotient
+    // overflows and raises the VM error, the remainder is 0
+    for (auto op : {DIV, REM}) {
+        parser.commands = {
+            Command{PUSH_CONST, 2},
+            Command{PUSH_CONST, 3},
+            Command{CALL, 0},
+            Command{CALL_BUILTIN, PRINT_FUN},
+            Command{POP},
+            Command{PUSH_CONST, 2},
+            Command{PUSH_CONST, 1},
+            Command{CALL, 0},
+            Command{CALL_BUILTIN, PRINT_FUN},
+            Command{POP},
+            Command{RETURN},
+            Command{LOAD, 1},
+            Command{LOAD, 0},
+            Command{op},
+            Command{RETURN},
+        };
+
+        auto expect_result = [op](auto& machine) {
+            testing::internal::CaptureStdout();
+            if (op == REM) {
+                machine.run();
+                EXPECT_EQ(testing::internal::GetCapturedStdout(), "0\n0\n");
+                return;
+            }
+            try {
+                machine.run();
+                ADD_FAILURE() << "no error";
+            } catch (const std::runtime_error& error) {
+                EXPECT_NE(std::string(error.what()).find("integer division overflow"), std::string::npos);
+            }
+            EXPECT_EQ(testing::internal::GetCapturedStdout(), "-7\n");
+        };
+        for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+            MockCommandParser copy = parser;
+            StackMachine<ReleaseMod> machine(copy, mode);
+            expect_result(machine);
+        }
+        MockCommandParser copy = parser;
+        StackMachine<TosCachedMod> cached(copy);
+        expect_result(cached);
+    }
+}
+
+TEST_F(StackMachineTest, SuperinstructionsKeepLoopSemantics) {
+    push_int_constants({0, 1, 5});
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 1;
+    func.local_count = 2;
+    func.code_offset = 5;
+    func.code_offset_end = 24;
+    parser.func_table[0] = func;
+
+    // constants 1..3 are 0, 1 and 5; function 0 sums 0..n, parts of its loop head
+    // and increment are fused in the release runs
+    parser.commands = {
+        Command{PUSH_CONST, 3},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 2},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{LTE},
+        Command{JMP_IF_FALSE, 9},
+        Command{LOAD, 1},
+        Command{LOAD, 2},
+        Command{ADD},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{JMP, -13},
+        Command{LOAD, 2},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "15\n");
+    }
+
+    // the unfused debug run measures the sequences the catalogue is built from
+    MockCommandParser copy = parser;
+    testing::internal::CaptureStdout();
+    StackMachine<DebugMod> machine(copy, DispatchMode::SWITCH);
+    machine.run();
+    testing::internal::GetCapturedStdout();
+    const std::vector<uint8_t> loop_head = {LOAD, LOAD, LTE, JMP_IF_FALSE};
+    int64_t loop_head_count = 0;
+    for (const auto& sequence : machine.get_profiler()->get_hot_sequences(1000)) {
+        if (sequence.opcodes == loop_head) {
+            loop_head_count = sequence.count;
+        }
+    }
+    EXPECT_EQ(loop_head_count, 7);
+}
+
+TEST_F(StackMachineTest, TosCachedModMatchesReleaseMod) {
+    push_int_constants({0, 1, 5});
+    Constant double_const;
+    double_const.type = TYPE_DOUBLE;
+    double_const.data.resize(sizeof(double));
+    *reinterpret_cast<double*>(double_const.data.data()) = 2.5;
+    parser.const_pool.push_back(double_const);
+
+    FunctionTableEntry func;
+    func.id = 1;
+    func.arg_count = 1;
+    func.local_count = 2;
+    func.code_offset = 19;
+    func.code_offset_end = 38;
+    parser.func_table[0] = func;
+
+    // a loop in function 0, three operands overflowing the two cached values and mixed
+    // int and double operands taking the generic path
+    parser.commands = {
+        Command{PUSH_CONST, 3},
+        Command{CALL, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 4},
+        Command{PUSH_CONST, 4},
+        Command{PUSH_CONST, 4},
+        Command{ADD},
+        Command{ADD},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{PUSH_CONST, 4},
+        Command{PUSH_CONST, 3},
+        Command{PUSH_CONST, 0},
+        Command{SUB},
+        Command{MUL},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{RETURN},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 2},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{LTE},
+        Command{JMP_IF_FALSE, 9},
+        Command{LOAD, 1},
+        Command{LOAD, 2},
+        Command{ADD},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{JMP, -13},
+        Command{LOAD, 2},
+        Command{RETURN},
+    };
+
+    const std::string expected = "15\n7.500000\n92.500000\n";
+    {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+    }
+    {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<TosCachedMod> machine(copy);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+    }
+}
+
+TEST_F(StackMachineTest, LoopTraceLeavesOnBranchAndTypeChanges) {
+    push_int_constants({0, 1, 3000, 1500});
+    Constant half;
+    half.type = TYPE_DOUBLE;
+    half.data.resize(sizeof(double));
+    *reinterpret_cast<double*>(half.data.data()) = 0.5;
+    parser.const_pool.push_back(half);
+
+    FunctionTableEntry main_func;
+    main_func.id = 0;
+    main_func.local_count = 3;
+    main_func.code_offset = 0;
+    main_func.code_offset_end = 34;
+    parser.func_table[0] = main_func;
+
+    // for (i = 0; i < 3000; ++i) { if (i < 1500) a = a + 1; else b = b + 0.5; }
+    // the loop is traced on the first branch, which stops holding halfway, and b turns
+    // from int into double
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 18},
+        Command{PUSH_CONST, 4},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 5},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{JMP, 4},
+        Command{PUSH_CONST, 5},
+        Command{LOAD, 2},
+        Command{ADD},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -22},
+        Command{LOAD, 1},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{POP},
+        Command{LOAD, 2},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+    };
+
+    testing::internal::CaptureStdout();
+    StackMachine<ReleaseMod> machine(parser);
+    machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "1500\n750.000000\n");
+}
+
+TEST_F(StackMachineTest, LoopWithCallIsTraced) {
+    push_int_constants({0, 1, 3000});
+
+    FunctionTableEntry main_func;
+    main_func.id = 0;
+    main_func.local_count = 2;
+    main_func.code_offset = 0;
+    main_func.code_offset_end = 21;
+    parser.func_table[0] = main_func;
+
+    FunctionTableEntry inc;
+    inc.id = 1;
+    inc.arg_count = 1;
+    inc.local_count = 0;
+    inc.code_offset = 21;
+    inc.code_offset_end = 25;
+    parser.func_table[1] = inc;
+
+    // for (i = 0; i < 3000; ++i) s = s + inc(i); with inc(x) = x + 1
+    // inc is recorded into the trace of the loop headed at offset 4
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 10},
+        Command{LOAD, 0},
+        Command{CALL, 1},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -14},
+        Command{LOAD, 1},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "4501500\n");
+        EXPECT_TRUE(machine.has_trace(4));
+    }
+}
+
+TEST_F(StackMachineTest, HotLoopContinuesInJittedMain) {
+    push_int_constants({0, 1, 2500, 150});
+
+    FunctionTableEntry main_func;
+    main_func.id = 0;
+    main_func.local_count = 3;
+    main_func.code_offset = 0;
+    main_func.code_offset_end = 31;
+    parser.func_table[0] = main_func;
+
+    // for (i = 0; i < 2500; ++i) for (j = 0; j < 150; ++j) sum = sum + j;
+    // an outer iteration is too long to trace, so main is jitted and the running frame moves
+    // into it at the outer loop head
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 20},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 4},
+        Command{LOAD, 1},
+        Command{LT},
+        Command{JMP_IF_FALSE, 9},
+        Command{LOAD, 1},
+        Command{LOAD, 2},
+        Command{ADD},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{JMP, -13},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -24},
+        Command{LOAD, 2},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+    };
+
+    {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "27937500\n");
+    }
+    {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<TosCachedMod> machine(copy);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "27937500\n");
+    }
+}
+
+TEST_F(StackMachineTest, TosCachedModTracesHotLoops) {
+    push_int_constants({0, 1, 3000});
+
+    FunctionTableEntry main_func;
+    main_func.id = 0;
+    main_func.local_count = 2;
+    main_func.code_offset = 0;
+    main_func.code_offset_end = 20;
+    parser.func_table[0] = main_func;
+
+    // for (i = 0; i < 3000; ++i) s = s + i;
+    // the cached back edge counts the loop headed at offset 4 and records its trace
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 9},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -13},
+        Command{LOAD, 1},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+    };
+
+    testing::internal::CaptureStdout();
+    StackMachine<TosCachedMod> machine(parser);
+    machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "4498500\n");
+    EXPECT_TRUE(machine.has_trace(4));
+}
+
+TEST_F(StackMachineTest, TracedMethodCallGuardsReceiverClass) {
+    push_int_constants({0, 1, 3000, 2950, 10, 20, 99});
+
+    auto add_function = [&](uint64_t id, int64_t begin, int64_t end, int64_t args, int64_t locals) {
+        FunctionTableEntry func;
+        func.id = id;
+        func.code_offset = begin;
+        func.code_offset_end = end;
+        func.arg_count = args;
+        func.local_count = locals;
+        parser.func_table[id] = func;
+    };
+    add_function(0, 0, 36, 0, 4);
+    add_function(1, 36, 40, 1, 0);
+    add_function(2, 40, 46, 1, 0);
+    parser.vmethod_table = {
+        VMethodTableEntry{.class_id = 0, .method_id = 0, .function_id = 1},
+        VMethodTableEntry{.class_id = 1, .method_id = 0, .function_id = 2},
+    };
+    parser.vfield_table = {
+        VFieldTableEntry{.class_id = 0, .field_id = 0, .field_index = 1},
+        VFieldTableEntry{.class_id = 1, .field_id = 0, .field_index = 2},
+    };
+
+    // a = {class 0, x = 10}, b = {class 1, 99, x = 20}, obj = a
+    // for (i = 0; i < 3000; ++i) { if (i == 2950) obj = b; s = s + obj.get(); }
+    // with get() = x for class 0 and x + 1 for class 1; the trace headed at offset 13 records
+    // get of class 0, so the class guard leaves it once obj is b
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{PUSH_CONST, 5},
+        Command{BUILD_ARR, 2},
+        Command{STORE, 2},
+        Command{PUSH_CONST, 2},
+        Command{PUSH_CONST, 7},
+        Command{PUSH_CONST, 6},
+        Command{BUILD_ARR, 3},
+        Command{STORE, 3},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 16},
+        Command{PUSH_CONST, 4},
+        Command{LOAD, 0},
+        Command{EQ},
+        Command{JMP_IF_FALSE, 2},
+        Command{LOAD, 3},
+        Command{STORE, 2},
+        Command{LOAD, 2},
+        Command{CALL_METHOD, 0},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -20},
+        Command{LOAD, 1},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{GET_FIELD, 0},
+        Command{CALL_BUILTIN, GET_FUN},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{GET_FIELD, 0},
+        Command{CALL_BUILTIN, GET_FUN},
+        Command{PUSH_CONST, 2},
+        Command{ADD},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "30550\n");
+        EXPECT_TRUE(machine.has_trace(13));
+    }
+}
+
+TEST_F(StackMachineTest, TraceExitInsideInlinedCallRebuildsItsFrame) {
+    push_int_constants({0, 1, 3000, 2950, 10});
+
+    FunctionTableEntry main_func;
+    main_func.id = 0;
+    main_func.local_count = 2;
+    main_func.code_offset = 0;
+    main_func.code_offset_end = 25;
+    parser.func_table[0] = main_func;
+
+    FunctionTableEntry pick;
+    pick.id = 1;
+    pick.arg_count = 1;
+    pick.local_count = 0;
+    pick.code_offset = 25;
+    pick.code_offset_end = 33;
+    parser.func_table[1] = pick;
+
+    // for (i = 0; i < 3000; ++i) s = s + get([i, pick(i)], 1);
+    // with pick(x) = x < 2950 ? 1 : 10; the trace headed at offset 4 records pick's first
+    // branch, so from i = 2950 on it leaves inside pick with main's operands still pending
+    parser.commands = {
+        Command{PUSH_CONST, 1},
+        Command{STORE, 0},
+        Command{PUSH_CONST, 1},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 3},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 14},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{LOAD, 0},
+        Command{CALL, 1},
+        Command{BUILD_ARR, 2},
+        Command{CALL_BUILTIN, GET_FUN},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{STORE, 1},
+        Command{PUSH_CONST, 2},
+        Command{LOAD, 0},
+        Command{ADD},
+        Command{STORE, 0},
+        Command{JMP, -18},
+        Command{LOAD, 1},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+        Command{PUSH_CONST, 4},
+        Command{LOAD, 0},
+        Command{LT},
+        Command{JMP_IF_FALSE, 2},
+        Command{PUSH_CONST, 2},
+        Command{RETURN},
+        Command{PUSH_CONST, 5},
+        Command{RETURN},
+    };
+
+    for (auto mode : {DispatchMode::SWITCH, DispatchMode::THREADED}) {
+        MockCommandParser copy = parser;
+        testing::internal::CaptureStdout();
+        StackMachine<ReleaseMod> machine(copy, mode);
+        machine.run();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "3450\n");
+        EXPECT_TRUE(machine.has_trace(4));
+    }
+}
+
+TEST(TieringPolicyTest, ParsesOverridesAndRejectsUnknownKeys) {
+    TieringPolicy policy = TieringPolicy::parse("baseline=10,optimize=200,loop=3");
+    EXPECT_EQ(policy.baseline_threshold, 10);
+    EXPECT_EQ(policy.optimize_threshold, 200);
+    EXPECT_EQ(policy.loop_weight, 3);
+    EXPECT_EQ(policy.call_weight, TieringPolicy{}.call_weight);
+
+    TieringPolicy off = TieringPolicy::parse("off", policy);
+    EXPECT_EQ(off.baseline_threshold, 0);
+    EXPECT_EQ(off.optimize_threshold, 0);
+    EXPECT_EQ(off.loop_weight, 3);
+
+    EXPECT_THROW(TieringPolicy::parse("hot=1"), std::runtime_error);
+    EXPECT_THROW(TieringPolicy::parse("baseline=-1"), std::runtime_error);
+    EXPECT_THROW(TieringPolicy::parse("optimize"), std::runtime_error);
+    EXPECT_THROW(TieringPolicy::parse("trace=0"), std::runtime_error);
+}
+
+TEST(ProfilerTest, ReportsEachTierOnce) {
+    std::unordered_map<size_t, FunctionTableEntry> func_table{ { 0, FunctionTableEntry{} } };
+    std::vector<Command> commands;
+    TieringPolicy policy = TieringPolicy::parse("call=1,loop=2,baseline=3,optimize=6,decay=0");
+    Profiler profiler(func_table, commands, policy);
+    const size_t slot = profiler.counter_slot(0);
+
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::BASELINE);
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+    // forward jumps do not count
+    EXPECT_EQ(profiler.record_backward_jump(2, 5, 0).tier, umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.function_hotness(slot), 4);
+    EXPECT_EQ(profiler.record_backward_jump(5, 2, 0).tier, umka::jit::Tier::OPTIMIZED);
+    EXPECT_EQ(profiler.record_backward_jump(5, 2, 0).tier, umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+}
+
+TEST(ProfilerTest, BackEdgesOfDifferentFunctionsStayApart) {
+    std::unordered_map<size_t, FunctionTableEntry> func_table{ { 0, FunctionTableEntry{} }, { 1, FunctionTableEntry{} } };
+    std::vector<Command> commands;
+    Profiler profiler(func_table, commands, TieringPolicy::parse("loop=1,baseline=3,optimize=0,decay=0"));
+
+    // both loops close at offset 7 of the code their frames run, e.g. two jitted copies
+    EXPECT_EQ(profiler.record_backward_jump(7, 2, 0).tier, umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.record_backward_jump(7, 2, 1).tier, umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.record_backward_jump(7, 2, 1).tier, umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.record_backward_jump(7, 2, 1).tier, umka::jit::Tier::BASELINE);
+    EXPECT_EQ(profiler.function_hotness(profiler.counter_slot(0)), 1);
+    EXPECT_EQ(profiler.function_hotness(profiler.counter_slot(1)), 3);
+}
+
+TEST(MemoizationTest, PurityFollowsTheCallGraph) {
+    std::unordered_map<size_t, FunctionTableEntry> func_table;
+    auto add_function = [&](size_t id, int64_t begin, int64_t end) {
+        FunctionTableEntry func;
+        func.id = id;
+        func.arg_count = 1;
+        func.code_offset = begin;
+        func.code_offset_end = end;
+        func_table[id] = func;
+    };
+    add_function(0, 0, 3);
+    add_function(1, 3, 5);
+    add_function(2, 5, 9);
+    add_function(3, 9, 11);
+    add_function(4, 11, 13);
+
+    std::vector<Command> commands = {
+        // 0 prints
+        Command{LOAD, 0},
+        Command{CALL_BUILTIN, PRINT_FUN},
+        Command{RETURN},
+        // 1 calls 0
+        Command{CALL, 0},
+        Command{RETURN},
+        // 2 calls itself and max
+        Command{LOAD, 0},
+        Command{CALL, 2},
+        Command{CALL_BUILTIN, MAX_FUN},
+        Command{RETURN},
+        // 3 tail calls 2
+        Command{LOAD, 0},
+        Command{TAIL_CALL, 2},
+        // 4 reads a field
+        Command{GET_FIELD, 0},
+        Command{RETURN},
+    };
+
+    EXPECT_EQ(find_pure_functions(commands, func_table), (std::vector<bool>{false, false, true, true, false}));
+}
+
+TEST(ProfilerTest, DecayHalvesHotness) {
+    std::unordered_map<size_t, FunctionTableEntry> func_table{ { 0, FunctionTableEntry{} } };
+    std::vector<Command> commands;
+    Profiler profiler(func_table, commands, TieringPolicy::parse("baseline=4,optimize=0,decay=4"));
+    const size_t slot = profiler.counter_slot(0);
+
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+    }
+    EXPECT_EQ(profiler.function_hotness(slot), 2); // 3 halved, then the fourth call
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::INTERPRETED);
+    EXPECT_EQ(profiler.increment_function_call(slot), umka::jit::Tier::BASELINE);
+}
+
+class BytecodeVerifierTest : public StackMachineTest {
+protected:
+    // main (function 0) calls function 1, which adds its two arguments
+    void SetUp() override {
+        StackMachineTest::SetUp();
+        FunctionTableEntry main_func;
+        main_func.id = 0;
+        main_func.code_offset = 0;
+        main_func.code_offset_end = 5;
+        parser.func_table[0] = main_func;
+
+        FunctionTableEntry add_func;
+        add_func.id = 1;
+        add_func.arg_count = 2;
+        add_func.code_offset = 5;
+        add_func.code_offset_end = 9;
+        parser.func_table[1] = add_func;
+
+        parser.commands = {
+            Command{PUSH_CONST, 0},
+            Command{PUSH_CONST, 0},
+            Command{CALL, 1},
+            Command{CALL, PRINT_FUN},
+            Command{RETURN},
+            Command{LOAD, 0},
+            Command{LOAD, 1},
+            Command{ADD},
+            Command{RETURN},
+        };
+    }
+
+    std::string verification_error() {
+        try {
+            BytecodeVerifier(parser.commands, parser.const_pool, parser.func_table, parser.vmethod_table).verify();
+        } catch (const std::runtime_error& e) {
+            return e.what();
+        }
+        return "";
+    }
+};
+
+TEST_F(BytecodeVerifierTest, AcceptsWellFormedImage) {
+    EXPECT_EQ(verification_error(), "");
+
+    testing::internal::CaptureStdout();
+    StackMachine<VerifiedMod> machine(parser);
+    machine.run();
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "84\n");
+}
+
+TEST_F(BytecodeVerifierTest, RejectsMalformedInstructions) {
+    auto image = parser.commands;
+
+    parser.commands[0] = Command{PUSH_CONST, 1};
+    EXPECT_NE(verification_error().find("offset 0 (PUSH_CONST): constant index 1 out of range"), std::string::npos);
+
+    parser.commands = image;
+    parser.commands[6] = Command{LOAD, 2};
+    EXPECT_NE(verification_error().find("function 1, offset 6 (LOAD): local index 2"), std::string::npos);
+
+    parser.commands = image;
+    parser.commands[1] = Command{JMP, 10};
+    EXPECT_NE(verification_error().find("control flow leaves the function"), std::string::npos);
+
+    parser.commands = image;
+    parser.commands[2] = Command{CALL, 7};
+    EXPECT_NE(verification_error().find("call to unknown function 7"), std::string::npos);
+}
+
+TEST_F(BytecodeVerifierTest, RejectsStackImbalance) {
+    parser.commands[1] = Command{POP};
+    EXPECT_NE(verification_error().find("offset 2 (CALL): stack underflow"), std::string::npos);
+
+    // the two paths reach RETURN with different stack depths
+    parser.commands = {
+        Command{PUSH_CONST, 0},
+        Command{JMP_IF_TRUE, 1},
+        Command{PUSH_CONST, 0},
+        Command{PUSH_CONST, 0},
+        Command{RETURN},
+        Command{LOAD, 0},
+        Command{LOAD, 1},
+        Command{ADD},
+        Command{RETURN},
+    };
+    EXPECT_NE(verification_error().find("inconsistent stack depth at offset 3"), std::string::npos);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+
+# Builds the opcode sequence profile of the examples and derives the superinstruction catalogue
+# from it: every example is compiled, run with `umka_vm --sequences` and the reported sequence
+# counts are summed over all examples. The profile goes to superinstruction_profile.txt, the
+# catalogue replaces for_all_superinstructions in UMKA-VM/parser/command_parser.h.
+#
+# usage: ./profile_sequences.py [output_path]    (default: superinstruction_profile.txt)
+
+import os
+import re
+import subprocess
+import sys
+from collections import defaultdict
+
+UMKA_COMPILER_PATH = "../cmake-build/bin/umka_compiler"
+UMKA_VM_PATH = "../cmake-build/bin/umka_vm"
+EXAMPLES_DIR = "./umka_examples"
+DEFAULT_OUTPUT_PATH = "superinstruction_profile.txt"
+CATALOGUE_HEADER_PATH = "../UMKA-VM/parser/command_parser.h"
+SEQUENCE_PREFIX = "sequence "
+TOP_SEQUENCES = 100
+RUN_TIMEOUT_SECONDS = 60  # garbage_collector never terminates
+
+# Catalogue rule: sequences are ranked by the dispatches fusing them saves, count * (length - 1),
+# and taken greedily; a sequence contained in one already taken, or containing one, is skipped.
+# A component may not switch frames, and a jump may only come last, as execute_fused runs the
+# components one after another.
+FIRST_SUPERINSTRUCTION_OPCODE = 0xC0
+MAX_SUPERINSTRUCTIONS = 16
+FRAME_SWITCHING_OPCODES = {"CALL", "TAIL_CALL", "CALL_METHOD", "RETURN"}
+JUMP_OPCODES = {"JMP", "JMP_IF_FALSE", "JMP_IF_TRUE"}
+
+def profile_example(example_path):
+    binary_path = f"{example_path}.bin"
+    result = subprocess.run(
+        [UMKA_COMPILER_PATH, example_path, binary_path],
+        capture_output=True,
+        text=True
+    )
+    if result.returncode != 0:
+        return None, result.stderr.strip()
+
+    try:
+        result = subprocess.run(
+            [UMKA_VM_PATH, binary_path, "--sequences"],
+            stdin=subprocess.DEVNULL,
+            capture_output=True,
+            text=True,
+            timeout=RUN_TIMEOUT_SECONDS
+        )
+    except subprocess.TimeoutExpired:
+        return None, f"no exit within {RUN_TIMEOUT_SECONDS}s"
+    if result.returncode != 0:
+        return None, (result.stderr or result.stdout).strip().split('\n')[-1]
+
+    sequences = {}
+    for line in result.stdout.split('\n'):
+        if line.startswith(SEQUENCE_PREFIX):
+            count, *opcodes = line[len(SEQUENCE_PREFIX):].split()
+            sequences[tuple(opcodes)] = int(count)
+    return sequences, ""
+
+def fusable(sequence):
+    if any(opcode in FRAME_SWITCHING_OPCODES for opcode in sequence):
+        return False
+    return not any(opcode in JUMP_OPCODES for opcode in sequence[:-1])
+
+def contains(outer, inner):
+    return any(outer[i:i + len(inner)] == inner for i in range(len(outer) - len(inner) + 1))
+
+def pick_catalogue(totals):
+    ranked = sorted(
+        (sequence for sequence in totals if fusable(sequence)),
+        key=lambda sequence: (-totals[sequence] * (len(sequence) - 1), sequence)
+    )
+    catalogue = []
+    for sequence in ranked:
+        if len(catalogue) == MAX_SUPERINSTRUCTIONS:
+            break
+        if any(contains(taken, sequence) or contains(sequence, taken) for taken in catalogue):
+            continue
+        catalogue.append(sequence)
+    return catalogue
+
+def write_catalogue(catalogue):
+    entries = []
+    for index, sequence in enumerate(catalogue):
+        name = '_'.join(sequence)
+        opcode = FIRST_SUPERINSTRUCTION_OPCODE + index
+        entries.append(f"    X({name}, 0x{opcode:02X}, {', '.join(sequence)})")
+    macro = "#define for_all_superinstructions(X) \\\n" + " \\\n".join(entries) + "\n"
+
+    with open(CATALOGUE_HEADER_PATH) as header:
+        text = header.read()
+    pattern = re.compile(r"#define for_all_superinstructions\(X\) \\\n(?:    X\(.*\) \\\n)*    X\(.*\)\n")
+    if not pattern.search(text):
+        raise RuntimeError(f"for_all_superinstructions not found in {CATALOGUE_HEADER_PATH}")
+    with open(CATALOGUE_HEADER_PATH, "w") as header:
+        header.write(pattern.sub(lambda _: macro, text, count=1))
+
+def main():
+    output_path = sys.argv[1] if len(sys.argv) > 1 else DEFAULT_OUTPUT_PATH
+
+    if not os.path.exists(UMKA_COMPILER_PATH):
+        print(f"Error: Compiler not found at {UMKA_COMPILER_PATH}")
+        return 1
+
+    if not os.path.exists(UMKA_VM_PATH):
+        print(f"Error: VM not found at {UMKA_VM_PATH}")
+        return 1
+
+    totals = defaultdict(int)
+    examples = defaultdict(list)
+    profiled = []
+    skipped = []
+
+    for example_name in sorted(os.listdir(EXAMPLES_DIR)):
+        example_path = os.path.join(EXAMPLES_DIR, example_name)
+        if not os.path.isfile(example_path) or '.' in example_name:
+            continue
+
+        sequences, error = profile_example(example_path)
+        if sequences is None:
+            print(f"{example_name}: skipped - {error}")
+            skipped.append(example_name)
+            continue
+
+        profiled.append(example_name)
+        for sequence, count in sequences.items():
+            totals[sequence] += count
+            examples[sequence].append((count, example_name))
+
+    catalogue = pick_catalogue(totals)
+    hottest = sorted(totals.items(), key=lambda item: (-item[1], item[0]))[:TOP_SEQUENCES]
+    with open(output_path, "w") as output:
+        output.write("# generated by test/profile_sequences.py, do not edit by hand\n")
+        output.write(f"# profiled: {' '.join(profiled)}\n")
+        output.write(f"# skipped: {' '.join(skipped)}\n")
+        output.write("# counts are summed over the hottest sequences `umka_vm --sequences` reports per example\n")
+        output.write("#\n# catalogue: saved dispatches | count | sequence\n")
+        for sequence in catalogue:
+            count = totals[sequence]
+            output.write(f"# {count * (len(sequence) - 1):>10} | {count:>10} | {' '.join(sequence)}\n")
+        output.write("#\n# count | sequence | examples contributing most\n")
+        for sequence, count in hottest:
+            leaders = sorted(examples[sequence], reverse=True)[:3]
+            output.write(f"{count:>10} | {' '.join(sequence)} | {', '.join(name for _, name in leaders)}\n")
+
+    write_catalogue(catalogue)
+    print(f"Profile of {len(profiled)} examples written to {output_path}, "
+          f"{len(catalogue)} superinstructions to {CATALOGUE_HEADER_PATH}")
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())